@@ -0,0 +1,114 @@
+/*
+ * CRC16 micro benchmark: compares the engines of modbus_crc.cpp with the
+ * historical table version for RTU frame sizes from 8 to 256 bytes.
+ *
+ * Usage: crc_bench.bin [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus.h"
+#include "modbus_crc.h"
+
+#define NB_FRAMES 64
+
+typedef uint16_t (*crc16_func_t) (const uint8_t *, uint16_t);
+
+static const int FRAME_SIZES[] = { 8, 16, 32, 64, 128, 256 };
+static const int NB_FRAME_SIZES = sizeof (FRAME_SIZES) / sizeof (FRAME_SIZES[0]);
+
+static uint8_t frames[NB_FRAMES][MAX_ADU_LENGTH_RTU];
+
+/* Prevents the compiler from removing the computations */
+static volatile uint16_t sink;
+
+static double bench_engine (crc16_func_t func, int size, int iterations) {
+    long long start;
+    long long elapsed;
+    uint16_t crc = 0;
+    int i;
+
+    start = modbus_time_us ();
+    for (i = 0; i < iterations; i++)
+        crc ^= func (frames[i % NB_FRAMES], size);
+    elapsed = modbus_time_us () - start;
+    sink = crc;
+
+    /* ns per frame */
+    return elapsed * 1000.0 / iterations;
+}
+
+static int check_engine (crc16_func_t func, const char *name) {
+    int i;
+    int size;
+
+    for (i = 0; i < NB_FRAMES; i++) {
+        for (size = 0; size <= MAX_ADU_LENGTH_RTU; size++) {
+            if (func (frames[i], size) != modbus_crc16_table (frames[i], size)) {
+                fprintf (stderr, "ERROR %s differs from the table version (frame %d, %d bytes)\n",
+                         name, i, size);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int main (int argc, char *argv[]) {
+    int iterations = 2000000;
+    int i;
+    int j;
+    struct {
+        crc16_engine_t engine;
+        crc16_func_t func;
+    } engines[] = {
+        { CRC16_ENGINE_TABLE, modbus_crc16_table },
+        { CRC16_ENGINE_SLICE4, modbus_crc16_slice4 },
+        { CRC16_ENGINE_SLICE8, modbus_crc16_slice8 },
+        { CRC16_ENGINE_CLMUL, modbus_crc16_clmul }
+    };
+    int nb_engines = sizeof (engines) / sizeof (engines[0]);
+
+    if (argc > 1)
+        iterations = atoi (argv[1]);
+
+    srand (1);
+    for (i = 0; i < NB_FRAMES; i++)
+        for (j = 0; j < MAX_ADU_LENGTH_RTU; j++)
+            frames[i][j] = rand ();
+
+    printf ("auto engine: %s\n", modbus_crc16_engine_name (modbus_crc16_get_engine ()));
+
+    for (i = 0; i < nb_engines; i++) {
+        if (!modbus_crc16_engine_supported (engines[i].engine))
+            continue;
+        if (check_engine (engines[i].func, modbus_crc16_engine_name (engines[i].engine)) < 0)
+            return 1;
+    }
+
+    printf ("\n%-12s", "bytes");
+    for (i = 0; i < NB_FRAME_SIZES; i++)
+        printf ("%14d", FRAME_SIZES[i]);
+    printf ("\n");
+
+    for (i = 0; i < nb_engines; i++) {
+        if (!modbus_crc16_engine_supported (engines[i].engine)) {
+            printf ("%-12s not supported by this CPU\n",
+                    modbus_crc16_engine_name (engines[i].engine));
+            continue;
+        }
+
+        printf ("%-12s", modbus_crc16_engine_name (engines[i].engine));
+        for (j = 0; j < NB_FRAME_SIZES; j++) {
+            double table_ns = bench_engine (modbus_crc16_table, FRAME_SIZES[j], iterations);
+            double ns = bench_engine (engines[i].func, FRAME_SIZES[j], iterations);
+
+            printf ("%7.1fns x%4.1f", ns, table_ns / ns);
+        }
+        printf ("\n");
+    }
+
+    return 0;
+}
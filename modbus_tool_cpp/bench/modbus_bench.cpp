@@ -0,0 +1,292 @@
+/*
+ * Transaction benchmark: a simulated slave (modbus_slave_manage) answers
+ * over a pty pair in RTU and over the loopback in TCP, the master measures
+ * the transactions per second, the p50/p99 round trip and the CPU time per
+ * transaction (master and slave threads) for each function code and block
+ * size.
+ *
+ * Usage: modbus_bench.bin [-n transactions] [-t rtu|tcp] [-p port] [-f]
+ *   -f: RTU end of frame on t3.5 silence (see modbus_set_frame_timing)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <pty.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "modbus.h"
+#include "modbus_server.h"
+
+#define SLAVE        0x01
+#define SELECT_TIME  1000
+
+#define NB_REGISTERS 1000
+#define NB_BITS      4000
+
+typedef struct
+{
+    int function;
+    int nb;
+} bench_case_t;
+
+static const bench_case_t CASES[] = {
+    { FC_READ_COIL_STATUS, 1 },
+    { FC_READ_COIL_STATUS, 256 },
+    { FC_READ_COIL_STATUS, MAX_STATUS },
+    { FC_READ_HOLDING_REGISTERS, 1 },
+    { FC_READ_HOLDING_REGISTERS, 16 },
+    { FC_READ_HOLDING_REGISTERS, 64 },
+    { FC_READ_HOLDING_REGISTERS, MAX_REGISTERS },
+    { FC_READ_INPUT_REGISTERS, 1 },
+    { FC_READ_INPUT_REGISTERS, 64 },
+    { FC_READ_INPUT_REGISTERS, MAX_REGISTERS },
+    { FC_FORCE_SINGLE_COIL, 1 },
+    { FC_PRESET_SINGLE_REGISTER, 1 },
+    { FC_FORCE_MULTIPLE_COILS, 16 },
+    { FC_FORCE_MULTIPLE_COILS, 256 },
+    { FC_FORCE_MULTIPLE_COILS, 1968 },
+    { FC_PRESET_MULTIPLE_REGISTERS, 1 },
+    { FC_PRESET_MULTIPLE_REGISTERS, 16 },
+    { FC_PRESET_MULTIPLE_REGISTERS, 64 },
+    { FC_PRESET_MULTIPLE_REGISTERS, 123 }
+};
+static const int NB_CASES = sizeof (CASES) / sizeof (CASES[0]);
+
+static modbus_mapping_t mb_mapping;
+static volatile int slave_running;
+
+/* Simulated RTU slave on the master side of the pty */
+static void *rtu_slave (void *arg) {
+    int fd = * (int *) arg;
+    c_modbus ctx ("", 115200, "none", 8, 1, SLAVE);
+    uint8_t query[MAX_MESSAGE_LENGTH];
+    int ret;
+
+    ctx.modbus_set_error_handling (NOP_ON_ERROR);
+    while (slave_running) {
+        ret = ctx.modbus_slave_receive (fd, query, 100);
+        if (ret > 0)
+            ctx.modbus_slave_manage (query, ret, &mb_mapping);
+    }
+
+    return NULL;
+}
+
+static void *tcp_slave (void *arg) {
+    c_modbus_server *server = (c_modbus_server *) arg;
+
+    while (slave_running)
+        server->modbus_server_run_once (100);
+
+    return NULL;
+}
+
+static long long cpu_time_us () {
+    struct rusage usage;
+
+    getrusage (RUSAGE_SELF, &usage);
+
+    return (long long) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int compare_latency (const void *a, const void *b) {
+    long long la = * (const long long *) a;
+    long long lb = * (const long long *) b;
+
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static int transaction (c_modbus *ctx, const bench_case_t *bc, int i) {
+    /* read_registers decodes in 32 bits values */
+    static uint32_t registers[MAX_REGISTERS];
+    static uint16_t values[MAX_REGISTERS];
+    static uint8_t bits[MAX_STATUS];
+    int address = (i * 7) % 64;
+
+    switch (bc->function) {
+    case FC_READ_COIL_STATUS:
+        return ctx->read_coil_status (address, bc->nb, bits, SELECT_TIME);
+    case FC_READ_HOLDING_REGISTERS:
+        return ctx->read_holding_registers (address, bc->nb, registers, UINT16, SELECT_TIME);
+    case FC_READ_INPUT_REGISTERS:
+        return ctx->read_input_registers (address, bc->nb, values, SELECT_TIME);
+    case FC_FORCE_SINGLE_COIL:
+        return ctx->force_single_coil (address, i & 1, SELECT_TIME);
+    case FC_PRESET_SINGLE_REGISTER:
+        return ctx->preset_single_register (address, i & 0xFFFF, SELECT_TIME);
+    case FC_FORCE_MULTIPLE_COILS:
+        return ctx->force_multiple_coils (address, bc->nb, bits, SELECT_TIME);
+    case FC_PRESET_MULTIPLE_REGISTERS:
+        return ctx->preset_multiple_registers (address, bc->nb, values, SELECT_TIME);
+    }
+
+    return INVALID_DATA;
+}
+
+static void bench_case (c_modbus *ctx, const bench_case_t *bc, int nb_transactions,
+                        long long *latencies) {
+    long long start;
+    long long cpu;
+    long long elapsed;
+    long long t;
+    int nb_errors = 0;
+    int i;
+
+    /* Warm up */
+    for (i = 0; i < 10; i++)
+        transaction (ctx, bc, i);
+
+    cpu = cpu_time_us ();
+    start = modbus_time_us ();
+    for (i = 0; i < nb_transactions; i++) {
+        t = modbus_time_us ();
+        if (transaction (ctx, bc, i) < 0)
+            nb_errors++;
+        latencies[i] = modbus_time_us () - t;
+    }
+    elapsed = modbus_time_us () - start;
+    cpu = cpu_time_us () - cpu;
+
+    qsort (latencies, nb_transactions, sizeof (long long), compare_latency);
+
+    printf ("  0x%02X %5d %10.0f %8lld %8lld %10.1f %7d\n",
+            bc->function, bc->nb,
+            nb_transactions * 1000000.0 / (elapsed > 0 ? elapsed : 1),
+            latencies[nb_transactions / 2],
+            latencies[ (nb_transactions * 99) / 100],
+            (double) cpu / nb_transactions, nb_errors);
+}
+
+static void bench_all (c_modbus *ctx, const char *name, int nb_transactions) {
+    long long *latencies;
+    int i;
+
+    latencies = (long long *) malloc (nb_transactions * sizeof (long long));
+
+    printf ("\n%s\n    fc    nb      trans/s  p50(us)  p99(us)  cpu(us/t)  errors\n", name);
+    for (i = 0; i < NB_CASES; i++)
+        bench_case (ctx, &CASES[i], nb_transactions, latencies);
+
+    free (latencies);
+}
+
+static int bench_rtu (int nb_transactions, int frame_timing) {
+    int master_fd;
+    int slave_fd;
+    char name[64];
+    pthread_t thread;
+
+    if (openpty (&master_fd, &slave_fd, name, NULL, NULL) < 0) {
+        perror ("openpty");
+        return -1;
+    }
+
+    c_modbus ctx (name, 115200, "none", 8, 1, SLAVE);
+    if (ctx.modbus_connect () == -1) {
+        perror ("[modbus_connect]");
+        return -1;
+    }
+    ctx.modbus_set_error_handling (NOP_ON_ERROR);
+    ctx.modbus_set_frame_timing (frame_timing, RTU_FRAME_SLACK_DEFAULT);
+
+    slave_running = TRUE;
+    pthread_create (&thread, NULL, rtu_slave, &master_fd);
+
+    bench_all (&ctx, frame_timing ? "RTU (pty, t3.5 frame timing)" : "RTU (pty)",
+               nb_transactions);
+
+    slave_running = FALSE;
+    pthread_join (thread, NULL);
+    ctx.modbus_close ();
+    close (slave_fd);
+    close (master_fd);
+
+    return 0;
+}
+
+static int bench_tcp (int nb_transactions, int port) {
+    c_modbus slave_ctx ("", 9600, "none", 8, 1, SLAVE);
+    c_modbus ctx ("", 9600, "none", 8, 1, SLAVE);
+    pthread_t thread;
+
+    slave_ctx.modbus_init_tcp ("127.0.0.1", port, SLAVE);
+    c_modbus_server server (&slave_ctx, &mb_mapping, 4);
+    if (server.modbus_server_listen (4) < 0)
+        return -1;
+
+    slave_running = TRUE;
+    pthread_create (&thread, NULL, tcp_slave, &server);
+
+    ctx.modbus_init_tcp ("127.0.0.1", port, SLAVE);
+    if (ctx.modbus_connect () == -1) {
+        perror ("[modbus_connect]");
+        slave_running = FALSE;
+        pthread_join (thread, NULL);
+        return -1;
+    }
+    ctx.modbus_set_error_handling (NOP_ON_ERROR);
+
+    bench_all (&ctx, "TCP (loopback)", nb_transactions);
+
+    ctx.modbus_close ();
+    slave_running = FALSE;
+    pthread_join (thread, NULL);
+
+    return 0;
+}
+
+int main (int argc, char *argv[]) {
+    int nb_transactions = 2000;
+    int port = 1502;
+    int frame_timing = FALSE;
+    int rtu = TRUE;
+    int tcp = TRUE;
+    int ch;
+
+    while ( (ch = getopt (argc, argv, "n:t:p:fh")) != EOF) {
+        switch (ch) {
+        case 'n':
+            nb_transactions = atoi (optarg);
+            break;
+        case 't':
+            rtu = strcmp (optarg, "rtu") == 0;
+            tcp = strcmp (optarg, "tcp") == 0;
+            break;
+        case 'p':
+            port = atoi (optarg);
+            break;
+        case 'f':
+            frame_timing = TRUE;
+            break;
+        case 'h':
+        default:
+            printf ("Usage: %s [-n transactions] [-t rtu|tcp] [-p port] [-f]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (nb_transactions <= 0)
+        nb_transactions = 1;
+
+    /* Simulated slave tables */
+    c_modbus mapping_ctx ("", 9600, "none", 8, 1, SLAVE);
+    if (mapping_ctx.modbus_mapping_new (&mb_mapping, NB_BITS, NB_BITS,
+                                        NB_REGISTERS, NB_REGISTERS) < 0) {
+        fprintf (stderr, "ERROR Can't allocate the mapping\n");
+        return 1;
+    }
+
+    if (rtu && bench_rtu (nb_transactions, frame_timing) < 0)
+        return 1;
+    if (tcp && bench_tcp (nb_transactions, port) < 0)
+        return 1;
+
+    mapping_ctx.modbus_mapping_free (&mb_mapping);
+
+    return 0;
+}
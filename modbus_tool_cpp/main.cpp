@@ -10,7 +10,12 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <sys/timeb.h>
+#include <time.h>
 #include "modbus.h"
+#include "modbus_pool.h"
+#include "modbus_capture.h"
+#include "modbus_profile.h"
+#include "modbus_scheduler.h"
 
 #define SLAVE         0x01
 
@@ -18,13 +23,34 @@ static int SPACE_TIME = 50;
 static int STEP_MODE = 0;
 static int COUNTS = 1;
 static int WAIT_TIME = 0;
+static int FRAME_TIMING = 0;
+static int RS485 = 0;
+static const char *CAPTURE_FILE = NULL;
+static const char *REPLAY_FILE = NULL;
+static const char *DUMP_FILE = NULL;
+static int REPLAY_SLAVE = 0;
+static int REPLAY_PORT = -1;
+static double REPLAY_SPEED = 1.0;
+static const char *PROFILE_FILE = NULL;
 
 void print_usage (const char *prog) {
-    printf ("\nUsage: <%s serial_node  data1,data2,..., -scnh>\n\n", prog);
+    printf ("\nUsage: <%s serial_node  data1,data2,..., -scnfh>\n"
+            "       <%s serial_node -R file [-S] [-x speed] [-p port]>\n"
+            "       <%s -D file>\n"
+            "       <%s -P profile [-n cycles]>\n\n", prog, prog, prog, prog);
     puts ("  -s: modbus space time\n"
           "  -c: step run\n"
           "  -n: repeat times\n"
           "  -w: wait time\n"
+          "  -f: end of frame on t3.5 silence (ignores -w)\n"
+          "  -r: RS-485 line, direction switched around the frames (-s 0 by default)\n"
+          "  -C file: capture the frames to file\n"
+          "  -R file: replay the frames sent in the capture file\n"
+          "  -S: replay as the slave, each frame answers the frame received\n"
+          "  -x speed: replay speed (2: twice faster, 0: no delay)\n"
+          "  -p port: only replay the frames of port\n"
+          "  -D file: print the capture file\n"
+          "  -P profile: poll the devices of the profile n times, print the values\n"
           "  -h: help\n");
     exit (1);
 }
@@ -33,15 +59,17 @@ void parse_opts (int argc, char *argv[]) {
     int ret, ch;
     opterr = 0;
     char key_value[128];
+    int space_time_set = 0;
 
     SPACE_TIME = 50;
     STEP_MODE = 0;
     COUNTS = 1;
 
-    while ( (ch = getopt (argc, argv, "w:s:cn:h")) != EOF) {
+    while ( (ch = getopt (argc, argv, "w:s:cn:frC:R:Sx:p:D:P:h")) != EOF) {
         switch (ch) {
         case 's':
             SPACE_TIME = atoi (optarg);
+            space_time_set = 1;
             break;
         case 'w':
             WAIT_TIME = atoi (optarg);
@@ -52,41 +80,244 @@ void parse_opts (int argc, char *argv[]) {
         case 'n':
             COUNTS = atoi (optarg);
             break;
+        case 'f':
+            FRAME_TIMING = 1;
+            break;
+        case 'r':
+            RS485 = 1;
+            break;
+        case 'C':
+            CAPTURE_FILE = optarg;
+            break;
+        case 'R':
+            REPLAY_FILE = optarg;
+            break;
+        case 'S':
+            REPLAY_SLAVE = 1;
+            break;
+        case 'x':
+            REPLAY_SPEED = atof (optarg);
+            break;
+        case 'p':
+            REPLAY_PORT = atoi (optarg);
+            break;
+        case 'D':
+            DUMP_FILE = optarg;
+            break;
+        case 'P':
+            PROFILE_FILE = optarg;
+            break;
         case 'h':
         case '?':
         default:
             print_usage (argv[0]);
         }
     }
+
+    /* The library keeps the gap between the frames of a RS-485 line */
+    if (RS485 && !space_time_set)
+        SPACE_TIME = 0;
+}
+
+/* Switches the line to RS-485 if -r is set */
+static int set_rs485 (c_modbus *modbus) {
+    int mode;
+
+    if (!RS485)
+        return 0;
+
+    mode = modbus->modbus_set_rs485 (MODBUS_RS485_KERNEL, 0, 0);
+    if (mode == -1)
+        return -1;
+    printf ("RS-485 direction switched by the %s\n",
+            (mode == MODBUS_RS485_KERNEL) ? "driver" : "RTS line");
+
+    return 0;
+}
+
+static long long monotonic_ns () {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until_ns (long long time_ns) {
+    struct timespec ts;
+
+    ts.tv_sec = time_ns / 1000000000;
+    ts.tv_nsec = time_ns % 1000000000;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+/* Sends the frames sent (tx) in the capture and waits for a frame where
+   one was received (rx). As master, the frames are sent at their time
+   since the first frame, as slave at their time since the last frame
+   received, both divided by the speed. Nothing is printed before the
+   end to keep the timing. */
+static int replay (c_modbus *modbus, const char *path, uint8_t *msg) {
+    c_modbus_capture capture;
+    modbus_capture_record_t rec;
+    long long first_ns = -1;
+    long long start_ns = 0;
+    long long last_rx_ns = 0;
+    long long last_rx_local_ns = 0;
+    long long delay_ns;
+    int nb_sent = 0;
+    int nb_received = 0;
+    int nb_missing = 0;
+    int length;
+    int ret;
+
+    if (capture.open_read (path) == -1)
+        return -1;
+
+    start_ns = monotonic_ns ();
+    while ( (length = capture.next (&rec, msg)) > 0) {
+        if (REPLAY_PORT != -1 && rec.port != REPLAY_PORT)
+            continue;
+        if (first_ns == -1) {
+            first_ns = rec.time_ns;
+            last_rx_ns = rec.time_ns;
+            last_rx_local_ns = start_ns;
+        }
+
+        if (rec.direction == MODBUS_CAPTURE_RX) {
+            if (REPLAY_SLAVE)
+                ret = modbus->modbus_slave_receive (-1, msg, 0);
+            else
+                ret = modbus->rcv_msg (msg, 1000, WAIT_TIME);
+            if (ret > 0)
+                nb_received++;
+            else
+                nb_missing++;
+            last_rx_ns = rec.time_ns;
+            last_rx_local_ns = monotonic_ns ();
+            continue;
+        }
+
+        if (REPLAY_SPEED > 0) {
+            if (REPLAY_SLAVE)
+                delay_ns = last_rx_local_ns + (long long) ( (rec.time_ns - last_rx_ns) / REPLAY_SPEED);
+            else
+                delay_ns = start_ns + (long long) ( (rec.time_ns - first_ns) / REPLAY_SPEED);
+            sleep_until_ns (delay_ns);
+        }
+
+        /* The CRC recorded is computed again by modbus_send */
+        if (length > CHECKSUM_LENGTH_RTU && modbus->modbus_send (msg, length - CHECKSUM_LENGTH_RTU) > 0)
+            nb_sent++;
+    }
+
+    printf ("%d frames sent, %d received, %d not received in %.3f s\n",
+            nb_sent, nb_received, nb_missing, (monotonic_ns () - start_ns) / 1e9);
+
+    return 0;
+}
+
+/* Scans each block of the profile cycles times */
+static int poll_profile (const char *path, int cycles) {
+    c_modbus_profile profile;
+    c_modbus *modbus;
+    c_modbus_scheduler *sched;
+    long long start_us;
+    int nb_scans = 0;
+
+    start_us = modbus_time_us ();
+    if (profile.load (path) == -1)
+        return -1;
+    printf ("%d blocks loaded in %lld us\n", profile.nb_blocks (),
+            modbus_time_us () - start_us);
+
+    modbus = profile.new_context ();
+    if (modbus->modbus_connect () == -1) {
+        perror ("[modbus_connect]");
+        delete modbus;
+        return -1;
+    }
+    if (profile.get_link ()->type_com == RTU && set_rs485 (modbus) == -1) {
+        modbus->modbus_close ();
+        delete modbus;
+        return -1;
+    }
+
+    sched = new c_modbus_scheduler (modbus, profile.nb_blocks ());
+    sched->set_select_time (profile.get_link ()->select_time);
+    if (profile.add_tags (sched) == 0) {
+        while (nb_scans < cycles * profile.nb_blocks ())
+            nb_scans += sched->run_once (SPACE_TIME);
+        profile.dump (stdout);
+        sched->dump_stats (stdout);
+    }
+
+    delete sched;
+    modbus->modbus_close ();
+    delete modbus;
+
+    return 0;
 }
 
 int main (int argc, char *argv[]) {
     int i, ret;
     uint8_t *tab_registers;
+    c_modbus_pool pool (1);
+    c_modbus_capture capture;
+
+    parse_opts (argc, argv);
+
+    if (DUMP_FILE != NULL) {
+        if (capture.open_read (DUMP_FILE) == -1)
+            exit (1);
+        capture.dump (stdout);
+        return 0;
+    }
 
-    if (argc < 3) {
+    if (PROFILE_FILE != NULL)
+        return (poll_profile (PROFILE_FILE, COUNTS) == -1) ? 1 : 0;
+
+    /* The options are before the serial node and the data */
+    if (argc - optind < 2 && ! (REPLAY_FILE != NULL && argc - optind == 1)) {
         print_usage (argv[0]);
     }
 
-    c_modbus modbus (argv[1], 9600, "none", 8, 1, SLAVE);
-    modbus.modbus_set_debug (TRUE);
+    c_modbus modbus (argv[optind], 9600, "none", 8, 1, SLAVE);
+    /* The dump of the frames would change the timing captured */
+    modbus.modbus_set_debug (CAPTURE_FILE == NULL && REPLAY_FILE == NULL);
+
+    if (CAPTURE_FILE != NULL) {
+        if (capture.open (CAPTURE_FILE, MODBUS_CAPTURE_DEFAULT_SIZE) == -1)
+            exit (1);
+        modbus.modbus_set_capture (&capture, 0);
+    }
 
     /* RTU parity : none, even, odd */
     if (modbus.modbus_connect () == -1) {
         perror ("[modbus_connect]");
         exit (1);
     }
+    if (set_rs485 (&modbus) == -1)
+        exit (1);
 
     /* Allocate and initialize the different memory spaces */
-    tab_registers = (uint8_t *) malloc (512 * sizeof (uint8_t));
-    memset (tab_registers, 0, 512 * sizeof (uint8_t));
+    tab_registers = pool.lease ();
+    memset (tab_registers, 0, MODBUS_BUFFER_SIZE);
+
+    if (REPLAY_FILE != NULL) {
+        modbus.modbus_set_frame_timing (FRAME_TIMING, RTU_FRAME_SLACK_DEFAULT);
+        ret = replay (&modbus, REPLAY_FILE, tab_registers);
+        modbus.modbus_close ();
+        pool.release (tab_registers);
+        return (ret == -1) ? 1 : 0;
+    }
 
     /* дmodbus֡ */
     uint8_t query[128];
     int query_length = 0;
     char value[16];
     const char *lps = NULL, *lpe = NULL;
-    lpe = lps = argv[2];
+    lpe = lps = argv[optind + 1];
     i = 0;
     while (lps) {
         lps = strchr (lps, ',');
@@ -100,7 +331,7 @@ int main (int argc, char *argv[]) {
     }
     query_length = i;
 
-    parse_opts (argc, argv);
+    modbus.modbus_set_frame_timing (FRAME_TIMING, RTU_FRAME_SLACK_DEFAULT);
 
     for (i = 0; i < COUNTS; i++) {
         printf ("--------------------------------------\n");
@@ -119,7 +350,7 @@ int main (int argc, char *argv[]) {
     }
 
     modbus.modbus_close ();
-    free (tab_registers);
+    pool.release (tab_registers);
 
     return 0;
 }
@@ -39,10 +39,13 @@
 #endif
 #include <termios.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <linux/serial.h>
 
 /* TCP */
 #include <sys/types.h>
@@ -61,6 +64,15 @@
 #endif
 
 #include "modbus.h"
+#include "modbus_mapping.h"
+#include "modbus_crc.h"
+#include "modbus_transport.h"
+#include "modbus_stats.h"
+#include "modbus_decode.h"
+#include "modbus_capture.h"
+#include "modbus_io.h"
+#include "modbus_uring.h"
+#include "modbus_bits.h"
 
 #define UNKNOWN_ERROR_MSG "Not defined in modbus specification"
 
@@ -91,66 +103,6 @@ static const char *TAB_ERROR_MSG[] = {
     /* 0x0B */ "Target device failed to respond"
 };
 
-/* Table of CRC values for high-order byte */
-static uint8_t table_crc_hi[] = {
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
-};
-
-/* Table of CRC values for low-order byte */
-static uint8_t table_crc_lo[] = {
-    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
-    0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
-    0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
-    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
-    0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
-    0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
-    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
-    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
-    0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
-    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
-    0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
-    0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
-    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
-    0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
-    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
-    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
-    0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
-    0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
-    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
-    0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
-    0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
-    0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
-    0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
-    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
-    0x43, 0x83, 0x41, 0x81, 0x80, 0x40
-};
-
 static const int TAB_HEADER_LENGTH[2] = {
     HEADER_LENGTH_RTU,
     HEADER_LENGTH_TCP
@@ -170,11 +122,39 @@ c_modbus::c_modbus (const char *device,
                     int baud, const char *parity, int data_bit,
                     int stop_bit, int slave) {
     mb_param = new modbus_param_t;
+    /* Allocated once, reused by all the transactions */
+    adu = (uint8_t *) modbus_aligned_alloc (MODBUS_BUFFER_SIZE);
+    if (adu == NULL)
+        fprintf (stderr, "ERROR Can't allocate the transaction buffer\n");
+    stats = NULL;
+    capture = NULL;
+    capture_port = 0;
+    tx_queue = NULL;
+    uring = NULL;
+    stats_rx_bytes = 0;
+    slave_timings = NULL;
+    rto_min_ms = MODBUS_RTO_MIN_DEFAULT;
+    rto_max_ms = MODBUS_RTO_MAX_DEFAULT;
+    nb_retries = 0;
+    quarantine_failures = 0;
+    probe_period_ms = MODBUS_PROBE_PERIOD_DEFAULT;
+    last_query_length = 0;
+    turnaround_ms = MODBUS_TURNAROUND_DEFAULT;
+    connect_timeout_ms = MODBUS_CONNECT_TIMEOUT_DEFAULT;
+    rs485_mode = MODBUS_RS485_NONE;
+    rs485_before_us = 0;
+    rs485_after_us = 0;
+    line_idle_us = 0;
+    keepalive_idle_s = 0;
+    keepalive_interval_s = 0;
+    keepalive_probes = 0;
 
     modbus_init_rtu (device, baud, parity, data_bit, stop_bit, slave);
 }
 
 c_modbus::~c_modbus () {
+    free (adu);
+    free (slave_timings);
     delete mb_param;
 }
 
@@ -194,16 +174,25 @@ void c_modbus::error_treat (int code, const char *string) {
         wprintf ("\033[31;40;1m \nerror_treat: %s (%0X)\n\033[0m", string, -code);
     }
 
-    if (mb_param->error_handling == FLUSH_OR_CONNECT_ON_ERROR) {
+    if (mb_param->error_handling == FLUSH_OR_CONNECT_ON_ERROR ||
+            mb_param->error_handling == CLOSE_ON_ERROR) {
         switch (code) {
         case INVALID_DATA:
         case INVALID_CRC:
         case INVALID_EXCEPTION_CODE:
-            modbus_flush ();
+            if (mb_param->fd >= 0)
+                modbus_flush ();
             break;
         case SELECT_FAILURE:
         case SOCKET_FAILURE:
         case CONNECTION_CLOSED:
+            if (mb_param->error_handling == CLOSE_ON_ERROR) {
+                /* The owner connects again */
+                if (mb_param->fd >= 0)
+                    modbus_close ();
+                mb_param->fd = -1;
+                break;
+            }
             modbus_close ();
             modbus_connect ();
             break;
@@ -251,87 +240,15 @@ void c_modbus::modbus_flush () {
 
 /* Computes the length of the expected response */
 unsigned int c_modbus::compute_response_length (uint8_t *query , uint8_t data_type) {
-    int length;
-    int offset;
-
-    offset = TAB_HEADER_LENGTH[mb_param->type_com];
-
-    switch (query[offset]) {
-    case FC_READ_COIL_STATUS:
-    case FC_READ_INPUT_STATUS: {
-        /* Header + nb values (code from force_multiple_coils) */
-        int nb = (query[offset + 3] << 8) | query[offset + 4];
-        length = 2 + (nb / 8) + ( (nb % 8) ? 1 : 0);
-    }
-    break;
-    case FC_READ_HOLDING_REGISTERS:
-    case FC_READ_INPUT_REGISTERS:
-        switch (data_type) {
-        case    0:      // Ϊ8λ
-        case    1:      // Ϊ8λ޷
-            /* Header + 1 * nb values */
-            length = 2 + (query[offset + 3] << 8 |
-                          query[offset + 4]);
-            break;
-        case    2:      // Ϊ16λ
-        case    3:      // Ϊ16λ޷
-            /* Header + 2 * nb values */
-            length = 2 + 2 * (query[offset + 3] << 8 |
-                              query[offset + 4]);
-            break;
-        case    4:      // Ϊ32λ
-        case    5:      // Ϊ32λ޷
-            /* Header + 4 * nb values */
-            length = 2 + 4 * (query[offset + 3] << 8 |
-                              query[offset + 4]);
-            break;
-        case    6:      // Ϊ64λ
-        case    7:      // Ϊ64λ޷
-            /* Header + 2 * nb values */
-            length = 2 + 2 * (query[offset + 3] << 8 |
-                              query[offset + 4]);
-            break;
-        case    8:      // ȸ
-            /* Header + 2 * nb values */
-            length = 2 + 2 * (query[offset + 3] << 8 |
-                              query[offset + 4]);
-            break;
-        case    9:      // ˫ȸ
-            /* Header + 2 * nb values */
-            length = 2 + 2 * (query[offset + 3] << 8 |
-                              query[offset + 4]);
-            break;
-        default:
-            /* Header + 2 * nb values */
-            length = 2 + 2 * (query[offset + 3] << 8 |
-                              query[offset + 4]);
-            break;
-        }
-        break;
-    case FC_READ_EXCEPTION_STATUS:
-        length = 3;
-        break;
-    case FC_REPORT_SLAVE_ID:
-        /* The response is device specific (the header provides the
-           length) */
-        return MSG_LENGTH_UNDEFINED;
-    default:
-        length = 5;
-    }
-
-    return length + offset + TAB_CHECKSUM_LENGTH[mb_param->type_com];
+    if (mb_param->type_com == RTU)
+        return modbus_rtu_frame::response_length (query, data_type);
+    else
+        return modbus_tcp_frame::response_length (query, data_type);
 }
 
 /* Builds a RTU query header */
 int c_modbus::build_query_basis_rtu (int slave, int function, int start_addr, int nb, uint8_t *query) {
-    query[0] = slave;
-    query[1] = function;
-    query[2] = start_addr >> 8;
-    query[3] = start_addr & 0x00ff;
-    query[4] = nb >> 8;
-    query[5] = nb & 0x00ff;
-
-    return PRESET_QUERY_LENGTH_RTU;
+    return modbus_rtu_frame::build_query_basis (slave, function, start_addr, nb, 0, query);
 }
 
 /* Builds a TCP query header */
@@ -345,31 +262,21 @@ int c_modbus::build_query_basis_tcp (int slave, int function,
        response with the request. So, at a time, on a TCP
        connection, this identifier must be unique.
     */
-    static uint16_t t_id = 0;
-
-    /* Transaction ID */
-    if (t_id < UINT16_MAX)
-        t_id++;
-    else
-        t_id = 0;
-    query[0] = t_id >> 8;
-    query[1] = t_id & 0x00ff;
-
-    /* Protocol Modbus */
-    query[2] = 0;
-    query[3] = 0;
+    uint16_t t_id = next_t_id ();
 
-    /* Length will be defined later by set_query_length_tcp at offsets 4
+    /* Length will be defined later by set_message_length_tcp at offsets 4
      * and 5 */
+    return modbus_tcp_frame::build_query_basis (slave, function, start_addr, nb, t_id, query);
+}
 
-    query[6] = slave;
-    query[7] = function;
-    query[8] = start_addr >> 8;
-    query[9] = start_addr & 0x00ff;
-    query[10] = nb >> 8;
-    query[11] = nb & 0x00ff;
+/* Transaction ID of the next TCP query */
+uint16_t c_modbus::next_t_id () {
+    if (mb_param->t_id < UINT16_MAX)
+        mb_param->t_id++;
+    else
+        mb_param->t_id = 0;
 
-    return PRESET_QUERY_LENGTH_TCP;
+    return mb_param->t_id;
 }
 
 int c_modbus::build_query_basis (int function, int start_addr,
@@ -382,10 +289,7 @@ int c_modbus::build_query_basis (int function, int start_addr,
 
 /* Builds a RTU response header */
 int c_modbus::build_response_basis_rtu (sft_t *sft, uint8_t *response) {
-    response[0] = sft->slave;
-    response[1] = sft->function;
-
-    return PRESET_RESPONSE_LENGTH_RTU;
+    return modbus_rtu_frame::build_response_basis (sft->slave, sft->function, 0, response);
 }
 
 /* Builds a TCP response header */
@@ -393,20 +297,9 @@ int c_modbus::build_response_basis_tcp (sft_t *sft, uint8_t *response) {
     /* Extract from MODBUS Messaging on TCP/IP Implementation
        Guide V1.0b (page 23/46):
        The transaction identifier is used to associate the future
-       response with the request. */
-    response[0] = sft->t_id >> 8;
-    response[1] = sft->t_id & 0x00ff;
-
-    /* Protocol Modbus */
-    response[2] = 0;
-    response[3] = 0;
-
-    /* Length to fix later with set_message_length_tcp (4 and 5) */
-
-    response[6] = sft->slave;
-    response[7] = sft->function;
-
-    return PRESET_RESPONSE_LENGTH_TCP;
+       response with the request.
+       Length to fix later with set_message_length_tcp (4 and 5) */
+    return modbus_tcp_frame::build_response_basis (sft->slave, sft->function, sft->t_id, response);
 }
 
 int c_modbus::build_response_basis (sft_t *sft, uint8_t *response) {
@@ -418,65 +311,80 @@ int c_modbus::build_response_basis (sft_t *sft, uint8_t *response) {
 
 /* Sets the length of TCP message in the message (query and response) */
 void c_modbus::set_message_length_tcp (uint8_t *msg, int msg_length) {
-    /* Substract the header length to the message length */
-    int mbap_length = msg_length - 6;
-
-    msg[4] = mbap_length >> 8;
-    msg[5] = mbap_length & 0x00FF;
+    modbus_tcp_frame::finalize (msg, msg_length);
 }
 
-/* Fast CRC */
+/* Fast CRC (see modbus_crc.cpp for the available engines) */
 uint16_t c_modbus::crc16 (uint8_t *buffer, uint16_t buffer_length) {
-    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
-    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
-    unsigned int i; /* will index into CRC lookup */
-
-    /* pass through message buffer */
-    while (buffer_length--) {
-        i = crc_hi ^ *buffer++; /* calculate the CRC  */
-        crc_hi = crc_lo ^ table_crc_hi[i];
-        crc_lo = table_crc_lo[i];
-    }
-
-    return (crc_hi << 8 | crc_lo);
+    return modbus_crc16 (buffer, buffer_length);
 }
 
 /* If CRC is correct returns msg_length else returns INVALID_CRC */
 int c_modbus::check_crc16 (uint8_t *msg, const int msg_length) {
     int ret;
-    uint16_t crc_calc;
-    uint16_t crc_received;
+    char s_error[128];
 
-    crc_calc = crc16 (msg, msg_length - 2);
-    crc_received = (msg[msg_length - 2] << 8) | msg[msg_length - 1];
+    ret = modbus_rtu_frame::check_crc (msg, msg_length);
+    if (ret != INVALID_CRC)
+        return ret;
 
-    /* Check CRC of msg */
-    if (crc_calc == crc_received) {
-        ret = msg_length;
+    if (msg_length < 2) {
+        sprintf (s_error, "!!!!!!!!!!!!!frame too short for a crc (%d bytes)",
+                 msg_length);
     } else {
-        char s_error[128];
+        uint16_t crc_calc = crc16 (msg, msg_length - 2);
+        uint16_t crc_received = (msg[msg_length - 2] << 8) | msg[msg_length - 1];
+
         sprintf (s_error, "!!!!!!!!!!!!!invalid crc received %0X - crc_calc %0X",
                  crc_received, crc_calc);
-        ret = INVALID_CRC;
-        error_treat (ret, s_error);
     }
+    error_treat (ret, s_error);
 
     return ret;
 }
 
 /* Sends a query/response over a serial or a TCP communication */
 int c_modbus::modbus_send (uint8_t *query, int query_length) {
+    if (mb_param->type_com == RTU)
+        query_length = modbus_rtu_frame::finalize (query, query_length);
+    else
+        query_length = modbus_tcp_frame::finalize (query, query_length);
+
+    return send_frame (query, query_length);
+}
+
+/* Sends a query built beforehand with its checksum (RTU) or its length
+   (TCP), only the transaction ID is set */
+int c_modbus::send_ready (uint8_t *query, int query_length) {
+    uint16_t t_id;
+
+    if (mb_param->type_com == TCP) {
+        t_id = next_t_id ();
+        query[0] = t_id >> 8;
+        query[1] = t_id & 0x00ff;
+    }
+
+    return send_frame (query, query_length);
+}
+
+/* Sends a complete frame */
+int c_modbus::send_frame (uint8_t *query, int query_length) {
     int i;
     int ret;
-    uint16_t s_crc;
+    modbus_slave_timing_t *timing;
 
-    if (mb_param->type_com == RTU) {
-        s_crc = crc16 (query, query_length);
-        query[query_length++] = s_crc >> 8;
-        query[query_length++] = s_crc & 0x00FF;
-    } else {
-        set_message_length_tcp (query, query_length);
+    if (quarantine_failures > 0) {
+        timing = slave_timing (query[TAB_HEADER_LENGTH[mb_param->type_com] - 1]);
+        if (timing != NULL && timing->offline) {
+            long long now = modbus_time_us ();
+
+            if (now < timing->next_probe_us)
+                return SLAVE_OFFLINE;
+            /* This query probes the slave */
+            timing->next_probe_us = now + (long long) probe_period_ms * 1000;
+        }
     }
+    last_query_length = query_length;
 
     if (mb_param->debug) {
         wprintf ("\033[34;40;1m \nsend:\033[0m");
@@ -485,7 +393,27 @@ int c_modbus::modbus_send (uint8_t *query, int query_length) {
         wprintf ("\n");
     }
 
-    if (mb_param->type_com == RTU) {
+    if (capture != NULL)
+        capture_frame (MODBUS_CAPTURE_TX, query, query_length);
+
+    if (stats != NULL || slave_timings != NULL) {
+        /* The round trip starts here */
+        stats_send_us = modbus_time_us ();
+        stats_tx_bytes = query_length;
+        stats_rx_bytes = 0;
+    }
+
+    if (tx_queue != NULL) {
+        /* Sent later by the owner of the queue, a full queue is sent
+           first (what the socket takes frees room) */
+        ret = tx_queue->push_copy (query, query_length);
+        if (ret == -1 && tx_queue->flush (mb_param->fd) >= 0)
+            ret = tx_queue->push_copy (query, query_length);
+        if (ret == 0)
+            ret = query_length;
+    } else if (mb_param->type_com == RTU && rs485_mode != MODBUS_RS485_NONE) {
+        ret = rs485_write (query, query_length);
+    } else if (mb_param->type_com == RTU) {
         /*tcflush ( mb_param->fd, TCIOFLUSH ); */
         ret = write (mb_param->fd, query, query_length);
     } else
@@ -501,6 +429,50 @@ int c_modbus::modbus_send (uint8_t *query, int query_length) {
     return ret;
 }
 
+/* Sleeps until the monotonic time time_us */
+static void sleep_until_us (long long time_us) {
+    struct timespec ts;
+
+    if (time_us <= modbus_time_us ())
+        return;
+
+    ts.tv_sec = time_us / 1000000;
+    ts.tv_nsec = (time_us % 1000000) * 1000;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+int c_modbus::rs485_write (const uint8_t *frame, int frame_length) {
+    int rts = TIOCM_RTS;
+    long long start_us;
+    int ret;
+
+    /* Silent interval of t3.5 between two frames */
+    sleep_until_us (line_idle_us + mb_param->t35_us);
+
+    if (rs485_mode == MODBUS_RS485_RTS) {
+        ioctl (mb_param->fd, TIOCMBIS, &rts);
+        sleep_until_us (modbus_time_us () + rs485_before_us);
+    }
+
+    start_us = modbus_time_us ();
+    ret = write (mb_param->fd, frame, frame_length);
+    if (ret > 0) {
+        tcdrain (mb_param->fd);
+        /* tcdrain can return when the last character is still in the
+           shift register of the UART */
+        sleep_until_us (start_us + (long long) ret * mb_param->char_us);
+    }
+
+    if (rs485_mode == MODBUS_RS485_RTS) {
+        sleep_until_us (modbus_time_us () + rs485_after_us);
+        ioctl (mb_param->fd, TIOCMBIC, &rts);
+    }
+    line_idle_us = modbus_time_us ();
+
+    return ret;
+}
+
 /* Sends a query/response over a serial or a TCP communication */
 int c_modbus::serial_send (uint8_t *query, int query_length) {
     int i;
@@ -591,20 +563,23 @@ int c_modbus::compute_query_length_data (uint8_t *msg) {
             }                                                                      \
     }                                                                              \
                                                                                    \
-    if (select_ret == 0) {                                                         \
-            /* Timeout */                                                          \
-            if (msg_length == (TAB_HEADER_LENGTH[mb_param->type_com] + 2 +         \
-                               TAB_CHECKSUM_LENGTH[mb_param->type_com])) {         \
-                    /* Optimization allowed because exception response is          \
-                       the smallest trame in modbus protocol (3) so always         \
-                       raise a timeout error */                                    \
-                    return MB_EXCEPTION;                                           \
-            } else {                                                               \
-                    /* Call to error_treat is done later to manage exceptions */   \
-                    if ( mb_param->debug )                                         \
-                        wprintf ( "\n" );                                          \
-                    return SELECT_TIMEOUT;                                         \
-            }                                                                      \
+    if (select_ret == 0)                                                           \
+            DATA_TIMEOUT();                                                        \
+}
+
+#define DATA_TIMEOUT()                                                             \
+{                                                                                  \
+    if (msg_length == (TAB_HEADER_LENGTH[mb_param->type_com] + 2 +                 \
+                       TAB_CHECKSUM_LENGTH[mb_param->type_com])) {                 \
+            /* Optimization allowed because exception response is                  \
+               the smallest trame in modbus protocol (3) so always                 \
+               raise a timeout error */                                            \
+            return MB_EXCEPTION;                                                   \
+    } else {                                                                       \
+            /* Call to error_treat is done later to manage exceptions */           \
+            if ( mb_param->debug )                                                 \
+                wprintf ( "\n" );                                                  \
+            return SELECT_TIMEOUT;                                                 \
     }                                                                              \
 }
 
@@ -664,14 +639,25 @@ int c_modbus::receive_msg (int msg_length_computed, uint8_t *msg, int select_tim
     length_to_read = msg_length_computed;
 
     select_ret = 0;
-    WAIT_DATA();
+    if (uring == NULL) {
+        WAIT_DATA();
+    } else {
+        /* The wait is part of the read */
+        select_ret = TRUE;
+    }
 
     p_msg = msg;
     if (mb_param->debug) {
         wprintf ("\033[32;40;1m \nrcv:\033[0m");
     }
     while (select_ret) {
-        if (mb_param->type_com == RTU)
+        if (uring != NULL) {
+            /* Waits and reads with one system call */
+            read_ret = uring->read_timeout (mb_param->fd, p_msg, length_to_read,
+                                            tv.tv_sec * 1000000L + tv.tv_usec);
+            if (read_ret == SELECT_TIMEOUT)
+                DATA_TIMEOUT();
+        } else if (mb_param->type_com == RTU)
             read_ret = read (mb_param->fd, p_msg, length_to_read);
         else
             read_ret = recv (mb_param->fd, p_msg, length_to_read, 0);
@@ -686,6 +672,7 @@ int c_modbus::receive_msg (int msg_length_computed, uint8_t *msg, int select_tim
 
         /* Sums bytes received */
         msg_length += read_ret;
+        stats_rx_bytes += read_ret;
 
         /* Display the hex code of each character received */
         if (mb_param->debug) {
@@ -731,9 +718,15 @@ int c_modbus::receive_msg (int msg_length_computed, uint8_t *msg, int select_tim
             /* If no character at the buffer wait
             TIME_OUT_END_OF_TRAME before to generate an error. */
             tv.tv_sec = 0;
-            tv.tv_usec = TIME_OUT_END_OF_TRAME;
+            if (mb_param->type_com == RTU && mb_param->frame_timing) {
+                /* The frame is over after a silent interval of t3.5 */
+                tv.tv_usec = mb_param->t35_us + mb_param->frame_slack_us;
+            } else {
+                tv.tv_usec = TIME_OUT_END_OF_TRAME;
+            }
 
-            WAIT_DATA();
+            if (uring == NULL)
+                WAIT_DATA();
         } else {
             /* All chars are received */
             select_ret = FALSE;
@@ -744,6 +737,12 @@ int c_modbus::receive_msg (int msg_length_computed, uint8_t *msg, int select_tim
         wprintf ("\n");
     }
 
+    if (capture != NULL)
+        capture_frame (MODBUS_CAPTURE_RX, msg, msg_length);
+
+    if (rs485_mode != MODBUS_RS485_NONE)
+        line_idle_us = modbus_time_us ();
+
     if (mb_param->type_com == RTU) {
         /* Returns msg_length on success and a negative value on
         failure */
@@ -760,7 +759,8 @@ int c_modbus::rcv_msg (uint8_t *msg, int select_time, int wait_time) {
     fd_set rfds;
     struct timeval tv;
     int msg_length;
-    int length_to_read = 1024;
+    /* An ADU is at most MAX_MESSAGE_LENGTH bytes */
+    int length_to_read = MAX_MESSAGE_LENGTH;
     uint8_t *p_msg;
     enum { FUNCTION, BYTE, COMPLETE };
 
@@ -775,15 +775,21 @@ int c_modbus::rcv_msg (uint8_t *msg, int select_time, int wait_time) {
     tv.tv_sec = 0;
     tv.tv_usec = select_time * 1000;
     WAIT_DATA();
-    modbus_sleep (0, wait_time * 1000);
 
     p_msg = msg;
     if (mb_param->debug) {
         wprintf ("\033[32;40;1m \nrcv:\033[0m");
     }
-    if (mb_param->type_com == RTU) {
+    if (mb_param->type_com == RTU && mb_param->frame_timing) {
+        /* No need to wait, the end of the frame is detected */
+        read_ret = receive_frame_rtu (p_msg, length_to_read);
+        if (read_ret < 0)
+            return read_ret;
+    } else if (mb_param->type_com == RTU) {
+        modbus_sleep (0, wait_time * 1000);
         read_ret = read (mb_param->fd, p_msg, length_to_read);
     } else {
+        modbus_sleep (0, wait_time * 1000);
         read_ret = recv (mb_param->fd, p_msg, length_to_read, 0);
     }
     if (read_ret == 0) {
@@ -806,6 +812,12 @@ int c_modbus::rcv_msg (uint8_t *msg, int select_time, int wait_time) {
         wprintf ("\n");
     }
 
+    if (capture != NULL)
+        capture_frame (MODBUS_CAPTURE_RX, msg, read_ret);
+
+    if (rs485_mode != MODBUS_RS485_NONE)
+        line_idle_us = modbus_time_us ();
+
     if (mb_param->type_com == RTU) {
         /* Returns msg_length on success and a negative value on
         failure */
@@ -816,7 +828,157 @@ int c_modbus::rcv_msg (uint8_t *msg, int select_time, int wait_time) {
     }
 }
 
+/* Reads the characters of a RTU frame until the line stays silent for
+   t3.5 (+ slack), the first character is already available.
+   Returns the number of characters read or a negative error. */
+int c_modbus::receive_frame_rtu (uint8_t *msg, int max_length) {
+    int select_ret;
+    int read_ret;
+    int msg_length = 0;
+    fd_set rfds;
+    struct timeval tv;
+
+    for (;;) {
+        read_ret = read (mb_param->fd, msg + msg_length, max_length - msg_length);
+        if (read_ret == 0) {
+            return CONNECTION_CLOSED;
+        } else if (read_ret < 0) {
+            if (errno == EINTR)
+                continue;
+            error_treat (SOCKET_FAILURE, "receive_msg: Read socket failure");
+            return SOCKET_FAILURE;
+        }
+        msg_length += read_ret;
+        if (msg_length >= max_length)
+            break;
+
+        FD_ZERO (&rfds);
+        FD_SET (mb_param->fd, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = mb_param->t35_us + mb_param->frame_slack_us;
+        do {
+            select_ret = select (mb_param->fd + 1, &rfds, NULL, NULL, &tv);
+        } while (select_ret == -1 && errno == EINTR);
+        if (select_ret == -1) {
+            error_treat (SELECT_FAILURE, "Select failure");
+            return SELECT_FAILURE;
+        }
+        if (select_ret == 0) {
+            /* Silent interval, end of the frame */
+            break;
+        }
+    }
+
+    return msg_length;
+}
+
+void c_modbus::modbus_rx_init (modbus_rx_t *rx, int msg_length_computed, uint8_t *msg) {
+    rx->msg = msg;
+    rx->msg_length = 0;
+
+    if (msg_length_computed == MSG_LENGTH_UNDEFINED) {
+        /* Reach the function code first, see receive_msg */
+        rx->state = RX_FUNCTION;
+        rx->msg_length_computed = TAB_HEADER_LENGTH[mb_param->type_com] + 1;
+    } else {
+        /* Reach the function code first to detect the exceptions
+           without waiting for a time out */
+        rx->state = RX_RESPONSE;
+        rx->msg_length_computed = TAB_HEADER_LENGTH[mb_param->type_com] + 1;
+        rx->msg_length_expected = msg_length_computed;
+    }
+    rx->length_to_read = rx->msg_length_computed;
+}
+
+int c_modbus::modbus_rx_feed (modbus_rx_t *rx, int fd) {
+    int read_ret;
+
+    while (rx->length_to_read > 0) {
+        if (mb_param->type_com == RTU)
+            read_ret = read (fd, rx->msg + rx->msg_length, rx->length_to_read);
+        else
+            read_ret = recv (fd, rx->msg + rx->msg_length, rx->length_to_read, MSG_DONTWAIT);
+
+        if (read_ret == 0) {
+            if (mb_param->type_com == RTU)
+                /* Nothing available on the serial line */
+                return 0;
+            return CONNECTION_CLOSED;
+        } else if (read_ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            error_treat (SOCKET_FAILURE, "modbus_rx_feed: Read socket failure");
+            return SOCKET_FAILURE;
+        }
+
+        if (mb_param->debug) {
+            int i;
+            for (i = 0; i < read_ret; i++)
+                wprintf ("<%.2X>", rx->msg[rx->msg_length + i]);
+        }
+
+        rx->msg_length += read_ret;
+        if (rx->msg_length < rx->msg_length_computed) {
+            /* Message incomplete */
+            rx->length_to_read = rx->msg_length_computed - rx->msg_length;
+            continue;
+        }
+
+        switch (rx->state) {
+        case RX_RESPONSE:
+            if (rx->msg[TAB_HEADER_LENGTH[mb_param->type_com]] & 0x80) {
+                /* Exception code and checksum */
+                rx->msg_length_computed = TAB_HEADER_LENGTH[mb_param->type_com] + 2 +
+                                          TAB_CHECKSUM_LENGTH[mb_param->type_com];
+            } else {
+                rx->msg_length_computed = rx->msg_length_expected;
+            }
+            rx->length_to_read = rx->msg_length_computed - rx->msg_length;
+            rx->state = RX_COMPLETE;
+            break;
+        case RX_FUNCTION:
+            /* Function code position */
+            rx->length_to_read = compute_query_length_header (rx->msg[TAB_HEADER_LENGTH[mb_param->type_com]]);
+            rx->msg_length_computed += rx->length_to_read;
+            rx->state = RX_BYTE;
+            break;
+        case RX_BYTE:
+            rx->length_to_read = compute_query_length_data (rx->msg);
+            rx->msg_length_computed += rx->length_to_read;
+            if (rx->msg_length_computed > TAB_MAX_ADU_LENGTH[mb_param->type_com]) {
+                error_treat (INVALID_DATA, "modbus_rx_feed: Too many data");
+                return INVALID_DATA;
+            }
+            rx->state = RX_COMPLETE;
+            break;
+        case RX_COMPLETE:
+            rx->length_to_read = 0;
+            break;
+        }
+    }
+
+    if (mb_param->debug) {
+        wprintf ("\n");
+    }
+
+    if (capture != NULL)
+        capture_frame (MODBUS_CAPTURE_RX, rx->msg, rx->msg_length);
+
+    if (rs485_mode != MODBUS_RS485_NONE)
+        line_idle_us = modbus_time_us ();
+
+    if (mb_param->type_com == RTU) {
+        /* Returns msg_length on success and a negative value on
+        failure */
+        return check_crc16 (rx->msg, rx->msg_length);
+    } else {
+        /* OK */
+        return rx->msg_length;
+    }
+}
+
 /* Listens for any query from a modbus master in TCP, requires the socket file
+
    descriptor etablished with the master device in argument or -1 to use the
    internal one of modbus_param_t.
 
@@ -835,104 +997,271 @@ int c_modbus::modbus_slave_receive (int sockfd, uint8_t *query,
     return receive_msg (MSG_LENGTH_UNDEFINED, query, select_time);
 }
 
-/* Receives the response and checks values (and checksum in RTU).
-
-   Returns:
-   - the number of values (bits or words) if success or the response
-     length if no value is returned
-   - less than 0 for exception errors
+/* Checks the number of values of a good response against the query.
 
-   Note: all functions used to send or receive data with modbus return
-   these values. */
-int c_modbus::modbus_receive (uint8_t *query, uint8_t *response,
-                              uint8_t data_type, int select_time) {
-    int ret;
-    int times = 0; // ¼ʱ
-    int response_length_computed;
+   Returns the number of values (bits or words) or the response length if
+   no value is returned, INVALID_DATA if the quantity doesn't correspond
+   to the query. */
+/* Minimum length of a response to the query, the fields read by
+   check_response_quantity and check_response_exception must be in the
+   frame (a mismatching function is left to the caller) */
+int c_modbus::check_response_length (uint8_t *query, uint8_t *response, int response_length) {
     int offset = TAB_HEADER_LENGTH[mb_param->type_com];
-
-again:
-    response_length_computed = compute_response_length (query, data_type);
-    ret = receive_msg (response_length_computed, response, select_time);
-    if (ret >= 0) {
-        /* GOOD RESPONSE */
-        int query_nb_value;
-        int response_nb_value;
-
-        /* The number of values is returned if it's corresponding
-        * to the query */
-        switch (response[offset]) {
+    int function = query[offset];
+    int min_length;
+
+    if (response_length < offset + 1)
+        min_length = offset + 1;
+    else if (response[offset] == 0x80 + function)
+        /* Exception code */
+        min_length = offset + 2;
+    else if (response[offset] != function)
+        return response_length;
+    else {
+        switch (function) {
         case FC_READ_COIL_STATUS:
         case FC_READ_INPUT_STATUS:
-            /* Read functions, 8 values in a byte (nb
-            * of values in the query and byte count in
-            * the response. */
-            query_nb_value = (query[offset + 3] << 8) + query[offset + 4];
-            query_nb_value = (query_nb_value / 8) + ( (query_nb_value % 8) ? 1 : 0);
-            response_nb_value = response[offset + 1];
-            break;
         case FC_READ_HOLDING_REGISTERS:
         case FC_READ_INPUT_REGISTERS:
-            query_nb_value = (query[offset + 3] << 8) + query[offset + 4];
-            switch (data_type) {
-            case    0:      // Ϊ8λ
-            case    1:      // Ϊ8λ޷
-                /* Read functions 1 value = 1 bytes */
-                response_nb_value = response[offset + 1];
-                /*ret = MB_EXCEPTION;*/
-                break;
-            case    2:      // Ϊ16λ
-            case    3:      // Ϊ16λ޷
-                /* Read functions 1 value = 2 bytes */
-                response_nb_value = (response[offset + 1] / 2);
-                break;
-            case    4:      // Ϊ32λ
-            case    5:      // Ϊ32λ޷
-                /* Read functions 1 value = 4 bytes */
-                response_nb_value = (response[offset + 1] / 4);
-                break;
-            case    6:      // Ϊ64λ
-            case    7:      // Ϊ64λ޷
-                ret = MB_EXCEPTION;
-                break;
-            case    8:      // ȸ
-                ret = MB_EXCEPTION;
-                break;
-            case    9:      // ˫ȸ
-                ret = MB_EXCEPTION;
-                break;
-            default:
-                ret = MB_EXCEPTION;
-                break;
-            }
+            /* Byte count then the values */
+            min_length = offset + 2;
+            if (response_length >= min_length)
+                min_length += response[offset + 1];
             break;
+        case FC_FORCE_SINGLE_COIL:
+        case FC_PRESET_SINGLE_REGISTER:
         case FC_FORCE_MULTIPLE_COILS:
         case FC_PRESET_MULTIPLE_REGISTERS:
-            /* N Write functions */
-            query_nb_value = (query[offset + 3] << 8) + query[offset + 4];
-            response_nb_value = (response[offset + 3] << 8) | response[offset + 4];
+            /* Echo of the address and the value (or quantity) */
+            min_length = offset + 5;
             break;
-        case FC_REPORT_SLAVE_ID:
-            /* Report slave ID (bytes received) */
-            query_nb_value = response_nb_value = ret;
+        default:
+            min_length = offset + 1;
+            break;
+        }
+    }
+    min_length += TAB_CHECKSUM_LENGTH[mb_param->type_com];
+
+    if (response_length < min_length) {
+        char s_error[128];
+        sprintf (s_error, "Response too short for the function (%d < %d)",
+                 response_length, min_length);
+        error_treat (INVALID_DATA, s_error);
+        return INVALID_DATA;
+    }
+
+    return response_length;
+}
+
+int c_modbus::check_response_quantity (uint8_t *query, uint8_t *response,
+                                       uint8_t data_type, int response_length) {
+    int ret = response_length;
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int query_nb_value;
+    int response_nb_value;
+
+    /* The number of values is returned if it's corresponding
+    * to the query */
+    switch (response[offset]) {
+    case FC_READ_COIL_STATUS:
+    case FC_READ_INPUT_STATUS:
+        /* Read functions, 8 values in a byte (nb
+        * of values in the query and byte count in
+        * the response. */
+        query_nb_value = (query[offset + 3] << 8) + query[offset + 4];
+        query_nb_value = (query_nb_value / 8) + ( (query_nb_value % 8) ? 1 : 0);
+        response_nb_value = response[offset + 1];
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+    case FC_READ_INPUT_REGISTERS:
+        query_nb_value = (query[offset + 3] << 8) + query[offset + 4];
+        switch (data_type) {
+        case    0:      // Ϊ8λ
+        case    1:      // Ϊ8λ޷
+            /* Read functions 1 value = 1 bytes */
+            response_nb_value = response[offset + 1];
+            /*ret = MB_EXCEPTION;*/
+            break;
+        case    2:      // Ϊ16λ
+        case    3:      // Ϊ16λ޷
+            /* Read functions 1 value = 2 bytes */
+            response_nb_value = (response[offset + 1] / 2);
+            break;
+        case    4:      // Ϊ32λ
+        case    5:      // Ϊ32λ޷
+            /* Read functions 1 value = 4 bytes */
+            response_nb_value = (response[offset + 1] / 4);
+            break;
+        case    6:      // Ϊ64λ
+        case    7:      // Ϊ64λ޷
+            ret = MB_EXCEPTION;
+            break;
+        case    8:      // ȸ
+            ret = MB_EXCEPTION;
+            break;
+        case    9:      // ˫ȸ
+            ret = MB_EXCEPTION;
             break;
         default:
-            /* 1 Write functions & others */
-            query_nb_value = response_nb_value = 1;
-        } // end switch (response[offset])
+            ret = MB_EXCEPTION;
+            break;
+        }
+        break;
+    case FC_FORCE_MULTIPLE_COILS:
+    case FC_PRESET_MULTIPLE_REGISTERS:
+        /* N Write functions */
+        query_nb_value = (query[offset + 3] << 8) + query[offset + 4];
+        response_nb_value = (response[offset + 3] << 8) | response[offset + 4];
+        break;
+    case FC_REPORT_SLAVE_ID:
+        /* Report slave ID (bytes received) */
+        query_nb_value = response_nb_value = response_length;
+        break;
+    default:
+        /* 1 Write functions & others */
+        query_nb_value = response_nb_value = 1;
+    } // end switch (response[offset])
+
+    if (query_nb_value == response_nb_value) {
+        ret = response_nb_value;
+    } else {
+        /*char *s_error = ( char* ) malloc ( 64 * sizeof ( char ) );*/
+        char s_error[128];
+        sprintf (s_error, "Quantity not corresponding to the query (%d != %d)", response_nb_value, query_nb_value);
+        ret = INVALID_DATA;
+        error_treat (ret, s_error);
+        /*free ( s_error );*/
+    }
 
-        if (query_nb_value == response_nb_value) {
-            ret = response_nb_value;
+    return ret;
+}
+
+/* Decodes an exception response, 0x80 + function is stored in the
+   exception response.
+
+   Returns the negative exception code, INVALID_EXCEPTION_CODE if the code
+   is unknown or INVALID_DATA if the response is not an exception to the
+   query. */
+int c_modbus::check_response_exception (uint8_t *query, uint8_t *response) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+
+    /* Check for exception response.
+    0x80 + function is stored in the exception
+    response. */
+    if (0x80 + query[offset] == response[offset]) {
+        int exception_code = response[offset + 1];
+        // FIXME check test
+        if (exception_code < NB_TAB_ERROR_MSG) {
+            error_treat (-exception_code, TAB_ERROR_MSG[response[offset + 1]]);
+            /* RETURN THE EXCEPTION CODE */
+            /* Modbus error code is negative */
+            return -exception_code;
         } else {
+            /* The chances are low to hit this
+            case but it can avoid a vicious
+            segfault */
             /*char *s_error = ( char* ) malloc ( 64 * sizeof ( char ) );*/
             char s_error[128];
-            sprintf (s_error, "Quantity not corresponding to the query (%d != %d)", response_nb_value, query_nb_value);
-            ret = INVALID_DATA;
-            error_treat (ret, s_error);
+            sprintf (s_error,
+                     "Invalid exception code %d",
+                     response[offset + 1]);
+            error_treat (INVALID_EXCEPTION_CODE,
+                         s_error);
             /*free ( s_error );*/
+            return INVALID_EXCEPTION_CODE;
+        }
+    }
+
+    return INVALID_DATA;
+}
+
+/* Receives the response and checks values (and checksum in RTU).
+
+   Returns:
+   - the number of values (bits or words) if success or the response
+     length if no value is returned
+   - less than 0 for exception errors
+
+   Note: all functions used to send or receive data with modbus return
+   these values. */
+int c_modbus::modbus_receive (uint8_t *query, uint8_t *response,
+                              uint8_t data_type, int select_time) {
+    return receive_expected (query, response, data_type,
+                             compute_response_length (query, data_type), select_time);
+}
+
+int c_modbus::receive_expected (uint8_t *query, uint8_t *response, uint8_t data_type,
+                                int response_length, int select_time) {
+    int ret;
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int attempt = 0;
+    int timeout = select_time;
+    modbus_slave_timing_t *timing = slave_timing (query[offset - 1]);
+    long delay_us;
+
+    if (is_broadcast (query)) {
+        /* Nothing comes back, the slaves are given the time to process
+           the query before the next one */
+        delay_us = broadcast_delay_us (last_query_length);
+        modbus_sleep (delay_us / 1000000, delay_us % 1000000);
+        if (stats != NULL)
+            stats->record_broadcast (query[offset - 1], query[offset], stats_tx_bytes);
+        return broadcast_quantity (query);
+    }
+
+    if (timing != NULL && timing->rto_ms < timeout)
+        timeout = timing->rto_ms;
+
+    for (;;) {
+        ret = receive_response (query, response, data_type, response_length, timeout);
+        if ( (ret != SELECT_TIMEOUT && ret != INVALID_CRC) || attempt >= nb_retries)
+            break;
+
+        /* Exponential backoff */
+        attempt++;
+        timeout *= 2;
+        if (timing != NULL && timeout > rto_max_ms)
+            timeout = rto_max_ms;
+        if (timeout > select_time)
+            timeout = select_time;
+        if (mb_param->debug) {
+            wprintf ("Retry %d of the query (%d ms)\n", attempt, timeout);
+        }
+
+        /* The end of a late or corrupted response is dropped */
+        modbus_flush ();
+        if (send_frame (query, last_query_length) < 0) {
+            ret = SOCKET_FAILURE;
+            break;
         }
-    } // end if (ret >= 0)
-    else if (ret == MB_EXCEPTION) {
+    }
+
+    if (timing != NULL) {
+        /* Karn's algorithm: the round trip of a query sent again is
+           ambiguous */
+        update_slave_timing (timing, ret, attempt == 0,
+                             modbus_time_us () - stats_send_us);
+    }
+
+    if (stats != NULL) {
+        stats->record (query[offset - 1], query[offset], ret,
+                       modbus_time_us () - stats_send_us,
+                       stats_tx_bytes, stats_rx_bytes);
+    }
+
+    return ret;
+}
+
+int c_modbus::receive_response (uint8_t *query, uint8_t *response, uint8_t data_type,
+                                int response_length, int select_time) {
+    int ret;
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+
+    ret = receive_msg (response_length, response, select_time);
+    if (ret >= 0) {
+        /* GOOD RESPONSE */
+        ret = check_response_quantity (query, response, data_type, ret);
+    } else if (ret == MB_EXCEPTION) {
         /* EXCEPTION CODE RECEIVED */
 
         /* CRC must be checked here (not done in receive_msg) */
@@ -946,35 +1275,11 @@ again:
         0x80 + function is stored in the exception
         response. */
         if (0x80 + query[offset] == response[offset]) {
-            int exception_code = response[offset + 1];
-            // FIXME check test
-            if (exception_code < NB_TAB_ERROR_MSG) {
-                error_treat (-exception_code, TAB_ERROR_MSG[response[offset + 1]]);
-                /* RETURN THE EXCEPTION CODE */
-                /* Modbus error code is negative */
-                return -exception_code;
-            } else {
-                /* The chances are low to hit this
-                case but it can avoid a vicious
-                segfault */
-                /*char *s_error = ( char* ) malloc ( 64 * sizeof ( char ) );*/
-                char s_error[128];
-                sprintf (s_error,
-                         "Invalid exception code %d",
-                         response[offset + 1]);
-                error_treat (INVALID_EXCEPTION_CODE,
-                             s_error);
-                /*free ( s_error );*/
-                return INVALID_EXCEPTION_CODE;
-            }
+            return check_response_exception (query, response);
         }
     } else if (ret == SELECT_TIMEOUT) {
-        if (++times <= 1) {
-            error_treat (ret, "modbus_receive");
-            /*wprintf ( "\033[33;32;1m select_timeout!\n\033[0m" );*/
-            /*goto again;*/
-        } else /* Other errors */
-            error_treat (ret, "modbus_receive");
+        /* Sent again by modbus_receive, see modbus_set_retries */
+        error_treat (ret, "modbus_receive");
     }
 
     return ret;
@@ -983,25 +1288,9 @@ again:
 int c_modbus::response_io_status (int address, int nb,
                                   uint8_t *tab_io_status,
                                   uint8_t *response, int offset) {
-    int shift = 0;
-    int byte = 0;
-    int i;
+    modbus_bits_pack (tab_io_status + address, nb, response + offset);
 
-    for (i = address; i < address + nb; i++) {
-        byte |= tab_io_status[i] << shift;
-        if (shift == 7) {
-            /* Byte is full */
-            response[offset++] = byte;
-            byte = shift = 0;
-        } else {
-            shift++;
-        }
-    }
-
-    if (shift != 0)
-        response[offset++] = byte;
-
-    return offset;
+    return offset + (nb / 8) + ( (nb % 8) ? 1 : 0);
 }
 
 /* Build the exception response */
@@ -1017,202 +1306,299 @@ int c_modbus::response_exception (sft_t *sft, int exception_code, uint8_t *respo
     return response_length;
 }
 
-/* Manages the received query.
-   Analyses the query and constructs a response.
+/* Exception response to a query, with a message in debug mode only: the
+   slave of a busy master shouldn't print on each bad query */
+int c_modbus::slave_exception (sft_t *sft, int exception_code, const char *name,
+                               int value, uint8_t *response) {
+    if (mb_param->debug) {
+        wprintf ("Illegal data %s %0X in %s\n",
+                 (exception_code == ILLEGAL_DATA_VALUE) ? "value" : "address",
+                 value, name);
+    }
 
-   If an error occurs, this function construct the response
-   accordingly.
-*/
-void c_modbus::modbus_slave_manage (const uint8_t *query,
-                                    int query_length, modbus_mapping_t *mb_mapping) {
+    return response_exception (sft, exception_code, response);
+}
+
+/* FC_READ_COIL_STATUS and FC_READ_INPUT_STATUS */
+int c_modbus::slave_read_status (sft_t *sft, const uint8_t *query, int /* query_length */,
+                                 modbus_mapping_t *mb_mapping, uint8_t *response) {
     int offset = TAB_HEADER_LENGTH[mb_param->type_com];
-    int slave = query[offset - 1];
-    int function = query[offset];
-    uint16_t address = (query[offset + 1] << 8) + query[offset + 2];
-    uint8_t response[MAX_MESSAGE_LENGTH];
-    int resp_length = 0;
-    sft_t sft;
+    int address = (query[offset + 1] << 8) + query[offset + 2];
+    int nb = (query[offset + 3] << 8) + query[offset + 4];
+    int byte_count = (nb / 8) + ( (nb % 8) ? 1 : 0);
+    int coils = (sft->function == FC_READ_COIL_STATUS);
+    const char *name = coils ? "read_coil_status" : "read_input_status";
+    uint8_t *tab = coils ? mb_mapping->tab_coil_status : mb_mapping->tab_input_status;
+    modbus_seqlock_t *locks = coils ? mb_mapping->seq_coil_status : mb_mapping->seq_input_status;
+    int nb_status = coils ? mb_mapping->nb_coil_status : mb_mapping->nb_input_status;
+    int resp_length;
+
+    if (nb > MAX_STATUS)
+        return slave_exception (sft, ILLEGAL_DATA_VALUE, name, nb, response);
+    if ( (address + nb) > nb_status)
+        return slave_exception (sft, ILLEGAL_DATA_ADDRESS, name, address + nb, response);
+
+    resp_length = build_response_basis (sft, response);
+    response[resp_length++] = byte_count;
+    if (mb_mapping->bit_packed) {
+        /* The padding bits of the last byte are 0 */
+        response[resp_length + byte_count - 1] = 0;
+        modbus_mapping_read_bits (tab, locks, address, nb, response + resp_length);
+        resp_length += byte_count;
+    } else {
+        uint8_t tab_status[MAX_STATUS];
 
-    if (slave != mb_param->slave && slave != MODBUS_BROADCAST_ADDRESS) {
-        // Ignores the query (not for me)
-        if (mb_param->debug) {
-            wprintf ("Request for slave %d ignored (not %d)\n",
-                     slave, mb_param->slave);
-        }
-        return;
+        modbus_mapping_read (tab, locks, address, nb, tab_status);
+        resp_length = response_io_status (0, nb, tab_status, response, resp_length);
     }
 
-    sft.slave = slave;
-    sft.function = function;
-    if (mb_param->type_com == TCP) {
-        sft.t_id = (query[0] << 8) + query[1];
-    } else {
-        sft.t_id = 0;
-        query_length -= CHECKSUM_LENGTH_RTU;
-    }
+    return resp_length;
+}
 
-    switch (function) {
-    case FC_READ_COIL_STATUS: {
-        int nb = (query[offset + 3] << 8) + query[offset + 4];
+/* FC_READ_HOLDING_REGISTERS and FC_READ_INPUT_REGISTERS */
+int c_modbus::slave_read_registers (sft_t *sft, const uint8_t *query, int /* query_length */,
+                                    modbus_mapping_t *mb_mapping, uint8_t *response) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int address = (query[offset + 1] << 8) + query[offset + 2];
+    int nb = (query[offset + 3] << 8) + query[offset + 4];
+    int holding = (sft->function == FC_READ_HOLDING_REGISTERS);
+    const char *name = holding ? "read_holding_registers" : "read_input_registers";
+    uint16_t *tab = holding ? mb_mapping->tab_holding_registers : mb_mapping->tab_input_registers;
+    modbus_seqlock_t *locks = holding ? mb_mapping->seq_holding_registers :
+                              mb_mapping->seq_input_registers;
+    int nb_registers = holding ? mb_mapping->nb_holding_registers :
+                       mb_mapping->nb_input_registers;
+    uint16_t tab_registers[MAX_REGISTERS];
+    modbus_virtual_range_t *range;
+    int resp_length;
+    int ret;
+    int i;
 
-        if ( (address + nb) > mb_mapping->nb_coil_status) {
-            wprintf ("Illegal data address %0X in read_coil_status\n",
-                     address + nb);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            resp_length = build_response_basis (&sft, response);
-            response[resp_length++] = (nb / 8) + ( (nb % 8) ? 1 : 0);
-            resp_length = response_io_status (address, nb,
-                                              mb_mapping->tab_coil_status,
-                                              response, resp_length);
+    if (nb > MAX_REGISTERS)
+        return slave_exception (sft, ILLEGAL_DATA_VALUE, name, nb, response);
+
+    for (i = 0; i < mb_mapping->nb_virtual_ranges; i++) {
+        range = &mb_mapping->virtual_ranges[i];
+        if (range->function == sft->function && address >= range->start_addr &&
+                address + nb <= range->start_addr + range->nb) {
+            ret = range->read (sft->function, address, nb, tab_registers, range->arg);
+            if (ret < 0)
+                return response_exception (sft, (ret >= GATEWAY_PROBLEM_TARGET) ? ret :
+                                           SLAVE_DEVICE_FAILURE, response);
+
+            resp_length = build_response_basis (sft, response);
+            response[resp_length++] = nb << 1;
+            modbus_encode_16 (tab_registers, nb, response + resp_length);
+            return resp_length + nb * 2;
         }
     }
-    break;
 
-    case FC_READ_INPUT_STATUS: {
-        /* Similar to coil status (but too much arguments to use a
-         * function) */
-        int nb = (query[offset + 3] << 8) + query[offset + 4];
+    if ( (address + nb) > nb_registers)
+        return slave_exception (sft, ILLEGAL_DATA_ADDRESS, name, address + nb, response);
 
-        if ( (address + nb) > mb_mapping->nb_input_status) {
-            wprintf ("Illegal data address %0X in read_input_status\n",
-                     address + nb);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            resp_length = build_response_basis (&sft, response);
-            response[resp_length++] = (nb / 8) + ( (nb % 8) ? 1 : 0);
-            resp_length = response_io_status (address, nb,
-                                              mb_mapping->tab_input_status,
-                                              response, resp_length);
-        }
+    resp_length = build_response_basis (sft, response);
+    response[resp_length++] = nb << 1;
+    if (locks == NULL) {
+        /* Straight from the table */
+        modbus_encode_16 (tab + address, nb, response + resp_length);
+    } else {
+        modbus_mapping_read (tab, locks, address, nb, tab_registers);
+        modbus_encode_16 (tab_registers, nb, response + resp_length);
     }
-    break;
 
-    case FC_READ_HOLDING_REGISTERS: {
-        int nb = (query[offset + 3] << 8) + query[offset + 4];
+    return resp_length + nb * 2;
+}
 
-        if ( (address + nb) > mb_mapping->nb_holding_registers) {
-            wprintf ("Illegal data address %0X in read_holding_registers\n",
-                     address + nb);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            int i;
+int c_modbus::slave_force_single_coil (sft_t *sft, const uint8_t *query, int query_length,
+                                       modbus_mapping_t *mb_mapping, uint8_t *response) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int address = (query[offset + 1] << 8) + query[offset + 2];
+    int data = (query[offset + 3] << 8) + query[offset + 4];
+    uint8_t status;
+
+    if (address >= mb_mapping->nb_coil_status)
+        return slave_exception (sft, ILLEGAL_DATA_ADDRESS, "force_single_coil", address,
+                                response);
+    if (data != 0xFF00 && data != 0x0)
+        return slave_exception (sft, ILLEGAL_DATA_VALUE, "force_single_coil", data, response);
+
+    status = (data) ? ON : OFF;
+    if (mb_mapping->bit_packed)
+        /* ON is the first bit of status */
+        modbus_mapping_write_bits (mb_mapping->tab_coil_status,
+                                   mb_mapping->seq_coil_status,
+                                   address, 1, &status);
+    else
+        modbus_mapping_write (mb_mapping->tab_coil_status,
+                              mb_mapping->seq_coil_status,
+                              address, 1, &status);
 
-            resp_length = build_response_basis (&sft, response);
-            response[resp_length++] = nb << 1;
-            for (i = address; i < address + nb; i++) {
-                response[resp_length++] = mb_mapping->tab_holding_registers[i] >> 8;
-                response[resp_length++] = mb_mapping->tab_holding_registers[i] & 0xFF;
-            }
-        }
-    }
-    break;
+    /* In RTU mode, the CRC is computed and added
+       to the query by modbus_send, the computed
+       CRC will be same and optimisation is
+       possible here (FIXME). */
+    memcpy (response, query, query_length);
 
-    case FC_READ_INPUT_REGISTERS: {
-        /* Similar to holding registers (but too much arguments to use a
-         * function) */
-        int nb = (query[offset + 3] << 8) + query[offset + 4];
+    return query_length;
+}
 
-        if ( (address + nb) > mb_mapping->nb_input_registers) {
-            wprintf ("Illegal data address %0X in read_input_registers\n",
-                     address + nb);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            int i;
+int c_modbus::slave_preset_single_register (sft_t *sft, const uint8_t *query, int query_length,
+                                            modbus_mapping_t *mb_mapping, uint8_t *response) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int address = (query[offset + 1] << 8) + query[offset + 2];
+    uint16_t data = (query[offset + 3] << 8) + query[offset + 4];
 
-            resp_length = build_response_basis (&sft, response);
-            response[resp_length++] = nb << 1;
-            for (i = address; i < address + nb; i++) {
-                response[resp_length++] = mb_mapping->tab_input_registers[i] >> 8;
-                response[resp_length++] = mb_mapping->tab_input_registers[i] & 0xFF;
-            }
-        }
-    }
-    break;
+    if (address >= mb_mapping->nb_holding_registers)
+        return slave_exception (sft, ILLEGAL_DATA_ADDRESS, "preset_single_register", address,
+                                response);
 
-    case FC_FORCE_SINGLE_COIL: {
-        if (address >= mb_mapping->nb_coil_status) {
-            wprintf ("Illegal data address %0X in force_singe_coil\n", address);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            int data = (query[offset + 3] << 8) + query[offset + 4];
+    modbus_mapping_write (mb_mapping->tab_holding_registers,
+                          mb_mapping->seq_holding_registers,
+                          address, 1, &data);
+    memcpy (response, query, query_length);
 
-            if (data == 0xFF00 || data == 0x0) {
-                mb_mapping->tab_coil_status[address] = (data) ? ON : OFF;
+    return query_length;
+}
 
-                /* In RTU mode, the CRC is computed and added
-                   to the query by modbus_send, the computed
-                   CRC will be same and optimisation is
-                   possible here (FIXME). */
-                memcpy (response, query, query_length);
-                resp_length = query_length;
-            } else {
-                wprintf ("Illegal data value %0X in force_single_coil request at address %0X\n",
-                         data, address);
-                resp_length = response_exception (&sft, ILLEGAL_DATA_VALUE, response);
-            }
-        }
+int c_modbus::slave_force_multiple_coils (sft_t *sft, const uint8_t *query, int query_length,
+                                          modbus_mapping_t *mb_mapping, uint8_t *response) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int address = (query[offset + 1] << 8) + query[offset + 2];
+    int nb = (query[offset + 3] << 8) + query[offset + 4];
+    int resp_length;
+
+    if (nb > MAX_WRITE_STATUS || query_length < offset + 6 + (nb + 7) / 8)
+        return slave_exception (sft, ILLEGAL_DATA_VALUE, "force_multiple_coils", nb, response);
+    if ( (address + nb) > mb_mapping->nb_coil_status)
+        return slave_exception (sft, ILLEGAL_DATA_ADDRESS, "force_multiple_coils", address + nb,
+                                response);
+
+    /* 6 = byte count */
+    if (mb_mapping->bit_packed) {
+        modbus_mapping_write_bits (mb_mapping->tab_coil_status,
+                                   mb_mapping->seq_coil_status,
+                                   address, nb, &query[offset + 6]);
+    } else {
+        uint8_t tab_status[MAX_WRITE_STATUS];
+
+        set_bits_from_bytes (tab_status, 0, nb, &query[offset + 6]);
+        modbus_mapping_write (mb_mapping->tab_coil_status,
+                              mb_mapping->seq_coil_status,
+                              address, nb, tab_status);
     }
-    break;
 
-    case FC_PRESET_SINGLE_REGISTER:
-        if (address >= mb_mapping->nb_holding_registers) {
-            wprintf ("Illegal data address %0X in preset_holding_register\n", address);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            int data = (query[offset + 3] << 8) + query[offset + 4];
+    resp_length = build_response_basis (sft, response);
+    /* 4 to copy the coil address (2) and the quantity of coils */
+    memcpy (response + resp_length, query + resp_length, 4);
 
-            mb_mapping->tab_holding_registers[address] = data;
-            memcpy (response, query, query_length);
-            resp_length = query_length;
-        }
-        break;
-    case FC_FORCE_MULTIPLE_COILS: {
-        int nb = (query[offset + 3] << 8) + query[offset + 4];
+    return resp_length + 4;
+}
 
-        if ( (address + nb) > mb_mapping->nb_coil_status) {
-            wprintf ("Illegal data address %0X in force_multiple_coils\n",
-                     address + nb);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            /* 6 = byte count */
-            set_bits_from_bytes (mb_mapping->tab_coil_status, address, nb, &query[offset + 6]);
+int c_modbus::slave_preset_multiple_registers (sft_t *sft, const uint8_t *query,
+                                               int query_length,
+                                               modbus_mapping_t *mb_mapping,
+                                               uint8_t *response) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int address = (query[offset + 1] << 8) + query[offset + 2];
+    int nb = (query[offset + 3] << 8) + query[offset + 4];
+    int resp_length;
+
+    if (nb > MAX_WRITE_REGISTERS || query_length < offset + 6 + nb * 2)
+        return slave_exception (sft, ILLEGAL_DATA_VALUE, "preset_multiple_registers", nb,
+                                response);
+    if ( (address + nb) > mb_mapping->nb_holding_registers)
+        return slave_exception (sft, ILLEGAL_DATA_ADDRESS, "preset_multiple_registers",
+                                address + nb, response);
+
+    /* 6 and 7 = first value */
+    if (mb_mapping->seq_holding_registers == NULL) {
+        modbus_decode_16 (&query[offset + 6], nb, mb_mapping->tab_holding_registers + address);
+    } else {
+        uint16_t tab_registers[MAX_REGISTERS];
 
-            resp_length = build_response_basis (&sft, response);
-            /* 4 to copy the coil address (2) and the quantity of coils */
-            memcpy (response + resp_length, query + resp_length, 4);
-            resp_length += 4;
-        }
+        modbus_decode_16 (&query[offset + 6], nb, tab_registers);
+        modbus_mapping_write (mb_mapping->tab_holding_registers,
+                              mb_mapping->seq_holding_registers,
+                              address, nb, tab_registers);
     }
-    break;
-    case FC_PRESET_MULTIPLE_REGISTERS: {
-        int nb = (query[offset + 3] << 8) + query[offset + 4];
 
-        if ( (address + nb) > mb_mapping->nb_holding_registers) {
-            wprintf ("Illegal data address %0X in preset_multiple_registers\n",
-                     address + nb);
-            resp_length = response_exception (&sft, ILLEGAL_DATA_ADDRESS, response);
-        } else {
-            int i, j;
-            for (i = address, j = 6; i < address + nb; i++, j += 2) {
-                /* 6 and 7 = first value */
-                mb_mapping->tab_holding_registers[i] =
-                    (query[offset + j] << 8) + query[offset + j + 1];
-            }
+    resp_length = build_response_basis (sft, response);
+    /* 4 to copy the address (2) and the no. of registers */
+    memcpy (response + resp_length, query + resp_length, 4);
+
+    return resp_length + 4;
+}
+
+const c_modbus::slave_handler_t c_modbus::slave_handlers[FC_PRESET_MULTIPLE_REGISTERS + 1] = {
+    NULL,
+    /* FC_READ_COIL_STATUS, FC_READ_INPUT_STATUS */
+    &c_modbus::slave_read_status,
+    &c_modbus::slave_read_status,
+    /* FC_READ_HOLDING_REGISTERS, FC_READ_INPUT_REGISTERS */
+    &c_modbus::slave_read_registers,
+    &c_modbus::slave_read_registers,
+    &c_modbus::slave_force_single_coil,
+    &c_modbus::slave_preset_single_register,
+    /* 0x07 to 0x0E */
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    &c_modbus::slave_force_multiple_coils,
+    &c_modbus::slave_preset_multiple_registers
+};
+
+/* Manages the received query.
+   Analyses the query and constructs a response.
+
+   If an error occurs, this function construct the response
+   accordingly.
+*/
+void c_modbus::modbus_slave_manage (const uint8_t *query,
+                                    int query_length, modbus_mapping_t *mb_mapping) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int slave = query[offset - 1];
+    int function = query[offset];
+    uint8_t *response = adu;
+    int resp_length;
+    slave_handler_t handler = NULL;
+    sft_t sft;
+    /* No response is sent to a broadcast in RTU */
+    int broadcast = (mb_param->type_com == RTU &&
+                     (slave == 0 || slave == MODBUS_BROADCAST_ADDRESS));
 
-            resp_length = build_response_basis (&sft, response);
-            /* 4 to copy the address (2) and the no. of registers */
-            memcpy (response + resp_length, query + resp_length, 4);
-            resp_length += 4;
+    /* No buffer for the response */
+    if (response == NULL)
+        return;
+
+    if (slave != mb_param->slave && slave != MODBUS_BROADCAST_ADDRESS && !broadcast) {
+        // Ignores the query (not for me)
+        if (mb_param->debug) {
+            wprintf ("Request for slave %d ignored (not %d)\n",
+                     slave, mb_param->slave);
         }
+        return;
     }
-    break;
-    case FC_READ_EXCEPTION_STATUS:
-    case FC_REPORT_SLAVE_ID:
-        wprintf ("Not implemented\n");
-        break;
+
+    sft.slave = slave;
+    sft.function = function;
+    if (mb_param->type_com == TCP) {
+        sft.t_id = (query[0] << 8) + query[1];
+    } else {
+        sft.t_id = 0;
+        query_length -= CHECKSUM_LENGTH_RTU;
     }
 
+    if (function <= FC_PRESET_MULTIPLE_REGISTERS)
+        handler = slave_handlers[function];
+    if (handler != NULL) {
+        resp_length = (this->*handler) (&sft, query, query_length, mb_mapping, response);
+    } else {
+        if (mb_param->debug)
+            wprintf ("Function %0X not supported\n", function);
+        resp_length = response_exception (&sft, ILLEGAL_FUNCTION, response);
+    }
+
+    if (broadcast)
+        return;
+
     modbus_send (response, resp_length);
 }
 
@@ -1223,34 +1609,20 @@ int c_modbus::read_io_status (int function,
     int query_length;
 
     uint8_t query[MIN_QUERY_LENGTH];
-    uint8_t response[MAX_MESSAGE_LENGTH];
+    uint8_t *response = adu;
 
     query_length = build_query_basis (function, start_addr, nb, query);
 
     ret = modbus_send (query, query_length);
     if (ret > 0) {
-        int i, temp, bit;
-        int pos = 0;
-        int offset;
-        int offset_end;
-
         ret = modbus_receive (query, response, UINT16, select_time);
-        if (ret < 0) {
-            return ret;
-        }
-
-        offset = TAB_HEADER_LENGTH[mb_param->type_com];
-        offset_end = offset + ret;
-        for (i = offset; i < offset_end; i++) {
-            /* Shift reg hi_byte to temp */
-            temp = response[i + 2];
-
-            for (bit = 0x01; (bit & 0xff) && (pos < nb);) {
-                data_dest[pos++] = (temp & bit) ? TRUE : FALSE;
-                bit = bit << 1;
-            }
-
+        if (ret < 0) {
+            return ret;
         }
+
+        /* The bits follow the byte count, ret */
+        modbus_bits_unpack (response + TAB_HEADER_LENGTH[mb_param->type_com] + 2,
+                            (ret * 8 < nb) ? ret * 8 : nb, data_dest);
     }
 
     return ret;
@@ -1299,13 +1671,25 @@ int c_modbus::read_input_status (int start_addr,
     return status;
 }
 
+/* Decodes nb values of type T and widens them to 32 bits, the signed
+   values are sign extended */
+template <typename T>
+static void decode_widen (const uint8_t *src, int nb, uint32_t *dest) {
+    T values[MAX_PDU_LENGTH];
+    int i;
+
+    modbus_decode<T, WORD_ORDER_BIG> (src, nb * sizeof (T), values);
+    for (i = 0; i < nb; i++)
+        dest[i] = (uint32_t) values[i];
+}
+
 /* Reads the data from a modbus slave and put that data into an array */
 int c_modbus::read_registers (int function, int start_addr,
                               int nb, uint32_t *data_dest, uint8_t data_type, int select_time) {
     int ret;
     int query_length;
     uint8_t query[MIN_QUERY_LENGTH];
-    uint8_t response[MAX_MESSAGE_LENGTH * 4];
+    uint8_t *response = adu;
 
     if (nb > MAX_REGISTERS) {
         fprintf (stderr, "ERROR Too many holding registers requested (%d > %d)\n", nb, MAX_REGISTERS);
@@ -1316,56 +1700,35 @@ int c_modbus::read_registers (int function, int start_addr,
 
     ret = modbus_send (query, query_length);
     if (ret > 0) {
-        int i;
         int offset;
 
         ret = modbus_receive (query, response, data_type, select_time);
 
         offset = TAB_HEADER_LENGTH[mb_param->type_com];
 
-        /* If ret is negative, the loop is jumped ! */
-        for (i = 0; i < ret; i++) {
+        /* One conversion for the whole payload */
+        if (ret > 0) {
+            const uint8_t *payload = response + offset + 2;
+
             switch (data_type) {
-            case    0:      // Ϊ8λ
-                data_dest[i] = (int8_t) (response[offset + 2 + i]);
-            case    1:      // Ϊ8λ޷
-                data_dest[i] = (uint8_t) (response[offset + 2 + i]);
+            case INT8:
+                decode_widen<int8_t> (payload, ret, data_dest);
+                break;
+            case UINT8:
+                decode_widen<uint8_t> (payload, ret, data_dest);
                 break;
-            case    2:      // Ϊ16λ
-                data_dest[i] = (int16_t) ( (response[offset + 2 + (i << 1) ] << 8)
-                                           | response[offset + 3 + (i << 1)]);
-            case    3:      // Ϊ16λ޷
-                data_dest[i] = (uint16_t) ( (response[offset + 2 + (i << 1) ] << 8)
-                                            | response[offset + 3 + (i << 1)]);
+            case INT16:
+                decode_widen<int16_t> (payload, ret, data_dest);
                 break;
-            case    4:      // Ϊ32λ
-                data_dest[i] = (int32_t) ( (response[offset + 2 + (i << 2) ] << 24)
-                                           | (response[offset + 3 + (i << 2) ] << 16)
-                                           | (response[offset + 4 + (i << 2) ] << 8)
-                                           | response[offset + 5 + (i << 2) ]);
-            case    5:      // Ϊ32λ޷
-                data_dest[i] = (uint32_t) ( (response[offset + 2 + (i << 2) ] << 24)
-                                            | (response[offset + 3 + (i << 2) ] << 16)
-                                            | (response[offset + 4 + (i << 2) ] << 8)
-                                            | response[offset + 5 + (i << 2) ]);
+            case UINT16:
+                decode_widen<uint16_t> (payload, ret, data_dest);
+                break;
+            case INT32:
+                decode_widen<int32_t> (payload, ret, data_dest);
                 break;
-            case    6:      // Ϊ64λ
-            case    7:      // Ϊ64λ޷
-                //ret = MB_EXCEPTION;
-                //return ret;
-            case    8:      // ȸ
-                //ret = MB_EXCEPTION;
-                //break;
-            case    9:      // ˫ȸ
-                //ret = MB_EXCEPTION;
-                //return ret;
             default:
-                data_dest[i] = (uint32_t) ( (response[offset + 2 + (i << 2) ] << 24)
-                                            | (response[offset + 3 + (i << 2) ] << 16)
-                                            | (response[offset + 4 + (i << 2) ] << 8)
-                                            | response[offset + 5 + (i << 2) ]);
-                //ret = MB_EXCEPTION;
-                //return ret;
+                decode_widen<uint32_t> (payload, ret, data_dest);
+                break;
             }
         }
     } // end if
@@ -1403,12 +1766,58 @@ int c_modbus::read_input_registers (int start_addr, int nb,
         return INVALID_DATA;
     }
 
-    status = read_registers (FC_READ_INPUT_REGISTERS,
-                             start_addr, nb, (uint32_t*) data_dest, UINT16, select_time);
+    status = read_registers_typed (FC_READ_INPUT_REGISTERS, start_addr, nb,
+                                   data_dest, UINT16, WORD_ORDER_BIG, select_time);
 
     return status;
 }
 
+/* Reads nb registers and decodes the payload as values of data_type */
+int c_modbus::read_registers_typed (int function, int start_addr, int nb, void *data_dest,
+                                    uint8_t data_type, int word_order, int select_time) {
+    int ret;
+    int size;
+    int query_length;
+    uint8_t query[MIN_QUERY_LENGTH];
+
+    if (nb > MAX_REGISTERS) {
+        fprintf (stderr, "ERROR Too many registers requested (%d > %d)\n", nb, MAX_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    size = modbus_data_type_size (data_type);
+    if (size == 0 || (nb * 2) % size != 0) {
+        fprintf (stderr, "ERROR %d registers can't be decoded as type %d\n", nb, data_type);
+        return INVALID_DATA;
+    }
+
+    query_length = build_query_basis (function, start_addr, nb, query);
+
+    ret = modbus_send (query, query_length);
+    if (ret > 0) {
+        ret = modbus_receive (query, adu, UINT16, select_time);
+        if (ret > 0) {
+            ret = modbus_decode_type (data_type, word_order,
+                                      adu + TAB_HEADER_LENGTH[mb_param->type_com] + 2,
+                                      ret * 2, data_dest);
+        }
+    }
+
+    return ret;
+}
+
+int c_modbus::read_holding_registers_typed (int start_addr, int nb, void *data_dest,
+                                            uint8_t data_type, int word_order, int select_time) {
+    return read_registers_typed (FC_READ_HOLDING_REGISTERS, start_addr, nb,
+                                 data_dest, data_type, word_order, select_time);
+}
+
+int c_modbus::read_input_registers_typed (int start_addr, int nb, void *data_dest,
+                                          uint8_t data_type, int word_order, int select_time) {
+    return read_registers_typed (FC_READ_INPUT_REGISTERS, start_addr, nb,
+                                 data_dest, data_type, word_order, select_time);
+}
+
 /* Sends a value to a register in a slave.
    Used by force_single_coil and preset_single_register */
 int c_modbus::set_single (int function, int addr, int value,
@@ -1423,8 +1832,7 @@ int c_modbus::set_single (int function, int addr, int value,
     if (ret > 0) {
         /* Used by force_single_coil and
         * preset_single_register */
-        uint8_t response[MIN_QUERY_LENGTH];
-        ret = modbus_receive (query, response, UINT16, select_time);
+        ret = modbus_receive (query, adu, UINT16, select_time);
     }
 
     return ret;
@@ -1434,14 +1842,11 @@ int c_modbus::set_single (int function, int addr, int value,
 int c_modbus::force_single_coil (int coil_addr, int state, int select_time) {
     int status;
 
-    printf ("force_single_coil ..\n");
     if (state) {
         state = 0xFF00;
     }
 
-    mb_param->debug = 1;
     status = set_single (FC_FORCE_SINGLE_COIL, coil_addr, state, select_time);
-    mb_param->debug = 0;
 
     return status;
 }
@@ -1459,17 +1864,14 @@ int c_modbus::preset_single_register (int reg_addr, int value, int select_time)
 int c_modbus::force_multiple_coils (int start_addr, int nb,
                                     const uint8_t *data_src, int select_time) {
     int ret;
-    int i;
     int byte_count;
     int query_length;
-    int coil_check = 0;
-    int pos = 0;
 
     uint8_t query[MAX_MESSAGE_LENGTH];
 
-    if (nb > MAX_STATUS) {
+    if (nb > MAX_WRITE_STATUS) {
         fprintf (stderr, "ERROR Writing to too many coils (%d > %d)\n",
-                 nb, MAX_STATUS);
+                 nb, MAX_WRITE_STATUS);
         return INVALID_DATA;
     }
 
@@ -1478,27 +1880,12 @@ int c_modbus::force_multiple_coils (int start_addr, int nb,
     byte_count = (nb / 8) + ( (nb % 8) ? 1 : 0);
     query[query_length++] = byte_count;
 
-    for (i = 0; i < byte_count; i++) {
-        int bit;
-
-        bit = 0x01;
-        query[query_length] = 0;
-
-        while ( (bit & 0xFF) && (coil_check++ < nb)) {
-            if (data_src[pos++])
-                query[query_length] |= bit;
-            else
-                query[query_length] &= ~ bit;
-
-            bit = bit << 1;
-        }
-        query_length++;
-    }
+    modbus_bits_pack (data_src, nb, query + query_length);
+    query_length += byte_count;
 
     ret = modbus_send (query, query_length);
     if (ret > 0) {
-        uint8_t response[MAX_MESSAGE_LENGTH];
-        ret = modbus_receive (query, response, UINT16, select_time);
+        ret = modbus_receive (query, adu, UINT16, select_time);
     }
 
 
@@ -1515,10 +1902,10 @@ int c_modbus::preset_multiple_registers (int start_addr, int nb,
 
     uint8_t query[MAX_MESSAGE_LENGTH];
 
-    if (nb > MAX_REGISTERS) {
+    if (nb > MAX_WRITE_REGISTERS) {
         fprintf (stderr,
                  "ERROR Trying to write to too many registers (%d > %d)\n",
-                 nb, MAX_REGISTERS);
+                 nb, MAX_WRITE_REGISTERS);
         return INVALID_DATA;
     }
 
@@ -1533,8 +1920,7 @@ int c_modbus::preset_multiple_registers (int start_addr, int nb,
 
     ret = modbus_send (query, query_length);
     if (ret > 0) {
-        uint8_t response[MAX_MESSAGE_LENGTH];
-        ret = modbus_receive (query, response, UINT16, select_time);
+        ret = modbus_receive (query, adu, UINT16, select_time);
     }
 
     return ret;
@@ -1556,7 +1942,7 @@ int c_modbus::report_slave_id (uint8_t *data_dest, int select_time) {
         int i;
         int offset;
         int offset_end;
-        uint8_t response[MAX_MESSAGE_LENGTH];
+        uint8_t *response = adu;
 
         /* Byte count, slave id, run indicator status,
            additional data */
@@ -1574,6 +1960,53 @@ int c_modbus::report_slave_id (uint8_t *data_dest, int select_time) {
     return ret;
 }
 
+/* Builds a query once for modbus_execute */
+int c_modbus::modbus_prepare (modbus_prepared_t *request, int function, int start_addr, int nb) {
+    int ret;
+
+    if (mb_param->type_com == RTU)
+        ret = modbus_rtu_frame::prepare (mb_param->slave, function, start_addr, nb, request);
+    else
+        ret = modbus_tcp_frame::prepare (mb_param->slave, function, start_addr, nb, request);
+
+    if (ret < 0)
+        fprintf (stderr, "ERROR Function code 0x%X (%d at %d) can't be prepared\n",
+                 function, nb, start_addr);
+
+    return ret;
+}
+
+/* Sends a prepared query, the response is checked against the length
+   computed by modbus_prepare */
+int c_modbus::modbus_execute (modbus_prepared_t *request, void *dest, int select_time) {
+    uint8_t *query = request->query;
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+    int nb = (query[offset + 3] << 8) | query[offset + 4];
+    int ret;
+
+    ret = send_ready (query, request->query_length);
+    if (ret > 0) {
+        ret = receive_expected (query, adu, UINT16, request->response_length, select_time);
+        if (ret > 0) {
+            switch (query[offset]) {
+            case FC_READ_COIL_STATUS:
+            case FC_READ_INPUT_STATUS:
+                /* The bits follow the byte count, ret */
+                modbus_bits_unpack (adu + offset + 2, (ret * 8 < nb) ? ret * 8 : nb,
+                                    (uint8_t *) dest);
+                ret = nb;
+                break;
+            case FC_READ_HOLDING_REGISTERS:
+            case FC_READ_INPUT_REGISTERS:
+                modbus_decode_16 (adu + offset + 2, ret, dest);
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
 /* Initializes the modbus_param_t structure for RTU
    - device: "/dev/ttyS0"
    - baud:   9600, 19200, 57600, 115200, etc
@@ -1594,6 +2027,8 @@ void c_modbus::modbus_init_rtu (const char *device,
     mb_param->type_com = RTU;
     mb_param->error_handling = FLUSH_OR_CONNECT_ON_ERROR;
     mb_param->slave = slave;
+    mb_param->frame_slack_us = RTU_FRAME_SLACK_DEFAULT;
+    compute_rtu_timings ();
 
 
     //--->liblog
@@ -1611,6 +2046,30 @@ void c_modbus::modbus_init_rtu (const char *device,
     /*logger_add_rotating_handler ("/var/log/wcx_modbus.log", 5000, 3);*/
 }
 
+/* A character is made of 1 start bit, the data bits, the parity bit and
+   the stop bits. The timings are fixed above 19200 bauds. */
+void c_modbus::compute_rtu_timings () {
+    int char_bits;
+    int char_us = 0;
+
+    char_bits = 1 + mb_param->data_bit + mb_param->stop_bit;
+    if (strncmp (mb_param->parity, "none", 4) != 0)
+        char_bits++;
+
+    if (mb_param->baud > 0)
+        char_us = (char_bits * 1000000 + mb_param->baud - 1) / mb_param->baud;
+    mb_param->char_us = char_us;
+
+    if (mb_param->baud > 19200 || mb_param->baud <= 0) {
+        mb_param->t15_us = RTU_T15_FIXED;
+        mb_param->t35_us = RTU_T35_FIXED;
+        return;
+    }
+
+    mb_param->t15_us = (char_us * 3 + 1) / 2;
+    mb_param->t35_us = (char_us * 7 + 1) / 2;
+}
+
 /* Initializes the modbus_param_t structure for TCP.
    - ip : "192.168.0.5"
    - port : 1099
@@ -1658,10 +2117,14 @@ void c_modbus::modbus_set_slave (int slave) {
 
    With NOP_ON_ERROR, it is expected that the application will
    check for error returns and deal with them as necessary.
+
+   With CLOSE_ON_ERROR, the connection is closed and the application
+   connects again.
 */
 void c_modbus::modbus_set_error_handling (error_handling_t error_handling) {
     if (error_handling == FLUSH_OR_CONNECT_ON_ERROR ||
-            error_handling == NOP_ON_ERROR) {
+            error_handling == NOP_ON_ERROR ||
+            error_handling == CLOSE_ON_ERROR) {
         mb_param->error_handling = error_handling;
     } else {
         fprintf (stderr,
@@ -1927,6 +2390,10 @@ int c_modbus::modbus_connect_rtu () {
 int c_modbus::modbus_connect_tcp () {
     int ret;
     int option;
+    int flags;
+    int error;
+    socklen_t len;
+    struct pollfd pfd;
     struct sockaddr_in addr;
 
     mb_param->fd = socket (PF_INET, SOCK_STREAM, 0);
@@ -1959,6 +2426,17 @@ int c_modbus::modbus_connect_tcp () {
     }
 #endif
 
+    if (keepalive_idle_s > 0) {
+        option = 1;
+        setsockopt (mb_param->fd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof (option));
+#ifdef TCP_KEEPIDLE
+        setsockopt (mb_param->fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_idle_s, sizeof (int));
+        setsockopt (mb_param->fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive_interval_s,
+                    sizeof (int));
+        setsockopt (mb_param->fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive_probes, sizeof (int));
+#endif
+    }
+
     if (mb_param->debug) {
         wprintf ("Connecting to %s\n", mb_param->ip);
     }
@@ -1966,12 +2444,36 @@ int c_modbus::modbus_connect_tcp () {
     addr.sin_family = AF_INET;
     addr.sin_port = htons (mb_param->port);
     addr.sin_addr.s_addr = inet_addr (mb_param->ip);
+
+    /* Non blocking to bound the wait by connect_timeout_ms */
+    flags = fcntl (mb_param->fd, F_GETFL, 0);
+    fcntl (mb_param->fd, F_SETFL, flags | O_NONBLOCK);
     ret = connect (mb_param->fd, (struct sockaddr *) &addr, sizeof (struct sockaddr_in));
+    if (ret < 0 && errno == EINPROGRESS) {
+        pfd.fd = mb_param->fd;
+        pfd.events = POLLOUT;
+        do {
+            ret = poll (&pfd, 1, connect_timeout_ms);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == 0) {
+            errno = ETIMEDOUT;
+            ret = -1;
+        } else if (ret > 0) {
+            error = 0;
+            len = sizeof (error);
+            getsockopt (mb_param->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            errno = error;
+            ret = (error == 0) ? 0 : -1;
+        }
+    }
     if (ret < 0) {
         perror ("connect");
         close (mb_param->fd);
+        mb_param->fd = -1;
         return ret;
     }
+    fcntl (mb_param->fd, F_SETFL, flags);
 
     return 0;
 }
@@ -1981,6 +2483,10 @@ int c_modbus::modbus_connect_tcp () {
 int c_modbus::modbus_connect () {
     int ret;
 
+    /* No buffer for the transactions */
+    if (adu == NULL)
+        return -1;
+
     if (mb_param->type_com == RTU)
         ret = modbus_connect_rtu ();
     else
@@ -2019,68 +2525,423 @@ void c_modbus::modbus_set_debug (int boolean) {
     /*logger_add_fp_handler (stderr);*/
 }
 
-/* Allocates 4 arrays to store coils, input status, input registers and
-   holding registers. The pointers are stored in modbus_mapping structure.
+/* Detects the end of the RTU frames with t3.5 */
+void c_modbus::modbus_set_frame_timing (int boolean, int slack_us) {
+    if (slack_us < 0)
+        slack_us = RTU_FRAME_SLACK_DEFAULT;
+    mb_param->frame_timing = boolean;
+    mb_param->frame_slack_us = slack_us;
+}
+
+void c_modbus::modbus_set_stats (c_modbus_stats *stats) {
+    this->stats = stats;
+}
+
+void c_modbus::modbus_set_capture (c_modbus_capture *capture, int port) {
+    this->capture = capture;
+    capture_port = port;
+}
+
+void c_modbus::modbus_set_tx_queue (c_modbus_tx_queue *queue) {
+    tx_queue = queue;
+}
+
+int c_modbus::modbus_set_io_uring (c_modbus_uring *ring) {
+    if (ring != NULL && !ring->is_available ()) {
+        if (mb_param->debug)
+            wprintf ("io_uring not available, select () is used\n");
+        uring = NULL;
+        return -1;
+    }
+
+    uring = ring;
+
+    return 0;
+}
+
+void c_modbus::capture_frame (int direction, const uint8_t *msg, int msg_length) {
+    capture->record (direction, capture_port, msg, msg_length);
+}
+
+void c_modbus::modbus_set_adaptive_timeout (int boolean, int min_ms, int max_ms) {
+    int i;
+
+    if (!boolean) {
+        free (slave_timings);
+        slave_timings = NULL;
+        return;
+    }
+
+    if (min_ms <= 0)
+        min_ms = MODBUS_RTO_MIN_DEFAULT;
+    if (max_ms < min_ms)
+        max_ms = min_ms;
+    rto_min_ms = min_ms;
+    rto_max_ms = max_ms;
+
+    if (slave_timings == NULL) {
+        slave_timings = (modbus_slave_timing_t *) calloc (256, sizeof (modbus_slave_timing_t));
+        if (slave_timings == NULL)
+            return;
+    }
+
+    /* The estimations start again */
+    memset (slave_timings, 0, 256 * sizeof (modbus_slave_timing_t));
+    for (i = 0; i < 256; i++)
+        slave_timings[i].rto_ms = rto_max_ms;
+}
+
+void c_modbus::modbus_set_retries (int nb_retries) {
+    this->nb_retries = nb_retries < 0 ? 0 : nb_retries;
+}
+
+void c_modbus::modbus_set_quarantine (int nb_failures, int probe_period_ms) {
+    int i;
+
+    quarantine_failures = nb_failures < 0 ? 0 : nb_failures;
+    this->probe_period_ms = probe_period_ms > 0 ? probe_period_ms : MODBUS_PROBE_PERIOD_DEFAULT;
+
+    if (quarantine_failures == 0 && slave_timings != NULL) {
+        for (i = 0; i < 256; i++)
+            slave_timings[i].offline = FALSE;
+    }
+}
+
+int c_modbus::modbus_get_slave_timing (int slave, modbus_slave_timing_t *timing) {
+    modbus_slave_timing_t *t = slave_timing (slave);
+
+    if (t == NULL)
+        return -1;
+
+    *timing = *t;
+
+    return 0;
+}
+
+void c_modbus::modbus_set_connect_timeout (int timeout_ms) {
+    if (timeout_ms <= 0)
+        timeout_ms = MODBUS_CONNECT_TIMEOUT_DEFAULT;
+    connect_timeout_ms = timeout_ms;
+}
+
+void c_modbus::modbus_set_keepalive (int idle_s, int interval_s, int nb_probes) {
+    keepalive_idle_s = (idle_s > 0) ? idle_s : 0;
+    keepalive_interval_s = (interval_s > 0) ? interval_s : 1;
+    keepalive_probes = (nb_probes > 0) ? nb_probes : 1;
+}
+
+void c_modbus::modbus_set_turnaround_delay (int ms) {
+    if (ms < 0)
+        ms = MODBUS_TURNAROUND_DEFAULT;
+    turnaround_ms = ms;
+}
+
+int c_modbus::is_broadcast (const uint8_t *query) {
+    int slave = query[HEADER_LENGTH_RTU - 1];
+    int function = query[HEADER_LENGTH_RTU];
+
+    if (mb_param->type_com != RTU || (slave != 0 && slave != MODBUS_BROADCAST_ADDRESS))
+        return FALSE;
+
+    return function == FC_FORCE_SINGLE_COIL || function == FC_PRESET_SINGLE_REGISTER ||
+           function == FC_FORCE_MULTIPLE_COILS || function == FC_PRESET_MULTIPLE_REGISTERS;
+}
+
+long c_modbus::broadcast_delay_us (int query_length) {
+    /* rs485_write () returns once the frame is sent */
+    if (rs485_mode != MODBUS_RS485_NONE)
+        return mb_param->t35_us + turnaround_ms * 1000L;
+
+    /* The write () returns before the frame is sent */
+    return (long) query_length * mb_param->char_us + mb_param->t35_us +
+           turnaround_ms * 1000L;
+}
+
+int c_modbus::broadcast_quantity (const uint8_t *query) {
+    int offset = TAB_HEADER_LENGTH[mb_param->type_com];
+
+    if (query[offset] == FC_FORCE_MULTIPLE_COILS || query[offset] == FC_PRESET_MULTIPLE_REGISTERS)
+        return (query[offset + 3] << 8) | query[offset + 4];
+
+    return 1;
+}
+
+modbus_slave_timing_t *c_modbus::slave_timing (int slave) {
+    if (slave_timings == NULL || slave < 0 || slave > 255)
+        return NULL;
+
+    /* No response is expected to a broadcast */
+    if (mb_param->type_com == RTU && (slave == 0 || slave == MODBUS_BROADCAST_ADDRESS))
+        return NULL;
+
+    return &slave_timings[slave];
+}
+
+void c_modbus::update_slave_timing (modbus_slave_timing_t *timing, int ret,
+                                    int sample, long long rtt_us) {
+    long long delta;
+    long long rto_us;
+
+    if (ret == SELECT_TIMEOUT) {
+        /* Backoff until the slave answers again */
+        timing->rto_ms *= 2;
+        if (timing->rto_ms > rto_max_ms)
+            timing->rto_ms = rto_max_ms;
+        timing->nb_failures++;
+
+        if (quarantine_failures > 0 && !timing->offline &&
+                timing->nb_failures >= quarantine_failures) {
+            timing->offline = TRUE;
+            timing->next_probe_us = modbus_time_us () + (long long) probe_period_ms * 1000;
+            error_treat (SLAVE_OFFLINE, "Slave out of the scan");
+        }
+        return;
+    }
+
+    /* A response or an exception: the slave is alive */
+    if (ret < GATEWAY_PROBLEM_TARGET)
+        return;
+    timing->nb_failures = 0;
+    timing->offline = FALSE;
+
+    /* An exception is only detected at the end of the time out */
+    if (!sample || ret < 0)
+        return;
+
+    if (timing->srtt_us == 0) {
+        timing->srtt_us = rtt_us;
+        timing->rttvar_us = rtt_us / 2;
+    } else {
+        delta = timing->srtt_us - rtt_us;
+        if (delta < 0)
+            delta = -delta;
+        timing->rttvar_us = (3 * timing->rttvar_us + delta) / 4;
+        timing->srtt_us = (7 * timing->srtt_us + rtt_us) / 8;
+    }
+
+    /* The clock granularity is 1 ms */
+    rto_us = timing->srtt_us + (4 * timing->rttvar_us > 1000 ? 4 * timing->rttvar_us : 1000);
+    timing->rto_ms = (int) ( (rto_us + 999) / 1000);
+    if (timing->rto_ms < rto_min_ms)
+        timing->rto_ms = rto_min_ms;
+    if (timing->rto_ms > rto_max_ms)
+        timing->rto_ms = rto_max_ms;
+}
+
+int c_modbus::modbus_set_rs485 (int mode, int delay_before_us, int delay_after_us) {
+#ifdef TIOCSRS485
+    struct serial_rs485 rs485;
+#endif
+
+    if (mb_param->type_com != RTU || mb_param->fd < 0) {
+        fprintf (stderr, "ERROR RS-485 needs a connected serial line\n");
+        return -1;
+    }
+
+    rs485_before_us = (delay_before_us > 0) ? delay_before_us : 0;
+    rs485_after_us = (delay_after_us > 0) ? delay_after_us : 0;
+
+#ifdef TIOCSRS485
+    if (mode == MODBUS_RS485_KERNEL || rs485_mode == MODBUS_RS485_KERNEL) {
+        memset (&rs485, 0, sizeof (rs485));
+        if (mode == MODBUS_RS485_KERNEL) {
+            rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+            /* In ms for the driver */
+            rs485.delay_rts_before_send = (rs485_before_us + 999) / 1000;
+            rs485.delay_rts_after_send = (rs485_after_us + 999) / 1000;
+        }
+        if (ioctl (mb_param->fd, TIOCSRS485, &rs485) == 0) {
+            if (mode == MODBUS_RS485_KERNEL) {
+                rs485_mode = mode;
+                line_idle_us = 0;
+                return mode;
+            }
+        } else if (mode == MODBUS_RS485_KERNEL) {
+            if (mb_param->debug)
+                wprintf ("No RS-485 in the driver of %s, RTS set by the library\n",
+                         mb_param->device);
+            mode = MODBUS_RS485_RTS;
+        }
+    }
+#else
+    if (mode == MODBUS_RS485_KERNEL)
+        mode = MODBUS_RS485_RTS;
+#endif
+
+    if (mode == MODBUS_RS485_RTS) {
+        int rts = TIOCM_RTS;
+
+        /* Receiving between the frames */
+        if (ioctl (mb_param->fd, TIOCMBIC, &rts) < 0) {
+            perror ("ioctl TIOCMBIC");
+            return -1;
+        }
+    } else if (mode != MODBUS_RS485_NONE) {
+        fprintf (stderr, "ERROR Invalid RS-485 mode %d\n", mode);
+        return -1;
+    }
+
+    rs485_mode = mode;
+    line_idle_us = 0;
+
+    return mode;
+}
+
+void c_modbus::modbus_get_rtu_timings (int *t15_us, int *t35_us) {
+    if (t15_us != NULL)
+        *t15_us = mb_param->t15_us;
+    if (t35_us != NULL)
+        *t35_us = mb_param->t35_us;
+}
+
+/* Size of a table rounded up to a multiple of the cache line */
+static size_t mapping_table_size (int nb, size_t size) {
+    return ( (size_t) nb * size + MODBUS_CACHE_LINE - 1) & ~ (size_t) (MODBUS_CACHE_LINE - 1);
+}
+
+static size_t mapping_locks_size (int nb) {
+    return mapping_table_size (nb / MODBUS_MAPPING_BLOCK + 1, sizeof (modbus_seqlock_t));
+}
+
+/* Allocates the 4 arrays, and the sequence locks if concurrent is set,
+   in a single block; each array starts on a cache line. With packed set,
+   the coils and input status take a bit each. */
+int c_modbus::mapping_alloc (modbus_mapping_t *mb_mapping,
+                             int nb_coil_status, int nb_input_status,
+                             int nb_holding_registers, int nb_input_registers,
+                             int concurrent, int packed) {
+    size_t size;
+    uint8_t *p;
+    int coil_bytes = packed ? (nb_coil_status + 7) / 8 : nb_coil_status;
+    int input_bytes = packed ? (nb_input_status + 7) / 8 : nb_input_status;
+
+    size = mapping_table_size (coil_bytes, sizeof (uint8_t)) +
+           mapping_table_size (input_bytes, sizeof (uint8_t)) +
+           mapping_table_size (nb_holding_registers, sizeof (uint16_t)) +
+           mapping_table_size (nb_input_registers, sizeof (uint16_t));
+    if (concurrent) {
+        size += mapping_locks_size (nb_coil_status) +
+                mapping_locks_size (nb_input_status) +
+                mapping_locks_size (nb_holding_registers) +
+                mapping_locks_size (nb_input_registers);
+    }
+
+    /* tab_coil_status is the start of the block, even if empty */
+    p = (uint8_t *) modbus_aligned_alloc (size > 0 ? size : MODBUS_CACHE_LINE);
+    if (p == NULL)
+        return -1;
+    memset (p, 0, size);
 
-   Returns 0 on success and -1 on failure.
-*/
-int c_modbus::modbus_mapping_new (modbus_mapping_t *mb_mapping,
-                                  int nb_coil_status, int nb_input_status,
-                                  int nb_holding_registers, int nb_input_registers) {
     /* 0X */
     mb_mapping->nb_coil_status = nb_coil_status;
-    mb_mapping->tab_coil_status =
-        (uint8_t *) malloc (nb_coil_status * sizeof (uint8_t));
-    memset (mb_mapping->tab_coil_status, 0,
-            nb_coil_status * sizeof (uint8_t));
-    if (mb_mapping->tab_coil_status == NULL)
-        return -1;
+    mb_mapping->tab_coil_status = p;
+    p += mapping_table_size (coil_bytes, sizeof (uint8_t));
 
     /* 1X */
     mb_mapping->nb_input_status = nb_input_status;
-    mb_mapping->tab_input_status =
-        (uint8_t *) malloc (nb_input_status * sizeof (uint8_t));
-    memset (mb_mapping->tab_input_status, 0,
-            nb_input_status * sizeof (uint8_t));
-    if (mb_mapping->tab_input_status == NULL) {
-        free (mb_mapping->tab_coil_status);
-        return -1;
-    }
+    mb_mapping->tab_input_status = p;
+    p += mapping_table_size (input_bytes, sizeof (uint8_t));
+    mb_mapping->bit_packed = packed;
 
     /* 4X */
     mb_mapping->nb_holding_registers = nb_holding_registers;
-    mb_mapping->tab_holding_registers =
-        (uint16_t *) malloc (nb_holding_registers * sizeof (uint16_t));
-    memset (mb_mapping->tab_holding_registers, 0,
-            nb_holding_registers * sizeof (uint16_t));
-    if (mb_mapping->tab_holding_registers == NULL) {
-        free (mb_mapping->tab_coil_status);
-        free (mb_mapping->tab_input_status);
-        return -1;
-    }
+    mb_mapping->tab_holding_registers = (uint16_t *) p;
+    p += mapping_table_size (nb_holding_registers, sizeof (uint16_t));
 
     /* 3X */
     mb_mapping->nb_input_registers = nb_input_registers;
-    mb_mapping->tab_input_registers =
-        (uint16_t *) malloc (nb_input_registers * sizeof (uint16_t));
-    memset (mb_mapping->tab_input_registers, 0,
-            nb_input_registers * sizeof (uint16_t));
-    if (mb_mapping->tab_input_registers == NULL) {
-        free (mb_mapping->tab_coil_status);
-        free (mb_mapping->tab_input_status);
-        free (mb_mapping->tab_holding_registers);
-        return -1;
+    mb_mapping->tab_input_registers = (uint16_t *) p;
+    p += mapping_table_size (nb_input_registers, sizeof (uint16_t));
+
+    mb_mapping->nb_virtual_ranges = 0;
+
+    if (! concurrent) {
+        /* Not shared between threads */
+        mb_mapping->seq_coil_status = NULL;
+        mb_mapping->seq_input_status = NULL;
+        mb_mapping->seq_input_registers = NULL;
+        mb_mapping->seq_holding_registers = NULL;
+        return 0;
     }
 
+    mb_mapping->seq_coil_status = (modbus_seqlock_t *) p;
+    p += mapping_locks_size (nb_coil_status);
+    mb_mapping->seq_input_status = (modbus_seqlock_t *) p;
+    p += mapping_locks_size (nb_input_status);
+    mb_mapping->seq_holding_registers = (modbus_seqlock_t *) p;
+    p += mapping_locks_size (nb_holding_registers);
+    mb_mapping->seq_input_registers = (modbus_seqlock_t *) p;
+
     return 0;
 }
 
-/* Frees the 4 arrays */
+/* Allocates 4 arrays to store coils, input status, input registers and
+   holding registers. The pointers are stored in modbus_mapping structure.
+
+   Returns 0 on success and -1 on failure.
+*/
+int c_modbus::modbus_mapping_new (modbus_mapping_t *mb_mapping,
+                                  int nb_coil_status, int nb_input_status,
+                                  int nb_holding_registers, int nb_input_registers) {
+    return mapping_alloc (mb_mapping, nb_coil_status, nb_input_status,
+                          nb_holding_registers, nb_input_registers, FALSE, FALSE);
+}
+
+/* Allocates the 4 arrays and a sequence lock for each block of
+   MODBUS_MAPPING_BLOCK values.
+
+   Returns 0 on success and -1 on failure.
+*/
+int c_modbus::modbus_mapping_new_concurrent (modbus_mapping_t *mb_mapping,
+                                             int nb_coil_status, int nb_input_status,
+                                             int nb_holding_registers, int nb_input_registers) {
+    return mapping_alloc (mb_mapping, nb_coil_status, nb_input_status,
+                          nb_holding_registers, nb_input_registers, TRUE, FALSE);
+}
+
+/* Allocates the 4 arrays, the coils and input status packed 8 per byte.
+
+   Returns 0 on success and -1 on failure.
+*/
+int c_modbus::modbus_mapping_new_packed (modbus_mapping_t *mb_mapping,
+                                         int nb_coil_status, int nb_input_status,
+                                         int nb_holding_registers, int nb_input_registers,
+                                         int concurrent) {
+    return mapping_alloc (mb_mapping, nb_coil_status, nb_input_status,
+                          nb_holding_registers, nb_input_registers, concurrent, TRUE);
+}
+
+/* Frees the 4 arrays (and the sequence locks), all allocated in the
+   block starting at tab_coil_status */
 void c_modbus::modbus_mapping_free (modbus_mapping_t *mb_mapping) {
     free (mb_mapping->tab_coil_status);
-    free (mb_mapping->tab_input_status);
-    free (mb_mapping->tab_holding_registers);
-    free (mb_mapping->tab_input_registers);
+    mb_mapping->tab_coil_status = NULL;
+}
+
+int c_modbus::modbus_mapping_add_virtual (modbus_mapping_t *mb_mapping, int function,
+                                          int start_addr, int nb,
+                                          modbus_virtual_read_t read, void *arg) {
+    modbus_virtual_range_t *range;
+
+    if (mb_mapping->nb_virtual_ranges >= MODBUS_MAX_VIRTUAL_RANGES) {
+        fprintf (stderr, "ERROR Too many virtual ranges (%d)\n", MODBUS_MAX_VIRTUAL_RANGES);
+        return -1;
+    }
+
+    if ( (function != FC_READ_HOLDING_REGISTERS && function != FC_READ_INPUT_REGISTERS) ||
+            start_addr < 0 || nb <= 0 || read == NULL) {
+        fprintf (stderr, "ERROR Invalid virtual range of function %d\n", function);
+        return -1;
+    }
+
+    range = &mb_mapping->virtual_ranges[mb_mapping->nb_virtual_ranges++];
+    range->function = function;
+    range->start_addr = start_addr;
+    range->nb = nb;
+    range->read = read;
+    range->arg = arg;
+
+    return 0;
 }
 
 /* Listens for any query from one or many modbus masters in TCP */
@@ -2089,6 +2950,9 @@ int c_modbus::modbus_slave_listen_tcp (int nb_connection) {
     int yes;
     struct sockaddr_in addr;
 
+    if (adu == NULL)
+        return -1;
+
     new_socket = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (new_socket < 0) {
         perror ("socket");
@@ -2181,21 +3045,12 @@ void c_modbus::set_bits_from_byte (uint8_t *dest, int address, const uint8_t val
    between address and address + nb_bits are set) */
 void c_modbus::set_bits_from_bytes (uint8_t *dest, int address, int nb_bits,
                                     const uint8_t tab_byte[]) {
-    int i;
-    int shift = 0;
-
-    for (i = address; i < address + nb_bits; i++) {
-        dest[i] = tab_byte[ (i - address) / 8] & (1 << shift) ? ON : OFF;
-        /* gcc doesn't like: shift = (++shift) % 8; */
-        shift++;
-        shift %= 8;
-    }
+    modbus_bits_unpack (tab_byte, nb_bits, dest + address);
 }
 
 /* Gets the byte value from many input/coil status.
    To obtain a full byte, set nb_bits to 8. */
 uint8_t c_modbus::get_byte_from_bits (const uint8_t *src, int address, int nb_bits) {
-    int i;
     uint8_t value = 0;
 
     if (nb_bits > 8) {
@@ -2203,9 +3058,7 @@ uint8_t c_modbus::get_byte_from_bits (const uint8_t *src, int address, int nb_bi
         nb_bits = 8;
     }
 
-    for (i = 0; i < nb_bits; i++) {
-        value |= (src[address + i] << i);
-    }
+    modbus_bits_pack (src + address, nb_bits, &value);
 
     return value;
 }
@@ -2229,3 +3082,22 @@ void c_modbus::modbus_write_float (float real, uint16_t *dest) {
     dest[0] = (uint16_t) i;
     dest[1] = (uint16_t) (i >> 16);
 }
+
+/* Returns a monotonic time stamp in microseconds */
+long long modbus_time_us () {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void *modbus_aligned_alloc (size_t size) {
+    void *ptr;
+
+    if (posix_memalign (&ptr, MODBUS_CACHE_LINE, size) != 0)
+        return NULL;
+
+    return ptr;
+}
+
@@ -80,6 +80,11 @@
 /* Kept for compatibility reasons (deprecated) */
 #define MAX_MESSAGE_LENGTH        260
 
+/* Frame buffers hold a TCP ADU and are aligned on a cache line, their
+   size is rounded up to a multiple of the cache line */
+#define MODBUS_CACHE_LINE          64
+#define MODBUS_BUFFER_SIZE        ((MAX_ADU_LENGTH_TCP + MODBUS_CACHE_LINE - 1) & ~(MODBUS_CACHE_LINE - 1))
+
 #define EXCEPTION_RESPONSE_LENGTH_RTU  5
 
 /* Modbus_Application_Protocol_V1_1b.pdf (chapter 6 section 1 page 12)
@@ -92,8 +97,49 @@
  */
 #define MAX_REGISTERS             125
 
+/* Modbus_Application_Protocol_V1_1b.pdf (chapter 6 sections 11 and 12)
+ * Quantity of Outputs (FC 0x0F): 1 to 1968 (0x7B0)
+ * Quantity of Registers (FC 0x10): 1 to 123 (0x7B)
+ */
+#define MAX_WRITE_STATUS         1968
+#define MAX_WRITE_REGISTERS       123
+
 #define REPORT_SLAVE_ID_LENGTH     75
 
+/* Modbus_over_serial_line_V1_02.pdf (chapter 2 section 5 page 13):
+ * above 19200 bauds, fixed values are used for the inter-character
+ * time-out (t1.5) and the inter-frame delay (t3.5), in microsecond */
+#define RTU_T15_FIXED            750
+#define RTU_T35_FIXED           1750
+
+/* Added to t3.5 to cover the latency of the scheduler and of the serial
+   adapters (microsecond) */
+#define RTU_FRAME_SLACK_DEFAULT 1000
+
+/* Bounds of the adaptive response time out in ms (the initial time out
+   is the maximum) */
+#define MODBUS_RTO_MIN_DEFAULT          20
+#define MODBUS_RTO_MAX_DEFAULT        1000
+
+/* A slave is probed every MODBUS_PROBE_PERIOD_DEFAULT ms when it's out of
+   the scan */
+#define MODBUS_PROBE_PERIOD_DEFAULT  10000
+
+/* Modbus_over_serial_line_V1_02.pdf (chapter 2 section 4 page 10): after
+   a broadcast, the master waits for the turnaround delay (100 to 200 ms
+   usually) so every slave has processed it */
+#define MODBUS_TURNAROUND_DEFAULT    100
+
+/* Direction control of a RS-485 line (modbus_set_rs485) */
+#define MODBUS_RS485_NONE    0
+/* The serial driver drives RTS (TIOCSRS485) */
+#define MODBUS_RS485_KERNEL  1
+/* RTS is set by the library around each frame */
+#define MODBUS_RS485_RTS     2
+
+/* Time out of a TCP connection in ms */
+#define MODBUS_CONNECT_TIMEOUT_DEFAULT  3000
+
 /* Time out between trames in microsecond */
 //#define TIME_OUT_BEGIN_OF_TRAME 500000
 #define TIME_OUT_BEGIN_OF_TRAME 300000
@@ -154,6 +200,8 @@
 #define SOCKET_FAILURE          -0x15
 #define CONNECTION_CLOSED       -0x16
 #define MB_EXCEPTION            -0x17
+/* The slave is out of the scan after too many time outs */
+#define SLAVE_OFFLINE           -0x18
 
 /* Internal using */
 #define MSG_LENGTH_UNDEFINED -1
@@ -194,7 +242,7 @@ typedef enum
 }
 type_com_t;
 
-typedef enum { FLUSH_OR_CONNECT_ON_ERROR, NOP_ON_ERROR } error_handling_t;
+typedef enum { FLUSH_OR_CONNECT_ON_ERROR, NOP_ON_ERROR, CLOSE_ON_ERROR } error_handling_t;
 
 /* This structure is byte-aligned */
 typedef struct
@@ -230,12 +278,84 @@ typedef struct
     char parity[5];
     /* In error_treat with TCP, do a reconnect or just dump the error */
     uint8_t error_handling;
+    /* RTU character timings in microsecond (computed from baud, data_bit,
+       stop_bit and parity) */
+    int t15_us;
+    int t35_us;
+    /* Time on the line of a character */
+    int char_us;
+    /* End of RTU frame detected on a silent interval of t3.5 + slack */
+    uint8_t frame_timing;
+    int frame_slack_us;
     /* IP address */
     char ip[16];
+    /* Last MBAP transaction identifier used on this connection */
+    uint16_t t_id;
     /* Save old termios settings */
     struct termios old_tios;
 } modbus_param_t;
 
+/* Reception of a message which can be resumed each time data is available
+   on a non blocking descriptor. The states are the ones of receive_msg,
+   RX_RESPONSE reaches the function code of a response to tell an
+   exception from the expected response. */
+typedef enum { RX_FUNCTION = 0, RX_BYTE, RX_COMPLETE, RX_RESPONSE } rx_state_t;
+
+typedef struct
+{
+    rx_state_t state;
+    int msg_length;
+    int msg_length_computed;
+    /* Length of the good response (RX_RESPONSE) */
+    int msg_length_expected;
+    int length_to_read;
+    uint8_t *msg;
+} modbus_rx_t;
+
+/* Round trip estimation of a slave (RFC 6298), see
+   modbus_set_adaptive_timeout */
+typedef struct
+{
+    /* Smoothed round trip and its mean deviation in us, 0 before the
+       first response */
+    long long srtt_us;
+    long long rttvar_us;
+    /* Response time out in ms */
+    int rto_ms;
+    /* Consecutive time outs */
+    int nb_failures;
+    /* Out of the scan, only probed */
+    int offline;
+    long long next_probe_us;
+} modbus_slave_timing_t;
+
+/* Number of values protected by a sequence lock in a concurrent mapping */
+#define MODBUS_MAPPING_BLOCK       64
+
+typedef struct
+{
+    volatile uint32_t sequence;
+} modbus_seqlock_t;
+
+/* Maximum number of virtual ranges of a mapping */
+#define MODBUS_MAX_VIRTUAL_RANGES  8
+
+/* Computes nb registers from address for a query of function
+   (FC_READ_HOLDING_REGISTERS or FC_READ_INPUT_REGISTERS).
+   Returns 0 or an exception code (ILLEGAL_DATA_ADDRESS,
+   SLAVE_DEVICE_FAILURE...) sent to the master */
+typedef int (*modbus_virtual_read_t) (int function, int address, int nb,
+                                      uint16_t *dest, void *arg);
+
+typedef struct
+{
+    int function;
+    int start_addr;
+    int nb;
+    modbus_virtual_read_t read;
+    void *arg;
+} modbus_virtual_range_t;
+
 typedef struct
 {
     int nb_coil_status;
@@ -247,10 +367,54 @@ typedef struct
     uint16_t *tab_input_registers;
     uint16_t *tab_holding_registers;
 
+    /* The coils and input status are packed, 8 per byte (see
+       modbus_mapping_new_packed and modbus_bits.h), instead of one per
+       byte */
+    int bit_packed;
+
+    /* Sequence locks of the blocks of each table, NULL if the mapping is
+       not shared between threads (see modbus_mapping.h) */
+    modbus_seqlock_t *seq_coil_status;
+    modbus_seqlock_t *seq_input_status;
+    modbus_seqlock_t *seq_input_registers;
+    modbus_seqlock_t *seq_holding_registers;
+
+    /* Registers computed when they are read (see
+       modbus_mapping_add_virtual) */
+    int nb_virtual_ranges;
+    modbus_virtual_range_t virtual_ranges[MODBUS_MAX_VIRTUAL_RANGES];
 } modbus_mapping_t;
 
+/* A query is at most a TCP one (MBAP header + 5 bytes) */
+#define MODBUS_PREPARED_LENGTH  16
+
+/* A query built once by modbus_prepare and sent as is by modbus_execute,
+   for the requests of a cyclic poll */
+typedef struct
+{
+    /* Query with its checksum (RTU) or its length (TCP) */
+    uint8_t query[MODBUS_PREPARED_LENGTH];
+    uint16_t query_length;
+    /* Length of the good response */
+    uint16_t response_length;
+} modbus_prepared_t;
+
+class c_modbus_stats;
+class c_modbus_capture;
+class c_modbus_tx_queue;
+class c_modbus_uring;
+
 class c_modbus
 {
+    friend class c_modbus_pipeline;
+    friend class c_modbus_server;
+    friend class c_modbus_scheduler;
+    friend class c_modbus_planner;
+    friend class c_modbus_async;
+    friend class c_modbus_fanout;
+    friend class c_modbus_tcp_pool;
+    friend class c_modbus_multibus;
+
 public:
 
     c_modbus (const char *device,
@@ -282,6 +446,18 @@ public:
     int read_input_registers (int start_addr, int nb,
                               uint16_t *dest, int select_time);
 
+    /* Reads nb registers and decodes them as values of data_type (INT8
+       to DOUBLE) with the word order of the 32 and 64 bits values
+       (WORD_ORDER_BIG or WORD_ORDER_SWAPPED, see modbus_decode.h).
+       dest is an array of nb * 2 / size of the type values.
+       Returns the number of values decoded or less than 0 for exceptions
+       errors */
+    int read_holding_registers_typed (int start_addr, int nb, void *dest,
+                                      uint8_t data_type, int word_order, int select_time);
+
+    int read_input_registers_typed (int start_addr, int nb, void *dest,
+                                    uint8_t data_type, int word_order, int select_time);
+
     /* Turns ON or OFF a single coil in the slave device */
     int force_single_coil (int coil_addr, int state, int select_time);
 
@@ -299,6 +475,19 @@ public:
     /* Returns the slave id! */
     int report_slave_id (uint8_t *dest, int select_time);
 
+    /* Builds once the query of a read (FC 0x01 to 0x04) or of a single
+       write (FC 0x05 and 0x06, nb is then the value) to the current
+       slave, with its checksum or length and the length of the response.
+       Returns 0 or INVALID_DATA */
+    int modbus_prepare (modbus_prepared_t *request, int function, int start_addr, int nb);
+
+    /* Sends a prepared query as is (only the transaction ID is set in
+       TCP) and checks the response. The bits read are stored as for
+       read_coil_status, the registers as uint16_t, dest is unused for
+       the writes.
+       Returns like the functions above */
+    int modbus_execute (modbus_prepared_t *request, void *dest, int select_time);
+
     /* Initializes the modbus_param_t structure for RTU.
        - device: "/dev/ttyS0"
        - baud:   9600, 19200, 57600, 115200, etc
@@ -335,6 +524,11 @@ public:
        With NOP_ON_ERROR, it is expected that the application will
        check for network error returns and deal with them as necessary.
 
+       With CLOSE_ON_ERROR, the connection is flushed like with
+       FLUSH_OR_CONNECT_ON_ERROR but closed on a network error (the
+       descriptor is set to -1) and the application connects again when
+       it wants, see c_modbus_tcp_pool.
+
        This function is only useful in TCP mode.
      */
     void modbus_set_error_handling (error_handling_t error_handling);
@@ -346,9 +540,89 @@ public:
     /* Closes a modbus connection */
     void modbus_close ();
 
+    /* Bounds the TCP connection to timeout_ms ms (the connect doesn't
+       wait for all the SYN retries of the kernel), 0 or less for
+       MODBUS_CONNECT_TIMEOUT_DEFAULT */
+    void modbus_set_connect_timeout (int timeout_ms);
+
+    /* The next TCP connections send a keepalive probe after idle_s
+       seconds without data, then every interval_s seconds: the
+       connection fails after nb_probes probes without answer. idle_s at
+       0 disables it (default). */
+    void modbus_set_keepalive (int idle_s, int interval_s, int nb_probes);
+
     /* Activates the debug messages */
     void modbus_set_debug (int boolean);
 
+    /* With boolean set, a RTU frame is complete as soon as the line is
+       silent for t3.5 (computed from the serial settings) + slack_us,
+       instead of the fixed TIME_OUT_END_OF_TRAME and the wait_time of
+       rcv_msg. slack_us covers the latency of USB serial adapters, use
+       RTU_FRAME_SLACK_DEFAULT if unsure. */
+    void modbus_set_frame_timing (int boolean, int slack_us);
+
+    /* Half-duplex RS-485 line (once connected): the driver switches the
+       direction (MODBUS_RS485_KERNEL) with the delays before and after
+       the frames, or the library sets RTS during the frames
+       (MODBUS_RS485_RTS, also used when the driver doesn't support
+       RS-485). The sends then wait for the end of the frame on the line
+       (tcdrain and its time at the baud rate) and for t3.5 since the end
+       of the previous frame, so no guard time is needed between the
+       transactions. MODBUS_RS485_NONE goes back to full-duplex.
+
+       Returns the mode used or -1 on failure. */
+    int modbus_set_rs485 (int mode, int delay_before_us, int delay_after_us);
+
+    /* Gets the inter-character time-out t1.5 and the inter-frame delay
+       t3.5 of the serial line in microsecond */
+    void modbus_get_rtu_timings (int *t15_us, int *t35_us);
+
+    /* Records the transactions (latency, errors, bytes) in stats, NULL
+       to stop. The statistics aren't freed by the context. */
+    void modbus_set_stats (c_modbus_stats *stats);
+
+    /* Copies the frames sent and received to capture, recorded with the
+       port (to tell the contexts sharing a capture apart), NULL to
+       stop. The capture isn't freed by the context. */
+    void modbus_set_capture (c_modbus_capture *capture, int port);
+
+    /* The frames sent are queued in queue instead of being written, the
+       caller sends them with queue->flush (), NULL to write them again */
+    void modbus_set_tx_queue (c_modbus_tx_queue *queue);
+
+    /* The messages are received through the io_uring ring (one system
+       call to wait and read), NULL for select () and read ().
+       Returns 0 or -1 if io_uring isn't available, the select () path is
+       then kept. */
+    int modbus_set_io_uring (c_modbus_uring *ring);
+
+    /* With boolean set, the response time out of each slave is computed
+       from its measured round trip like the TCP retransmission time out
+       (smoothed RTT + 4 * deviation), between min_ms and max_ms. The
+       select_time given to the functions is then an upper bound. */
+    void modbus_set_adaptive_timeout (int boolean, int min_ms, int max_ms);
+
+    /* Sends the query again up to nb_retries times on a time out or a
+       CRC error, the time out is doubled at each attempt (bounded by the
+       select_time of the call) */
+    void modbus_set_retries (int nb_retries);
+
+    /* With the adaptive time out, a slave is taken out of the scan after
+       nb_failures consecutive time outs: the queries then fail at once
+       with SLAVE_OFFLINE except one every probe_period_ms, until it
+       answers again. nb_failures at 0 disables it. */
+    void modbus_set_quarantine (int nb_failures, int probe_period_ms);
+
+    /* In RTU, the writes (FC 05, 06, 0F and 10) to the slave 0 or
+       MODBUS_BROADCAST_ADDRESS don't wait for a response: the call returns
+       after the frame is on the line and the turnaround delay elapsed,
+       with the number of values written. */
+    void modbus_set_turnaround_delay (int ms);
+
+    /* Gets the round trip estimation of a slave.
+       Returns 0 or -1 if the adaptive time out isn't enabled. */
+    int modbus_get_slave_timing (int slave, modbus_slave_timing_t *timing);
+
     /**
      * SLAVE/CLIENT FUNCTIONS
      **/
@@ -362,9 +636,45 @@ public:
                             int nb_coil_status, int nb_input_status,
                             int nb_holding_registers, int nb_input_registers);
 
+    /* Same as modbus_mapping_new but the tables can be read and written by
+       several threads at once with the functions of modbus_mapping.h, the
+       queries of modbus_slave_manage use them too.
+
+       Returns 0 on success and -1 on failure
+     */
+    int modbus_mapping_new_concurrent (modbus_mapping_t *mb_mapping,
+                                       int nb_coil_status, int nb_input_status,
+                                       int nb_holding_registers, int nb_input_registers);
+
+    /* Same as modbus_mapping_new (or modbus_mapping_new_concurrent if
+       concurrent is set) but the coils and input status are stored as
+       packed bits: tab_coil_status and tab_input_status are read and
+       written with modbus_bits_get/set or modbus_mapping_read_bits/
+       write_bits. A slave of 65536 coils then needs 8 KB per table and
+       the responses of FC 0x01/0x02 are copies of bits.
+
+       Returns 0 on success and -1 on failure
+     */
+    int modbus_mapping_new_packed (modbus_mapping_t *mb_mapping,
+                                   int nb_coil_status, int nb_input_status,
+                                   int nb_holding_registers, int nb_input_registers,
+                                   int concurrent);
+
     /* Frees the 4 arrays */
     void modbus_mapping_free (modbus_mapping_t *mb_mapping);
 
+    /* Adds nb registers from start_addr of the holding (function
+       FC_READ_HOLDING_REGISTERS) or input registers
+       (FC_READ_INPUT_REGISTERS) which aren't stored in the tables:
+       modbus_slave_manage calls read to compute them when a query reads
+       them. A query must read registers of one range only, the ranges can
+       be beyond the size of the table.
+
+       Returns 0 or -1 if there are too many ranges */
+    int modbus_mapping_add_virtual (modbus_mapping_t *mb_mapping, int function,
+                                    int start_addr, int nb,
+                                    modbus_virtual_read_t read, void *arg);
+
     /* Listens for any query from one or many modbus masters in TCP.
        Returns: socket
      */
@@ -423,6 +733,18 @@ public:
 
     int rcv_msg (uint8_t *msg, int select_time, int wait_time);
 
+    /* Prepares the resumable reception of a message in msg.
+       msg_length_computed must be set to MSG_LENGTH_UNDEFINED if undefined
+       (query receiving). Otherwise it's the length of the response to a
+       query (see compute_response_length), an exception response is
+       complete as soon as it's received. */
+    void modbus_rx_init (modbus_rx_t *rx, int msg_length_computed, uint8_t *msg);
+
+    /* Reads the data available on the non blocking descriptor fd.
+       Returns 0 if the message is incomplete, the message length when it's
+       complete (CRC checked in RTU) or a negative value on error. */
+    int modbus_rx_feed (modbus_rx_t *rx, int fd);
+
     /* Sends a query/response over a serial or a TCP communication */
     int modbus_send (uint8_t *query, int query_length);
 
@@ -436,8 +758,24 @@ public:
 
     unsigned int compute_response_length (uint8_t *query , uint8_t data_type);
 
+    /* Receives the response of a query and records the transaction in
+       the statistics */
     int modbus_receive (uint8_t *query, uint8_t *response, uint8_t data_type, int select_time);
 
+    /* Checks the frame is long enough for the fields of its function (a
+       MBAP length or a frame cut short can announce less).
+       Returns response_length or INVALID_DATA */
+    int check_response_length (uint8_t *query, uint8_t *response, int response_length);
+
+    /* Checks the number of values of a good response against the query.
+       Returns the number of values or INVALID_DATA */
+    int check_response_quantity (uint8_t *query, uint8_t *response,
+                                 uint8_t data_type, int response_length);
+
+    /* Decodes an exception response (0x80 + function).
+       Returns the negative exception code */
+    int check_response_exception (uint8_t *query, uint8_t *response);
+
     void modbus_sleep (long int s, long int us);
 
 private:
@@ -463,6 +801,17 @@ private:
 
     int build_response_basis (sft_t *sft, uint8_t *response);
 
+    /* Transaction ID of the next TCP query */
+    uint16_t next_t_id ();
+
+    /* Sends a frame already completed (checksum or length) */
+    int send_frame (uint8_t *query, int query_length);
+
+    /* Sends a query built beforehand with its checksum in RTU or its
+       length in TCP (see modbus_transport.h), only the transaction ID is
+       updated */
+    int send_ready (uint8_t *query, int query_length);
+
     /* Sets the length of TCP message in the message (query and response) */
     void set_message_length_tcp (uint8_t *msg, int msg_length);
 
@@ -483,6 +832,33 @@ private:
     int response_exception (sft_t *sft,
                             int exception_code, uint8_t *response);
 
+    /* Handler of a function code in modbus_slave_manage, query_length
+       without the CRC. Returns the length of the response. */
+    typedef int (c_modbus::*slave_handler_t) (sft_t *sft, const uint8_t *query,
+                                             int query_length,
+                                             modbus_mapping_t *mb_mapping,
+                                             uint8_t *response);
+
+    /* Handlers indexed by function code, NULL if not supported */
+    static const slave_handler_t slave_handlers[FC_PRESET_MULTIPLE_REGISTERS + 1];
+
+    int slave_read_status (sft_t *sft, const uint8_t *query, int query_length,
+                           modbus_mapping_t *mb_mapping, uint8_t *response);
+    int slave_read_registers (sft_t *sft, const uint8_t *query, int query_length,
+                              modbus_mapping_t *mb_mapping, uint8_t *response);
+    int slave_force_single_coil (sft_t *sft, const uint8_t *query, int query_length,
+                                 modbus_mapping_t *mb_mapping, uint8_t *response);
+    int slave_preset_single_register (sft_t *sft, const uint8_t *query, int query_length,
+                                      modbus_mapping_t *mb_mapping, uint8_t *response);
+    int slave_force_multiple_coils (sft_t *sft, const uint8_t *query, int query_length,
+                                    modbus_mapping_t *mb_mapping, uint8_t *response);
+    int slave_preset_multiple_registers (sft_t *sft, const uint8_t *query, int query_length,
+                                         modbus_mapping_t *mb_mapping, uint8_t *response);
+
+    /* Exception response to a query, with a message in debug mode */
+    int slave_exception (sft_t *sft, int exception_code, const char *name,
+                         int value, uint8_t *response);
+
     /* Reads IO status */
     int read_io_status (int function,
                         int start_addr, int nb, uint8_t *data_dest, int select_time);
@@ -491,6 +867,10 @@ private:
     int read_registers (int function, int start_addr,
                         int nb, uint32_t *data_dest, uint8_t data_type, int select_time);
 
+    /* Reads nb registers and decodes them as values of data_type */
+    int read_registers_typed (int function, int start_addr, int nb, void *data_dest,
+                              uint8_t data_type, int word_order, int select_time);
+
     /* Sends a value to a register in a slave.
     Used by force_single_coil and preset_single_register */
     int set_single (int function, int addr, int value,
@@ -502,12 +882,105 @@ private:
     /* Establishes a modbus TCP connection with a modbus slave */
     int modbus_connect_tcp ();
 
+    /* Allocates the tables of a mapping in one block */
+    int mapping_alloc (modbus_mapping_t *mb_mapping,
+                       int nb_coil_status, int nb_input_status,
+                       int nb_holding_registers, int nb_input_registers,
+                       int concurrent, int packed);
+
+    /* Computes t1.5 and t3.5 from the serial settings */
+    void compute_rtu_timings ();
+
+    /* Reads a RTU frame until the line is silent for t3.5 */
+    int receive_frame_rtu (uint8_t *msg, int max_length);
+
     /* Closes the file descriptor in RTU mode */
     void modbus_close_rtu ();
 
     /* Closes the network connection and socket in TCP mode */
     void modbus_close_tcp ();
 
+    /* Frame buffer of the transactions, MODBUS_BUFFER_SIZE bytes */
+    uint8_t *adu;
+
+    /* Instrumentation, see modbus_set_stats */
+    c_modbus_stats *stats;
+    long long stats_send_us;
+    int stats_tx_bytes;
+    int stats_rx_bytes;
+
+    /* See modbus_set_capture */
+    c_modbus_capture *capture;
+    int capture_port;
+
+    /* See modbus_set_tx_queue */
+    c_modbus_tx_queue *tx_queue;
+
+    /* See modbus_set_io_uring */
+    c_modbus_uring *uring;
+
+    /* Records a frame in the capture if any */
+    void capture_frame (int direction, const uint8_t *msg, int msg_length);
+
+    /* Adaptive time out and retries, NULL when disabled */
+    modbus_slave_timing_t *slave_timings;
+    int rto_min_ms;
+    int rto_max_ms;
+    int nb_retries;
+    int quarantine_failures;
+    int probe_period_ms;
+    /* Length of the last frame sent, to send it again */
+    int last_query_length;
+    /* See modbus_set_turnaround_delay */
+    int turnaround_ms;
+    /* See modbus_set_rs485 */
+    int rs485_mode;
+    int rs485_before_us;
+    int rs485_after_us;
+    /* Monotonic time in us of the end of the last frame on the line */
+    long long line_idle_us;
+
+    /* Writes a RTU frame on a RS-485 line */
+    int rs485_write (const uint8_t *frame, int frame_length);
+
+    /* See modbus_set_connect_timeout and modbus_set_keepalive */
+    int connect_timeout_ms;
+    int keepalive_idle_s;
+    int keepalive_interval_s;
+    int keepalive_probes;
+
+    /* TRUE for a write without response (RTU broadcast) */
+    int is_broadcast (const uint8_t *query);
+
+    /* Time in us to send a frame of query_length bytes and the
+       turnaround delay */
+    long broadcast_delay_us (int query_length);
+
+    /* Number of values written by a broadcast */
+    int broadcast_quantity (const uint8_t *query);
+
+    /* Returns the estimation of a slave or NULL */
+    modbus_slave_timing_t *slave_timing (int slave);
+
+    /* Updates the estimation with the result of a transaction */
+    void update_slave_timing (modbus_slave_timing_t *timing, int ret,
+                              int sample, long long rtt_us);
+
+    /* modbus_receive of a response of response_length bytes */
+    int receive_expected (uint8_t *query, uint8_t *response, uint8_t data_type,
+                          int response_length, int select_time);
+
+    int receive_response (uint8_t *query, uint8_t *response, uint8_t data_type,
+                          int response_length, int select_time);
+
 };
 
+/* Returns a monotonic time stamp in microseconds */
+long long modbus_time_us ();
+
+/* Allocates size bytes aligned on MODBUS_CACHE_LINE, to release with
+   free (). Returns NULL on failure. */
+void *modbus_aligned_alloc (size_t size);
+
 #endif  /* _MODBUS_H_ */
+
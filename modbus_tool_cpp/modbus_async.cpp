@@ -0,0 +1,445 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "modbus_async.h"
+#include "modbus_decode.h"
+#include "modbus_stats.h"
+
+c_modbus_async::c_modbus_async (c_modbus *ctx, int max_requests) {
+    this->ctx = ctx;
+    if (max_requests <= 0)
+        max_requests = MODBUS_ASYNC_DEFAULT_REQUESTS;
+    this->max_requests = max_requests;
+    first = 0;
+    nb_requests = 0;
+    active = FALSE;
+    cancelling = FALSE;
+    stale = FALSE;
+    deadline = 0;
+    sent_us = 0;
+    fd = -1;
+    fd_flags = 0;
+
+    requests = (modbus_async_request_t *) calloc (max_requests, sizeof (modbus_async_request_t));
+    response = (uint8_t *) modbus_aligned_alloc (MODBUS_BUFFER_SIZE);
+    pool = new c_modbus_pool (max_requests);
+    if (requests == NULL || response == NULL || pool->nb_buffers () < max_requests) {
+        fprintf (stderr, "ERROR Can't allocate %d asynchronous requests\n", max_requests);
+        this->max_requests = 0;
+    }
+}
+
+c_modbus_async::~c_modbus_async () {
+    int i;
+
+    for (i = 0; i < nb_requests; i++)
+        pool->release (requests[ (first + i) % max_requests].query);
+
+    /* Gives the descriptor back to the blocking functions */
+    if (fd != -1 && fd == ctx->mb_param->fd)
+        fcntl (fd, F_SETFL, fd_flags);
+
+    free (requests);
+    free (response);
+    delete pool;
+}
+
+int c_modbus_async::get_fd () {
+    return ctx->mb_param->fd;
+}
+
+int c_modbus_async::pending () {
+    return nb_requests;
+}
+
+int c_modbus_async::next_timeout () {
+    long long delay;
+
+    if (!active)
+        return -1;
+
+    delay = deadline - modbus_time_us () / 1000;
+
+    return delay > 0 ? (int) delay : 0;
+}
+
+void c_modbus_async::set_non_blocking () {
+    int flags;
+
+    /* The descriptor changes on a reconnection */
+    if (fd == ctx->mb_param->fd)
+        return;
+
+    fd = ctx->mb_param->fd;
+    flags = fcntl (fd, F_GETFL, 0);
+    if (flags == -1)
+        return;
+    fd_flags = flags;
+    fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int c_modbus_async::submit (int function, int start_addr, int nb,
+                            const uint8_t *data, int data_length, void *dest,
+                            int timeout, modbus_async_cb_t cb, void *arg) {
+    modbus_async_request_t *request;
+    uint8_t *query;
+
+    if (nb_requests >= max_requests) {
+        fprintf (stderr, "ERROR Too many asynchronous requests (%d)\n", max_requests);
+        return INVALID_DATA;
+    }
+
+    query = pool->lease ();
+    if (query == NULL) {
+        ctx->error_treat (INVALID_DATA, "async: no frame buffer available");
+        return INVALID_DATA;
+    }
+
+    request = &requests[ (first + nb_requests) % max_requests];
+    request->query = query;
+    request->query_length = ctx->build_query_basis (function, start_addr, nb, query);
+    if (data_length > 0) {
+        memcpy (query + request->query_length, data, data_length);
+        request->query_length += data_length;
+    }
+    request->response_length = ctx->compute_response_length (query, UINT16);
+    request->nb = nb;
+    request->dest = dest;
+    request->timeout = timeout;
+    request->cb = cb;
+    request->arg = arg;
+    nb_requests++;
+
+    if (!active && !cancelling)
+        start_next ();
+
+    return 0;
+}
+
+void c_modbus_async::start_next () {
+    modbus_async_request_t *request;
+    int ret;
+
+    while (!active && nb_requests > 0) {
+        request = &requests[first];
+
+        if (stale) {
+            /* Drops the late response of the last transaction */
+            ctx->modbus_flush ();
+            stale = FALSE;
+        }
+
+        set_non_blocking ();
+        /* The CRC is appended to the query in RTU */
+        ret = ctx->modbus_send (request->query, request->query_length);
+        if (ret <= 0) {
+            complete (ret < 0 ? ret : SOCKET_FAILURE, 0);
+            continue;
+        }
+
+        sent_us = modbus_time_us ();
+        deadline = sent_us / 1000 + request->timeout;
+        ctx->modbus_rx_init (&rx, request->response_length, response);
+        active = TRUE;
+    }
+}
+
+void c_modbus_async::complete (int status, int response_length) {
+    modbus_async_request_t *request = &requests[first];
+    modbus_async_cb_t cb = request->cb;
+    void *arg = request->arg;
+    int offset = (ctx->mb_param->type_com == RTU) ? HEADER_LENGTH_RTU : HEADER_LENGTH_TCP;
+
+    if (ctx->stats != NULL) {
+        ctx->stats->record (request->query[offset - 1], request->query[offset], status,
+                            active ? modbus_time_us () - sent_us : 0,
+                            request->query_length, response_length);
+    }
+
+    pool->release (request->query);
+    request->query = NULL;
+    first = (first + 1) % max_requests;
+    nb_requests--;
+    active = FALSE;
+
+    /* The callback may queue new requests */
+    if (cb != NULL)
+        cb (status, arg);
+}
+
+int c_modbus_async::decode_response (int response_length) {
+    modbus_async_request_t *request = &requests[first];
+    uint8_t *query = request->query;
+    int offset = (ctx->mb_param->type_com == RTU) ? HEADER_LENGTH_RTU : HEADER_LENGTH_TCP;
+    int function = query[offset];
+    int status;
+    int i;
+
+    if (ctx->check_response_length (query, response, response_length) < 0)
+        return INVALID_DATA;
+
+    if (response[offset] == 0x80 + function)
+        return ctx->check_response_exception (query, response);
+
+    if (response[offset] != function) {
+        ctx->error_treat (INVALID_DATA, "async: function code not corresponding to the query");
+        return INVALID_DATA;
+    }
+
+    status = ctx->check_response_quantity (query, response, UINT16, response_length);
+    if (status <= 0)
+        return status;
+
+    switch (function) {
+    case FC_READ_COIL_STATUS:
+    case FC_READ_INPUT_STATUS: {
+        const uint8_t *data = response + offset + 2;
+        uint8_t *dest = (uint8_t *) request->dest;
+
+        for (i = 0; i < request->nb; i++)
+            dest[i] = (data[i / 8] & (1 << (i % 8))) ? TRUE : FALSE;
+        status = request->nb;
+    }
+    break;
+    case FC_READ_HOLDING_REGISTERS:
+    case FC_READ_INPUT_REGISTERS:
+        modbus_decode_16 (response + offset + 2, status, request->dest);
+        break;
+    default:
+        break;
+    }
+
+    return status;
+}
+
+int c_modbus_async::on_readable () {
+    int ret;
+
+    if (!active) {
+        /* Nothing is expected */
+        ctx->modbus_flush ();
+        stale = FALSE;
+        return 0;
+    }
+
+    for (;;) {
+        ret = ctx->modbus_rx_feed (&rx, fd);
+        if (ret == 0)
+            return 0;
+
+        if (ret == SOCKET_FAILURE || ret == CONNECTION_CLOSED) {
+            if (ret == CONNECTION_CLOSED)
+                ctx->error_treat (ret, "async: connection closed");
+            cancel_all (ret);
+            return ret;
+        }
+
+        if (ret > 0 && ctx->mb_param->type_com == TCP &&
+                (response[0] != requests[first].query[0] ||
+                 response[1] != requests[first].query[1])) {
+            /* Response of a transaction already timed out */
+            if (ctx->mb_param->debug) {
+                printf ("Response with unknown transaction id %d ignored\n",
+                        (response[0] << 8) | response[1]);
+            }
+            ctx->modbus_rx_init (&rx, requests[first].response_length, response);
+            continue;
+        }
+
+        break;
+    }
+
+    if (ret > 0) {
+        complete (decode_response (ret), ret);
+    } else {
+        /* Invalid CRC or length, the rest of the frame is garbage */
+        stale = TRUE;
+        complete (ret, rx.msg_length);
+    }
+    start_next ();
+
+    return 1;
+}
+
+int c_modbus_async::on_timeout () {
+    if (!active || modbus_time_us () / 1000 < deadline)
+        return 0;
+
+    ctx->error_treat (SELECT_TIMEOUT, "async: response timeout");
+    stale = TRUE;
+    complete (SELECT_TIMEOUT, rx.msg_length);
+    start_next ();
+
+    return 1;
+}
+
+int c_modbus_async::run_once (int max_wait) {
+    struct pollfd pfd;
+    int timeout = next_timeout ();
+    int nb_completed = 0;
+    int ret;
+
+    if (timeout == -1 || timeout > max_wait)
+        timeout = max_wait;
+
+    pfd.fd = get_fd ();
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    ret = ::poll (&pfd, 1, timeout);
+    if (ret == -1) {
+        if (errno == EINTR)
+            return 0;
+        ctx->error_treat (SELECT_FAILURE, "Poll failure");
+        cancel_all (SELECT_FAILURE);
+        return SELECT_FAILURE;
+    }
+
+    if (ret > 0) {
+        ret = on_readable ();
+        if (ret < 0)
+            return ret;
+        nb_completed += ret;
+    }
+
+    return nb_completed + on_timeout ();
+}
+
+void c_modbus_async::cancel_all (int status) {
+    int nb = nb_requests;
+
+    /* The requests queued by the callbacks aren't cancelled */
+    cancelling = TRUE;
+    while (nb-- > 0)
+        complete (status, 0);
+    cancelling = FALSE;
+
+    start_next ();
+}
+
+int c_modbus_async::async_read_coil_status (int start_addr, int nb, uint8_t *dest, int timeout,
+                                            modbus_async_cb_t cb, void *arg) {
+    if (nb > MAX_STATUS) {
+        fprintf (stderr,
+                 "ERROR Too many coils status requested (%d > %d)\n",
+                 nb, MAX_STATUS);
+        return INVALID_DATA;
+    }
+
+    return submit (FC_READ_COIL_STATUS, start_addr, nb, NULL, 0, dest, timeout, cb, arg);
+}
+
+int c_modbus_async::async_read_input_status (int start_addr, int nb, uint8_t *dest, int timeout,
+                                             modbus_async_cb_t cb, void *arg) {
+    if (nb > MAX_STATUS) {
+        fprintf (stderr,
+                 "ERROR Too many input status requested (%d > %d)\n",
+                 nb, MAX_STATUS);
+        return INVALID_DATA;
+    }
+
+    return submit (FC_READ_INPUT_STATUS, start_addr, nb, NULL, 0, dest, timeout, cb, arg);
+}
+
+int c_modbus_async::async_read_holding_registers (int start_addr, int nb, uint16_t *dest,
+                                                  int timeout, modbus_async_cb_t cb, void *arg) {
+    if (nb > MAX_REGISTERS) {
+        fprintf (stderr,
+                 "ERROR Too many holding registers requested (%d > %d)\n",
+                 nb, MAX_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    return submit (FC_READ_HOLDING_REGISTERS, start_addr, nb, NULL, 0, dest, timeout, cb, arg);
+}
+
+int c_modbus_async::async_read_input_registers (int start_addr, int nb, uint16_t *dest,
+                                                int timeout, modbus_async_cb_t cb, void *arg) {
+    if (nb > MAX_REGISTERS) {
+        fprintf (stderr,
+                 "ERROR Too many input registers requested (%d > %d)\n",
+                 nb, MAX_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    return submit (FC_READ_INPUT_REGISTERS, start_addr, nb, NULL, 0, dest, timeout, cb, arg);
+}
+
+int c_modbus_async::async_force_single_coil (int coil_addr, int state, int timeout,
+                                             modbus_async_cb_t cb, void *arg) {
+    if (state)
+        state = 0xFF00;
+
+    return submit (FC_FORCE_SINGLE_COIL, coil_addr, state, NULL, 0, NULL, timeout, cb, arg);
+}
+
+int c_modbus_async::async_preset_single_register (int reg_addr, int value, int timeout,
+                                                  modbus_async_cb_t cb, void *arg) {
+    return submit (FC_PRESET_SINGLE_REGISTER, reg_addr, value, NULL, 0, NULL, timeout, cb, arg);
+}
+
+int c_modbus_async::async_force_multiple_coils (int start_addr, int nb, const uint8_t *data,
+                                                int timeout, modbus_async_cb_t cb, void *arg) {
+    uint8_t payload[1 + MAX_WRITE_STATUS / 8];
+    int byte_count;
+    int i;
+
+    if (nb > MAX_WRITE_STATUS) {
+        fprintf (stderr, "ERROR Writing to too many coils (%d > %d)\n",
+                 nb, MAX_WRITE_STATUS);
+        return INVALID_DATA;
+    }
+
+    byte_count = (nb / 8) + ( (nb % 8) ? 1 : 0);
+    payload[0] = byte_count;
+    memset (payload + 1, 0, byte_count);
+    for (i = 0; i < nb; i++) {
+        if (data[i])
+            payload[1 + i / 8] |= 1 << (i % 8);
+    }
+
+    return submit (FC_FORCE_MULTIPLE_COILS, start_addr, nb,
+                   payload, 1 + byte_count, NULL, timeout, cb, arg);
+}
+
+int c_modbus_async::async_preset_multiple_registers (int start_addr, int nb, const uint16_t *data,
+                                                     int timeout, modbus_async_cb_t cb, void *arg) {
+    uint8_t payload[1 + MAX_WRITE_REGISTERS * 2];
+    int i;
+
+    if (nb > MAX_WRITE_REGISTERS) {
+        fprintf (stderr,
+                 "ERROR Trying to write to too many registers (%d > %d)\n",
+                 nb, MAX_WRITE_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    payload[0] = nb * 2;
+    for (i = 0; i < nb; i++) {
+        payload[1 + (i << 1)] = data[i] >> 8;
+        payload[2 + (i << 1)] = data[i] & 0x00FF;
+    }
+
+    return submit (FC_PRESET_MULTIPLE_REGISTERS, start_addr, nb,
+                   payload, 1 + nb * 2, NULL, timeout, cb, arg);
+}
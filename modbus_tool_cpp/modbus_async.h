@@ -0,0 +1,163 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_ASYNC_H_
+#define _MODBUS_ASYNC_H_
+
+#include "modbus.h"
+#include "modbus_pool.h"
+
+#define MODBUS_ASYNC_DEFAULT_REQUESTS  16
+
+/* Called when an asynchronous transaction completes. status is the number
+   of values (bits or words) on success or less than 0 for exceptions
+   errors, exactly like the blocking functions of c_modbus. */
+typedef void (*modbus_async_cb_t) (int status, void *arg);
+
+typedef struct
+{
+    /* Request, built in a buffer of the pool when it's queued */
+    uint8_t *query;
+    int query_length;
+    int response_length;
+    int nb;
+    void *dest;
+    /* Response time out in ms */
+    int timeout;
+    modbus_async_cb_t cb;
+    void *arg;
+} modbus_async_request_t;
+
+/* Asynchronous master driven by the event loop of the application (RTU
+   and TCP).
+
+   The functions below queue a request for the current slave of the
+   context and return at once: 0 if queued or less than 0 on error. The
+   requests are sent one after the other, the descriptor is in non
+   blocking mode and the response is received with modbus_rx_feed as the
+   data arrives. The application watches get_fd () for reading, waits at
+   most next_timeout () ms and calls on_readable () and on_timeout ()
+   (or run_once () without event loop). The callbacks are called from
+   these functions; a request which can't be sent is completed with the
+   error too.
+
+   The blocking functions of the context mustn't be used while requests
+   are pending. */
+class c_modbus_async
+{
+public:
+
+    c_modbus_async (c_modbus *ctx, int max_requests);
+    ~c_modbus_async ();
+
+    /* Descriptor to watch for reading */
+    int get_fd ();
+
+    /* Number of requests queued or in progress */
+    int pending ();
+
+    /* Delay in ms before the time out of the transaction in progress, -1
+       if nothing is in progress */
+    int next_timeout ();
+
+    /* To call when the descriptor is readable.
+       Returns the number of completed transactions (0 or 1) or less than
+       0 if the connection failed (all the requests are then completed
+       with the error). */
+    int on_readable ();
+
+    /* Completes the transaction in progress if its time out expired.
+       Returns the number of completed transactions (0 or 1). */
+    int on_timeout ();
+
+    /* Waits at most max_wait ms for the descriptor and calls the
+       handlers above. Returns the number of completed transactions or
+       less than 0 if the connection failed. */
+    int run_once (int max_wait);
+
+    /* Completes all the pending requests with status */
+    void cancel_all (int status);
+
+    int async_read_coil_status (int start_addr, int nb, uint8_t *dest, int timeout,
+                                modbus_async_cb_t cb, void *arg);
+
+    int async_read_input_status (int start_addr, int nb, uint8_t *dest, int timeout,
+                                 modbus_async_cb_t cb, void *arg);
+
+    int async_read_holding_registers (int start_addr, int nb, uint16_t *dest, int timeout,
+                                      modbus_async_cb_t cb, void *arg);
+
+    int async_read_input_registers (int start_addr, int nb, uint16_t *dest, int timeout,
+                                    modbus_async_cb_t cb, void *arg);
+
+    int async_force_single_coil (int coil_addr, int state, int timeout,
+                                 modbus_async_cb_t cb, void *arg);
+
+    int async_preset_single_register (int reg_addr, int value, int timeout,
+                                      modbus_async_cb_t cb, void *arg);
+
+    int async_force_multiple_coils (int start_addr, int nb, const uint8_t *data,
+                                    int timeout, modbus_async_cb_t cb, void *arg);
+
+    int async_preset_multiple_registers (int start_addr, int nb, const uint16_t *data,
+                                         int timeout, modbus_async_cb_t cb, void *arg);
+
+private:
+
+    c_modbus *ctx;
+
+    /* Queue of the requests, the first one is in progress when active */
+    modbus_async_request_t *requests;
+    int max_requests;
+    int first;
+    int nb_requests;
+    int active;
+    int cancelling;
+
+    /* A response of a timed out transaction may still arrive */
+    int stale;
+
+    /* Monotonic time in ms of the time out of the transaction in progress */
+    long long deadline;
+    /* Monotonic time in us of the send, for the statistics */
+    long long sent_us;
+
+    modbus_rx_t rx;
+    uint8_t *response;
+
+    /* A frame buffer per request */
+    c_modbus_pool *pool;
+
+    /* Descriptor set in non blocking mode and its original flags */
+    int fd;
+    int fd_flags;
+
+    int submit (int function, int start_addr, int nb,
+                const uint8_t *data, int data_length, void *dest,
+                int timeout, modbus_async_cb_t cb, void *arg);
+
+    void set_non_blocking ();
+
+    /* Sends the first requests until one is in progress */
+    void start_next ();
+
+    /* response_length is 0 when no response was received */
+    void complete (int status, int response_length);
+
+    /* Checks and decodes the response of the transaction in progress */
+    int decode_response (int response_length);
+};
+
+#endif  /* _MODBUS_ASYNC_H_ */
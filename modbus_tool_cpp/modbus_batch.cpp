@@ -0,0 +1,246 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "modbus_batch.h"
+
+static int compare_writes (const void *a, const void *b) {
+    const modbus_batch_write_t *wa = (const modbus_batch_write_t *) a;
+    const modbus_batch_write_t *wb = (const modbus_batch_write_t *) b;
+
+    if (wa->phase != wb->phase)
+        return wa->phase - wb->phase;
+    if (wa->address != wb->address)
+        return wa->address - wb->address;
+
+    return wa->sequence - wb->sequence;
+}
+
+c_modbus_batch::c_modbus_batch (c_modbus *ctx, int max_writes) {
+    if (max_writes <= 0)
+        max_writes = MODBUS_BATCH_DEFAULT_WRITES;
+    this->ctx = ctx;
+    this->max_writes = max_writes;
+    nb_writes = 0;
+    nb_phases = 0;
+    window_ms = MODBUS_BATCH_DEFAULT_WINDOW;
+    select_time = MODBUS_BATCH_DEFAULT_SELECT_TIME;
+    first_ms = 0;
+    memset (slave_phases, 0, sizeof (slave_phases));
+    memset (slave_functions, 0, sizeof (slave_functions));
+    memset (&counters, 0, sizeof (counters));
+
+    writes = (modbus_batch_write_t *) malloc (max_writes * sizeof (modbus_batch_write_t));
+    if (writes == NULL)
+        this->max_writes = 0;
+}
+
+c_modbus_batch::~c_modbus_batch () {
+    free (writes);
+}
+
+void c_modbus_batch::set_window (int window_ms) {
+    this->window_ms = window_ms < 0 ? 0 : window_ms;
+}
+
+void c_modbus_batch::set_select_time (int select_time) {
+    this->select_time = select_time;
+}
+
+int c_modbus_batch::queue (int slave, int function, int address, int value) {
+    modbus_batch_write_t *write;
+    int ret = 0;
+
+    if (max_writes == 0)
+        return -1;
+
+    if (slave < 0 || slave >= MODBUS_BATCH_SLAVES || address < 0 || address > 0xFFFF) {
+        fprintf (stderr, "ERROR Invalid write of slave %d at %d\n", slave, address);
+        return INVALID_DATA;
+    }
+
+    if (nb_writes >= max_writes)
+        ret = flush ();
+
+    if (slave_phases[slave] == 0 || slave_functions[slave] != function) {
+        /* The other table of the slave, the writes queued are sent
+           first */
+        slave_phases[slave] = ++nb_phases;
+        slave_functions[slave] = function;
+    }
+
+    if (nb_writes == 0)
+        first_ms = modbus_time_us () / 1000;
+
+    write = &writes[nb_writes];
+    write->slave = slave;
+    write->function = function;
+    write->address = address;
+    write->value = value;
+    write->phase = slave_phases[slave];
+    write->sequence = nb_writes;
+    nb_writes++;
+    counters.nb_writes++;
+
+    return ret;
+}
+
+int c_modbus_batch::force_coil (int slave, int address, int state) {
+    return queue (slave, FC_FORCE_MULTIPLE_COILS, address, state ? ON : OFF);
+}
+
+int c_modbus_batch::preset_register (int slave, int address, int value) {
+    return queue (slave, FC_PRESET_MULTIPLE_REGISTERS, address, value & 0xFFFF);
+}
+
+int c_modbus_batch::force_coils (int slave, int address, int nb, const uint8_t *states) {
+    int status = 0;
+    int ret;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        ret = force_coil (slave, address + i, states[i]);
+        if (ret == INVALID_DATA)
+            return ret;
+        if (ret < 0 && status == 0)
+            status = ret;
+    }
+
+    return status;
+}
+
+int c_modbus_batch::preset_registers (int slave, int address, int nb, const uint16_t *values) {
+    int status = 0;
+    int ret;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        ret = preset_register (slave, address + i, values[i]);
+        if (ret == INVALID_DATA)
+            return ret;
+        if (ret < 0 && status == 0)
+            status = ret;
+    }
+
+    return status;
+}
+
+void c_modbus_batch::barrier (int slave) {
+    if (slave >= 0 && slave < MODBUS_BATCH_SLAVES)
+        slave_phases[slave] = 0;
+}
+
+int c_modbus_batch::poll () {
+    if (nb_writes == 0 || modbus_time_us () / 1000 - first_ms < window_ms)
+        return 0;
+
+    return flush ();
+}
+
+int c_modbus_batch::write_run (int first, int nb) {
+    modbus_batch_write_t *write = &writes[first];
+    uint16_t registers[MAX_WRITE_REGISTERS];
+    uint8_t states[MAX_WRITE_STATUS];
+    int i;
+
+    ctx->modbus_set_slave (write->slave);
+
+    if (write->function == FC_FORCE_MULTIPLE_COILS) {
+        if (nb == 1)
+            return ctx->force_single_coil (write->address, write->value, select_time);
+        for (i = 0; i < nb; i++)
+            states[i] = write[i].value;
+        return ctx->force_multiple_coils (write->address, nb, states, select_time);
+    }
+
+    if (nb == 1)
+        return ctx->preset_single_register (write->address, write->value, select_time);
+    for (i = 0; i < nb; i++)
+        registers[i] = write[i].value;
+
+    return ctx->preset_multiple_registers (write->address, nb, registers, select_time);
+}
+
+int c_modbus_batch::flush () {
+    uint8_t failed[MODBUS_BATCH_SLAVES];
+    int status = 0;
+    int limit;
+    int first;
+    int nb;
+    int ret;
+    int i;
+    int j;
+
+    if (nb_writes == 0)
+        return 0;
+
+    qsort (writes, nb_writes, sizeof (modbus_batch_write_t), compare_writes);
+
+    /* Last writer wins: keeps the last write of each address of a
+       phase */
+    for (i = 0, j = 0; i < nb_writes; i++) {
+        if (i + 1 < nb_writes && writes[i + 1].phase == writes[i].phase &&
+                writes[i + 1].address == writes[i].address) {
+            counters.nb_overwritten++;
+            continue;
+        }
+        writes[j++] = writes[i];
+    }
+    nb_writes = j;
+
+    memset (failed, 0, sizeof (failed));
+    first = 0;
+    while (first < nb_writes) {
+        limit = (writes[first].function == FC_FORCE_MULTIPLE_COILS) ?
+                MAX_WRITE_STATUS : MAX_WRITE_REGISTERS;
+
+        /* Contiguous addresses of the phase */
+        nb = 1;
+        while (first + nb < nb_writes && nb < limit &&
+                writes[first + nb].phase == writes[first].phase &&
+                writes[first + nb].address == writes[first].address + nb)
+            nb++;
+
+        if (!failed[writes[first].slave]) {
+            ret = write_run (first, nb);
+            counters.nb_transactions++;
+            if (ret < 0) {
+                counters.nb_errors++;
+                failed[writes[first].slave] = TRUE;
+                if (status == 0)
+                    status = ret;
+            }
+        }
+
+        first += nb;
+    }
+
+    nb_writes = 0;
+    nb_phases = 0;
+    memset (slave_phases, 0, sizeof (slave_phases));
+
+    return status;
+}
+
+int c_modbus_batch::pending () {
+    return nb_writes;
+}
+
+void c_modbus_batch::get_counters (modbus_batch_counters_t *counters) {
+    memcpy (counters, &this->counters, sizeof (modbus_batch_counters_t));
+}
@@ -0,0 +1,129 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_BATCH_H_
+#define _MODBUS_BATCH_H_
+
+#include "modbus.h"
+
+#define MODBUS_BATCH_DEFAULT_WRITES  1024
+
+/* Time in ms the writes wait for the next ones before being sent */
+#define MODBUS_BATCH_DEFAULT_WINDOW    10
+
+#define MODBUS_BATCH_DEFAULT_SELECT_TIME  500
+
+#define MODBUS_BATCH_SLAVES           256
+
+/* A write of one coil or register */
+typedef struct
+{
+    int slave;
+    /* FC_FORCE_MULTIPLE_COILS or FC_PRESET_MULTIPLE_REGISTERS */
+    int function;
+    int address;
+    int value;
+    /* Writes of the same phase can be merged and reordered */
+    int phase;
+    /* Order of the write */
+    int sequence;
+} modbus_batch_write_t;
+
+typedef struct
+{
+    unsigned long nb_writes;
+    /* Writes replaced by a later write to the same address */
+    unsigned long nb_overwritten;
+    unsigned long nb_transactions;
+    unsigned long nb_errors;
+} modbus_batch_counters_t;
+
+/* Write coalescing.
+
+   The writes of coils and registers are queued and sent together once
+   the window is over (see poll): the contiguous addresses of a slave
+   make one FC 0x0F or 0x10 transaction (within MAX_WRITE_STATUS coils and
+   MAX_WRITE_REGISTERS registers), a lone value is sent with FC 0x05 or
+   0x06. When an address is written several times, only the last value
+   is sent.
+
+   The writes of a slave are split in phases: a phase ends when the
+   slave is written in the other table (coils or registers) or on
+   barrier (). The writes of a phase are sent by increasing address, the
+   phases of all the slaves in the order they were started. So a command
+   coil written after its setpoint registers is always sent after them.
+
+   When a transaction fails, the next phases of its slave are dropped. */
+class c_modbus_batch
+{
+public:
+
+    c_modbus_batch (c_modbus *ctx, int max_writes);
+    ~c_modbus_batch ();
+
+    /* Time in ms since the first write queued after which poll () sends
+       the writes, 0 to send them at each poll () */
+    void set_window (int window_ms);
+
+    /* Response time out in ms of the transactions */
+    void set_select_time (int select_time);
+
+    /* Queue writes, the queue is flushed when full.
+       Return 0, INVALID_DATA for an invalid write or the status of the
+       flush of a full queue (the write is queued even so). */
+    int force_coil (int slave, int address, int state);
+    int preset_register (int slave, int address, int value);
+    int force_coils (int slave, int address, int nb, const uint8_t *states);
+    int preset_registers (int slave, int address, int nb, const uint16_t *values);
+
+    /* The next writes of the slave are sent after the writes queued */
+    void barrier (int slave);
+
+    /* Flushes the writes if the window is over.
+       Returns the status of flush () or 0 if too soon. */
+    int poll ();
+
+    /* Sends all the writes queued.
+       Returns 0 or the error of the first transaction failed. */
+    int flush ();
+
+    /* Number of writes queued */
+    int pending ();
+
+    void get_counters (modbus_batch_counters_t *counters);
+
+private:
+
+    c_modbus *ctx;
+    modbus_batch_write_t *writes;
+    int max_writes;
+    int nb_writes;
+    int nb_phases;
+    int window_ms;
+    int select_time;
+    /* Monotonic time in ms of the first write queued */
+    long long first_ms;
+    /* Current phase and function of each slave, 0 if none */
+    int slave_phases[MODBUS_BATCH_SLAVES];
+    int slave_functions[MODBUS_BATCH_SLAVES];
+    modbus_batch_counters_t counters;
+
+    int queue (int slave, int function, int address, int value);
+
+    /* Writes nb contiguous values of writes [first, first + nb[ */
+    int write_run (int first, int nb);
+};
+
+#endif  /* _MODBUS_BATCH_H_ */
@@ -0,0 +1,125 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "modbus_bits.h"
+
+/* Bits copied per step by modbus_bits_copy, a word of 64 bits holds
+   them at any of the 8 bit offsets */
+#define BITS_STEP  56
+
+#define BYTES_LSB  0x0101010101010101ULL
+#define BYTES_LOW  0x7F7F7F7F7F7F7F7FULL
+#define BYTES_MSB  0x8080808080808080ULL
+
+/* The bytes of the tables are loaded in little endian words */
+static inline uint64_t le64 (uint64_t word) {
+#if defined (__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64 (word);
+#else
+    return word;
+#endif
+}
+
+static inline uint64_t bits_mask (int nb) {
+    return (nb >= 64) ? ~0ULL : ( (uint64_t) 1 << nb) - 1;
+}
+
+/* Loads nb (<= BITS_STEP) bits from the bit bit of src, only the bytes
+   holding them are read */
+static inline uint64_t load_bits (const uint8_t *src, int bit, int nb) {
+    int shift = bit & 7;
+    uint64_t word = 0;
+
+    memcpy (&word, src + (bit >> 3), (shift + nb + 7) >> 3);
+
+    return (le64 (word) >> shift) & bits_mask (nb);
+}
+
+static inline void store_bits (uint8_t *dest, int bit, int nb, uint64_t value) {
+    int shift = bit & 7;
+    int nb_bytes = (shift + nb + 7) >> 3;
+    uint64_t mask = bits_mask (nb) << shift;
+    uint64_t word = 0;
+
+    memcpy (&word, dest + (bit >> 3), nb_bytes);
+    word = le64 (word);
+    word = (word & ~mask) | (value << shift);
+    word = le64 (word);
+    memcpy (dest + (bit >> 3), &word, nb_bytes);
+}
+
+void modbus_bits_pack (const uint8_t *src, int nb, uint8_t *dest) {
+    uint64_t word;
+    int i;
+
+    for (i = 0; i + 8 <= nb; i += 8) {
+        memcpy (&word, src + i, 8);
+        word = le64 (word);
+        /* The MSB of each byte set if the byte isn't 0, moved to bit 0 */
+        word = ( ( ( (word & BYTES_LOW) + BYTES_LOW) | word) & BYTES_MSB) >> 7;
+        /* The bit 0 of byte j goes to bit 56 + j */
+        dest[i >> 3] = (word * 0x0102040810204080ULL) >> 56;
+    }
+
+    if (i < nb) {
+        uint8_t byte = 0;
+        int bit;
+
+        for (bit = 0; i < nb; i++, bit++)
+            if (src[i])
+                byte |= 1 << bit;
+        dest[i >> 3] = byte;
+    }
+}
+
+void modbus_bits_unpack (const uint8_t *src, int nb, uint8_t *dest) {
+    uint64_t word;
+    int i;
+
+    for (i = 0; i + 8 <= nb; i += 8) {
+        /* The bit j of the byte in the byte j */
+        word = (src[i >> 3] * BYTES_LSB) & 0x8040201008040201ULL;
+        /* Each non zero byte to 1 (no carry: a byte is at most 0x80) */
+        word = ( (word + BYTES_LOW) >> 7) & BYTES_LSB;
+        word = le64 (word);
+        memcpy (dest + i, &word, 8);
+    }
+
+    for (; i < nb; i++)
+        dest[i] = (src[i >> 3] >> (i & 7)) & 1;
+}
+
+void modbus_bits_copy (uint8_t *dest, int dest_bit, const uint8_t *src, int src_bit, int nb) {
+    int count;
+
+    if ( ( (dest_bit | src_bit) & 7) == 0) {
+        /* Both on a byte, only the last bits are shifted */
+        memcpy (dest + (dest_bit >> 3), src + (src_bit >> 3), nb >> 3);
+        count = nb & ~7;
+        dest_bit += count;
+        src_bit += count;
+        nb -= count;
+    }
+
+    while (nb > 0) {
+        count = (nb > BITS_STEP) ? BITS_STEP : nb;
+        store_bits (dest, dest_bit, count, load_bits (src, src_bit, count));
+        dest_bit += count;
+        src_bit += count;
+        nb -= count;
+    }
+}
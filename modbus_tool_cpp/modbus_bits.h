@@ -0,0 +1,50 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_BITS_H_
+#define _MODBUS_BITS_H_
+
+#include <stdint.h>
+
+/* Bit kernels of the coils and discrete inputs.
+
+   A packed table is in the order of the Modbus PDU: bit i is the bit
+   i % 8 (LSB first) of the byte i / 8. The kernels work on 64 bits
+   words: 8 values per step between one byte per value and packed bits,
+   56 bits per step between two packed tables at any bit offset. */
+
+/* Packs nb values stored one per byte (0 or not) from src to dest, the
+   unused bits of the last byte are cleared */
+void modbus_bits_pack (const uint8_t *src, int nb, uint8_t *dest);
+
+/* Unpacks nb bits of src to one byte (ON or OFF) per value */
+void modbus_bits_unpack (const uint8_t *src, int nb, uint8_t *dest);
+
+/* Copies nb bits from the bit src_bit of src to the bit dest_bit of
+   dest, the other bits of dest are kept */
+void modbus_bits_copy (uint8_t *dest, int dest_bit, const uint8_t *src, int src_bit, int nb);
+
+inline int modbus_bits_get (const uint8_t *tab, int bit) {
+    return (tab[bit >> 3] >> (bit & 7)) & 1;
+}
+
+inline void modbus_bits_set (uint8_t *tab, int bit, int value) {
+    if (value)
+        tab[bit >> 3] |= 1 << (bit & 7);
+    else
+        tab[bit >> 3] &= ~ (1 << (bit & 7));
+}
+
+#endif  /* _MODBUS_BITS_H_ */
@@ -0,0 +1,302 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "modbus_cache.h"
+#include "modbus_decode.h"
+
+/* The values are compared by runs of 32 addresses, one word of the valid
+   bits */
+#define CACHE_RUN  32
+
+static int function_table (int function) {
+    switch (function) {
+    case FC_READ_COIL_STATUS:
+        return 0;
+    case FC_READ_INPUT_STATUS:
+        return 1;
+    case FC_READ_HOLDING_REGISTERS:
+        return 2;
+    case FC_READ_INPUT_REGISTERS:
+        return 3;
+    }
+
+    return -1;
+}
+
+c_modbus_cache::c_modbus_cache () {
+    memset (slaves, 0, sizeof (slaves));
+}
+
+c_modbus_cache::~c_modbus_cache () {
+    int slave;
+    int table;
+    int page;
+
+    for (slave = 0; slave < MODBUS_CACHE_SLAVES; slave++) {
+        if (slaves[slave] == NULL)
+            continue;
+        for (table = 0; table < MODBUS_CACHE_TABLES; table++)
+            for (page = 0; page < MODBUS_CACHE_PAGES; page++)
+                free (slaves[slave]->pages[table][page]);
+        free (slaves[slave]);
+    }
+}
+
+modbus_cache_page_t *c_modbus_cache::get_page (int slave, int table, int address, int create) {
+    modbus_cache_page_t **page;
+
+    if (slaves[slave] == NULL) {
+        if (!create)
+            return NULL;
+        slaves[slave] = (modbus_cache_slave_t *) calloc (1, sizeof (modbus_cache_slave_t));
+        if (slaves[slave] == NULL)
+            return NULL;
+    }
+
+    page = &slaves[slave]->pages[table][address >> MODBUS_CACHE_PAGE_BITS];
+    if (*page == NULL && create)
+        *page = (modbus_cache_page_t *) calloc (1, sizeof (modbus_cache_page_t));
+
+    return *page;
+}
+
+int c_modbus_cache::compare (int slave, int function, int start_addr, int nb,
+                             const uint16_t *values, modbus_delta_t *deltas) {
+    modbus_cache_page_t *page;
+    long long now = modbus_time_us ();
+    int table = function_table (function);
+    int nb_deltas = 0;
+    int offset;
+    int count;
+    int bit;
+    uint32_t mask;
+    uint16_t value;
+    uint16_t last;
+    int diff;
+    int i;
+
+    if (slave < 0 || slave >= MODBUS_CACHE_SLAVES || table < 0 ||
+            nb <= 0 || start_addr < 0 || start_addr + nb > 0x10000) {
+        fprintf (stderr, "ERROR Invalid cache update (%d values at %d)\n", nb, start_addr);
+        return INVALID_DATA;
+    }
+
+    while (nb > 0) {
+        page = get_page (slave, table, start_addr, TRUE);
+        if (page == NULL)
+            return -1;
+
+        /* Run up to the next word of the valid bits */
+        offset = start_addr & (MODBUS_CACHE_PAGE - 1);
+        bit = offset % CACHE_RUN;
+        count = CACHE_RUN - bit;
+        if (count > nb)
+            count = nb;
+        mask = (count == CACHE_RUN) ? 0xFFFFFFFF : ( ( (uint32_t) 1 << count) - 1) << bit;
+
+        if ( (page->valid[offset / CACHE_RUN] & mask) != mask ||
+                memcmp (page->values + offset, values, count * sizeof (uint16_t)) != 0) {
+            for (i = 0; i < count; i++) {
+                value = values[i];
+                last = page->values[offset + i];
+
+                if (page->valid[offset / CACHE_RUN] & ( (uint32_t) 1 << (bit + i))) {
+                    if (value == last)
+                        continue;
+                    diff = (value > last) ? value - last : last - value;
+                    if (diff <= page->deadbands[offset + i])
+                        continue;
+                } else {
+                    page->valid[offset / CACHE_RUN] |= (uint32_t) 1 << (bit + i);
+                    last = value;
+                }
+
+                page->values[offset + i] = value;
+                page->timestamps[offset + i] = now;
+                deltas[nb_deltas].slave = slave;
+                deltas[nb_deltas].function = function;
+                deltas[nb_deltas].address = start_addr + i;
+                deltas[nb_deltas].value = value;
+                deltas[nb_deltas].previous = last;
+                nb_deltas++;
+            }
+        }
+
+        start_addr += count;
+        values += count;
+        nb -= count;
+    }
+
+    return nb_deltas;
+}
+
+int c_modbus_cache::update (int slave, int function, int start_addr, int nb,
+                            const uint16_t *values, modbus_delta_t *deltas) {
+    if (function != FC_READ_HOLDING_REGISTERS && function != FC_READ_INPUT_REGISTERS) {
+        fprintf (stderr, "ERROR Function code 0x%X isn't a register read\n", function);
+        return INVALID_DATA;
+    }
+
+    return compare (slave, function, start_addr, nb, values, deltas);
+}
+
+int c_modbus_cache::update_bits (int slave, int function, int start_addr, int nb,
+                                 const uint8_t *values, modbus_delta_t *deltas) {
+    uint16_t bits[CACHE_RUN];
+    int nb_deltas = 0;
+    int count;
+    int ret;
+    int i;
+
+    if (function != FC_READ_COIL_STATUS && function != FC_READ_INPUT_STATUS) {
+        fprintf (stderr, "ERROR Function code 0x%X isn't a bit read\n", function);
+        return INVALID_DATA;
+    }
+
+    /* The bits are cached as registers */
+    while (nb > 0) {
+        count = (nb > CACHE_RUN) ? CACHE_RUN : nb;
+        for (i = 0; i < count; i++)
+            bits[i] = values[i] ? 1 : 0;
+
+        ret = compare (slave, function, start_addr, count, bits, deltas + nb_deltas);
+        if (ret < 0)
+            return ret;
+        nb_deltas += ret;
+
+        start_addr += count;
+        values += count;
+        nb -= count;
+    }
+
+    return nb_deltas;
+}
+
+int c_modbus_cache::read (c_modbus *ctx, int slave, int function, int start_addr, int nb,
+                          modbus_delta_t *deltas, int select_time) {
+    uint16_t registers[MAX_REGISTERS];
+    uint8_t bits[MAX_STATUS];
+    int status;
+
+    ctx->modbus_set_slave (slave);
+
+    switch (function) {
+    case FC_READ_COIL_STATUS:
+        status = ctx->read_coil_status (start_addr, nb, bits, select_time);
+        break;
+    case FC_READ_INPUT_STATUS:
+        status = ctx->read_input_status (start_addr, nb, bits, select_time);
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+        status = ctx->read_holding_registers_typed (start_addr, nb, registers, UINT16,
+                                                    WORD_ORDER_BIG, select_time);
+        break;
+    case FC_READ_INPUT_REGISTERS:
+        status = ctx->read_input_registers_typed (start_addr, nb, registers, UINT16,
+                                                  WORD_ORDER_BIG, select_time);
+        break;
+    default:
+        fprintf (stderr, "ERROR Function code 0x%X can't be cached\n", function);
+        return INVALID_DATA;
+    }
+
+    if (status < 0)
+        return status;
+
+    if (function == FC_READ_COIL_STATUS || function == FC_READ_INPUT_STATUS)
+        return update_bits (slave, function, start_addr, nb, bits, deltas);
+
+    return update (slave, function, start_addr, status, registers, deltas);
+}
+
+int c_modbus_cache::set_deadband (int slave, int function, int start_addr, int nb,
+                                  int deadband) {
+    modbus_cache_page_t *page;
+    int table = function_table (function);
+    int i;
+
+    if (function != FC_READ_HOLDING_REGISTERS && function != FC_READ_INPUT_REGISTERS) {
+        fprintf (stderr, "ERROR A deadband is only possible on registers\n");
+        return -1;
+    }
+
+    if (slave < 0 || slave >= MODBUS_CACHE_SLAVES || start_addr < 0 ||
+            start_addr + nb > 0x10000 || deadband < 0 || deadband > 0xFFFF) {
+        fprintf (stderr, "ERROR Invalid deadband %d (%d registers at %d)\n",
+                 deadband, nb, start_addr);
+        return -1;
+    }
+
+    for (i = start_addr; i < start_addr + nb; i++) {
+        page = get_page (slave, table, i, TRUE);
+        if (page == NULL)
+            return -1;
+        page->deadbands[i & (MODBUS_CACHE_PAGE - 1)] = deadband;
+    }
+
+    return 0;
+}
+
+int c_modbus_cache::get (int slave, int function, int address,
+                         uint16_t *value, long long *timestamp) {
+    modbus_cache_page_t *page;
+    int table = function_table (function);
+    int offset = address & (MODBUS_CACHE_PAGE - 1);
+
+    if (slave < 0 || slave >= MODBUS_CACHE_SLAVES || table < 0 ||
+            address < 0 || address > 0xFFFF)
+        return -1;
+
+    page = get_page (slave, table, address, FALSE);
+    if (page == NULL || ! (page->valid[offset / CACHE_RUN] & ( (uint32_t) 1 << (offset % CACHE_RUN))))
+        return -1;
+
+    *value = page->values[offset];
+    if (timestamp != NULL)
+        *timestamp = page->timestamps[offset];
+
+    return 0;
+}
+
+void c_modbus_cache::invalidate (int slave) {
+    int first = slave;
+    int last = slave;
+    int table;
+    int page;
+
+    if (slave == -1) {
+        first = 0;
+        last = MODBUS_CACHE_SLAVES - 1;
+    } else if (slave < 0 || slave >= MODBUS_CACHE_SLAVES) {
+        return;
+    }
+
+    /* The deadbands are kept */
+    for (slave = first; slave <= last; slave++) {
+        if (slaves[slave] == NULL)
+            continue;
+        for (table = 0; table < MODBUS_CACHE_TABLES; table++) {
+            for (page = 0; page < MODBUS_CACHE_PAGES; page++) {
+                if (slaves[slave]->pages[table][page] != NULL)
+                    memset (slaves[slave]->pages[table][page]->valid, 0,
+                            sizeof (slaves[slave]->pages[table][page]->valid));
+            }
+        }
+    }
+}
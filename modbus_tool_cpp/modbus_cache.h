@@ -0,0 +1,116 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_CACHE_H_
+#define _MODBUS_CACHE_H_
+
+#include "modbus.h"
+
+#define MODBUS_CACHE_SLAVES      256
+
+/* Coils, input status, holding registers and input registers (FC 0x01
+   to 0x04) */
+#define MODBUS_CACHE_TABLES        4
+
+/* The addresses of a table are cached by pages allocated at their first
+   update */
+#define MODBUS_CACHE_PAGE_BITS     8
+#define MODBUS_CACHE_PAGE        (1 << MODBUS_CACHE_PAGE_BITS)
+#define MODBUS_CACHE_PAGES       (0x10000 / MODBUS_CACHE_PAGE)
+
+/* A changed value */
+typedef struct
+{
+    uint8_t slave;
+    uint8_t function;
+    uint16_t address;
+    uint16_t value;
+    /* Last value reported, equal to value on the first report */
+    uint16_t previous;
+} modbus_delta_t;
+
+typedef struct
+{
+    /* Last values reported */
+    uint16_t values[MODBUS_CACHE_PAGE];
+    /* A change is only reported when it's greater than the deadband */
+    uint16_t deadbands[MODBUS_CACHE_PAGE];
+    /* One bit per address reported once */
+    uint32_t valid[MODBUS_CACHE_PAGE / 32];
+    /* Monotonic time in us of the last report */
+    long long timestamps[MODBUS_CACHE_PAGE];
+} modbus_cache_page_t;
+
+typedef struct
+{
+    modbus_cache_page_t *pages[MODBUS_CACHE_TABLES][MODBUS_CACHE_PAGES];
+} modbus_cache_slave_t;
+
+/* Last known values of the slaves, for report by exception.
+
+   Each response is compared to the cache (by blocks with memcmp first,
+   then value by value only where the blocks differ) and only the
+   changed values are given back as deltas. An analog value within its
+   deadband of the last value reported isn't reported and the cache
+   keeps the last value reported, so a slow drift is reported once it
+   exceeds the deadband. The first value of an address is always
+   reported.
+
+   The functions return the number of deltas written in deltas, which
+   must have room for nb deltas, or less than 0 on error. */
+class c_modbus_cache
+{
+public:
+
+    c_modbus_cache ();
+    ~c_modbus_cache ();
+
+    /* Compares the registers read with FC 0x03 or 0x04 to the cache */
+    int update (int slave, int function, int start_addr, int nb,
+                const uint16_t *values, modbus_delta_t *deltas);
+
+    /* Compares the bits (one per byte) read with FC 0x01 or 0x02 to the
+       cache */
+    int update_bits (int slave, int function, int start_addr, int nb,
+                     const uint8_t *values, modbus_delta_t *deltas);
+
+    /* Reads the values from the slave with ctx and updates the cache */
+    int read (c_modbus *ctx, int slave, int function, int start_addr, int nb,
+              modbus_delta_t *deltas, int select_time);
+
+    /* Sets the deadband of nb registers (0: every change is reported).
+       Returns 0 or -1 if out of memory. */
+    int set_deadband (int slave, int function, int start_addr, int nb, int deadband);
+
+    /* Gets the last value reported of an address and its time stamp.
+       Returns 0 or -1 if the value was never reported. */
+    int get (int slave, int function, int address, uint16_t *value, long long *timestamp);
+
+    /* Forgets the values of a slave (-1 for all), the next values read
+       are all reported (ex: after the loss of a slave) */
+    void invalidate (int slave);
+
+private:
+
+    modbus_cache_slave_t *slaves[MODBUS_CACHE_SLAVES];
+
+    /* Returns the page of an address, allocated when create is set */
+    modbus_cache_page_t *get_page (int slave, int table, int address, int create);
+
+    int compare (int slave, int function, int start_addr, int nb,
+                 const uint16_t *values, modbus_delta_t *deltas);
+};
+
+#endif  /* _MODBUS_CACHE_H_ */
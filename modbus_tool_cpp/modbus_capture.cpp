@@ -0,0 +1,322 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modbus_capture.h"
+
+/* The ring starts on a cache line */
+#define CAPTURE_HEADER_SIZE  ((sizeof (modbus_capture_header_t) + MODBUS_CACHE_LINE - 1) & ~(MODBUS_CACHE_LINE - 1))
+
+/* Smallest ring, a few frames of the maximum length */
+#define CAPTURE_MIN_SIZE     4096
+
+static uint64_t record_size (int msg_length) {
+    return (sizeof (modbus_capture_record_t) + msg_length + MODBUS_CAPTURE_ALIGN - 1) &
+           ~ (MODBUS_CAPTURE_ALIGN - 1);
+}
+
+static uint64_t clock_ns (clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime (clock, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+c_modbus_capture::c_modbus_capture () {
+    fd = -1;
+    map = NULL;
+    map_size = 0;
+    header = NULL;
+    ring = NULL;
+    lock = 0;
+    read_offset = 0;
+    nb_read = 0;
+}
+
+c_modbus_capture::~c_modbus_capture () {
+    close ();
+}
+
+int c_modbus_capture::open (const char *path, int size) {
+    close ();
+
+    if (size <= 0)
+        size = MODBUS_CAPTURE_DEFAULT_SIZE;
+    if (size < CAPTURE_MIN_SIZE)
+        size = CAPTURE_MIN_SIZE;
+    size &= ~ (MODBUS_CAPTURE_ALIGN - 1);
+
+    fd = ::open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf (stderr, "ERROR Can't create the capture %s (%s)\n", path, strerror (errno));
+        return -1;
+    }
+
+    map_size = CAPTURE_HEADER_SIZE + size;
+    if (ftruncate (fd, map_size) == -1) {
+        fprintf (stderr, "ERROR Can't size the capture %s (%s)\n", path, strerror (errno));
+        close ();
+        return -1;
+    }
+
+    map = (uint8_t *) mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf (stderr, "ERROR Can't map the capture %s (%s)\n", path, strerror (errno));
+        map = NULL;
+        close ();
+        return -1;
+    }
+
+    header = (modbus_capture_header_t *) map;
+    ring = map + CAPTURE_HEADER_SIZE;
+
+    header->magic = MODBUS_CAPTURE_MAGIC;
+    header->version = MODBUS_CAPTURE_VERSION;
+    header->header_size = CAPTURE_HEADER_SIZE;
+    header->size = size;
+    header->head = 0;
+    header->tail = 0;
+    header->nb_records = 0;
+    header->nb_dropped = 0;
+    header->realtime_ns = clock_ns (CLOCK_REALTIME);
+    header->monotonic_ns = clock_ns (CLOCK_MONOTONIC);
+
+    return 0;
+}
+
+int c_modbus_capture::open_read (const char *path) {
+    struct stat st;
+
+    close ();
+
+    fd = ::open (path, O_RDONLY);
+    if (fd == -1) {
+        fprintf (stderr, "ERROR Can't open the capture %s (%s)\n", path, strerror (errno));
+        return -1;
+    }
+
+    if (fstat (fd, &st) == -1 || st.st_size < (off_t) CAPTURE_HEADER_SIZE) {
+        fprintf (stderr, "ERROR %s isn't a capture\n", path);
+        close ();
+        return -1;
+    }
+
+    map_size = st.st_size;
+    /* Private, the records are never written back */
+    map = (uint8_t *) mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf (stderr, "ERROR Can't map the capture %s (%s)\n", path, strerror (errno));
+        map = NULL;
+        close ();
+        return -1;
+    }
+
+    header = (modbus_capture_header_t *) map;
+    if (header->magic != MODBUS_CAPTURE_MAGIC || header->version != MODBUS_CAPTURE_VERSION ||
+            (uint64_t) header->header_size + header->size > map_size ||
+            header->head >= header->size || header->tail >= header->size) {
+        fprintf (stderr, "ERROR %s isn't a capture (version %d)\n", path, MODBUS_CAPTURE_VERSION);
+        close ();
+        return -1;
+    }
+    ring = map + header->header_size;
+
+    rewind ();
+
+    return 0;
+}
+
+void c_modbus_capture::close () {
+    if (map != NULL)
+        munmap (map, map_size);
+    if (fd != -1)
+        ::close (fd);
+
+    fd = -1;
+    map = NULL;
+    map_size = 0;
+    header = NULL;
+    ring = NULL;
+}
+
+uint64_t c_modbus_capture::skip (uint64_t offset) {
+    modbus_capture_record_t *rec = (modbus_capture_record_t *) (ring + offset);
+
+    if (header->size - offset < sizeof (modbus_capture_record_t) ||
+            rec->length == MODBUS_CAPTURE_WRAP)
+        return 0;
+
+    offset += record_size (rec->length);
+    if (offset >= header->size)
+        offset = 0;
+
+    return offset;
+}
+
+void c_modbus_capture::evict (uint64_t offset, uint64_t end) {
+    modbus_capture_record_t *rec;
+
+    while (header->nb_records > 0 && header->tail >= offset && header->tail < end) {
+        rec = (modbus_capture_record_t *) (ring + header->tail);
+        if (header->size - header->tail < sizeof (modbus_capture_record_t) ||
+                rec->length == MODBUS_CAPTURE_WRAP) {
+            /* End of the ring, not a record */
+            header->tail = 0;
+            continue;
+        }
+        header->tail = skip (header->tail);
+        header->nb_records--;
+        header->nb_dropped++;
+    }
+}
+
+void c_modbus_capture::record (int direction, int port, const uint8_t *msg, int msg_length) {
+    modbus_capture_record_t *rec;
+    uint64_t time_ns;
+    uint64_t head;
+    uint64_t need;
+
+    if (header == NULL || msg_length <= 0)
+        return;
+
+    /* Before the lock, the time of the frame */
+    time_ns = clock_ns (CLOCK_MONOTONIC);
+    if (msg_length > MAX_MESSAGE_LENGTH)
+        msg_length = MAX_MESSAGE_LENGTH;
+    need = record_size (msg_length);
+
+    while (__sync_lock_test_and_set (&lock, 1))
+        ;
+
+    head = header->head;
+    if (head + need > header->size) {
+        /* Closes the end of the ring and starts again at 0 */
+        evict (head, header->size);
+        if (header->size - head >= sizeof (modbus_capture_record_t))
+            ( (modbus_capture_record_t *) (ring + head))->length = MODBUS_CAPTURE_WRAP;
+        head = 0;
+    }
+    evict (head, head + need);
+    if (header->nb_records == 0)
+        header->tail = head;
+
+    rec = (modbus_capture_record_t *) (ring + head);
+    rec->time_ns = time_ns;
+    rec->length = msg_length;
+    rec->direction = direction;
+    rec->port = port;
+    rec->sequence = (uint32_t) (header->nb_records + header->nb_dropped);
+    memcpy (rec + 1, msg, msg_length);
+
+    /* The record is complete before the header shows it */
+    __sync_synchronize ();
+    head += need;
+    header->head = (head >= header->size) ? 0 : head;
+    header->nb_records++;
+
+    __sync_lock_release (&lock);
+}
+
+int c_modbus_capture::next (modbus_capture_record_t *record, uint8_t *msg) {
+    modbus_capture_record_t *rec;
+
+    if (header == NULL || nb_read >= header->nb_records)
+        return 0;
+
+    rec = (modbus_capture_record_t *) (ring + read_offset);
+    if (header->size - read_offset < sizeof (modbus_capture_record_t) ||
+            rec->length == MODBUS_CAPTURE_WRAP) {
+        read_offset = 0;
+        rec = (modbus_capture_record_t *) ring;
+    }
+
+    if (rec->length > MAX_MESSAGE_LENGTH ||
+            read_offset + record_size (rec->length) > header->size) {
+        fprintf (stderr, "ERROR Corrupted record %llu of the capture\n",
+                 (unsigned long long) nb_read);
+        nb_read = header->nb_records;
+        return 0;
+    }
+
+    memcpy (record, rec, sizeof (modbus_capture_record_t));
+    memcpy (msg, rec + 1, rec->length);
+
+    read_offset = skip (read_offset);
+    nb_read++;
+
+    return record->length;
+}
+
+void c_modbus_capture::rewind () {
+    if (header == NULL)
+        return;
+
+    read_offset = header->tail;
+    nb_read = 0;
+}
+
+const modbus_capture_header_t *c_modbus_capture::get_header () {
+    return header;
+}
+
+void c_modbus_capture::dump (FILE *fp) {
+    modbus_capture_record_t rec;
+    uint8_t msg[MAX_MESSAGE_LENGTH];
+    uint64_t first_ns = 0;
+    uint64_t time_ns;
+    time_t seconds;
+    struct tm tm;
+    char s_time[32];
+    int length;
+    int i;
+
+    if (header == NULL)
+        return;
+
+    fprintf (fp, "%llu records (%llu overwritten)\n",
+             (unsigned long long) header->nb_records,
+             (unsigned long long) header->nb_dropped);
+
+    rewind ();
+    while ( (length = next (&rec, msg)) > 0) {
+        if (first_ns == 0)
+            first_ns = rec.time_ns;
+
+        /* Time of day of the frame and time since the first one */
+        time_ns = header->realtime_ns + (rec.time_ns - header->monotonic_ns);
+        seconds = time_ns / 1000000000;
+        localtime_r (&seconds, &tm);
+        strftime (s_time, sizeof (s_time), "%Y-%m-%d %H:%M:%S", &tm);
+
+        fprintf (fp, "%s.%06llu +%10.6f #%u port %d %s", s_time,
+                 (unsigned long long) (time_ns % 1000000000) / 1000,
+                 (rec.time_ns - first_ns) / 1e9, rec.sequence, rec.port,
+                 (rec.direction == MODBUS_CAPTURE_TX) ? "tx" : "rx");
+        for (i = 0; i < length; i++)
+            fprintf (fp, " %.2X", msg[i]);
+        fprintf (fp, "\n");
+    }
+    rewind ();
+}
@@ -0,0 +1,138 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_CAPTURE_H_
+#define _MODBUS_CAPTURE_H_
+
+#include <stdio.h>
+
+#include "modbus.h"
+
+/* "MBCP" */
+#define MODBUS_CAPTURE_MAGIC         0x5043424D
+#define MODBUS_CAPTURE_VERSION       1
+
+/* Size of the ring of the records in bytes */
+#define MODBUS_CAPTURE_DEFAULT_SIZE  (4 * 1024 * 1024)
+
+/* The records start on 8 bytes */
+#define MODBUS_CAPTURE_ALIGN         8
+
+/* Length of the record closing the end of the ring */
+#define MODBUS_CAPTURE_WRAP          0xFFFF
+
+/* Direction of a frame relatively to the port capturing it */
+#define MODBUS_CAPTURE_TX            0
+#define MODBUS_CAPTURE_RX            1
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    /* Offset of the ring in the file */
+    uint16_t header_size;
+    /* Size of the ring */
+    uint32_t size;
+    uint32_t reserved;
+    /* Offsets in the ring of the next record and of the oldest one */
+    uint64_t head;
+    uint64_t tail;
+    uint64_t nb_records;
+    /* Records overwritten by the ring */
+    uint64_t nb_dropped;
+    /* Clocks when the capture was opened, to convert the time stamps
+       of the records to the time of day */
+    uint64_t realtime_ns;
+    uint64_t monotonic_ns;
+} modbus_capture_header_t;
+
+typedef struct
+{
+    /* Monotonic clock in ns */
+    uint64_t time_ns;
+    /* Length of the ADU following the record */
+    uint16_t length;
+    uint8_t direction;
+    uint8_t port;
+    uint32_t sequence;
+} modbus_capture_record_t;
+
+/* Capture of the frames of one or several c_modbus in a ring of records
+   mapped from a file.
+
+   Given to a context with modbus_set_capture, every ADU sent or received
+   is copied to the ring with its time stamp, direction and port: no
+   formatting nor system call on the way, so the timing of the bus stays
+   as it is without capture. When the ring is full, the oldest records
+   are overwritten. The file stays readable after a crash of the
+   process, the header is updated with each record.
+
+   The contexts recording in a capture can run in different threads. */
+class c_modbus_capture
+{
+public:
+
+    c_modbus_capture ();
+    ~c_modbus_capture ();
+
+    /* Creates (or truncates) the file of the capture, size is the size
+       of the ring (<= 0 for MODBUS_CAPTURE_DEFAULT_SIZE).
+       Returns 0 or -1 on failure. */
+    int open (const char *path, int size);
+
+    /* Opens a capture to read its records.
+       Returns 0 or -1 on failure. */
+    int open_read (const char *path);
+
+    void close ();
+
+    /* Appends a frame */
+    void record (int direction, int port, const uint8_t *msg, int msg_length);
+
+    /* Copies the next record from the oldest one and its ADU in msg
+       (MAX_MESSAGE_LENGTH bytes).
+       Returns the length of the ADU or 0 after the last record. */
+    int next (modbus_capture_record_t *record, uint8_t *msg);
+
+    /* Goes back to the oldest record */
+    void rewind ();
+
+    /* Returns NULL if not opened */
+    const modbus_capture_header_t *get_header ();
+
+    /* Prints the records, one per line */
+    void dump (FILE *fp);
+
+private:
+
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    modbus_capture_header_t *header;
+    uint8_t *ring;
+    volatile int lock;
+
+    /* Position of next () */
+    uint64_t read_offset;
+    uint64_t nb_read;
+
+    /* Offset of the record after the one at offset */
+    uint64_t skip (uint64_t offset);
+
+    /* Overwrites the oldest records from offset to end */
+    void evict (uint64_t offset, uint64_t end);
+};
+
+#endif  /* _MODBUS_CAPTURE_H_ */
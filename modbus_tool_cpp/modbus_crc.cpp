@@ -0,0 +1,399 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   CRC16 of the RTU frames (polynomial 0x8005 reflected, initial value
+   0xFFFF).
+
+   The slicing engines process 4 or 8 bytes per step with one table per
+   byte position. The carry-less multiply engine reduces 8 bytes per step
+   with a Barrett reduction: for w = crc ^ 8 bytes of data (little
+   endian),
+
+       T1  = clmul (w, mu) mod x^64         mu = reflected x^80 / P
+       crc = clmul (T1, P') / x^64          P' = 0x14003 (P reflected)
+
+   The tables are built and the engine is picked once, at the first call,
+   from the CPU features (modbus_crc16_set_engine to force one).
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "modbus.h"
+#include "modbus_crc.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CRC16_CLMUL_X86
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#elif (defined(__aarch64__) && __GNUC__ >= 6) || \
+    (defined(__arm__) && (defined(__ARM_FEATURE_CRYPTO) || __GNUC__ >= 8))
+/* On 32 bits ARM the build targets a plain ARMv7 FPU, only the PMULL
+   kernel is compiled for the crypto extension (GCC 8 or later accepts
+   the fpu target attribute) and it's picked at run time from AT_HWCAP2 */
+#define CRC16_CLMUL_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef AT_HWCAP2
+#define AT_HWCAP2 26
+#endif
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#undef CRC16_CLMUL_X86
+#undef CRC16_CLMUL_ARM
+#endif
+
+/* Barrett constants, see above */
+#define CRC16_CLMUL_MU    0xF0FFEBFFCFFFBFFFULL
+#define CRC16_CLMUL_POLY  0x14003ULL
+
+/* Table of CRC values for high-order byte */
+static const uint8_t table_crc_hi[] = {
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
+};
+
+/* Table of CRC values for low-order byte */
+static const uint8_t table_crc_lo[] = {
+    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
+    0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
+    0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
+    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
+    0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
+    0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
+    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
+    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
+    0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
+    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
+    0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
+    0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
+    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
+    0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
+    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
+    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
+    0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
+    0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
+    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
+    0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
+    0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
+    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
+    0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
+    0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
+    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
+    0x43, 0x83, 0x41, 0x81, 0x80, 0x40
+};
+
+/* Tables of the slicing engines, table_slice[k][i] is the CRC of the byte
+   i followed by k null bytes (computed by crc16_build_tables) */
+static uint16_t table_slice[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void crc16_build_tables () {
+    int i;
+    int k;
+
+    for (i = 0; i < 256; i++) {
+        uint16_t crc = i;
+
+        for (k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        table_slice[0][i] = crc;
+    }
+
+    for (k = 1; k < 8; k++) {
+        for (i = 0; i < 256; i++) {
+            uint16_t crc = table_slice[k - 1][i];
+
+            table_slice[k][i] = (crc >> 8) ^ table_slice[0][crc & 0xFF];
+        }
+    }
+}
+
+static inline void crc16_init_tables () {
+    pthread_once (&tables_once, crc16_build_tables);
+}
+
+/* The frame stores the low byte of the CRC first, the historical API
+   returns it as the high byte */
+static inline uint16_t crc16_result (uint16_t crc) {
+    return (crc << 8) | (crc >> 8);
+}
+
+static inline uint16_t crc16_bytes (uint16_t crc, const uint8_t *buffer, int length) {
+    while (length--)
+        crc = (crc >> 8) ^ table_slice[0][ (crc ^ *buffer++) & 0xFF];
+
+    return crc;
+}
+
+uint16_t modbus_crc16_table (const uint8_t *buffer, uint16_t buffer_length) {
+    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
+    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
+    unsigned int i; /* will index into CRC lookup */
+
+    /* pass through message buffer */
+    while (buffer_length--) {
+        i = crc_hi ^ *buffer++; /* calculate the CRC  */
+        crc_hi = crc_lo ^ table_crc_hi[i];
+        crc_lo = table_crc_lo[i];
+    }
+
+    return (crc_hi << 8 | crc_lo);
+}
+
+uint16_t modbus_crc16_slice4 (const uint8_t *buffer, uint16_t buffer_length) {
+    uint16_t crc = 0xFFFF;
+    int length = buffer_length;
+
+    crc16_init_tables ();
+
+    while (length >= 4) {
+        crc ^= buffer[0] | (buffer[1] << 8);
+        crc = table_slice[3][crc & 0xFF] ^ table_slice[2][crc >> 8] ^
+              table_slice[1][buffer[2]] ^ table_slice[0][buffer[3]];
+        buffer += 4;
+        length -= 4;
+    }
+
+    return crc16_result (crc16_bytes (crc, buffer, length));
+}
+
+uint16_t modbus_crc16_slice8 (const uint8_t *buffer, uint16_t buffer_length) {
+    uint16_t crc = 0xFFFF;
+    int length = buffer_length;
+
+    crc16_init_tables ();
+
+    while (length >= 8) {
+        crc ^= buffer[0] | (buffer[1] << 8);
+        crc = table_slice[7][crc & 0xFF] ^ table_slice[6][crc >> 8] ^
+              table_slice[5][buffer[2]] ^ table_slice[4][buffer[3]] ^
+              table_slice[3][buffer[4]] ^ table_slice[2][buffer[5]] ^
+              table_slice[1][buffer[6]] ^ table_slice[0][buffer[7]];
+        buffer += 8;
+        length -= 8;
+    }
+
+    return crc16_result (crc16_bytes (crc, buffer, length));
+}
+
+#if defined(CRC16_CLMUL_X86)
+
+__attribute__ ( (target ("sse2,pclmul")))
+static uint16_t crc16_clmul_blocks (uint16_t crc, const uint8_t *buffer, int nb_blocks) {
+    const __m128i mu = _mm_set_epi32 (0, 0, (int) (CRC16_CLMUL_MU >> 32), (int) CRC16_CLMUL_MU);
+    const __m128i poly = _mm_set_epi32 (0, 0, 0, (int) CRC16_CLMUL_POLY);
+    __m128i w;
+    __m128i t;
+
+    while (nb_blocks--) {
+        w = _mm_loadl_epi64 ( (const __m128i *) buffer);
+        w = _mm_xor_si128 (w, _mm_cvtsi32_si128 (crc));
+        t = _mm_move_epi64 (_mm_clmulepi64_si128 (w, mu, 0x00));
+        t = _mm_clmulepi64_si128 (t, poly, 0x00);
+        crc = _mm_extract_epi16 (t, 4);
+        buffer += 8;
+    }
+
+    return crc;
+}
+
+static int crc16_clmul_supported () {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+        return FALSE;
+
+    return (ecx & bit_PCLMUL) && (edx & bit_SSE2);
+}
+
+#elif defined(CRC16_CLMUL_ARM)
+
+#if defined(__aarch64__)
+__attribute__ ( (target ("+crypto")))
+#elif !defined(__ARM_FEATURE_CRYPTO)
+__attribute__ ( (target ("fpu=crypto-neon-fp-armv8")))
+#endif
+static uint16_t crc16_clmul_blocks (uint16_t crc, const uint8_t *buffer, int nb_blocks) {
+    uint64_t w;
+    uint64_t t;
+
+    while (nb_blocks--) {
+        memcpy (&w, buffer, sizeof (w));
+        w ^= crc;
+        t = vgetq_lane_u64 (vreinterpretq_u64_p128 (
+                                vmull_p64 ( (poly64_t) w, (poly64_t) CRC16_CLMUL_MU)), 0);
+        t = vgetq_lane_u64 (vreinterpretq_u64_p128 (
+                                vmull_p64 ( (poly64_t) t, (poly64_t) CRC16_CLMUL_POLY)), 1);
+        crc = (uint16_t) t;
+        buffer += 8;
+    }
+
+    return crc;
+}
+
+static int crc16_clmul_supported () {
+#if defined(__aarch64__)
+    /* HWCAP_PMULL */
+    return (getauxval (AT_HWCAP) & (1 << 4)) != 0;
+#else
+    /* HWCAP2_PMULL */
+    return (getauxval (AT_HWCAP2) & (1 << 1)) != 0;
+#endif
+}
+
+#endif
+
+uint16_t modbus_crc16_clmul (const uint8_t *buffer, uint16_t buffer_length) {
+#if defined(CRC16_CLMUL_X86) || defined(CRC16_CLMUL_ARM)
+    uint16_t crc;
+
+    crc16_init_tables ();
+    crc = crc16_clmul_blocks (0xFFFF, buffer, buffer_length / 8);
+
+    return crc16_result (crc16_bytes (crc, buffer + (buffer_length & ~7),
+                                      buffer_length & 7));
+#else
+    return modbus_crc16_slice8 (buffer, buffer_length);
+#endif
+}
+
+int modbus_crc16_engine_supported (crc16_engine_t engine) {
+    switch (engine) {
+    case CRC16_ENGINE_AUTO:
+    case CRC16_ENGINE_TABLE:
+    case CRC16_ENGINE_SLICE4:
+    case CRC16_ENGINE_SLICE8:
+        return TRUE;
+    case CRC16_ENGINE_CLMUL:
+#if defined(CRC16_CLMUL_X86) || defined(CRC16_CLMUL_ARM)
+        return crc16_clmul_supported ();
+#else
+        return FALSE;
+#endif
+    }
+
+    return FALSE;
+}
+
+static uint16_t (*crc16_func) (const uint8_t *, uint16_t) = modbus_crc16_slice8;
+static crc16_engine_t crc16_engine = CRC16_ENGINE_AUTO;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static void crc16_select_engine (crc16_engine_t engine) {
+    if (engine == CRC16_ENGINE_AUTO) {
+        if (modbus_crc16_engine_supported (CRC16_ENGINE_CLMUL))
+            engine = CRC16_ENGINE_CLMUL;
+        else
+            engine = CRC16_ENGINE_SLICE8;
+    }
+
+    crc16_init_tables ();
+
+    switch (engine) {
+    case CRC16_ENGINE_TABLE:
+        crc16_func = modbus_crc16_table;
+        break;
+    case CRC16_ENGINE_SLICE4:
+        crc16_func = modbus_crc16_slice4;
+        break;
+    case CRC16_ENGINE_CLMUL:
+        crc16_func = modbus_crc16_clmul;
+        break;
+    case CRC16_ENGINE_SLICE8:
+    default:
+        crc16_func = modbus_crc16_slice8;
+        break;
+    }
+    crc16_engine = engine;
+}
+
+static void crc16_auto_engine () {
+    crc16_select_engine (CRC16_ENGINE_AUTO);
+}
+
+/* Picks the automatic engine once, before the first CRC or the first
+   modbus_crc16_set_engine (which then overrides it) */
+static inline void crc16_init_engine () {
+    pthread_once (&engine_once, crc16_auto_engine);
+}
+
+int modbus_crc16_set_engine (crc16_engine_t engine) {
+    if (!modbus_crc16_engine_supported (engine))
+        return -1;
+
+    crc16_init_engine ();
+    crc16_select_engine (engine);
+
+    return 0;
+}
+
+crc16_engine_t modbus_crc16_get_engine () {
+    crc16_init_engine ();
+
+    return crc16_engine;
+}
+
+const char *modbus_crc16_engine_name (crc16_engine_t engine) {
+    switch (engine) {
+    case CRC16_ENGINE_AUTO:
+        return "auto";
+    case CRC16_ENGINE_TABLE:
+        return "table";
+    case CRC16_ENGINE_SLICE4:
+        return "slice-by-4";
+    case CRC16_ENGINE_SLICE8:
+        return "slice-by-8";
+    case CRC16_ENGINE_CLMUL:
+        return "clmul";
+    }
+
+    return "unknown";
+}
+
+uint16_t modbus_crc16 (const uint8_t *buffer, uint16_t buffer_length) {
+    crc16_init_engine ();
+
+    return crc16_func (buffer, buffer_length);
+}
@@ -0,0 +1,61 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_CRC_H_
+#define _MODBUS_CRC_H_
+
+#include <stdint.h>
+
+/* CRC16 engines, all of them return the same value as the historical
+   table version: high byte first in the frame, low byte last. */
+typedef enum
+{
+    /* Fastest engine supported by the CPU, picked at the first call */
+    CRC16_ENGINE_AUTO = 0,
+    /* One byte per step, two tables of 256 bytes */
+    CRC16_ENGINE_TABLE,
+    /* Four bytes per step, 2 KB of tables */
+    CRC16_ENGINE_SLICE4,
+    /* Eight bytes per step, 4 KB of tables */
+    CRC16_ENGINE_SLICE8,
+    /* Eight bytes per step with the carry-less multiply of the CPU
+       (PCLMULQDQ on x86, PMULL on ARMv8) */
+    CRC16_ENGINE_CLMUL
+} crc16_engine_t;
+
+/* Computes the CRC16 of a RTU frame with the selected engine */
+uint16_t modbus_crc16 (const uint8_t *buffer, uint16_t buffer_length);
+
+uint16_t modbus_crc16_table (const uint8_t *buffer, uint16_t buffer_length);
+uint16_t modbus_crc16_slice4 (const uint8_t *buffer, uint16_t buffer_length);
+uint16_t modbus_crc16_slice8 (const uint8_t *buffer, uint16_t buffer_length);
+
+/* Only available if modbus_crc16_engine_supported (CRC16_ENGINE_CLMUL) */
+uint16_t modbus_crc16_clmul (const uint8_t *buffer, uint16_t buffer_length);
+
+/* Returns TRUE if the engine can run on this CPU */
+int modbus_crc16_engine_supported (crc16_engine_t engine);
+
+/* Selects the engine used by modbus_crc16 (CRC16_ENGINE_AUTO to let the
+   library choose). Returns 0 on success or -1 if the engine is not
+   supported by this CPU. */
+int modbus_crc16_set_engine (crc16_engine_t engine);
+
+/* Engine used by modbus_crc16 */
+crc16_engine_t modbus_crc16_get_engine ();
+
+const char *modbus_crc16_engine_name (crc16_engine_t engine);
+
+#endif  /* _MODBUS_CRC_H_ */
@@ -0,0 +1,220 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   On a little endian CPU every conversion is a swap of the bytes of the
+   registers followed, for the big word order, by a reverse of the
+   registers of each value:
+   - 16 bits: AB          -> BA
+   - 32 bits: AB CD       -> DC BA     (swapped: CD AB    -> BA DC)
+   - 64 bits: AB CD EF GH -> HG FE DC BA (swapped: GH EF CD AB -> BA DC FE HG)
+   SSE2 does it with shifts and 16 bits shuffles (always available on
+   x86-64), NEON with the vrev instructions.
+*/
+
+#include <string.h>
+
+#include "modbus.h"
+#include "modbus_decode.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DECODE_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+#include <arm_neon.h>
+#define DECODE_NEON
+#endif
+
+#ifdef DECODE_SSE2
+static inline __m128i swap_bytes_16 (__m128i v) {
+    return _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+}
+#endif
+
+void modbus_decode_8 (const uint8_t *src, int nb, void *dest) {
+    memcpy (dest, src, nb);
+}
+
+void modbus_decode_16 (const uint8_t *src, int nb, void *dest) {
+    uint8_t *d = (uint8_t *) dest;
+    uint16_t value;
+    int i = 0;
+
+#if defined(DECODE_SSE2)
+    for (; i + 8 <= nb; i += 8) {
+        __m128i v = _mm_loadu_si128 ( (const __m128i *) (src + 2 * i));
+        _mm_storeu_si128 ( (__m128i *) (d + 2 * i), swap_bytes_16 (v));
+    }
+#elif defined(DECODE_NEON)
+    for (; i + 8 <= nb; i += 8)
+        vst1q_u8 (d + 2 * i, vrev16q_u8 (vld1q_u8 (src + 2 * i)));
+#endif
+
+    for (; i < nb; i++) {
+        value = (src[2 * i] << 8) | src[2 * i + 1];
+        memcpy (d + 2 * i, &value, 2);
+    }
+}
+
+void modbus_encode_16 (const void *src, int nb, uint8_t *dest) {
+    const uint8_t *s = (const uint8_t *) src;
+    uint16_t value;
+    int i = 0;
+
+#if defined(DECODE_SSE2)
+    for (; i + 8 <= nb; i += 8) {
+        __m128i v = _mm_loadu_si128 ( (const __m128i *) (s + 2 * i));
+        _mm_storeu_si128 ( (__m128i *) (dest + 2 * i), swap_bytes_16 (v));
+    }
+#elif defined(DECODE_NEON)
+    for (; i + 8 <= nb; i += 8)
+        vst1q_u8 (dest + 2 * i, vrev16q_u8 (vld1q_u8 (s + 2 * i)));
+#endif
+
+    for (; i < nb; i++) {
+        memcpy (&value, s + 2 * i, 2);
+        dest[2 * i] = value >> 8;
+        dest[2 * i + 1] = value & 0xFF;
+    }
+}
+
+void modbus_decode_32 (const uint8_t *src, int nb, void *dest, int word_order) {
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s;
+    uint32_t value;
+    int i = 0;
+
+#if defined(DECODE_SSE2)
+    if (word_order == WORD_ORDER_BIG) {
+        for (; i + 4 <= nb; i += 4) {
+            __m128i v = swap_bytes_16 (_mm_loadu_si128 ( (const __m128i *) (src + 4 * i)));
+            v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+            v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (2, 3, 0, 1));
+            _mm_storeu_si128 ( (__m128i *) (d + 4 * i), v);
+        }
+    } else {
+        for (; i + 4 <= nb; i += 4) {
+            __m128i v = _mm_loadu_si128 ( (const __m128i *) (src + 4 * i));
+            _mm_storeu_si128 ( (__m128i *) (d + 4 * i), swap_bytes_16 (v));
+        }
+    }
+#elif defined(DECODE_NEON)
+    if (word_order == WORD_ORDER_BIG) {
+        for (; i + 4 <= nb; i += 4)
+            vst1q_u8 (d + 4 * i, vrev32q_u8 (vld1q_u8 (src + 4 * i)));
+    } else {
+        for (; i + 4 <= nb; i += 4)
+            vst1q_u8 (d + 4 * i, vrev16q_u8 (vld1q_u8 (src + 4 * i)));
+    }
+#endif
+
+    for (; i < nb; i++) {
+        s = src + 4 * i;
+        if (word_order == WORD_ORDER_BIG)
+            value = ( (uint32_t) s[0] << 24) | (s[1] << 16) | (s[2] << 8) | s[3];
+        else
+            value = ( (uint32_t) s[2] << 24) | (s[3] << 16) | (s[0] << 8) | s[1];
+        memcpy (d + 4 * i, &value, 4);
+    }
+}
+
+void modbus_decode_64 (const uint8_t *src, int nb, void *dest, int word_order) {
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s;
+    uint64_t value;
+    int i = 0;
+    int k;
+
+#if defined(DECODE_SSE2)
+    if (word_order == WORD_ORDER_BIG) {
+        for (; i + 2 <= nb; i += 2) {
+            __m128i v = swap_bytes_16 (_mm_loadu_si128 ( (const __m128i *) (src + 8 * i)));
+            v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+            v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE (0, 1, 2, 3));
+            _mm_storeu_si128 ( (__m128i *) (d + 8 * i), v);
+        }
+    } else {
+        for (; i + 2 <= nb; i += 2) {
+            __m128i v = _mm_loadu_si128 ( (const __m128i *) (src + 8 * i));
+            _mm_storeu_si128 ( (__m128i *) (d + 8 * i), swap_bytes_16 (v));
+        }
+    }
+#elif defined(DECODE_NEON)
+    if (word_order == WORD_ORDER_BIG) {
+        for (; i + 2 <= nb; i += 2)
+            vst1q_u8 (d + 8 * i, vrev64q_u8 (vld1q_u8 (src + 8 * i)));
+    } else {
+        for (; i + 2 <= nb; i += 2)
+            vst1q_u8 (d + 8 * i, vrev16q_u8 (vld1q_u8 (src + 8 * i)));
+    }
+#endif
+
+    for (; i < nb; i++) {
+        s = src + 8 * i;
+        value = 0;
+        for (k = 0; k < 4; k++) {
+            /* Register k of the value */
+            int r = (word_order == WORD_ORDER_BIG) ? k : 3 - k;
+
+            value = (value << 16) | (uint64_t) ( (s[2 * r] << 8) | s[2 * r + 1]);
+        }
+        memcpy (d + 8 * i, &value, 8);
+    }
+}
+
+int modbus_data_type_size (uint8_t data_type) {
+    switch (data_type) {
+    case INT8:
+    case UINT8:
+        return 1;
+    case INT16:
+    case UINT16:
+        return 2;
+    case INT32:
+    case UINT32:
+    case FLOAT:
+        return 4;
+    case INT64:
+    case UINT64:
+    case DOUBLE:
+        return 8;
+    }
+
+    return 0;
+}
+
+int modbus_decode_type (uint8_t data_type, int word_order,
+                        const uint8_t *src, int nb_bytes, void *dest) {
+    int size = modbus_data_type_size (data_type);
+
+    if (size == 0)
+        return -1;
+
+    /* The signed and unsigned types share the same bits */
+    switch (size) {
+    case 1:
+        return modbus_decode<uint8_t, WORD_ORDER_BIG> (src, nb_bytes, (uint8_t *) dest);
+    case 2:
+        return modbus_decode<uint16_t, WORD_ORDER_BIG> (src, nb_bytes, (uint16_t *) dest);
+    case 4:
+        if (word_order == WORD_ORDER_SWAPPED)
+            return modbus_decode<uint32_t, WORD_ORDER_SWAPPED> (src, nb_bytes, (uint32_t *) dest);
+        return modbus_decode<uint32_t, WORD_ORDER_BIG> (src, nb_bytes, (uint32_t *) dest);
+    default:
+        if (word_order == WORD_ORDER_SWAPPED)
+            return modbus_decode<uint64_t, WORD_ORDER_SWAPPED> (src, nb_bytes, (uint64_t *) dest);
+        return modbus_decode<uint64_t, WORD_ORDER_BIG> (src, nb_bytes, (uint64_t *) dest);
+    }
+}
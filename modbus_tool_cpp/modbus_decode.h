@@ -0,0 +1,97 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_DECODE_H_
+#define _MODBUS_DECODE_H_
+
+#include <stdint.h>
+
+/* Order of the registers of the 32 and 64 bits values */
+/* High register first (ABCD), the order of the Modbus specification */
+#define WORD_ORDER_BIG      0
+/* Low register first (CDAB), used by many PLCs and energy meters */
+#define WORD_ORDER_SWAPPED  1
+
+/* Block decoding of the register payloads (big endian bytes).
+
+   The kernels convert a whole payload to native values: with SSE2 (x86)
+   or NEON (ARM) 16 bytes are swapped per step, the remaining values are
+   assembled one by one. dest doesn't need to be aligned.
+
+   nb is the number of values. */
+void modbus_decode_8 (const uint8_t *src, int nb, void *dest);
+void modbus_decode_16 (const uint8_t *src, int nb, void *dest);
+void modbus_decode_32 (const uint8_t *src, int nb, void *dest, int word_order);
+void modbus_decode_64 (const uint8_t *src, int nb, void *dest, int word_order);
+
+/* The other way: nb native registers of src to big endian bytes, for
+   the responses of a slave. src doesn't need to be aligned. */
+void modbus_encode_16 (const void *src, int nb, uint8_t *dest);
+
+/* Kernel of a size of value, selected at compile time */
+template <int SIZE>
+struct modbus_decode_kernel {
+};
+
+template <>
+struct modbus_decode_kernel<1> {
+    static void run (const uint8_t *src, int nb, void *dest, int) {
+        modbus_decode_8 (src, nb, dest);
+    }
+};
+
+template <>
+struct modbus_decode_kernel<2> {
+    static void run (const uint8_t *src, int nb, void *dest, int) {
+        modbus_decode_16 (src, nb, dest);
+    }
+};
+
+template <>
+struct modbus_decode_kernel<4> {
+    static void run (const uint8_t *src, int nb, void *dest, int word_order) {
+        modbus_decode_32 (src, nb, dest, word_order);
+    }
+};
+
+template <>
+struct modbus_decode_kernel<8> {
+    static void run (const uint8_t *src, int nb, void *dest, int word_order) {
+        modbus_decode_64 (src, nb, dest, word_order);
+    }
+};
+
+/* Decodes the nb_bytes of a payload as values of type T (int8_t to
+   uint64_t, float, double) in the word order WORD_ORDER.
+   Returns the number of values decoded. */
+template <typename T, int WORD_ORDER>
+int modbus_decode (const uint8_t *src, int nb_bytes, T *dest) {
+    int nb = nb_bytes / (int) sizeof (T);
+
+    modbus_decode_kernel<sizeof (T)>::run (src, nb, dest, WORD_ORDER);
+
+    return nb;
+}
+
+/* Same as modbus_decode for a data type known at run time (INT8 to
+   DOUBLE of modbus.h), dest must be an array of that type.
+   Returns the number of values decoded or -1 if the type is invalid. */
+int modbus_decode_type (uint8_t data_type, int word_order,
+                        const uint8_t *src, int nb_bytes, void *dest);
+
+/* Size in bytes of a data type, 0 if invalid */
+int modbus_data_type_size (uint8_t data_type);
+
+#endif  /* _MODBUS_DECODE_H_ */
@@ -0,0 +1,316 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/select.h>
+
+#include "modbus_fanout.h"
+#include "modbus_bits.h"
+#include "modbus_stats.h"
+
+c_modbus_fanout::c_modbus_fanout (int max_targets) {
+    if (max_targets <= 0)
+        max_targets = MODBUS_FANOUT_DEFAULT_TARGETS;
+
+    nb = 0;
+    targets = (modbus_fanout_target_t *) calloc (max_targets, sizeof (modbus_fanout_target_t));
+    /* A query and a response per target */
+    pool = new c_modbus_pool (max_targets * 2);
+    if (targets == NULL || pool->nb_buffers () < max_targets * 2)
+        max_targets = 0;
+    this->max_targets = max_targets;
+}
+
+c_modbus_fanout::~c_modbus_fanout () {
+    free (targets);
+    delete pool;
+}
+
+int c_modbus_fanout::add (c_modbus *ctx) {
+    modbus_fanout_target_t *target;
+
+    if (nb >= max_targets) {
+        fprintf (stderr, "ERROR Too many fan-out targets (%d)\n", max_targets);
+        return -1;
+    }
+
+    if (ctx->mb_param->fd < 0) {
+        fprintf (stderr, "ERROR Fan-out target not connected\n");
+        return -1;
+    }
+
+    if (ctx->mb_param->fd > FD_SETSIZE - 1) {
+        fprintf (stderr, "ERROR Descriptor %d of the fan-out target too large for select\n",
+                 ctx->mb_param->fd);
+        return -1;
+    }
+
+    target = &targets[nb];
+    target->ctx = ctx;
+    target->query = pool->lease ();
+    target->response = pool->lease ();
+    target->status = 0;
+    target->pending = FALSE;
+
+    return nb++;
+}
+
+int c_modbus_fanout::nb_targets () {
+    return nb;
+}
+
+int c_modbus_fanout::get_status (int target) {
+    if (target < 0 || target >= nb)
+        return INVALID_DATA;
+
+    return targets[target].status;
+}
+
+int c_modbus_fanout::decode_response (modbus_fanout_target_t *target, int response_length) {
+    c_modbus *ctx = target->ctx;
+    int offset = (ctx->mb_param->type_com == RTU) ? HEADER_LENGTH_RTU : HEADER_LENGTH_TCP;
+    int function = target->query[offset];
+
+    if (response_length < 0)
+        return response_length;
+
+    if (ctx->check_response_length (target->query, target->response, response_length) < 0)
+        return INVALID_DATA;
+
+    if (target->response[offset] == 0x80 + function)
+        return ctx->check_response_exception (target->query, target->response);
+
+    if (target->response[offset] != function) {
+        ctx->error_treat (INVALID_DATA, "fanout: function code not corresponding to the query");
+        return INVALID_DATA;
+    }
+
+    return ctx->check_response_quantity (target->query, target->response, UINT16,
+                                         response_length);
+}
+
+/* Records the transaction of a target in the statistics of its context */
+void c_modbus_fanout::record (modbus_fanout_target_t *target, int response_length) {
+    c_modbus *ctx = target->ctx;
+    int offset = (ctx->mb_param->type_com == RTU) ? HEADER_LENGTH_RTU : HEADER_LENGTH_TCP;
+
+    if (ctx->stats == NULL)
+        return;
+
+    if (target->broadcast)
+        ctx->stats->record_broadcast (target->query[offset - 1], target->query[offset],
+                                      ctx->stats_tx_bytes);
+    else
+        ctx->stats->record (target->query[offset - 1], target->query[offset], target->status,
+                            modbus_time_us () - ctx->stats_send_us, ctx->stats_tx_bytes,
+                            response_length > 0 ? response_length : 0);
+}
+
+/* Sends the query to all the targets, then receives the responses */
+int c_modbus_fanout::write (int function, int addr, int nb_values, const uint8_t *data,
+                            int data_length, int select_time) {
+    modbus_fanout_target_t *target;
+    c_modbus *ctx;
+    int query_length;
+    int nb_pending = 0;
+    int nb_ok = 0;
+    int ret;
+    int i;
+    int max_fd;
+    long long now;
+    long long timeout_us;
+    fd_set rfds;
+    struct timeval tv;
+
+    for (i = 0; i < nb; i++) {
+        target = &targets[i];
+        ctx = target->ctx;
+
+        /* Closed on an error since the previous write (or reopened past
+           the select limit) */
+        if (ctx->mb_param->fd < 0 || ctx->mb_param->fd > FD_SETSIZE - 1) {
+            target->status = SOCKET_FAILURE;
+            continue;
+        }
+
+        query_length = ctx->build_query_basis (function, addr, nb_values, target->query);
+        if (data_length > 0) {
+            memcpy (target->query + query_length, data, data_length);
+            query_length += data_length;
+        }
+
+        ret = ctx->modbus_send (target->query, query_length);
+        if (ret < 0) {
+            target->status = ret;
+            continue;
+        }
+
+        target->pending = TRUE;
+        target->broadcast = ctx->is_broadcast (target->query);
+        if (target->broadcast) {
+            target->status = ctx->broadcast_quantity (target->query);
+            record (target, 0);
+            target->deadline_us = modbus_time_us () +
+                                  ctx->broadcast_delay_us (ctx->last_query_length);
+        } else {
+            ctx->modbus_rx_init (&target->rx, ctx->compute_response_length (target->query, UINT16),
+                                 target->response);
+            target->deadline_us = modbus_time_us () + select_time * 1000LL;
+        }
+        nb_pending++;
+    }
+
+    while (nb_pending > 0) {
+        now = modbus_time_us ();
+        timeout_us = -1;
+        max_fd = -1;
+        FD_ZERO (&rfds);
+        for (i = 0; i < nb; i++) {
+            target = &targets[i];
+            if (!target->pending)
+                continue;
+            if (!target->broadcast && target->ctx->mb_param->fd < 0) {
+                target->status = SOCKET_FAILURE;
+                target->pending = FALSE;
+                nb_pending--;
+                continue;
+            }
+            if (timeout_us < 0 || target->deadline_us - now < timeout_us)
+                timeout_us = target->deadline_us - now;
+            if (!target->broadcast) {
+                FD_SET (target->ctx->mb_param->fd, &rfds);
+                if (target->ctx->mb_param->fd > max_fd)
+                    max_fd = target->ctx->mb_param->fd;
+            }
+        }
+        if (nb_pending == 0)
+            break;
+        if (timeout_us < 0)
+            timeout_us = 0;
+
+        tv.tv_sec = timeout_us / 1000000;
+        tv.tv_usec = timeout_us % 1000000;
+        ret = select (max_fd + 1, &rfds, NULL, NULL, &tv);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            for (i = 0; i < nb; i++) {
+                if (targets[i].pending) {
+                    targets[i].pending = FALSE;
+                    targets[i].status = SELECT_FAILURE;
+                }
+            }
+            fprintf (stderr, "ERROR fan-out select failure\n");
+            break;
+        }
+
+        now = modbus_time_us ();
+        for (i = 0; i < nb; i++) {
+            target = &targets[i];
+            if (!target->pending)
+                continue;
+            ctx = target->ctx;
+
+            if (!target->broadcast && ctx->mb_param->fd >= 0 &&
+                    FD_ISSET (ctx->mb_param->fd, &rfds)) {
+                ret = ctx->modbus_rx_feed (&target->rx, ctx->mb_param->fd);
+                if (ret > 0 && ctx->mb_param->type_com == TCP &&
+                        (target->response[0] != target->query[0] ||
+                         target->response[1] != target->query[1])) {
+                    /* Late response to an older transaction */
+                    ctx->modbus_rx_init (&target->rx,
+                                         ctx->compute_response_length (target->query, UINT16),
+                                         target->response);
+                    ret = 0;
+                }
+                if (ret != 0) {
+                    target->status = decode_response (target, ret);
+                    target->pending = FALSE;
+                    record (target, ret);
+                }
+            }
+
+            if (target->pending && now >= target->deadline_us) {
+                /* The status of a broadcast is already set */
+                if (!target->broadcast) {
+                    ctx->error_treat (SELECT_TIMEOUT, "fanout: response timeout");
+                    target->status = SELECT_TIMEOUT;
+                    record (target, 0);
+                }
+                target->pending = FALSE;
+            }
+
+            if (!target->pending)
+                nb_pending--;
+        }
+    }
+
+    for (i = 0; i < nb; i++) {
+        if (targets[i].status > 0)
+            nb_ok++;
+    }
+
+    return nb_ok;
+}
+
+int c_modbus_fanout::force_single_coil (int coil_addr, int state, int select_time) {
+    return write (FC_FORCE_SINGLE_COIL, coil_addr, state ? 0xFF00 : 0, NULL, 0, select_time);
+}
+
+int c_modbus_fanout::preset_single_register (int reg_addr, int value, int select_time) {
+    return write (FC_PRESET_SINGLE_REGISTER, reg_addr, value, NULL, 0, select_time);
+}
+
+int c_modbus_fanout::force_multiple_coils (int start_addr, int nb, const uint8_t *data_src,
+                                           int select_time) {
+    uint8_t data[MAX_WRITE_STATUS / 8 + 2];
+    int byte_count;
+
+    if (nb > MAX_WRITE_STATUS) {
+        fprintf (stderr, "ERROR Writing to too many coils (%d > %d)\n",
+                 nb, MAX_WRITE_STATUS);
+        return INVALID_DATA;
+    }
+
+    byte_count = (nb / 8) + ( (nb % 8) ? 1 : 0);
+    data[0] = byte_count;
+    modbus_bits_pack (data_src, nb, data + 1);
+
+    return write (FC_FORCE_MULTIPLE_COILS, start_addr, nb, data, byte_count + 1, select_time);
+}
+
+int c_modbus_fanout::preset_multiple_registers (int start_addr, int nb, const uint16_t *data_src,
+                                                int select_time) {
+    uint8_t data[MAX_WRITE_REGISTERS * 2 + 1];
+    int i;
+
+    if (nb > MAX_WRITE_REGISTERS) {
+        fprintf (stderr,
+                 "ERROR Trying to write to too many registers (%d > %d)\n",
+                 nb, MAX_WRITE_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    data[0] = nb * 2;
+    for (i = 0; i < nb; i++) {
+        data[1 + i * 2] = data_src[i] >> 8;
+        data[2 + i * 2] = data_src[i] & 0x00FF;
+    }
+
+    return write (FC_PRESET_MULTIPLE_REGISTERS, start_addr, nb, data, nb * 2 + 1, select_time);
+}
@@ -0,0 +1,97 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_FANOUT_H_
+#define _MODBUS_FANOUT_H_
+
+#include "modbus.h"
+#include "modbus_pool.h"
+
+#define MODBUS_FANOUT_DEFAULT_TARGETS  64
+
+typedef struct
+{
+    c_modbus *ctx;
+    /* Buffers of the pool */
+    uint8_t *query;
+    uint8_t *response;
+    modbus_rx_t rx;
+    /* Result of the last write */
+    int status;
+    /* Waiting for the response, or for the turnaround delay of a
+       broadcast */
+    int pending;
+    int broadcast;
+    /* Monotonic time in us of the time out */
+    long long deadline_us;
+} modbus_fanout_target_t;
+
+/* Fan-out of a write.
+
+   The same write is sent to the slaves of many connected contexts (TCP
+   servers, or serial lines) without waiting for each response in turn:
+   all the queries are sent, then the responses are received in one
+   select () loop as they come back. The contexts whose slave is a
+   broadcast address in RTU only wait for their turnaround delay (see
+   modbus_set_turnaround_delay). The result of each target is given by
+   get_status (); the write returns the number of targets which succeeded.
+
+   The contexts mustn't be used by anything else during a write. */
+class c_modbus_fanout
+{
+public:
+
+    c_modbus_fanout (int max_targets);
+    ~c_modbus_fanout ();
+
+    /* Adds a connected context, the writes are sent to its slave.
+       Returns the index of the target or -1 if it's full */
+    int add (c_modbus *ctx);
+
+    int nb_targets ();
+
+    /* Number of values written by the last write to a target or less
+       than 0 on error */
+    int get_status (int target);
+
+    int force_single_coil (int coil_addr, int state, int select_time);
+
+    int preset_single_register (int reg_addr, int value, int select_time);
+
+    int force_multiple_coils (int start_addr, int nb, const uint8_t *data_src,
+                              int select_time);
+
+    int preset_multiple_registers (int start_addr, int nb, const uint16_t *data_src,
+                                   int select_time);
+
+private:
+
+    modbus_fanout_target_t *targets;
+    int nb;
+    int max_targets;
+    c_modbus_pool *pool;
+
+    int write (int function, int addr, int nb_values, const uint8_t *data,
+               int data_length, int select_time);
+
+    /* Checks the response received by a target */
+    int decode_response (modbus_fanout_target_t *target, int response_length);
+
+    /* Records the transaction of a target in the statistics of its
+       context */
+    void record (modbus_fanout_target_t *target, int response_length);
+};
+
+#endif  /* _MODBUS_FANOUT_H_ */
@@ -0,0 +1,420 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Modbus TCP to RTU gateway.
+
+   Extract from MODBUS Application Protocol Specification V1.1b (page
+   49/51): the exception 0x0B (gateway target device failed to respond)
+   tells the master that no response was obtained from the target device.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "modbus_gateway.h"
+
+/* Offset of the function code in a TCP query */
+#define PDU HEADER_LENGTH_TCP
+
+static int is_bit_function (int function) {
+    return function == FC_READ_COIL_STATUS || function == FC_READ_INPUT_STATUS;
+}
+
+c_modbus_gateway::c_modbus_gateway (c_modbus *tcp_ctx, c_modbus *rtu_ctx, int max_connections) {
+    this->rtu_ctx = rtu_ctx;
+    nb_pending = 0;
+    max_age = MODBUS_GATEWAY_DEFAULT_MAX_AGE;
+    select_time = TIME_OUT_END_OF_TRAME / 1000;
+    running = FALSE;
+    memset (&counters, 0, sizeof (counters));
+
+    server = new c_modbus_server (tcp_ctx, NULL, max_connections);
+    server->modbus_server_set_handler (on_query, this);
+    planner = new c_modbus_planner (MODBUS_GATEWAY_MAX_PENDING);
+    requests = (modbus_gateway_request_t *) malloc (MODBUS_GATEWAY_MAX_PENDING *
+               sizeof (modbus_gateway_request_t));
+    entries = (modbus_gateway_entry_t *) calloc (MODBUS_GATEWAY_CACHE_ENTRIES,
+              sizeof (modbus_gateway_entry_t));
+}
+
+c_modbus_gateway::~c_modbus_gateway () {
+    delete server;
+    delete planner;
+    free (requests);
+    free (entries);
+}
+
+void c_modbus_gateway::set_max_age (int max_age) {
+    this->max_age = max_age < 0 ? 0 : max_age;
+}
+
+void c_modbus_gateway::set_select_time (int select_time) {
+    this->select_time = select_time;
+}
+
+int c_modbus_gateway::listen (int nb_connection) {
+    if (requests == NULL || entries == NULL)
+        return -1;
+
+    return server->modbus_server_listen (nb_connection);
+}
+
+void c_modbus_gateway::on_query (int fd, const uint8_t *query, int query_length, void *arg) {
+    c_modbus_gateway *gateway = (c_modbus_gateway *) arg;
+    int i;
+
+    if (query == NULL) {
+        /* Closed, the queries of that connection aren't answered */
+        for (i = 0; i < gateway->nb_pending; i++) {
+            if (gateway->requests[i].fd == fd)
+                gateway->requests[i].fd = -1;
+        }
+        return;
+    }
+
+    gateway->queue (fd, query, query_length);
+}
+
+void c_modbus_gateway::queue (int fd, const uint8_t *query, int query_length) {
+    modbus_gateway_request_t *request;
+
+    counters.nb_queries++;
+
+    if (nb_pending >= MODBUS_GATEWAY_MAX_PENDING) {
+        modbus_gateway_request_t busy;
+
+        busy.fd = fd;
+        memcpy (busy.query, query, PDU + 1);
+        respond_exception (&busy, SLAVE_DEVICE_BUSY);
+        return;
+    }
+
+    request = &requests[nb_pending++];
+    request->fd = fd;
+    memcpy (request->query, query, query_length);
+    request->query_length = query_length;
+    request->read_id = -1;
+}
+
+void c_modbus_gateway::respond (modbus_gateway_request_t *request,
+                                const uint8_t *pdu, int pdu_length) {
+    uint8_t response[MAX_ADU_LENGTH_TCP];
+    int length = PDU + pdu_length;
+
+    if (request->fd == -1)
+        return;
+
+    /* Transaction and protocol identifiers, length and unit of the query */
+    memcpy (response, request->query, PDU);
+    response[4] = (pdu_length + 1) >> 8;
+    response[5] = (pdu_length + 1) & 0x00FF;
+    memcpy (response + PDU, pdu, pdu_length);
+
+    /* Sent with the other responses of the round */
+    if (server->modbus_server_send (request->fd, response, length) < 0)
+        fprintf (stderr, "ERROR Gateway response not sent\n");
+}
+
+void c_modbus_gateway::respond_exception (modbus_gateway_request_t *request, int status) {
+    uint8_t pdu[2];
+
+    pdu[0] = request->query[PDU] | 0x80;
+    if (status < 0 && status >= GATEWAY_PROBLEM_TARGET)
+        /* Exception of the slave */
+        pdu[1] = -status;
+    else
+        /* Time out, CRC, ... on the serial line */
+        pdu[1] = -GATEWAY_PROBLEM_TARGET;
+
+    respond (request, pdu, 2);
+}
+
+void c_modbus_gateway::respond_read (modbus_gateway_request_t *request, const void *values) {
+    uint8_t pdu[2 + MAX_STATUS / 8 + 1];
+    int nb = (request->query[PDU + 3] << 8) | request->query[PDU + 4];
+    int byte_count;
+    int i;
+
+    pdu[0] = request->query[PDU];
+    if (is_bit_function (request->query[PDU])) {
+        const uint8_t *bits = (const uint8_t *) values;
+
+        byte_count = (nb / 8) + ( (nb % 8) ? 1 : 0);
+        memset (pdu + 2, 0, byte_count);
+        for (i = 0; i < nb; i++) {
+            if (bits[i])
+                pdu[2 + i / 8] |= 1 << (i % 8);
+        }
+    } else {
+        const uint16_t *registers = (const uint16_t *) values;
+
+        byte_count = nb * 2;
+        for (i = 0; i < nb; i++) {
+            pdu[2 + (i << 1)] = registers[i] >> 8;
+            pdu[3 + (i << 1)] = registers[i] & 0x00FF;
+        }
+    }
+    pdu[1] = byte_count;
+
+    respond (request, pdu, 2 + byte_count);
+}
+
+int c_modbus_gateway::lookup (int slave, int function, int address, int nb,
+                              long long now, void *dest) {
+    modbus_gateway_entry_t *entry;
+    int i;
+
+    if (max_age == 0)
+        return FALSE;
+
+    for (i = 0; i < MODBUS_GATEWAY_CACHE_ENTRIES; i++) {
+        entry = &entries[i];
+        if (!entry->used || entry->slave != slave || entry->function != function ||
+                address < entry->address || address + nb > entry->address + entry->nb ||
+                now - entry->time_ms > max_age)
+            continue;
+
+        if (is_bit_function (function))
+            memcpy (dest, (uint8_t *) entry->data + (address - entry->address), nb);
+        else
+            memcpy (dest, entry->data + (address - entry->address), nb * sizeof (uint16_t));
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+void c_modbus_gateway::store (int slave, int function, int address, int nb, long long now,
+                              const void *src) {
+    modbus_gateway_entry_t *entry = NULL;
+    int i;
+
+    if (max_age == 0)
+        return;
+
+    /* Same read, a free entry or the oldest one */
+    for (i = 0; i < MODBUS_GATEWAY_CACHE_ENTRIES; i++) {
+        if (entries[i].used && entries[i].slave == slave && entries[i].function == function &&
+                entries[i].address == address && entries[i].nb == nb) {
+            entry = &entries[i];
+            break;
+        }
+        if (entry == NULL || (entry->used && (!entries[i].used ||
+                                               entries[i].time_ms < entry->time_ms)))
+            entry = &entries[i];
+    }
+
+    entry->used = TRUE;
+    entry->slave = slave;
+    entry->function = function;
+    entry->address = address;
+    entry->nb = nb;
+    entry->time_ms = now;
+    memcpy (entry->data, src, is_bit_function (function) ? nb : nb * sizeof (uint16_t));
+}
+
+void c_modbus_gateway::invalidate (int slave, int function, int address, int nb) {
+    modbus_gateway_entry_t *entry;
+    int i;
+
+    for (i = 0; i < MODBUS_GATEWAY_CACHE_ENTRIES; i++) {
+        entry = &entries[i];
+        if (entry->used && entry->slave == slave && entry->function == function &&
+                address < entry->address + entry->nb && entry->address < address + nb)
+            entry->used = FALSE;
+    }
+}
+
+int c_modbus_gateway::forward_write (modbus_gateway_request_t *request) {
+    uint8_t *query = request->query;
+    int function = query[PDU];
+    int address = (query[PDU + 1] << 8) | query[PDU + 2];
+    int value = (query[PDU + 3] << 8) | query[PDU + 4];
+    uint8_t bits[MAX_STATUS];
+    uint16_t registers[MAX_REGISTERS];
+    int status;
+    int i;
+
+    rtu_ctx->modbus_set_slave (query[PDU - 1]);
+
+    switch (function) {
+    case FC_FORCE_SINGLE_COIL:
+        invalidate (query[PDU - 1], FC_READ_COIL_STATUS, address, 1);
+        status = rtu_ctx->force_single_coil (address, value == 0xFF00, select_time);
+        break;
+    case FC_PRESET_SINGLE_REGISTER:
+        invalidate (query[PDU - 1], FC_READ_HOLDING_REGISTERS, address, 1);
+        status = rtu_ctx->preset_single_register (address, value, select_time);
+        break;
+    case FC_FORCE_MULTIPLE_COILS:
+        /* The values must be in the query received */
+        if (value < 1 || value > MAX_WRITE_STATUS || query[PDU + 5] < (value + 7) / 8 ||
+                request->query_length < PDU + 6 + (value + 7) / 8)
+            return ILLEGAL_DATA_VALUE;
+        invalidate (query[PDU - 1], FC_READ_COIL_STATUS, address, value);
+        for (i = 0; i < value; i++)
+            bits[i] = (query[PDU + 6 + i / 8] >> (i % 8)) & 1;
+        status = rtu_ctx->force_multiple_coils (address, value, bits, select_time);
+        break;
+    default:
+        if (value < 1 || value > MAX_WRITE_REGISTERS || query[PDU + 5] < value * 2 ||
+                request->query_length < PDU + 6 + value * 2)
+            return ILLEGAL_DATA_VALUE;
+        invalidate (query[PDU - 1], FC_READ_HOLDING_REGISTERS, address, value);
+        for (i = 0; i < value; i++)
+            registers[i] = (query[PDU + 6 + (i << 1)] << 8) | query[PDU + 7 + (i << 1)];
+        status = rtu_ctx->preset_multiple_registers (address, value, registers, select_time);
+        break;
+    }
+    counters.nb_transactions++;
+
+    return status;
+}
+
+void c_modbus_gateway::process () {
+    modbus_gateway_request_t *request;
+    long long now = modbus_time_us () / 1000;
+    int function;
+    int slave;
+    int address;
+    int nb;
+    int status;
+    int nb_reads = 0;
+    int i;
+
+    for (i = 0; i < nb_pending; i++) {
+        request = &requests[i];
+        if (request->fd == -1)
+            continue;
+
+        slave = request->query[PDU - 1];
+        function = request->query[PDU];
+        address = (request->query[PDU + 1] << 8) | request->query[PDU + 2];
+        nb = (request->query[PDU + 3] << 8) | request->query[PDU + 4];
+
+        if (request->query_length < PDU + 5) {
+            /* No address and value or number of values */
+            respond_exception (request, ILLEGAL_DATA_VALUE);
+            continue;
+        }
+
+        if (slave == 0) {
+            /* Broadcast on the serial line, there's no response to pass
+               on */
+            respond_exception (request, GATEWAY_PROBLEM_PATH);
+            continue;
+        }
+
+        switch (function) {
+        case FC_READ_COIL_STATUS:
+        case FC_READ_INPUT_STATUS:
+        case FC_READ_HOLDING_REGISTERS:
+        case FC_READ_INPUT_REGISTERS:
+            if (nb < 1 || nb > (is_bit_function (function) ? MAX_STATUS : MAX_REGISTERS) ||
+                    address + nb > 0x10000) {
+                respond_exception (request, ILLEGAL_DATA_VALUE);
+            } else if (lookup (slave, function, address, nb, now, request->data)) {
+                counters.nb_cache_hits++;
+                respond_read (request, request->data);
+            } else {
+                /* Read after the writes of this round */
+                request->read_id = planner->add_read (slave, function, address, nb,
+                                                      request->data);
+                if (request->read_id < 0)
+                    respond_exception (request, SLAVE_DEVICE_BUSY);
+                else
+                    nb_reads++;
+            }
+            break;
+        case FC_FORCE_SINGLE_COIL:
+        case FC_PRESET_SINGLE_REGISTER:
+        case FC_FORCE_MULTIPLE_COILS:
+        case FC_PRESET_MULTIPLE_REGISTERS:
+            status = forward_write (request);
+            if (status < 0)
+                respond_exception (request, status);
+            else
+                /* Function, address and value or number of values of
+                   the query */
+                respond (request, request->query + PDU, 5);
+            break;
+        default:
+            respond_exception (request, ILLEGAL_FUNCTION);
+            break;
+        }
+    }
+
+    if (nb_reads > 0) {
+        planner->plan ();
+        planner->execute (rtu_ctx, select_time);
+        counters.nb_transactions += planner->nb_blocks ();
+        now = modbus_time_us () / 1000;
+
+        for (i = 0; i < nb_pending; i++) {
+            request = &requests[i];
+            if (request->read_id < 0)
+                continue;
+
+            status = planner->get_status (request->read_id);
+            if (status < 0) {
+                respond_exception (request, status);
+                continue;
+            }
+
+            store (request->query[PDU - 1], request->query[PDU],
+                   (request->query[PDU + 1] << 8) | request->query[PDU + 2],
+                   (request->query[PDU + 3] << 8) | request->query[PDU + 4],
+                   now, request->data);
+            respond_read (request, request->data);
+        }
+        planner->clear ();
+    }
+
+    nb_pending = 0;
+    server->modbus_server_flush ();
+}
+
+int c_modbus_gateway::run_once (int select_time) {
+    int ret;
+
+    ret = server->modbus_server_run_once (select_time);
+    if (ret < 0)
+        return -1;
+
+    if (nb_pending > 0)
+        process ();
+
+    return ret;
+}
+
+int c_modbus_gateway::run () {
+    running = TRUE;
+    while (running) {
+        if (run_once (TIME_OUT_END_OF_TRAME / 1000) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void c_modbus_gateway::stop () {
+    running = FALSE;
+}
+
+void c_modbus_gateway::get_counters (modbus_gateway_counters_t *counters) {
+    *counters = this->counters;
+}
@@ -0,0 +1,148 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_GATEWAY_H_
+#define _MODBUS_GATEWAY_H_
+
+#include "modbus.h"
+#include "modbus_server.h"
+#include "modbus_planner.h"
+
+/* Age in ms up to which a value read on the serial line answers the
+   masters */
+#define MODBUS_GATEWAY_DEFAULT_MAX_AGE   500
+
+/* Queries waiting for the serial line */
+#define MODBUS_GATEWAY_MAX_PENDING       256
+
+#define MODBUS_GATEWAY_CACHE_ENTRIES     128
+
+typedef struct
+{
+    /* Connection of the master, -1 if closed meanwhile */
+    int fd;
+    uint8_t query[MAX_ADU_LENGTH_TCP];
+    int query_length;
+    int read_id;
+    /* Values read, a byte per bit or registers */
+    uint16_t data[MAX_STATUS / 2];
+} modbus_gateway_request_t;
+
+typedef struct
+{
+    int used;
+    int slave;
+    int function;
+    int address;
+    int nb;
+    /* Monotonic time in ms of the read */
+    long long time_ms;
+    uint16_t data[MAX_STATUS / 2];
+} modbus_gateway_entry_t;
+
+typedef struct
+{
+    unsigned long nb_queries;
+    /* Reads answered from the cache */
+    unsigned long nb_cache_hits;
+    /* Transactions on the serial line */
+    unsigned long nb_transactions;
+} modbus_gateway_counters_t;
+
+/* Modbus TCP to RTU gateway.
+
+   The masters are served by a c_modbus_server on tcp_ctx, their queries
+   are collected during each run_once () and then handled together on the
+   serial line of rtu_ctx (the unit identifier is the RTU slave):
+   - a read is answered from the cache when a read of the same slave and
+     function covering its range is not older than the maximum age;
+   - the other reads are merged by a c_modbus_planner, identical or
+     overlapping reads of several masters make one serial transaction;
+   - the writes (FC 0x05, 0x06, 0x0F, 0x10) are forwarded first, in the
+     order received, and remove the values they overlap from the cache.
+
+   The errors of the serial line are answered with the exception
+   GATEWAY_PROBLEM_TARGET, the exceptions of the slaves are passed on. */
+class c_modbus_gateway
+{
+public:
+
+    c_modbus_gateway (c_modbus *tcp_ctx, c_modbus *rtu_ctx, int max_connections);
+    ~c_modbus_gateway ();
+
+    /* Maximum age in ms of the values served from the cache, 0 to read
+       every query on the serial line (they're still merged) */
+    void set_max_age (int max_age);
+
+    /* Response time out of the serial line in ms */
+    void set_select_time (int select_time);
+
+    /* Listens on the port of tcp_ctx.
+       Returns 0 on success or -1 on failure. */
+    int listen (int nb_connection);
+
+    /* Waits at most select_time ms for queries and handles them.
+       Returns the number of queries answered or -1 on failure. */
+    int run_once (int select_time);
+
+    /* Handles queries until stop () is called.
+       Returns 0 or -1 on failure. */
+    int run ();
+
+    void stop ();
+
+    void get_counters (modbus_gateway_counters_t *counters);
+
+private:
+
+    c_modbus *rtu_ctx;
+    c_modbus_server *server;
+    c_modbus_planner *planner;
+
+    modbus_gateway_request_t *requests;
+    int nb_pending;
+
+    modbus_gateway_entry_t *entries;
+
+    int max_age;
+    int select_time;
+    volatile int running;
+    modbus_gateway_counters_t counters;
+
+    static void on_query (int fd, const uint8_t *query, int query_length, void *arg);
+
+    void queue (int fd, const uint8_t *query, int query_length);
+
+    /* Handles the queries collected */
+    void process ();
+
+    /* Returns the value to send or less than 0 for an exception */
+    int forward_write (modbus_gateway_request_t *request);
+
+    int lookup (int slave, int function, int address, int nb, long long now, void *dest);
+
+    void store (int slave, int function, int address, int nb, long long now,
+                const void *src);
+
+    void invalidate (int slave, int function, int address, int nb);
+
+    void respond (modbus_gateway_request_t *request, const uint8_t *pdu, int pdu_length);
+
+    void respond_exception (modbus_gateway_request_t *request, int status);
+
+    void respond_read (modbus_gateway_request_t *request, const void *values);
+};
+
+#endif  /* _MODBUS_GATEWAY_H_ */
@@ -0,0 +1,280 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "modbus_io.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX  1024
+#endif
+
+c_modbus_rx_ring::c_modbus_rx_ring (int size) {
+    if (size < MODBUS_BUFFER_SIZE)
+        size = MODBUS_IO_DEFAULT_SIZE;
+    this->size = size;
+    buffer = (uint8_t *) modbus_aligned_alloc (size);
+    if (buffer == NULL)
+        this->size = 0;
+    memset (&counters, 0, sizeof (counters));
+    reset ();
+}
+
+c_modbus_rx_ring::~c_modbus_rx_ring () {
+    free (buffer);
+}
+
+void c_modbus_rx_ring::reset () {
+    head = 0;
+    tail = 0;
+}
+
+int c_modbus_rx_ring::pending () {
+    return tail - head;
+}
+
+int c_modbus_rx_ring::fill (int fd) {
+    int ret;
+
+    /* The frame started is moved to the start of the buffer */
+    if (head > 0) {
+        tail -= head;
+        memmove (buffer, buffer + head, tail);
+        head = 0;
+    }
+
+    if (tail == size)
+        return 0;
+
+    do {
+        ret = recv (fd, buffer + tail, size - tail, MSG_DONTWAIT);
+    } while (ret == -1 && errno == EINTR);
+    counters.nb_calls++;
+
+    if (ret == 0)
+        return CONNECTION_CLOSED;
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return SOCKET_FAILURE;
+    }
+
+    tail += ret;
+    counters.nb_bytes += ret;
+
+    return ret;
+}
+
+int c_modbus_rx_ring::next_frame (uint8_t **frame) {
+    uint8_t *msg = buffer + head;
+    int protocol;
+    int length;
+
+    if (tail - head < HEADER_LENGTH_TCP + 1)
+        return 0;
+
+    protocol = (msg[2] << 8) | msg[3];
+    length = ( (msg[4] << 8) | msg[5]) + 6;
+    if (protocol != 0 || length < HEADER_LENGTH_TCP + 1 || length > MAX_ADU_LENGTH_TCP)
+        return INVALID_DATA;
+
+    if (tail - head < length)
+        return 0;
+
+    *frame = msg;
+    head += length;
+    counters.nb_frames++;
+
+    return length;
+}
+
+void c_modbus_rx_ring::get_counters (modbus_io_counters_t *counters) {
+    *counters = this->counters;
+}
+
+c_modbus_tx_queue::c_modbus_tx_queue (int size, int max_iov) {
+    if (size < MODBUS_BUFFER_SIZE)
+        size = MODBUS_IO_DEFAULT_SIZE;
+    if (max_iov <= 0 || max_iov > IOV_MAX)
+        max_iov = MODBUS_IO_DEFAULT_IOV;
+
+    this->size = size;
+    this->max_iov = max_iov;
+    buffer = (uint8_t *) modbus_aligned_alloc (size);
+    iov = (struct iovec *) malloc (max_iov * sizeof (struct iovec));
+    if (buffer == NULL || iov == NULL) {
+        this->size = 0;
+        this->max_iov = 0;
+    }
+    memset (&counters, 0, sizeof (counters));
+    clear ();
+}
+
+c_modbus_tx_queue::~c_modbus_tx_queue () {
+    free (buffer);
+    free (iov);
+}
+
+void c_modbus_tx_queue::clear () {
+    used = 0;
+    first = 0;
+    nb_iov = 0;
+    nb_pending = 0;
+}
+
+int c_modbus_tx_queue::pending () {
+    return nb_pending;
+}
+
+int c_modbus_tx_queue::push (const uint8_t *frame, int length) {
+    if (nb_iov == max_iov)
+        compact ();
+    if (nb_iov == max_iov)
+        return -1;
+
+    iov[nb_iov].iov_base = (void *) frame;
+    iov[nb_iov].iov_len = length;
+    nb_iov++;
+    nb_pending += length;
+    counters.nb_frames++;
+
+    return 0;
+}
+
+/* Offset in buffer of the first byte copied not sent */
+int c_modbus_tx_queue::live_start () {
+    uint8_t *p;
+    int start = used;
+    int i;
+
+    for (i = first; i < nb_iov; i++) {
+        p = (uint8_t *) iov[i].iov_base;
+        if (p >= buffer && p < buffer + size && p - buffer < start)
+            start = p - buffer;
+    }
+
+    return start;
+}
+
+/* Moves what a partial flush left to the start of buffer and iov */
+void c_modbus_tx_queue::compact () {
+    uint8_t *p;
+    int start = live_start ();
+    int i;
+
+    if (start > 0) {
+        memmove (buffer, buffer + start, used - start);
+        for (i = first; i < nb_iov; i++) {
+            p = (uint8_t *) iov[i].iov_base;
+            if (p >= buffer && p < buffer + size)
+                iov[i].iov_base = p - start;
+        }
+        used -= start;
+    }
+
+    if (first > 0) {
+        memmove (iov, iov + first, (nb_iov - first) * sizeof (struct iovec));
+        nb_iov -= first;
+        first = 0;
+    }
+}
+
+int c_modbus_tx_queue::room () {
+    if (nb_iov - first >= max_iov)
+        return 0;
+
+    return size - (used - live_start ());
+}
+
+int c_modbus_tx_queue::push_copy (const uint8_t *frame, int length) {
+    struct iovec *last;
+
+    if (used + length > size || nb_iov == max_iov)
+        compact ();
+    if (used + length > size)
+        return -1;
+
+    last = (nb_iov > first) ? &iov[nb_iov - 1] : NULL;
+
+    /* The copies following each other are sent as one block */
+    if (last != NULL && (uint8_t *) last->iov_base + last->iov_len == buffer + used) {
+        last->iov_len += length;
+    } else {
+        if (nb_iov == max_iov)
+            return -1;
+        iov[nb_iov].iov_base = buffer + used;
+        iov[nb_iov].iov_len = length;
+        nb_iov++;
+    }
+
+    memcpy (buffer + used, frame, length);
+    used += length;
+    nb_pending += length;
+    counters.nb_frames++;
+
+    return 0;
+}
+
+int c_modbus_tx_queue::flush (int fd) {
+    struct msghdr msg;
+    size_t sent;
+    int ret;
+
+    while (first < nb_iov) {
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = nb_iov - first;
+
+        /* writev () without SIGPIPE */
+        ret = sendmsg (fd, &msg, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            clear ();
+            return SOCKET_FAILURE;
+        }
+        counters.nb_calls++;
+        counters.nb_bytes += ret;
+        nb_pending -= ret;
+
+        /* Skips what was sent */
+        sent = ret;
+        while (first < nb_iov && sent >= iov[first].iov_len) {
+            sent -= iov[first].iov_len;
+            first++;
+        }
+        if (sent > 0) {
+            iov[first].iov_base = (uint8_t *) iov[first].iov_base + sent;
+            iov[first].iov_len -= sent;
+        }
+    }
+
+    if (first == nb_iov)
+        clear ();
+
+    return nb_pending;
+}
+
+void c_modbus_tx_queue::get_counters (modbus_io_counters_t *counters) {
+    *counters = this->counters;
+}
@@ -0,0 +1,129 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_IO_H_
+#define _MODBUS_IO_H_
+
+#include <sys/uio.h>
+
+#include "modbus.h"
+
+/* Enough for 16 frames of the largest size */
+#define MODBUS_IO_DEFAULT_SIZE   (MODBUS_BUFFER_SIZE * 16)
+#define MODBUS_IO_DEFAULT_IOV    64
+
+typedef struct
+{
+    /* System calls */
+    unsigned long nb_calls;
+    unsigned long nb_frames;
+    unsigned long nb_bytes;
+} modbus_io_counters_t;
+
+/* Receive buffer of a Modbus TCP connection.
+
+   fill () reads in one recv () all the socket holds (up to the free
+   space), next_frame () then returns the complete frames one by one,
+   delimited by the length of their MBAP header and left in place. The
+   bytes of an incomplete frame are moved to the start of the buffer once
+   the complete ones are consumed, so a frame is always contiguous. */
+class c_modbus_rx_ring
+{
+public:
+
+    c_modbus_rx_ring (int size);
+    ~c_modbus_rx_ring ();
+
+    /* Reads the data available on the non blocking socket fd.
+       Returns the number of bytes read, 0 if nothing is available or the
+       buffer is full, CONNECTION_CLOSED or SOCKET_FAILURE */
+    int fill (int fd);
+
+    /* Sets frame to the next complete frame, valid until the next
+       fill ().
+       Returns its length, 0 if none or INVALID_DATA if the header is
+       invalid (the stream is out of sync) */
+    int next_frame (uint8_t **frame);
+
+    /* Number of bytes received not consumed */
+    int pending ();
+
+    void reset ();
+
+    void get_counters (modbus_io_counters_t *counters);
+
+private:
+
+    uint8_t *buffer;
+    int size;
+    /* First byte not consumed and end of the data */
+    int head;
+    int tail;
+    modbus_io_counters_t counters;
+};
+
+/* Send queue of a connection.
+
+   The frames are queued and sent together by flush () with one writev ().
+   push () queues a frame in place (it must stay valid until it's sent),
+   push_copy () copies it in the buffer of the queue. On a non blocking
+   socket, flush () keeps what the socket didn't take for the next one,
+   the frames queued meanwhile go after it. */
+class c_modbus_tx_queue
+{
+public:
+
+    c_modbus_tx_queue (int size, int max_iov);
+    ~c_modbus_tx_queue ();
+
+    /* Return 0 or -1 if the queue is full */
+    int push (const uint8_t *frame, int length);
+    int push_copy (const uint8_t *frame, int length);
+
+    /* Sends the frames queued.
+       Returns the number of bytes still queued (0 when all are sent) or
+       SOCKET_FAILURE */
+    int flush (int fd);
+
+    /* Number of bytes queued */
+    int pending ();
+
+    /* Number of bytes push_copy () can take */
+    int room ();
+
+    /* Drops the frames queued */
+    void clear ();
+
+    void get_counters (modbus_io_counters_t *counters);
+
+private:
+
+    uint8_t *buffer;
+    int size;
+    /* Bytes of buffer used */
+    int used;
+    struct iovec *iov;
+    int max_iov;
+    /* Frames not sent: iov [first, nb_iov[ */
+    int first;
+    int nb_iov;
+    int nb_pending;
+    modbus_io_counters_t counters;
+
+    int live_start ();
+    void compact ();
+};
+
+#endif  /* _MODBUS_IO_H_ */
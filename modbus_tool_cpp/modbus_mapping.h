@@ -0,0 +1,210 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_MAPPING_H_
+#define _MODBUS_MAPPING_H_
+
+#include <string.h>
+
+#include "modbus.h"
+#include "modbus_bits.h"
+
+/* Concurrent access to a modbus_mapping_t created by
+   modbus_mapping_new_concurrent.
+
+   Each table is split in blocks of MODBUS_MAPPING_BLOCK values protected
+   by a sequence lock: a writer makes the sequence odd while it updates
+   the block, a reader copies the values and starts again if a sequence
+   changed meanwhile. The readers never take a lock and never block the
+   writers, and a read of several values (a 32 bits value spread over two
+   registers for example) is always consistent.
+
+   When the tables have no locks (mapping created by modbus_mapping_new)
+   these functions are simple copies.
+
+   A read is consistent for up to MAX_STATUS values, longer reads are
+   consistent by chunks of MAX_STATUS values. */
+
+inline uint32_t modbus_seqlock_read_begin (const modbus_seqlock_t *lock) {
+    uint32_t sequence;
+
+    /* A writer is updating the block */
+    while ( (sequence = lock->sequence) & 1)
+        ;
+    __sync_synchronize ();
+
+    return sequence;
+}
+
+inline int modbus_seqlock_read_retry (const modbus_seqlock_t *lock, uint32_t sequence) {
+    __sync_synchronize ();
+
+    return lock->sequence != sequence;
+}
+
+inline void modbus_seqlock_write_begin (modbus_seqlock_t *lock) {
+    uint32_t sequence;
+
+    /* The writers of a block are serialized by the odd sequence */
+    for (;;) {
+        sequence = lock->sequence;
+        if (! (sequence & 1) &&
+                __sync_bool_compare_and_swap (&lock->sequence, sequence, sequence + 1))
+            break;
+    }
+}
+
+inline void modbus_seqlock_write_end (modbus_seqlock_t *lock) {
+    __sync_synchronize ();
+    __sync_fetch_and_add (&lock->sequence, 1);
+}
+
+/* Copies nb values of the table from address to dest */
+template <typename T>
+void modbus_mapping_read (const T *tab, const modbus_seqlock_t *locks,
+                          int address, int nb, T *dest) {
+    uint32_t sequences[MAX_STATUS / MODBUS_MAPPING_BLOCK + 2];
+    int first;
+    int last;
+    int i;
+    int retry;
+
+    if (locks == NULL || nb <= 0) {
+        memcpy (dest, tab + address, nb * sizeof (T));
+        return;
+    }
+
+    while (nb > MAX_STATUS) {
+        modbus_mapping_read (tab, locks, address, MAX_STATUS, dest);
+        address += MAX_STATUS;
+        dest += MAX_STATUS;
+        nb -= MAX_STATUS;
+    }
+
+    first = address / MODBUS_MAPPING_BLOCK;
+    last = (address + nb - 1) / MODBUS_MAPPING_BLOCK;
+
+    do {
+
+        for (i = first; i <= last; i++)
+            sequences[i - first] = modbus_seqlock_read_begin (&locks[i]);
+
+        memcpy (dest, (const void *) (tab + address), nb * sizeof (T));
+
+        retry = FALSE;
+        for (i = first; i <= last; i++) {
+            if (modbus_seqlock_read_retry (&locks[i], sequences[i - first])) {
+                retry = TRUE;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/* Copies nb values from src to the table at address */
+template <typename T>
+void modbus_mapping_write (T *tab, modbus_seqlock_t *locks,
+                           int address, int nb, const T *src) {
+    int first;
+    int last;
+    int i;
+
+    if (locks == NULL || nb <= 0) {
+        memcpy (tab + address, src, nb * sizeof (T));
+        return;
+    }
+
+    first = address / MODBUS_MAPPING_BLOCK;
+    last = (address + nb - 1) / MODBUS_MAPPING_BLOCK;
+
+    /* Always in the same order to not deadlock with another writer */
+    for (i = first; i <= last; i++)
+        modbus_seqlock_write_begin (&locks[i]);
+
+    memcpy (tab + address, src, nb * sizeof (T));
+
+    for (i = first; i <= last; i++)
+        modbus_seqlock_write_end (&locks[i]);
+}
+
+/* Copies nb bits of a packed table (modbus_mapping_new_packed) from
+   address to dest, packed from its first bit */
+inline void modbus_mapping_read_bits (const uint8_t *tab, const modbus_seqlock_t *locks,
+                                      int address, int nb, uint8_t *dest) {
+    uint32_t sequences[MAX_STATUS / MODBUS_MAPPING_BLOCK + 2];
+    int first;
+    int last;
+    int i;
+    int retry;
+
+    if (locks == NULL || nb <= 0) {
+        modbus_bits_copy (dest, 0, tab, address, nb);
+        return;
+    }
+
+    while (nb > MAX_STATUS) {
+        modbus_mapping_read_bits (tab, locks, address, MAX_STATUS, dest);
+        address += MAX_STATUS;
+        dest += MAX_STATUS / 8;
+        nb -= MAX_STATUS;
+    }
+
+    first = address / MODBUS_MAPPING_BLOCK;
+    last = (address + nb - 1) / MODBUS_MAPPING_BLOCK;
+
+    do {
+
+        for (i = first; i <= last; i++)
+            sequences[i - first] = modbus_seqlock_read_begin (&locks[i]);
+
+        modbus_bits_copy (dest, 0, tab, address, nb);
+
+        retry = FALSE;
+        for (i = first; i <= last; i++) {
+            if (modbus_seqlock_read_retry (&locks[i], sequences[i - first])) {
+                retry = TRUE;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/* Copies nb bits, packed from the first bit of src, to a packed table at
+   address. A block of MODBUS_MAPPING_BLOCK bits is a whole number of
+   bytes, the writers of different blocks never share a byte. */
+inline void modbus_mapping_write_bits (uint8_t *tab, modbus_seqlock_t *locks,
+                                       int address, int nb, const uint8_t *src) {
+    int first;
+    int last;
+    int i;
+
+    if (locks == NULL || nb <= 0) {
+        modbus_bits_copy (tab, address, src, 0, nb);
+        return;
+    }
+
+    first = address / MODBUS_MAPPING_BLOCK;
+    last = (address + nb - 1) / MODBUS_MAPPING_BLOCK;
+
+    for (i = first; i <= last; i++)
+        modbus_seqlock_write_begin (&locks[i]);
+
+    modbus_bits_copy (tab, address, src, 0, nb);
+
+    for (i = first; i <= last; i++)
+        modbus_seqlock_write_end (&locks[i]);
+}
+
+#endif  /* _MODBUS_MAPPING_H_ */
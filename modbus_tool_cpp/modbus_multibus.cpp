@@ -0,0 +1,148 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "modbus_multibus.h"
+
+c_modbus_multibus::c_modbus_multibus () {
+    nb = 0;
+    running = FALSE;
+    memset (buses, 0, sizeof (buses));
+}
+
+c_modbus_multibus::~c_modbus_multibus () {
+    int i;
+
+    stop ();
+    for (i = 0; i < nb; i++)
+        delete buses[i].scheduler;
+}
+
+int c_modbus_multibus::add_bus (c_modbus *ctx, int max_tags) {
+    modbus_bus_t *bus;
+
+    if (running) {
+        fprintf (stderr, "ERROR The buses can't be added once started\n");
+        return -1;
+    }
+
+    if (nb >= MODBUS_MULTIBUS_MAX_BUSES) {
+        fprintf (stderr, "ERROR Too many buses (%d)\n", MODBUS_MULTIBUS_MAX_BUSES);
+        return -1;
+    }
+
+    bus = &buses[nb];
+    bus->ctx = ctx;
+    /* The thread of the bus connects again after a failure */
+    ctx->modbus_set_error_handling (CLOSE_ON_ERROR);
+    bus->scheduler = new c_modbus_scheduler (ctx, max_tags);
+    bus->multibus = this;
+    bus->started = FALSE;
+    bus->connected = FALSE;
+
+    return nb++;
+}
+
+int c_modbus_multibus::nb_buses () {
+    return nb;
+}
+
+c_modbus_scheduler *c_modbus_multibus::get_scheduler (int bus) {
+    if (bus < 0 || bus >= nb)
+        return NULL;
+
+    return buses[bus].scheduler;
+}
+
+int c_modbus_multibus::is_connected (int bus) {
+    if (bus < 0 || bus >= nb)
+        return FALSE;
+
+    return buses[bus].connected;
+}
+
+void *c_modbus_multibus::bus_thread (void *arg) {
+    modbus_bus_t *bus = (modbus_bus_t *) arg;
+    c_modbus_multibus *multibus = bus->multibus;
+
+    while (multibus->running) {
+        if (! bus->connected) {
+            if (bus->ctx->modbus_connect () == -1) {
+                bus->ctx->modbus_sleep (0, MODBUS_MULTIBUS_RECONNECT * 1000);
+                continue;
+            }
+            bus->connected = TRUE;
+        }
+
+        /* Bounded wait to see the stop request */
+        bus->scheduler->run_once (TIME_OUT_END_OF_TRAME / 1000);
+
+        /* Closed by a socket failure or a lost line */
+        if (bus->ctx->mb_param->fd < 0)
+            bus->connected = FALSE;
+    }
+
+    if (bus->connected) {
+        bus->ctx->modbus_close ();
+        bus->connected = FALSE;
+    }
+
+    return NULL;
+}
+
+int c_modbus_multibus::start () {
+    int i;
+
+    if (running)
+        return 0;
+
+    running = TRUE;
+    for (i = 0; i < nb; i++) {
+        if (pthread_create (&buses[i].thread, NULL, bus_thread, &buses[i]) != 0) {
+            perror ("pthread_create");
+            stop ();
+            return -1;
+        }
+        buses[i].started = TRUE;
+    }
+
+    return 0;
+}
+
+void c_modbus_multibus::stop () {
+    int i;
+
+    running = FALSE;
+    for (i = 0; i < nb; i++) {
+        if (buses[i].started) {
+            pthread_join (buses[i].thread, NULL);
+            buses[i].started = FALSE;
+        }
+    }
+}
+
+void c_modbus_multibus::dump_stats (FILE *fp) {
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        fprintf (fp, "bus %d (%s): %d tags\n", i,
+                 buses[i].connected ? "connected" : "disconnected",
+                 buses[i].scheduler->nb_tags ());
+        buses[i].scheduler->dump_stats (fp);
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_MULTIBUS_H_
+#define _MODBUS_MULTIBUS_H_
+
+#include <pthread.h>
+
+#include "modbus.h"
+#include "modbus_scheduler.h"
+
+#define MODBUS_MULTIBUS_MAX_BUSES  32
+
+/* Delay between two connection attempts of a bus in ms */
+#define MODBUS_MULTIBUS_RECONNECT 1000
+
+class c_modbus_multibus;
+
+typedef struct
+{
+    c_modbus *ctx;
+    c_modbus_scheduler *scheduler;
+    c_modbus_multibus *multibus;
+    pthread_t thread;
+    int started;
+    volatile int connected;
+} modbus_bus_t;
+
+/* Polls several serial lines (and TCP links) in parallel.
+
+   Each bus is a c_modbus context with its own scheduler and thread: the
+   lines are independent so a slow slave or a timeout on one port never
+   delays the others, and the throughput grows with the number of ports.
+   The tags are added to the scheduler of each bus (get_scheduler) before
+   start (). The callbacks of the tags are called from the thread of their
+   bus. */
+class c_modbus_multibus
+{
+public:
+
+    c_modbus_multibus ();
+    ~c_modbus_multibus ();
+
+    /* Adds a bus, the context must be initialized (modbus_init_rtu or
+       modbus_init_tcp) but not connected. Its error handling becomes
+       CLOSE_ON_ERROR. The context isn't freed by the multibus.
+       Returns the bus id or -1 on failure. */
+    int add_bus (c_modbus *ctx, int max_tags);
+
+    int nb_buses ();
+
+    c_modbus_scheduler *get_scheduler (int bus);
+
+    /* TRUE when the bus is connected */
+    int is_connected (int bus);
+
+    /* Starts a thread per bus, each one connects its context (and tries
+       again every MODBUS_MULTIBUS_RECONNECT ms) then runs its scheduler.
+       Returns 0 or -1 on failure. */
+    int start ();
+
+    /* Stops the threads and closes the connections */
+    void stop ();
+
+    void dump_stats (FILE *fp);
+
+private:
+
+    modbus_bus_t buses[MODBUS_MULTIBUS_MAX_BUSES];
+    int nb;
+    volatile int running;
+
+    static void *bus_thread (void *arg);
+};
+
+#endif  /* _MODBUS_MULTIBUS_H_ */
@@ -0,0 +1,513 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Pipelined Modbus TCP client.
+
+   Extract from MODBUS Messaging on TCP/IP Implementation Guide V1.0b
+   (page 10/46): a client may send several requests without waiting for
+   the responses, the transaction identifier of the MBAP header is then
+   used to pair each response with its request.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+#include "modbus_pipeline.h"
+#include "modbus_stats.h"
+#include "modbus_capture.h"
+
+c_modbus_pipeline::c_modbus_pipeline (c_modbus *ctx, int depth) {
+    this->ctx = ctx;
+    slots = NULL;
+    this->depth = 0;
+    nb_in_flight = 0;
+    rx_length = 0;
+    txq = NULL;
+    pool = new c_modbus_pool (MODBUS_PIPELINE_MAX_DEPTH);
+    rx = (uint8_t *) modbus_aligned_alloc (MODBUS_PIPELINE_RX_SIZE);
+    if (rx == NULL) {
+        /* The depth stays 0, no request is accepted */
+        fprintf (stderr, "ERROR Can't allocate the pipeline receive buffer\n");
+        return;
+    }
+
+    if (set_depth (depth) < 0) {
+        set_depth (MODBUS_PIPELINE_DEFAULT_DEPTH);
+    }
+}
+
+c_modbus_pipeline::~c_modbus_pipeline () {
+    int i;
+
+    for (i = 0; i < depth; i++)
+        pool->release (slots[i].query);
+    free (slots);
+    free (rx);
+    delete pool;
+    delete txq;
+}
+
+int c_modbus_pipeline::set_depth (int depth) {
+    modbus_pipeline_slot_t *new_slots;
+
+    if (depth < 1 || depth > MODBUS_PIPELINE_MAX_DEPTH) {
+        fprintf (stderr, "ERROR Invalid pipeline depth %d (1 to %d)\n",
+                 depth, MODBUS_PIPELINE_MAX_DEPTH);
+        return -1;
+    }
+
+    if (rx == NULL)
+        return -1;
+
+    if (nb_in_flight > 0) {
+        fprintf (stderr, "ERROR Pipeline depth can't be changed with %d transactions in flight\n",
+                 nb_in_flight);
+        return -1;
+    }
+
+    new_slots = (modbus_pipeline_slot_t *) calloc (depth, sizeof (modbus_pipeline_slot_t));
+    if (new_slots == NULL)
+        return -1;
+
+    free (slots);
+    slots = new_slots;
+    this->depth = depth;
+
+    return 0;
+}
+
+int c_modbus_pipeline::in_flight () {
+    return nb_in_flight;
+}
+
+void c_modbus_pipeline::set_batching (int boolean) {
+    if (boolean && txq == NULL) {
+        /* Enough for the largest requests of a full pipeline */
+        txq = new c_modbus_tx_queue (MODBUS_BUFFER_SIZE * MODBUS_PIPELINE_MAX_DEPTH,
+                                     MODBUS_PIPELINE_MAX_DEPTH);
+    } else if (!boolean && txq != NULL) {
+        send_queued ();
+        delete txq;
+        txq = NULL;
+    }
+}
+
+void c_modbus_pipeline::get_tx_counters (modbus_io_counters_t *counters) {
+    if (txq != NULL)
+        txq->get_counters (counters);
+    else
+        memset (counters, 0, sizeof (*counters));
+}
+
+int c_modbus_pipeline::send_queued () {
+    if (txq == NULL || txq->pending () == 0)
+        return 0;
+
+    /* The socket of the context is blocking, all is sent */
+    if (txq->flush (ctx->mb_param->fd) != 0) {
+        txq->clear ();
+        complete_all (SOCKET_FAILURE);
+        ctx->error_treat (SOCKET_FAILURE, "pipeline: Write socket failure");
+        return SOCKET_FAILURE;
+    }
+
+    return 0;
+}
+
+/* Builds and sends a request, the response is handled by poll () */
+int c_modbus_pipeline::submit (int slave, int function, int start_addr, int nb,
+                               const uint8_t *data, int data_length, void *dest,
+                               int select_time, modbus_pipeline_cb_t cb, void *arg) {
+    int i;
+    int ret;
+    int query_length;
+    uint8_t *query;
+    modbus_pipeline_slot_t *slot = NULL;
+
+    if (ctx->mb_param->type_com != TCP) {
+        fprintf (stderr, "ERROR Pipelining is only available in TCP\n");
+        return INVALID_DATA;
+    }
+
+    if (depth == 0) {
+        fprintf (stderr, "ERROR Pipeline without slots\n");
+        return INVALID_DATA;
+    }
+
+    /* Wait for a free slot, the timed out transactions are released by
+       poll () so this loop always ends */
+    while (nb_in_flight >= depth) {
+        ret = poll (select_time);
+        if (ret < 0 && ret != SELECT_TIMEOUT)
+            return ret;
+    }
+
+    for (i = 0; i < depth; i++) {
+        if (!slots[i].used) {
+            slot = &slots[i];
+            break;
+        }
+    }
+
+    query = pool->lease ();
+    if (query == NULL) {
+        ctx->error_treat (INVALID_DATA, "pipeline: no frame buffer available");
+        return INVALID_DATA;
+    }
+
+    query_length = ctx->build_query_basis_tcp (slave, function, start_addr, nb, query);
+    if (data_length > 0) {
+        memcpy (query + query_length, data, data_length);
+        query_length += data_length;
+    }
+
+    slot->t_id = (query[0] << 8) | query[1];
+    slot->query = query;
+    slot->query_length = query_length;
+    slot->nb = nb;
+    slot->dest = dest;
+    slot->sent_us = modbus_time_us ();
+    slot->deadline = slot->sent_us / 1000 + select_time;
+    slot->cb = cb;
+    slot->arg = arg;
+
+    /* Finalized, captured and queued as any other request when batching */
+    if (txq != NULL)
+        ctx->modbus_set_tx_queue (txq);
+    ret = ctx->modbus_send (query, query_length);
+    if (txq != NULL)
+        ctx->modbus_set_tx_queue (NULL);
+    if (ret > 0) {
+        slot->used = TRUE;
+        nb_in_flight++;
+    } else {
+        pool->release (query);
+        slot->query = NULL;
+    }
+
+    return ret;
+}
+
+void c_modbus_pipeline::complete (modbus_pipeline_slot_t *slot, int status,
+                                  int response_length) {
+    if (ctx->stats != NULL) {
+        ctx->stats->record (slot->query[HEADER_LENGTH_TCP - 1], slot->query[HEADER_LENGTH_TCP],
+                            status, modbus_time_us () - slot->sent_us,
+                            slot->query_length, response_length);
+    }
+
+    slot->used = FALSE;
+    nb_in_flight--;
+    pool->release (slot->query);
+    slot->query = NULL;
+
+    if (slot->cb != NULL)
+        slot->cb (status, slot->arg);
+}
+
+void c_modbus_pipeline::complete_all (int status) {
+    int i;
+
+    for (i = 0; i < depth; i++) {
+        if (slots[i].used)
+            complete (&slots[i], status, 0);
+    }
+}
+
+void c_modbus_pipeline::complete_timed_out (long long now) {
+    int i;
+
+    for (i = 0; i < depth; i++) {
+        if (slots[i].used && slots[i].deadline <= now) {
+            ctx->error_treat (SELECT_TIMEOUT, "pipeline: response timeout");
+            complete (&slots[i], SELECT_TIMEOUT, 0);
+        }
+    }
+}
+
+/* Pairs a response with its request, checks and decodes it */
+void c_modbus_pipeline::complete_response (uint8_t *response, int response_length) {
+    int i;
+    int status;
+    int function;
+    uint16_t t_id = (response[0] << 8) | response[1];
+    modbus_pipeline_slot_t *slot = NULL;
+
+    for (i = 0; i < depth; i++) {
+        if (slots[i].used && slots[i].t_id == t_id) {
+            slot = &slots[i];
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        /* Response to a transaction already timed out */
+        if (ctx->mb_param->debug) {
+            printf ("Response with unknown transaction id %d ignored\n", t_id);
+        }
+        return;
+    }
+
+    function = slot->query[HEADER_LENGTH_TCP];
+    if (ctx->check_response_length (slot->query, response, response_length) < 0) {
+        status = INVALID_DATA;
+    } else if (response[HEADER_LENGTH_TCP] == 0x80 + function) {
+        status = ctx->check_response_exception (slot->query, response);
+    } else if (response[HEADER_LENGTH_TCP] != function) {
+        ctx->error_treat (INVALID_DATA, "pipeline: function code not corresponding to the query");
+        status = INVALID_DATA;
+    } else {
+        status = ctx->check_response_quantity (slot->query, response, UINT16, response_length);
+    }
+
+    if (status > 0) {
+        const uint8_t *data = response + HEADER_LENGTH_TCP + 2;
+
+        switch (function) {
+        case FC_READ_COIL_STATUS:
+        case FC_READ_INPUT_STATUS: {
+            uint8_t *dest = (uint8_t *) slot->dest;
+
+            for (i = 0; i < slot->nb; i++)
+                dest[i] = (data[i / 8] & (1 << (i % 8))) ? TRUE : FALSE;
+            status = slot->nb;
+        }
+        break;
+        case FC_READ_HOLDING_REGISTERS:
+        case FC_READ_INPUT_REGISTERS: {
+            uint16_t *dest = (uint16_t *) slot->dest;
+
+            for (i = 0; i < status; i++)
+                dest[i] = (data[i << 1] << 8) | data[ (i << 1) + 1];
+        }
+        break;
+        default:
+            break;
+        }
+    }
+
+    complete (slot, status, response_length);
+}
+
+int c_modbus_pipeline::poll (int select_time) {
+    int ret;
+    int nb_completed = nb_in_flight;
+    long long now;
+    long long timeout;
+    fd_set rfds;
+    struct timeval tv;
+    int i;
+    int start = 0;
+
+    if (nb_in_flight == 0)
+        return 0;
+
+    ret = send_queued ();
+    if (ret < 0)
+        return ret;
+
+    /* Don't wait after the first deadline */
+    now = modbus_time_us () / 1000;
+    timeout = select_time;
+    for (i = 0; i < depth; i++) {
+        if (slots[i].used && slots[i].deadline - now < timeout)
+            timeout = slots[i].deadline - now;
+    }
+    if (timeout < 0)
+        timeout = 0;
+
+    FD_ZERO (&rfds);
+    FD_SET (ctx->mb_param->fd, &rfds);
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    ret = select (ctx->mb_param->fd + 1, &rfds, NULL, NULL, &tv);
+    if (ret == -1) {
+        if (errno == EINTR)
+            return 0;
+        complete_all (SELECT_FAILURE);
+        ctx->error_treat (SELECT_FAILURE, "Select failure");
+        return SELECT_FAILURE;
+    }
+
+    if (ret > 0) {
+        ret = recv (ctx->mb_param->fd, rx + rx_length,
+                    MODBUS_PIPELINE_RX_SIZE - rx_length, MSG_DONTWAIT);
+        if (ret == 0) {
+            complete_all (CONNECTION_CLOSED);
+            ctx->error_treat (CONNECTION_CLOSED, "pipeline: connection closed");
+            return CONNECTION_CLOSED;
+        } else if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+            complete_all (SOCKET_FAILURE);
+            ctx->error_treat (SOCKET_FAILURE, "pipeline: Read socket failure");
+            return SOCKET_FAILURE;
+        }
+
+        if (ret > 0) {
+            if (ctx->mb_param->debug) {
+                printf ("\033[32;40;1m \nrcv:\033[0m");
+                for (i = 0; i < ret; i++)
+                    printf ("<%.2X>", rx[rx_length + i]);
+                printf ("\n");
+            }
+            rx_length += ret;
+        }
+
+        /* Extracts all the complete responses of the buffer, decoded in
+           place; the remaining bytes are moved once at the end */
+        while (rx_length - start >= HEADER_LENGTH_TCP + 1) {
+            uint8_t *response = rx + start;
+            int protocol = (response[2] << 8) | response[3];
+            int mbap_length = (response[4] << 8) | response[5];
+            int response_length = mbap_length + 6;
+
+            if (protocol != 0 || mbap_length < 2 ||
+                    response_length > MAX_ADU_LENGTH_TCP) {
+                /* The stream is out of sync, nothing can be paired
+                   anymore */
+                rx_length = 0;
+                complete_all (INVALID_DATA);
+                ctx->error_treat (INVALID_DATA, "pipeline: invalid MBAP header");
+                return INVALID_DATA;
+            }
+
+            if (rx_length - start < response_length)
+                break;
+
+            if (ctx->capture != NULL)
+                ctx->capture_frame (MODBUS_CAPTURE_RX, response, response_length);
+            complete_response (response, response_length);
+            start += response_length;
+        }
+
+        if (start > 0) {
+            rx_length -= start;
+            memmove (rx, rx + start, rx_length);
+        }
+    }
+
+    complete_timed_out (modbus_time_us () / 1000);
+
+    return nb_completed - nb_in_flight;
+}
+
+int c_modbus_pipeline::flush () {
+    int ret;
+
+    while (nb_in_flight > 0) {
+        ret = poll (TIME_OUT_END_OF_TRAME / 1000);
+        if (ret < 0 && ret != SELECT_TIMEOUT)
+            return ret;
+    }
+
+    return 0;
+}
+
+int c_modbus_pipeline::read_coil_status (int slave, int start_addr, int nb, uint8_t *dest,
+                                         int select_time, modbus_pipeline_cb_t cb, void *arg) {
+    if (nb > MAX_STATUS) {
+        fprintf (stderr,
+                 "ERROR Too many coils status requested (%d > %d)\n",
+                 nb, MAX_STATUS);
+        return INVALID_DATA;
+    }
+
+    return submit (slave, FC_READ_COIL_STATUS, start_addr, nb, NULL, 0,
+                   dest, select_time, cb, arg);
+}
+
+int c_modbus_pipeline::read_input_status (int slave, int start_addr, int nb, uint8_t *dest,
+                                          int select_time, modbus_pipeline_cb_t cb, void *arg) {
+    if (nb > MAX_STATUS) {
+        fprintf (stderr,
+                 "ERROR Too many input status requested (%d > %d)\n",
+                 nb, MAX_STATUS);
+        return INVALID_DATA;
+    }
+
+    return submit (slave, FC_READ_INPUT_STATUS, start_addr, nb, NULL, 0,
+                   dest, select_time, cb, arg);
+}
+
+int c_modbus_pipeline::read_holding_registers (int slave, int start_addr, int nb, uint16_t *dest,
+                                               int select_time, modbus_pipeline_cb_t cb, void *arg) {
+    if (nb > MAX_REGISTERS) {
+        fprintf (stderr,
+                 "ERROR Too many holding registers requested (%d > %d)\n",
+                 nb, MAX_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    return submit (slave, FC_READ_HOLDING_REGISTERS, start_addr, nb, NULL, 0,
+                   dest, select_time, cb, arg);
+}
+
+int c_modbus_pipeline::read_input_registers (int slave, int start_addr, int nb, uint16_t *dest,
+                                             int select_time, modbus_pipeline_cb_t cb, void *arg) {
+    if (nb > MAX_REGISTERS) {
+        fprintf (stderr,
+                 "ERROR Too many input registers requested (%d > %d)\n",
+                 nb, MAX_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    return submit (slave, FC_READ_INPUT_REGISTERS, start_addr, nb, NULL, 0,
+                   dest, select_time, cb, arg);
+}
+
+int c_modbus_pipeline::force_single_coil (int slave, int coil_addr, int state,
+                                          int select_time, modbus_pipeline_cb_t cb, void *arg) {
+    if (state)
+        state = 0xFF00;
+
+    return submit (slave, FC_FORCE_SINGLE_COIL, coil_addr, state, NULL, 0,
+                   NULL, select_time, cb, arg);
+}
+
+int c_modbus_pipeline::preset_single_register (int slave, int reg_addr, int value,
+                                               int select_time, modbus_pipeline_cb_t cb, void *arg) {
+    return submit (slave, FC_PRESET_SINGLE_REGISTER, reg_addr, value, NULL, 0,
+                   NULL, select_time, cb, arg);
+}
+
+int c_modbus_pipeline::preset_multiple_registers (int slave, int start_addr, int nb,
+                                                  const uint16_t *data, int select_time,
+                                                  modbus_pipeline_cb_t cb, void *arg) {
+    int i;
+    uint8_t payload[1 + MAX_WRITE_REGISTERS * 2];
+
+    if (nb > MAX_WRITE_REGISTERS) {
+        fprintf (stderr,
+                 "ERROR Trying to write to too many registers (%d > %d)\n",
+                 nb, MAX_WRITE_REGISTERS);
+        return INVALID_DATA;
+    }
+
+    payload[0] = nb * 2;
+    for (i = 0; i < nb; i++) {
+        payload[1 + (i << 1)] = data[i] >> 8;
+        payload[2 + (i << 1)] = data[i] & 0x00FF;
+    }
+
+    return submit (slave, FC_PRESET_MULTIPLE_REGISTERS, start_addr, nb,
+                   payload, 1 + nb * 2, NULL, select_time, cb, arg);
+}
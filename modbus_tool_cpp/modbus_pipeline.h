@@ -0,0 +1,156 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_PIPELINE_H_
+#define _MODBUS_PIPELINE_H_
+
+#include "modbus.h"
+#include "modbus_pool.h"
+#include "modbus_io.h"
+
+/* Most gateways accept 8 to 16 concurrent transactions per connection */
+#define MODBUS_PIPELINE_DEFAULT_DEPTH   8
+#define MODBUS_PIPELINE_MAX_DEPTH      64
+
+/* The receive buffer may hold several responses */
+#define MODBUS_PIPELINE_RX_SIZE        (MODBUS_BUFFER_SIZE * 4)
+
+/* Called when a pipelined transaction completes. status is the number of
+   values (bits or words) on success or less than 0 for exceptions errors,
+   exactly like the blocking functions of c_modbus. */
+typedef void (*modbus_pipeline_cb_t) (int status, void *arg);
+
+typedef struct
+{
+    int used;
+    uint16_t t_id;
+    /* Request, built in a buffer of the pool and kept until the
+       response is checked */
+    uint8_t *query;
+    int query_length;
+    int nb;
+    void *dest;
+    /* Monotonic time in ms after which the transaction times out */
+    long long deadline;
+    /* Monotonic time in us of the send, for the statistics */
+    long long sent_us;
+    modbus_pipeline_cb_t cb;
+    void *arg;
+} modbus_pipeline_slot_t;
+
+/* Modbus TCP client keeping several requests outstanding on the socket of
+   a c_modbus connection. The responses are matched to the requests with
+   the MBAP transaction identifier so they can come back in any order.
+
+   Requests are queued with the functions below; each one returns the
+   number of bytes sent or less than 0 on error. When the pipeline is
+   full, the call waits for a free slot first. The results are given to
+   the callback from poll () or flush ().
+
+   With batching, the requests are queued and sent together with one
+   system call by the next poll () (or when the pipeline is full), the
+   responses are always read together in one recv (). */
+class c_modbus_pipeline
+{
+public:
+
+    c_modbus_pipeline (c_modbus *ctx, int depth);
+    ~c_modbus_pipeline ();
+
+    /* Sets the maximum number of transactions in flight (1 to
+       MODBUS_PIPELINE_MAX_DEPTH). Only possible when nothing is
+       in flight. Returns 0 on success or -1 on failure. */
+    int set_depth (int depth);
+
+    /* Number of transactions waiting for a response */
+    int in_flight ();
+
+    /* Enables or disables the batching of the requests, the requests
+       queued are sent first when it's disabled */
+    void set_batching (int boolean);
+
+    /* System calls, frames and bytes of the batched sends */
+    void get_tx_counters (modbus_io_counters_t *counters);
+
+    int read_coil_status (int slave, int start_addr, int nb, uint8_t *dest,
+                          int select_time, modbus_pipeline_cb_t cb, void *arg);
+
+    int read_input_status (int slave, int start_addr, int nb, uint8_t *dest,
+                           int select_time, modbus_pipeline_cb_t cb, void *arg);
+
+    int read_holding_registers (int slave, int start_addr, int nb, uint16_t *dest,
+                                int select_time, modbus_pipeline_cb_t cb, void *arg);
+
+    int read_input_registers (int slave, int start_addr, int nb, uint16_t *dest,
+                              int select_time, modbus_pipeline_cb_t cb, void *arg);
+
+    int force_single_coil (int slave, int coil_addr, int state,
+                           int select_time, modbus_pipeline_cb_t cb, void *arg);
+
+    int preset_single_register (int slave, int reg_addr, int value,
+                                int select_time, modbus_pipeline_cb_t cb, void *arg);
+
+    int preset_multiple_registers (int slave, int start_addr, int nb,
+                                   const uint16_t *data, int select_time,
+                                   modbus_pipeline_cb_t cb, void *arg);
+
+    /* Waits at most select_time ms for responses and completes all the
+       transactions received or timed out.
+       Returns the number of completed transactions or less than 0 if the
+       connection failed (all the transactions in flight are then
+       completed with the error). */
+    int poll (int select_time);
+
+    /* Waits until all the transactions in flight are completed.
+       Returns 0 on success or less than 0 if the connection failed. */
+    int flush ();
+
+private:
+
+    c_modbus *ctx;
+    modbus_pipeline_slot_t *slots;
+    int depth;
+    int nb_in_flight;
+
+    /* A frame buffer per transaction in flight */
+    c_modbus_pool *pool;
+
+    /* Requests waiting to be sent, NULL without batching */
+    c_modbus_tx_queue *txq;
+
+    /* Receive buffer, the responses are decoded in place */
+    uint8_t *rx;
+    int rx_length;
+
+    /* Sends the requests queued.
+       Returns 0 or SOCKET_FAILURE (the transactions are then completed
+       with the error) */
+    int send_queued ();
+
+    int submit (int slave, int function, int start_addr, int nb,
+                const uint8_t *data, int data_length, void *dest,
+                int select_time, modbus_pipeline_cb_t cb, void *arg);
+
+    /* response_length is 0 when no response was received */
+    void complete (modbus_pipeline_slot_t *slot, int status, int response_length);
+
+    void complete_response (uint8_t *response, int response_length);
+
+    void complete_all (int status);
+
+    void complete_timed_out (long long now);
+};
+
+#endif  /* _MODBUS_PIPELINE_H_ */
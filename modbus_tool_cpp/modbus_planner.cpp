@@ -0,0 +1,278 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "modbus_planner.h"
+#include "modbus_decode.h"
+
+static int is_bit_function (int function) {
+    return function == FC_READ_COIL_STATUS || function == FC_READ_INPUT_STATUS;
+}
+
+static int compare_reads (const void *a, const void *b) {
+    const modbus_plan_read_t *ra = * (modbus_plan_read_t * const *) a;
+    const modbus_plan_read_t *rb = * (modbus_plan_read_t * const *) b;
+
+    if (ra->slave != rb->slave)
+        return ra->slave - rb->slave;
+    if (ra->function != rb->function)
+        return ra->function - rb->function;
+    if (ra->address != rb->address)
+        return ra->address - rb->address;
+
+    return rb->nb - ra->nb;
+}
+
+c_modbus_planner::c_modbus_planner (int max_reads) {
+    if (max_reads <= 0)
+        max_reads = MODBUS_PLANNER_DEFAULT_READS;
+    this->max_reads = max_reads;
+    nb_reads = 0;
+    nb_planned = 0;
+    gap_registers = MODBUS_PLANNER_GAP_REGISTERS;
+    gap_bits = MODBUS_PLANNER_GAP_BITS;
+
+    reads = (modbus_plan_read_t *) malloc (max_reads * sizeof (modbus_plan_read_t));
+    sorted = (modbus_plan_read_t **) malloc (max_reads * sizeof (modbus_plan_read_t *));
+    blocks = (modbus_plan_block_t *) malloc (max_reads * sizeof (modbus_plan_block_t));
+    if (reads == NULL || sorted == NULL || blocks == NULL)
+        this->max_reads = 0;
+}
+
+c_modbus_planner::~c_modbus_planner () {
+    free (reads);
+    free (sorted);
+    free (blocks);
+}
+
+int c_modbus_planner::add_read (int slave, int function, int address, int nb, void *dest) {
+    modbus_plan_read_t *read;
+    int max_nb;
+
+    if (nb_reads >= max_reads) {
+        fprintf (stderr, "ERROR Too many reads (%d)\n", max_reads);
+        return -1;
+    }
+
+    switch (function) {
+    case FC_READ_COIL_STATUS:
+    case FC_READ_INPUT_STATUS:
+        max_nb = MAX_STATUS;
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+    case FC_READ_INPUT_REGISTERS:
+        max_nb = MAX_REGISTERS;
+        break;
+    default:
+        fprintf (stderr, "ERROR Function code 0x%X can't be planned\n", function);
+        return -1;
+    }
+
+    if (nb <= 0 || nb > max_nb || address < 0 || address + nb > 0x10000 || dest == NULL) {
+        fprintf (stderr, "ERROR Invalid read (%d values at %d)\n", nb, address);
+        return -1;
+    }
+
+    read = &reads[nb_reads];
+    read->slave = slave;
+    read->function = function;
+    read->address = address;
+    read->nb = nb;
+    read->dest = dest;
+    read->status = 0;
+    /* The blocks must be built again */
+    nb_planned = 0;
+
+    return nb_reads++;
+}
+
+void c_modbus_planner::set_max_gap (int registers, int bits) {
+    gap_registers = registers < 0 ? 0 : registers;
+    gap_bits = bits < 0 ? 0 : bits;
+    nb_planned = 0;
+}
+
+int c_modbus_planner::plan () {
+    modbus_plan_block_t *block = NULL;
+    modbus_plan_read_t *read;
+    int i;
+    int end;
+    int gap;
+    int limit;
+
+    if (max_reads == 0)
+        return -1;
+
+    for (i = 0; i < nb_reads; i++)
+        sorted[i] = &reads[i];
+    qsort (sorted, nb_reads, sizeof (modbus_plan_read_t *), compare_reads);
+
+    nb_planned = 0;
+    for (i = 0; i < nb_reads; i++) {
+        read = sorted[i];
+        if (is_bit_function (read->function)) {
+            gap = gap_bits;
+            limit = MAX_STATUS;
+        } else {
+            gap = gap_registers;
+            limit = MAX_REGISTERS;
+        }
+
+        if (block != NULL && block->slave == read->slave &&
+                block->function == read->function &&
+                read->address - (block->address + block->nb) <= gap) {
+            end = read->address + read->nb;
+            if (end < block->address + block->nb)
+                end = block->address + block->nb;
+            if (end - block->address <= limit) {
+                /* Merged */
+                block->nb = end - block->address;
+                block->count++;
+                continue;
+            }
+        }
+
+        block = &blocks[nb_planned++];
+        block->slave = read->slave;
+        block->function = read->function;
+        block->address = read->address;
+        block->nb = read->nb;
+        block->first = i;
+        block->count = 1;
+        block->split = FALSE;
+    }
+
+    return nb_planned;
+}
+
+int c_modbus_planner::nb_blocks () {
+    return nb_planned;
+}
+
+const modbus_plan_block_t *c_modbus_planner::get_block (int block) {
+    if (block < 0 || block >= nb_planned)
+        return NULL;
+
+    return &blocks[block];
+}
+
+int c_modbus_planner::read_range (c_modbus *ctx, int slave, int function, int address,
+                                  int nb, int first, int count, int select_time) {
+    uint16_t registers[MAX_REGISTERS];
+    uint8_t bits[MAX_STATUS];
+    modbus_plan_read_t *read;
+    int status;
+    int offset;
+    int i;
+
+    ctx->modbus_set_slave (slave);
+
+    if (function == FC_READ_COIL_STATUS)
+        status = ctx->read_coil_status (address, nb, bits, select_time);
+    else if (function == FC_READ_INPUT_STATUS)
+        status = ctx->read_input_status (address, nb, bits, select_time);
+    else
+        status = ctx->read_registers_typed (function, address, nb, registers,
+                                            UINT16, WORD_ORDER_BIG, select_time);
+
+    for (i = first; i < first + count; i++) {
+        read = sorted[i];
+        if (status < 0) {
+            read->status = status;
+            continue;
+        }
+
+        offset = read->address - address;
+        if (is_bit_function (function)) {
+            memcpy (read->dest, bits + offset, read->nb);
+        } else {
+            memcpy (read->dest, registers + offset, read->nb * sizeof (uint16_t));
+        }
+        read->status = read->nb;
+    }
+
+    return status;
+}
+
+int c_modbus_planner::read_block (c_modbus *ctx, int block, int select_time) {
+    modbus_plan_block_t *b;
+    modbus_plan_read_t *read;
+    int status;
+    int i;
+
+    if (block < 0 || block >= nb_planned)
+        return INVALID_DATA;
+    b = &blocks[block];
+
+    if (! b->split) {
+        status = read_range (ctx, b->slave, b->function, b->address, b->nb,
+                             b->first, b->count, select_time);
+        if (status != ILLEGAL_DATA_ADDRESS || b->count == 1)
+            return status;
+
+        /* An address of a gap isn't mapped by the slave */
+        b->split = TRUE;
+    }
+
+    status = b->nb;
+    for (i = b->first; i < b->first + b->count; i++) {
+        read = sorted[i];
+        if (i > b->first && read->address == sorted[i - 1]->address &&
+                read->nb == sorted[i - 1]->nb) {
+            /* Same range as the previous read, sent once */
+            read->status = sorted[i - 1]->status;
+            if (read->status >= 0)
+                memcpy (read->dest, sorted[i - 1]->dest,
+                        is_bit_function (read->function) ? read->nb : read->nb * sizeof (uint16_t));
+        } else {
+            read_range (ctx, read->slave, read->function, read->address,
+                        read->nb, i, 1, select_time);
+        }
+        if (read->status < 0)
+            status = read->status;
+    }
+
+    return status;
+}
+
+int c_modbus_planner::execute (c_modbus *ctx, int select_time) {
+    int i;
+    int nb_ok = 0;
+
+    if (nb_planned == 0 && plan () <= 0)
+        return 0;
+
+    for (i = 0; i < nb_planned; i++) {
+        if (read_block (ctx, i, select_time) >= 0)
+            nb_ok++;
+    }
+
+    return nb_ok;
+}
+
+int c_modbus_planner::get_status (int read_id) {
+    if (read_id < 0 || read_id >= nb_reads)
+        return INVALID_DATA;
+
+    return reads[read_id].status;
+}
+
+void c_modbus_planner::clear () {
+    nb_reads = 0;
+    nb_planned = 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_PLANNER_H_
+#define _MODBUS_PLANNER_H_
+
+#include "modbus.h"
+
+#define MODBUS_PLANNER_DEFAULT_READS  1024
+
+/* Number of values not requested which can be read to merge two reads.
+   A register costs 2 bytes on the line, much less than a transaction. */
+#define MODBUS_PLANNER_GAP_REGISTERS    8
+#define MODBUS_PLANNER_GAP_BITS        64
+
+/* A range of values wanted by a caller */
+typedef struct
+{
+    int slave;
+    int function;
+    int address;
+    int nb;
+    /* uint8_t[nb] for the bits, uint16_t[nb] for the registers */
+    void *dest;
+    /* Result of the last read: nb on success or less than 0 for
+       exceptions errors */
+    int status;
+} modbus_plan_read_t;
+
+/* One transaction covering several reads */
+typedef struct
+{
+    int slave;
+    int function;
+    int address;
+    int nb;
+    /* Reads of the block, index in the sorted reads */
+    int first;
+    int count;
+    /* The slave refused the merged range (ILLEGAL_DATA_ADDRESS in a gap),
+       the reads of the block are sent one by one */
+    int split;
+} modbus_plan_block_t;
+
+/* Read coalescing.
+
+   The reads are sorted by slave, function and address then merged into
+   the fewest transactions allowed by the gap tolerance and the limits of
+   the protocol (MAX_REGISTERS registers, MAX_STATUS bits). The values of
+   each response are copied back to the destination of every read.
+
+   Some slaves answer ILLEGAL_DATA_ADDRESS when a range covers addresses
+   they don't map: the block is then split for good and its reads are
+   sent separately. */
+class c_modbus_planner
+{
+public:
+
+    c_modbus_planner (int max_reads);
+    ~c_modbus_planner ();
+
+    /* Adds a read (FC_READ_COIL_STATUS, FC_READ_INPUT_STATUS,
+       FC_READ_HOLDING_REGISTERS or FC_READ_INPUT_REGISTERS).
+       Returns the read id or -1 on failure. */
+    int add_read (int slave, int function, int address, int nb, void *dest);
+
+    /* Gap tolerance in values, 0 to only merge adjacent reads */
+    void set_max_gap (int registers, int bits);
+
+    /* Builds the blocks, must be called after the reads are added.
+       Returns the number of blocks or -1 on failure. */
+    int plan ();
+
+    int nb_blocks ();
+
+    const modbus_plan_block_t *get_block (int block);
+
+    /* Performs the transactions of a block and copies the values to the
+       reads. Returns the status of the block (nb or less than 0). */
+    int read_block (c_modbus *ctx, int block, int select_time);
+
+    /* Reads all the blocks.
+       Returns the number of blocks read without error. */
+    int execute (c_modbus *ctx, int select_time);
+
+    /* Status of the last read (see modbus_plan_read_t) */
+    int get_status (int read_id);
+
+    /* Removes all the reads, the gap tolerance is kept */
+    void clear ();
+
+private:
+
+    modbus_plan_read_t *reads;
+    /* Reads sorted by slave, function and address */
+    modbus_plan_read_t **sorted;
+    modbus_plan_block_t *blocks;
+    int max_reads;
+    int nb_reads;
+    int nb_planned;
+    int gap_registers;
+    int gap_bits;
+
+    /* Reads nb values and copies them to the reads [first, first + count[ */
+    int read_range (c_modbus *ctx, int slave, int function, int address,
+                    int nb, int first, int count, int select_time);
+};
+
+#endif  /* _MODBUS_PLANNER_H_ */
@@ -0,0 +1,85 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "modbus_pool.h"
+
+c_modbus_pool::c_modbus_pool (int nb_buffers) {
+    int i;
+
+    if (nb_buffers < 0)
+        nb_buffers = 0;
+    lock = 0;
+    memory = (uint8_t *) modbus_aligned_alloc ( (size_t) nb_buffers * MODBUS_BUFFER_SIZE +
+                                                MODBUS_CACHE_LINE);
+    free_list = (int *) malloc ( (nb_buffers + 1) * sizeof (int));
+    if (memory == NULL || free_list == NULL) {
+        fprintf (stderr, "ERROR Can't allocate %d frame buffers\n", nb_buffers);
+        nb_buffers = 0;
+    }
+
+    nb = nb_buffers;
+    nb_available = nb_buffers;
+    for (i = 0; i < nb_buffers; i++)
+        free_list[i] = nb_buffers - 1 - i;
+}
+
+c_modbus_pool::~c_modbus_pool () {
+    free (memory);
+    free (free_list);
+}
+
+uint8_t *c_modbus_pool::lease () {
+    uint8_t *buffer = NULL;
+
+    /* Held for a few instructions, a spin lock is enough */
+    while (__sync_lock_test_and_set (&lock, 1))
+        ;
+    if (nb_available > 0) {
+        nb_available--;
+        buffer = memory + (size_t) free_list[nb_available] * MODBUS_BUFFER_SIZE;
+    }
+    __sync_lock_release (&lock);
+
+    return buffer;
+}
+
+void c_modbus_pool::release (uint8_t *buffer) {
+    if (buffer == NULL)
+        return;
+
+    while (__sync_lock_test_and_set (&lock, 1))
+        ;
+    free_list[nb_available++] = (buffer - memory) / MODBUS_BUFFER_SIZE;
+    __sync_lock_release (&lock);
+}
+
+int c_modbus_pool::nb_free () {
+    return nb_available;
+}
+
+int c_modbus_pool::nb_buffers () {
+    return nb;
+}
+
+uint8_t *c_modbus_pool::get_memory () {
+    return memory;
+}
+
+size_t c_modbus_pool::get_memory_size () {
+    return (size_t) nb * MODBUS_BUFFER_SIZE;
+}
@@ -0,0 +1,62 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_POOL_H_
+#define _MODBUS_POOL_H_
+
+#include "modbus.h"
+
+/* Pool of frame buffers.
+
+   The buffers (MODBUS_BUFFER_SIZE bytes, aligned on a cache line) are
+   allocated once in a single block. A buffer is leased for a transaction,
+   the frame is built, sent, received and decoded in place, then the
+   buffer is released. Nothing is allocated after the construction: when
+   all the buffers are leased, lease () fails.
+
+   lease () and release () may be called from several threads. */
+class c_modbus_pool
+{
+public:
+
+    c_modbus_pool (int nb_buffers);
+    ~c_modbus_pool ();
+
+    /* Returns a buffer or NULL if all the buffers are leased */
+    uint8_t *lease ();
+
+    /* Gives back a buffer returned by lease () */
+    void release (uint8_t *buffer);
+
+    /* Number of buffers available */
+    int nb_free ();
+
+    int nb_buffers ();
+
+    /* Block of all the buffers (to register for zero copy I/O) */
+    uint8_t *get_memory ();
+    size_t get_memory_size ();
+
+private:
+
+    uint8_t *memory;
+    /* Stack of the indexes of the free buffers */
+    int *free_list;
+    int nb;
+    int nb_available;
+    volatile int lock;
+};
+
+#endif  /* _MODBUS_POOL_H_ */
@@ -0,0 +1,615 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "modbus_profile.h"
+#include "modbus_transport.h"
+#include "modbus_decode.h"
+
+#define PROFILE_DEFAULT_BLOCKS  64
+
+typedef struct
+{
+    const char *name;
+    int value;
+} profile_keyword_t;
+
+static const profile_keyword_t profile_tables[] = {
+    { "coils", FC_READ_COIL_STATUS },
+    { "inputs", FC_READ_INPUT_STATUS },
+    { "holding", FC_READ_HOLDING_REGISTERS },
+    { "input_registers", FC_READ_INPUT_REGISTERS },
+    { NULL, 0 }
+};
+
+/* The bits are stored one per byte, like UINT8 */
+#define PROFILE_BIT  -1
+
+static const profile_keyword_t profile_types[] = {
+    { "bit", PROFILE_BIT },
+    { "int8", INT8 },
+    { "uint8", UINT8 },
+    { "int16", INT16 },
+    { "uint16", UINT16 },
+    { "int32", INT32 },
+    { "uint32", UINT32 },
+    { "int64", INT64 },
+    { "uint64", UINT64 },
+    { "float", FLOAT },
+    { "double", DOUBLE },
+    { NULL, 0 }
+};
+
+static int find_keyword (const profile_keyword_t *keywords, const char *name, int *value) {
+    for (; keywords->name != NULL; keywords++) {
+        if (strcmp (keywords->name, name) == 0) {
+            *value = keywords->value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int is_bits (int function) {
+    return function == FC_READ_COIL_STATUS || function == FC_READ_INPUT_STATUS;
+}
+
+/* Modification time in ns and size of a file, -1 if it doesn't exist */
+static int stat_profile (const char *path, long long *mtime, long long *size) {
+    struct stat st;
+
+    if (stat (path, &st) == -1)
+        return -1;
+
+    *mtime = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    *size = st.st_size;
+
+    return 0;
+}
+
+c_modbus_profile::c_modbus_profile () {
+    blocks = NULL;
+    values = NULL;
+    max_blocks = 0;
+    clear ();
+}
+
+c_modbus_profile::~c_modbus_profile () {
+    free (blocks);
+    free (values);
+}
+
+void c_modbus_profile::clear () {
+    memset (&link, 0, sizeof (link));
+    link.type_com = RTU;
+    link.baud = 9600;
+    strcpy (link.parity, "none");
+    link.data_bit = 8;
+    link.stop_bit = 1;
+    link.port = MODBUS_TCP_DEFAULT_PORT;
+    link.select_time = TIME_OUT_END_OF_TRAME / 1000;
+
+    nb = 0;
+    free (values);
+    values = NULL;
+    values_size = 0;
+    first_tag = -1;
+    profile_mtime = 0;
+    profile_size = 0;
+}
+
+int c_modbus_profile::add_blocks (int slave, int function, int address, int count,
+                                  uint8_t data_type, int word_order, int period_ms,
+                                  int priority, const char *name) {
+    modbus_profile_block_t *block;
+    int size = is_bits (function) ? 0 : modbus_data_type_size (data_type);
+    int max_values;
+    int n;
+
+    /* Values per transaction, the registers of a value stay together */
+    if (size == 0)
+        max_values = MAX_STATUS;
+    else
+        max_values = MAX_REGISTERS * 2 / size;
+
+    while (count > 0) {
+        if (nb == max_blocks) {
+            int max = (max_blocks == 0) ? PROFILE_DEFAULT_BLOCKS : max_blocks * 2;
+            modbus_profile_block_t *tab;
+
+            tab = (modbus_profile_block_t *) realloc (blocks, max * sizeof (modbus_profile_block_t));
+            if (tab == NULL) {
+                fprintf (stderr, "ERROR Can't allocate %d blocks\n", max);
+                return -1;
+            }
+            blocks = tab;
+            max_blocks = max;
+        }
+
+        n = (count > max_values) ? max_values : count;
+
+        block = &blocks[nb++];
+        memset (block, 0, sizeof (modbus_profile_block_t));
+        block->slave = slave;
+        block->function = function;
+        block->address = address;
+        block->nb = (size == 0) ? n : n * size / 2;
+        block->data_type = data_type;
+        block->word_order = word_order;
+        block->period_ms = period_ms;
+        block->priority = priority;
+        strncpy (block->name, name, MODBUS_PROFILE_NAME_LENGTH - 1);
+
+        address += block->nb;
+        count -= n;
+    }
+
+    return 0;
+}
+
+int c_modbus_profile::parse_line (char *line, int line_number, int *slave) {
+    const char *separators = " \t\r\n";
+    char *tokens[16];
+    char *comment;
+    int nb_tokens = 0;
+    int function;
+    int type;
+    int address;
+    int count;
+    int period_ms;
+    int nb_values;
+    int priority = 0;
+    int word_order = WORD_ORDER_BIG;
+    const char *name = "";
+    int i;
+
+    comment = strchr (line, '#');
+    if (comment != NULL)
+        *comment = '\0';
+
+    tokens[0] = strtok (line, separators);
+    while (tokens[nb_tokens] != NULL && nb_tokens < 15) {
+        nb_tokens++;
+        tokens[nb_tokens] = strtok (NULL, separators);
+    }
+
+    if (nb_tokens == 0)
+        return 0;
+
+    if (strcmp (tokens[0], "rtu") == 0 && nb_tokens == 6) {
+        link.type_com = RTU;
+        strncpy (link.device, tokens[1], sizeof (link.device) - 1);
+        link.baud = atoi (tokens[2]);
+        strncpy (link.parity, tokens[3], sizeof (link.parity) - 1);
+        link.data_bit = atoi (tokens[4]);
+        link.stop_bit = atoi (tokens[5]);
+        return 0;
+    }
+
+    if (strcmp (tokens[0], "tcp") == 0 && (nb_tokens == 2 || nb_tokens == 3)) {
+        link.type_com = TCP;
+        strncpy (link.device, tokens[1], sizeof (link.device) - 1);
+        if (nb_tokens == 3)
+            link.port = atoi (tokens[2]);
+        return 0;
+    }
+
+    if (strcmp (tokens[0], "timeout") == 0 && nb_tokens == 2) {
+        link.select_time = atoi (tokens[1]);
+        return 0;
+    }
+
+    if (strcmp (tokens[0], "slave") == 0 && nb_tokens == 2) {
+        *slave = atoi (tokens[1]);
+        if (*slave < 1 || *slave > 247) {
+            fprintf (stderr, "ERROR Line %d of the profile: invalid slave %s\n",
+                     line_number, tokens[1]);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (find_keyword (profile_tables, tokens[0], &function) == -1 || nb_tokens < 5) {
+        fprintf (stderr, "ERROR Line %d of the profile: invalid statement %s\n",
+                 line_number, tokens[0]);
+        return -1;
+    }
+
+    if (*slave == 0) {
+        fprintf (stderr, "ERROR Line %d of the profile: no slave given\n", line_number);
+        return -1;
+    }
+
+    if (find_keyword (profile_types, tokens[3], &type) == -1 ||
+            (type == PROFILE_BIT) != is_bits (function)) {
+        fprintf (stderr, "ERROR Line %d of the profile: invalid type %s for %s\n",
+                 line_number, tokens[3], tokens[0]);
+        return -1;
+    }
+
+    address = atoi (tokens[1]);
+    count = atoi (tokens[2]);
+    period_ms = atoi (tokens[4]);
+
+    for (i = 5; i < nb_tokens; i++) {
+        if (strncmp (tokens[i], "class=", 6) == 0) {
+            priority = atoi (tokens[i] + 6);
+        } else if (strcmp (tokens[i], "order=big") == 0) {
+            word_order = WORD_ORDER_BIG;
+        } else if (strcmp (tokens[i], "order=swapped") == 0) {
+            word_order = WORD_ORDER_SWAPPED;
+        } else if (strncmp (tokens[i], "name=", 5) == 0) {
+            name = tokens[i] + 5;
+        } else {
+            fprintf (stderr, "ERROR Line %d of the profile: invalid option %s\n",
+                     line_number, tokens[i]);
+            return -1;
+        }
+    }
+
+    if (type == PROFILE_BIT) {
+        type = UINT8;
+        nb_values = count;
+    } else {
+        /* A value of 8 bits is half a register, whole registers are read */
+        if (modbus_data_type_size (type) == 1 && count % 2)
+            count++;
+        nb_values = count * modbus_data_type_size (type) / 2;
+    }
+
+    if (address < 0 || count <= 0 || address + nb_values > 65536 || period_ms <= 0 ||
+            priority < 0 || priority >= MODBUS_SCHED_CLASSES) {
+        fprintf (stderr, "ERROR Line %d of the profile: invalid block\n", line_number);
+        return -1;
+    }
+
+    return add_blocks (*slave, function, address, count, type, word_order,
+                       period_ms, priority, name);
+}
+
+int c_modbus_profile::build () {
+    modbus_profile_block_t *block;
+    int i;
+
+    values_size = 0;
+    for (i = 0; i < nb; i++) {
+        block = &blocks[i];
+
+        if (link.type_com == RTU)
+            modbus_rtu_frame::prepare (block->slave, block->function, block->address,
+                                       block->nb, &block->request);
+        else
+            modbus_tcp_frame::prepare (block->slave, block->function, block->address,
+                                       block->nb, &block->request);
+
+        /* The registers are aligned */
+        block->offset = values_size;
+        values_size += is_bits (block->function) ? (block->nb + 1) & ~1 : block->nb * 2;
+    }
+
+    free (values);
+    values = (uint8_t *) calloc (1, values_size + 1);
+    if (values == NULL) {
+        fprintf (stderr, "ERROR Can't allocate the values of the plan\n");
+        return -1;
+    }
+
+    return nb;
+}
+
+int c_modbus_profile::compile (const char *path) {
+    char line[MODBUS_PROFILE_LINE_LENGTH];
+    int line_number = 0;
+    int slave = 0;
+    FILE *fp;
+
+    clear ();
+
+    fp = fopen (path, "r");
+    if (fp == NULL) {
+        fprintf (stderr, "ERROR Can't open the profile %s\n", path);
+        return -1;
+    }
+
+    while (fgets (line, sizeof (line), fp) != NULL) {
+        line_number++;
+        if (parse_line (line, line_number, &slave) == -1) {
+            fclose (fp);
+            clear ();
+            return -1;
+        }
+    }
+    fclose (fp);
+
+    if (link.device[0] == '\0') {
+        fprintf (stderr, "ERROR No rtu or tcp line in the profile %s\n", path);
+        clear ();
+        return -1;
+    }
+
+    stat_profile (path, &profile_mtime, &profile_size);
+
+    return build ();
+}
+
+int c_modbus_profile::save_plan (const char *plan_path) {
+    modbus_plan_header_t header;
+    FILE *fp;
+    int ret = 0;
+
+    memset (&header, 0, sizeof (header));
+    header.magic = MODBUS_PLAN_MAGIC;
+    header.version = MODBUS_PLAN_VERSION;
+    header.header_size = sizeof (modbus_plan_header_t);
+    header.profile_mtime = profile_mtime;
+    header.profile_size = profile_size;
+    header.link = link;
+    header.nb_blocks = nb;
+    header.values_size = values_size;
+
+    fp = fopen (plan_path, "wb");
+    if (fp == NULL) {
+        fprintf (stderr, "ERROR Can't create the plan %s\n", plan_path);
+        return -1;
+    }
+
+    if (fwrite (&header, sizeof (header), 1, fp) != 1 ||
+            (int) fwrite (blocks, sizeof (modbus_profile_block_t), nb, fp) != nb)
+        ret = -1;
+    if (fclose (fp) != 0)
+        ret = -1;
+
+    if (ret == -1) {
+        fprintf (stderr, "ERROR Can't write the plan %s\n", plan_path);
+        remove (plan_path);
+    }
+
+    return ret;
+}
+
+int c_modbus_profile::load_plan (const char *plan_path, const char *profile) {
+    modbus_plan_header_t header;
+    long long mtime;
+    long long size;
+    FILE *fp;
+
+    clear ();
+
+    fp = fopen (plan_path, "rb");
+    if (fp == NULL)
+        return -1;
+
+    if (fread (&header, sizeof (header), 1, fp) != 1 ||
+            header.magic != MODBUS_PLAN_MAGIC || header.version != MODBUS_PLAN_VERSION ||
+            header.header_size != sizeof (modbus_plan_header_t) || header.nb_blocks < 0) {
+        fclose (fp);
+        return -1;
+    }
+
+    /* Out of date */
+    if (profile != NULL && (stat_profile (profile, &mtime, &size) == -1 ||
+                            mtime != header.profile_mtime || size != header.profile_size)) {
+        fclose (fp);
+        return -1;
+    }
+
+    if (header.nb_blocks > max_blocks) {
+        modbus_profile_block_t *tab;
+
+        tab = (modbus_profile_block_t *) realloc (blocks, header.nb_blocks *
+                                                         sizeof (modbus_profile_block_t));
+        if (tab == NULL) {
+            fclose (fp);
+            return -1;
+        }
+        blocks = tab;
+        max_blocks = header.nb_blocks;
+    }
+
+    if ( (int) fread (blocks, sizeof (modbus_profile_block_t), header.nb_blocks, fp) !=
+            header.nb_blocks) {
+        fclose (fp);
+        return -1;
+    }
+    fclose (fp);
+
+    values = (uint8_t *) calloc (1, header.values_size + 1);
+    if (values == NULL)
+        return -1;
+
+    link = header.link;
+    nb = header.nb_blocks;
+    values_size = header.values_size;
+    profile_mtime = header.profile_mtime;
+    profile_size = header.profile_size;
+
+    return 0;
+}
+
+int c_modbus_profile::load (const char *path) {
+    char plan_path[PATH_MAX];
+
+    if (strlen (path) + strlen (MODBUS_PLAN_SUFFIX) >= sizeof (plan_path)) {
+        fprintf (stderr, "ERROR Profile path too long %s\n", path);
+        return -1;
+    }
+    strcpy (plan_path, path);
+    strcat (plan_path, MODBUS_PLAN_SUFFIX);
+
+    if (load_plan (plan_path, path) == 0)
+        return nb;
+
+    if (compile (path) == -1)
+        return -1;
+
+    /* The plan is only a cache */
+    save_plan (plan_path);
+
+    return nb;
+}
+
+c_modbus *c_modbus_profile::new_context () {
+    int slave = (nb > 0) ? blocks[0].slave : 1;
+    c_modbus *ctx;
+
+    ctx = new c_modbus (link.device, link.baud, link.parity,
+                        link.data_bit, link.stop_bit, slave);
+    if (link.type_com == TCP)
+        ctx->modbus_init_tcp (link.device, link.port, slave);
+
+    return ctx;
+}
+
+const modbus_profile_link_t *c_modbus_profile::get_link () {
+    return &link;
+}
+
+int c_modbus_profile::nb_blocks () {
+    return nb;
+}
+
+const modbus_profile_block_t *c_modbus_profile::get_block (int block) {
+    if (block < 0 || block >= nb)
+        return NULL;
+
+    return &blocks[block];
+}
+
+int c_modbus_profile::find_block (const char *name) {
+    int i;
+
+    for (i = 0; i < nb; i++)
+        if (strcmp (blocks[i].name, name) == 0)
+            return i;
+
+    return -1;
+}
+
+int c_modbus_profile::add_tags (c_modbus_scheduler *sched) {
+    modbus_tag_t tag;
+    int id;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        memset (&tag, 0, sizeof (tag));
+        tag.slave = blocks[i].slave;
+        tag.function = blocks[i].function;
+        tag.address = blocks[i].address;
+        tag.nb = blocks[i].nb;
+        tag.dest = values + blocks[i].offset;
+        tag.period_ms = blocks[i].period_ms;
+        tag.priority = blocks[i].priority;
+        tag.request = &blocks[i].request;
+
+        id = sched->add_tag (&tag);
+        if (id == -1)
+            return -1;
+        if (i == 0)
+            first_tag = id;
+    }
+
+    return 0;
+}
+
+int c_modbus_profile::get_tag (int block) {
+    if (block < 0 || block >= nb || first_tag == -1)
+        return -1;
+
+    return first_tag + block;
+}
+
+int c_modbus_profile::get_values (int block, void *dest) {
+    const modbus_profile_block_t *b = get_block (block);
+    const uint16_t *registers;
+    uint8_t payload[MAX_REGISTERS * 2];
+    int i;
+
+    if (b == NULL)
+        return -1;
+
+    if (is_bits (b->function)) {
+        memcpy (dest, values + b->offset, b->nb);
+        return b->nb;
+    }
+
+    /* Back to the bytes of the response for the decoding */
+    registers = (const uint16_t *) (values + b->offset);
+    for (i = 0; i < b->nb; i++) {
+        payload[2 * i] = registers[i] >> 8;
+        payload[2 * i + 1] = registers[i] & 0x00FF;
+    }
+
+    return modbus_decode_type (b->data_type, b->word_order, payload, b->nb * 2, dest);
+}
+
+void c_modbus_profile::dump (FILE *fp) {
+    union {
+        uint64_t align;
+        uint8_t bytes[MAX_STATUS];
+    } buffer;
+    const modbus_profile_block_t *b;
+    int nb_values;
+    int i;
+    int j;
+
+    for (i = 0; i < nb; i++) {
+        b = &blocks[i];
+        nb_values = get_values (i, buffer.bytes);
+
+        fprintf (fp, "%-16s slave %3d fc %d address %5d:", b->name, b->slave,
+                 b->function, b->address);
+        for (j = 0; j < nb_values; j++) {
+            switch (is_bits (b->function) ? UINT8 : b->data_type) {
+            case INT8:
+                fprintf (fp, " %d", ( (int8_t *) buffer.bytes) [j]);
+                break;
+            case UINT8:
+                fprintf (fp, " %u", ( (uint8_t *) buffer.bytes) [j]);
+                break;
+            case INT16:
+                fprintf (fp, " %d", ( (int16_t *) buffer.bytes) [j]);
+                break;
+            case UINT16:
+                fprintf (fp, " %u", ( (uint16_t *) buffer.bytes) [j]);
+                break;
+            case INT32:
+                fprintf (fp, " %d", ( (int32_t *) buffer.bytes) [j]);
+                break;
+            case UINT32:
+                fprintf (fp, " %u", ( (uint32_t *) buffer.bytes) [j]);
+                break;
+            case INT64:
+                fprintf (fp, " %lld", (long long) ( (int64_t *) buffer.bytes) [j]);
+                break;
+            case UINT64:
+                fprintf (fp, " %llu", (unsigned long long) ( (uint64_t *) buffer.bytes) [j]);
+                break;
+            case FLOAT:
+                fprintf (fp, " %g", ( (float *) buffer.bytes) [j]);
+                break;
+            default:
+                fprintf (fp, " %g", ( (double *) buffer.bytes) [j]);
+                break;
+            }
+        }
+        fprintf (fp, "\n");
+    }
+}
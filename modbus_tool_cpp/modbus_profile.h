@@ -0,0 +1,186 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_PROFILE_H_
+#define _MODBUS_PROFILE_H_
+
+#include <stdio.h>
+
+#include "modbus.h"
+#include "modbus_scheduler.h"
+
+/* "MBPL" */
+#define MODBUS_PLAN_MAGIC    0x4C50424D
+#define MODBUS_PLAN_VERSION  2
+
+/* Suffix of the plan compiled from a profile, stored next to it */
+#define MODBUS_PLAN_SUFFIX   ".plan"
+
+#define MODBUS_PROFILE_NAME_LENGTH  32
+#define MODBUS_PROFILE_LINE_LENGTH 256
+
+/* Serial line or TCP server of the devices */
+typedef struct
+{
+    /* RTU or TCP */
+    int32_t type_com;
+    /* Serial device or IP address */
+    char device[64];
+    int32_t baud;
+    char parity[8];
+    int32_t data_bit;
+    int32_t stop_bit;
+    int32_t port;
+    /* Response time out in ms */
+    int32_t select_time;
+} modbus_profile_link_t;
+
+/* One transaction of the poll plan */
+typedef struct
+{
+    int32_t slave;
+    int32_t function;
+    int32_t address;
+    /* Number of bits or registers read */
+    int32_t nb;
+    /* Type of the values (INT8 to DOUBLE), UINT8 for the bits */
+    uint8_t data_type;
+    uint8_t word_order;
+    uint16_t reserved;
+    int32_t period_ms;
+    int32_t priority;
+    /* Offset in bytes of the values in the values of the plan */
+    int32_t offset;
+    char name[MODBUS_PROFILE_NAME_LENGTH];
+    /* Query and length of the response */
+    modbus_prepared_t request;
+} modbus_profile_block_t;
+
+/* Start of a plan file, followed by the blocks */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    /* Profile the plan was compiled from */
+    int64_t profile_mtime;
+    int64_t profile_size;
+    modbus_profile_link_t link;
+    int32_t nb_blocks;
+    /* Size in bytes of the values of the blocks */
+    int32_t values_size;
+} modbus_plan_header_t;
+
+/* Device profile.
+
+   A profile describes a site in a text file, one statement per line
+   ('#' starts a comment):
+
+       rtu <device> <baud> <none|even|odd> <data bits> <stop bits>
+       tcp <ip address> [<port>]
+       timeout <ms>
+       slave <id>
+       <table> <address> <count> <type> <period ms> [class=<0-3>]
+               [order=<big|swapped>] [name=<name>]
+
+   <table> is coils, inputs, holding or input_registers, <type> is bit
+   (coils and inputs) or int8 to double, <count> the number of values of
+   that type. The blocks belong to the last slave given. A block too
+   large for one transaction is split.
+
+   The profile is compiled into a poll plan: the query of each block is
+   prepared once with its CRC (RTU) or MBAP length (TCP) and the length
+   of its response (see modbus_prepare). The plan is cached
+   in <profile>.plan and loaded as is while the profile doesn't change,
+   the scheduler then sends the requests without building any frame. */
+class c_modbus_profile
+{
+public:
+
+    c_modbus_profile ();
+    ~c_modbus_profile ();
+
+    /* Loads the plan cached next to the profile, or compiles the profile
+       and caches the plan if it's missing or out of date.
+       Returns the number of blocks or -1 on failure. */
+    int load (const char *path);
+
+    /* Compiles a profile.
+       Returns the number of blocks or -1 on failure. */
+    int compile (const char *path);
+
+    /* Writes or reads a plan. load_plan fails if the plan wasn't
+       compiled from the profile as it is now (profile NULL to skip the
+       check). Return 0 or -1 on failure. */
+    int save_plan (const char *plan_path);
+    int load_plan (const char *plan_path, const char *profile);
+
+    /* Returns a context for the line of the profile, to connect and free
+       by the caller */
+    c_modbus *new_context ();
+
+    const modbus_profile_link_t *get_link ();
+
+    int nb_blocks ();
+
+    const modbus_profile_block_t *get_block (int block);
+
+    /* Returns the first block of that name or -1 */
+    int find_block (const char *name);
+
+    /* Adds a tag per block to the scheduler, the requests of the plan are
+       sent as is and the values are stored in the plan.
+       Returns 0 or -1 on failure. */
+    int add_tags (c_modbus_scheduler *sched);
+
+    /* Tag of a block in the scheduler given to add_tags */
+    int get_tag (int block);
+
+    /* Copies the last values read of a block as an array of its type
+       (uint8_t for the bits).
+       Returns the number of values or -1 if the block is invalid. */
+    int get_values (int block, void *dest);
+
+    /* Prints the values of the blocks */
+    void dump (FILE *fp);
+
+    void clear ();
+
+private:
+
+    modbus_profile_link_t link;
+    modbus_profile_block_t *blocks;
+    int nb;
+    int max_blocks;
+    uint8_t *values;
+    int values_size;
+    int first_tag;
+    /* Modification time in ns and size of the profile compiled */
+    long long profile_mtime;
+    long long profile_size;
+
+    /* Adds the blocks of a line, split in transactions */
+    int add_blocks (int slave, int function, int address, int count,
+                    uint8_t data_type, int word_order, int period_ms,
+                    int priority, const char *name);
+
+    /* Builds the requests and allocates the values */
+    int build ();
+
+    /* Parses a statement of the profile */
+    int parse_line (char *line, int line_number, int *slave);
+};
+
+#endif  /* _MODBUS_PROFILE_H_ */
@@ -0,0 +1,210 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Bounded queue with a sequence number per slot (D. Vyukov's bounded
+   MPMC queue, with a single consumer).
+
+   The slot of position p is free for the producer when its sequence is
+   p, filled for the consumer when it's p + 1; the consumer sets it to
+   p + capacity when it takes the element, freeing it for the next lap.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+
+#include "modbus_queue.h"
+
+/* Waits a bit longer at each call: spins, yields, then sleeps */
+static void queue_backoff (int *round) {
+    struct timespec ts;
+
+    if (*round < 64) {
+        /* Spin */
+    } else if (*round < 128) {
+        sched_yield ();
+    } else {
+        ts.tv_sec = 0;
+        ts.tv_nsec = 50000;
+        nanosleep (&ts, NULL);
+    }
+    (*round)++;
+}
+
+c_modbus_queue::c_modbus_queue (int element_size, int capacity, int nb_producers, int policy) {
+    unsigned long size = 1;
+    unsigned long i;
+
+    if (capacity <= 0)
+        capacity = MODBUS_QUEUE_DEFAULT_CAPACITY;
+    while (size < (unsigned long) capacity)
+        size <<= 1;
+
+    this->element_size = element_size;
+    /* The sequence, then the element */
+    slot_size = (sizeof (unsigned long) + element_size + sizeof (unsigned long) - 1) &
+                ~ (sizeof (unsigned long) - 1);
+    this->nb_producers = (nb_producers < 1) ? 1 : nb_producers;
+    this->policy = policy;
+    head = 0;
+    tail = 0;
+    max_depth = 0;
+    nb_dropped = 0;
+    nb_waits = 0;
+
+    slots = (uint8_t *) modbus_aligned_alloc (size * slot_size);
+    if (slots == NULL) {
+        fprintf (stderr, "ERROR Can't allocate a queue of %lu elements\n", size);
+        size = 0;
+    }
+    mask = size - 1;
+
+    for (i = 0; i < size; i++)
+        *sequence (i) = i;
+}
+
+c_modbus_queue::~c_modbus_queue () {
+    free (slots);
+}
+
+volatile unsigned long *c_modbus_queue::sequence (unsigned long position) {
+    return (volatile unsigned long *) (slots + (position & mask) * slot_size);
+}
+
+int c_modbus_queue::push (const void *element) {
+    volatile unsigned long *seq;
+    unsigned long position;
+    long diff;
+    int round = 0;
+    int waited = FALSE;
+
+    if (slots == NULL)
+        return -1;
+
+    position = tail;
+    for (;;) {
+        seq = sequence (position);
+        diff = (long) (*seq - position);
+        if (diff == 0) {
+            /* The slot is free, it's taken by moving the tail */
+            if (nb_producers == 1) {
+                tail = position + 1;
+                break;
+            }
+            if (__sync_bool_compare_and_swap (&tail, position, position + 1))
+                break;
+            position = tail;
+        } else if (diff < 0) {
+            /* Full: the consumer didn't free the slot of the last lap */
+            if (policy != MODBUS_QUEUE_BLOCK) {
+                __sync_fetch_and_add (&nb_dropped, 1);
+                return -1;
+            }
+            if (!waited) {
+                __sync_fetch_and_add (&nb_waits, 1);
+                waited = TRUE;
+            }
+            queue_backoff (&round);
+            position = tail;
+        } else {
+            /* Taken by another producer */
+            position = tail;
+        }
+    }
+
+    memcpy ( (uint8_t *) seq + sizeof (unsigned long), element, element_size);
+    /* The element is written before the slot is published */
+    __sync_synchronize ();
+    *seq = position + 1;
+
+    return 0;
+}
+
+int c_modbus_queue::push_batch (const void *elements, int nb) {
+    const uint8_t *element = (const uint8_t *) elements;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        if (push (element + (size_t) i * element_size) < 0)
+            break;
+    }
+
+    return i;
+}
+
+int c_modbus_queue::pop (void *elements, int max, int timeout_ms) {
+    uint8_t *element = (uint8_t *) elements;
+    volatile unsigned long *seq;
+    unsigned long depth;
+    long long deadline = 0;
+    int round = 0;
+    int nb = 0;
+
+    if (slots == NULL)
+        return 0;
+
+    if (timeout_ms > 0)
+        deadline = modbus_time_us () + timeout_ms * 1000LL;
+
+    while (nb < max) {
+        seq = sequence (head);
+        if ( (long) (*seq - (head + 1)) < 0) {
+            /* Empty (or the producer of the next slot isn't done) */
+            if (nb > 0 || timeout_ms == 0 ||
+                    (timeout_ms > 0 && modbus_time_us () >= deadline))
+                break;
+            queue_backoff (&round);
+            continue;
+        }
+
+        if (nb == 0) {
+            depth = tail - head;
+            if (depth > max_depth)
+                max_depth = depth;
+        }
+
+        /* The element is read after its sequence */
+        __sync_synchronize ();
+        memcpy (element + (size_t) nb * element_size,
+                (uint8_t *) seq + sizeof (unsigned long), element_size);
+        __sync_synchronize ();
+        *seq = head + mask + 1;
+        head = head + 1;
+        nb++;
+    }
+
+    return nb;
+}
+
+int c_modbus_queue::pending () {
+    long nb = (long) (tail - head);
+
+    return (nb < 0) ? 0 : nb;
+}
+
+int c_modbus_queue::capacity () {
+    return (slots == NULL) ? 0 : mask + 1;
+}
+
+void c_modbus_queue::get_counters (modbus_queue_counters_t *counters) {
+    counters->nb_pushed = tail;
+    counters->nb_popped = head;
+    counters->nb_dropped = nb_dropped;
+    counters->nb_waits = nb_waits;
+    counters->max_depth = max_depth;
+}
@@ -0,0 +1,144 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_QUEUE_H_
+#define _MODBUS_QUEUE_H_
+
+#include "modbus.h"
+
+#define MODBUS_QUEUE_DEFAULT_CAPACITY  4096
+
+/* What push () does when the queue is full */
+#define MODBUS_QUEUE_DROP   0
+#define MODBUS_QUEUE_BLOCK  1
+
+/* Values of a write command */
+#define MODBUS_COMMAND_MAX_VALUES  16
+
+/* A value read from a slave */
+typedef struct
+{
+    /* Monotonic time in us of the response */
+    long long timestamp_us;
+    uint8_t slave;
+    /* Table read (FC_READ_COIL_STATUS to FC_READ_INPUT_REGISTERS) */
+    uint8_t function;
+    /* UINT8 for the bits, INT8 to DOUBLE for the registers */
+    uint8_t data_type;
+    uint8_t reserved;
+    uint16_t address;
+    union {
+        long long integer;
+        double real;
+    } value;
+} modbus_sample_t;
+
+/* Called on the I/O thread when a command is executed, status like the
+   functions of c_modbus */
+typedef void (*modbus_command_cb_t) (int status, void *arg);
+
+/* A write to send to a slave */
+typedef struct
+{
+    uint8_t slave;
+    /* FC_FORCE_SINGLE_COIL, FC_PRESET_SINGLE_REGISTER,
+       FC_FORCE_MULTIPLE_COILS or FC_PRESET_MULTIPLE_REGISTERS */
+    uint8_t function;
+    uint16_t address;
+    /* Number of values (1 for the single writes) */
+    uint16_t nb;
+    /* 0 or 1 for the coils */
+    uint16_t values[MODBUS_COMMAND_MAX_VALUES];
+    modbus_command_cb_t cb;
+    void *arg;
+} modbus_command_t;
+
+typedef struct
+{
+    unsigned long nb_pushed;
+    unsigned long nb_popped;
+    /* Elements lost with MODBUS_QUEUE_DROP */
+    unsigned long nb_dropped;
+    /* Pushes which waited with MODBUS_QUEUE_BLOCK */
+    unsigned long nb_waits;
+    /* Highest number of elements seen by the consumer */
+    unsigned long max_depth;
+} modbus_queue_counters_t;
+
+/* Bounded lock-free queue of fixed size elements between threads.
+
+   There is one consumer and one producer, or several producers if
+   nb_producers is more than 1 (their pushes then reserve the slots with
+   a compare and swap). Each slot has a sequence number telling whether
+   it is free or filled, so neither side takes a lock and the consumer
+   never waits for a producer which was preempted.
+
+   When the queue is full, push () fails and counts the element as
+   dropped (MODBUS_QUEUE_DROP) or waits for the consumer
+   (MODBUS_QUEUE_BLOCK); a producer which must not wait can check
+   pending () against capacity () to slow down before that. pop ()
+   takes the elements in batches. */
+class c_modbus_queue
+{
+public:
+
+    /* capacity is rounded up to a power of 2 */
+    c_modbus_queue (int element_size, int capacity, int nb_producers, int policy);
+    ~c_modbus_queue ();
+
+    /* Returns 0 or -1 if the element was dropped */
+    int push (const void *element);
+
+    /* Pushes nb elements (one after the other).
+       Returns the number of elements pushed */
+    int push_batch (const void *elements, int nb);
+
+    /* Copies at most max elements in elements, waiting at most timeout_ms
+       ms (0 to return at once, -1 forever) for the first one.
+       Returns the number of elements copied */
+    int pop (void *elements, int max, int timeout_ms);
+
+    /* Number of elements queued */
+    int pending ();
+
+    int capacity ();
+
+    void get_counters (modbus_queue_counters_t *counters);
+
+private:
+
+    uint8_t *slots;
+    int slot_size;
+    int element_size;
+    unsigned long mask;
+    int nb_producers;
+    int policy;
+
+    /* Written by the producers and by the consumer, on their own cache
+       lines */
+    char pad0[MODBUS_CACHE_LINE];
+    volatile unsigned long tail;
+    char pad1[MODBUS_CACHE_LINE];
+    volatile unsigned long head;
+    unsigned long max_depth;
+    char pad2[MODBUS_CACHE_LINE];
+
+    volatile unsigned long nb_dropped;
+    volatile unsigned long nb_waits;
+
+    volatile unsigned long *sequence (unsigned long position);
+};
+
+#endif  /* _MODBUS_QUEUE_H_ */
@@ -0,0 +1,463 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "modbus_scheduler.h"
+#include "modbus_decode.h"
+
+c_modbus_scheduler::c_modbus_scheduler (c_modbus *ctx, int max_tags) {
+    int i;
+
+    this->ctx = ctx;
+    if (max_tags <= 0)
+        max_tags = MODBUS_SCHED_DEFAULT_TAGS;
+    this->max_tags = max_tags;
+    nb_entries = 0;
+    select_time = TIME_OUT_END_OF_TRAME / 1000;
+    running = FALSE;
+    samples = NULL;
+    commands = NULL;
+    for (i = 0; i < MODBUS_SCHED_SLAVES; i++)
+        images[i] = NULL;
+
+    entries = (modbus_sched_entry_t *) malloc (max_tags * sizeof (modbus_sched_entry_t));
+    for (i = 0; i < MODBUS_SCHED_CLASSES; i++) {
+        heaps[i] = (int *) malloc (max_tags * sizeof (int));
+        heap_sizes[i] = 0;
+        if (heaps[i] == NULL)
+            this->max_tags = 0;
+    }
+    if (entries == NULL)
+        this->max_tags = 0;
+}
+
+c_modbus_scheduler::~c_modbus_scheduler () {
+    int i;
+
+    for (i = 0; i < MODBUS_SCHED_CLASSES; i++)
+        free (heaps[i]);
+    free (entries);
+}
+
+void c_modbus_scheduler::heap_push (int priority, int index) {
+    int *heap = heaps[priority];
+    int pos = heap_sizes[priority]++;
+    int parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) / 2;
+        if (entries[heap[parent]].deadline <= entries[index].deadline)
+            break;
+        heap[pos] = heap[parent];
+        pos = parent;
+    }
+    heap[pos] = index;
+}
+
+void c_modbus_scheduler::heap_sift_down (int priority, int pos) {
+    int *heap = heaps[priority];
+    int size = heap_sizes[priority];
+    int index = heap[pos];
+    int child;
+
+    for (;;) {
+        child = 2 * pos + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size &&
+                entries[heap[child + 1]].deadline < entries[heap[child]].deadline)
+            child++;
+        if (entries[index].deadline <= entries[heap[child]].deadline)
+            break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = index;
+}
+
+int c_modbus_scheduler::heap_pop (int priority) {
+    int *heap = heaps[priority];
+    int index = heap[0];
+
+    heap_sizes[priority]--;
+    if (heap_sizes[priority] > 0) {
+        heap[0] = heap[heap_sizes[priority]];
+        heap_sift_down (priority, 0);
+    }
+
+    return index;
+}
+
+int c_modbus_scheduler::add_tag (const modbus_tag_t *tag) {
+    modbus_sched_entry_t *entry;
+    int max_nb;
+
+    if (nb_entries >= max_tags) {
+        fprintf (stderr, "ERROR Too many tags (%d)\n", max_tags);
+        return -1;
+    }
+
+    switch (tag->function) {
+    case FC_READ_COIL_STATUS:
+    case FC_READ_INPUT_STATUS:
+        max_nb = MAX_STATUS;
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+    case FC_READ_INPUT_REGISTERS:
+        max_nb = MAX_REGISTERS;
+        break;
+    default:
+        fprintf (stderr, "ERROR Function code 0x%X can't be polled\n", tag->function);
+        return -1;
+    }
+
+    if (tag->nb <= 0 || tag->nb > max_nb || tag->address < 0) {
+        fprintf (stderr, "ERROR Invalid tag (%d values at %d)\n", tag->nb, tag->address);
+        return -1;
+    }
+
+    if (tag->dest == NULL) {
+        modbus_mapping_t *image = NULL;
+        int nb = 0;
+
+        if (tag->slave >= 0 && tag->slave < MODBUS_SCHED_SLAVES)
+            image = images[tag->slave];
+        if (image != NULL) {
+            switch (tag->function) {
+            case FC_READ_COIL_STATUS:
+                nb = image->nb_coil_status;
+                break;
+            case FC_READ_INPUT_STATUS:
+                nb = image->nb_input_status;
+                break;
+            case FC_READ_HOLDING_REGISTERS:
+                nb = image->nb_holding_registers;
+                break;
+            default:
+                nb = image->nb_input_registers;
+                break;
+            }
+        }
+        if (tag->address + tag->nb > nb) {
+            fprintf (stderr, "ERROR No image of slave %d for %d values at %d\n",
+                     tag->slave, tag->nb, tag->address);
+            return -1;
+        }
+    }
+
+    if (tag->priority < 0 || tag->priority >= MODBUS_SCHED_CLASSES ||
+            tag->period_ms <= 0) {
+        fprintf (stderr, "ERROR Invalid scan class %d or period %d ms\n",
+                 tag->priority, tag->period_ms);
+        return -1;
+    }
+
+    entry = &entries[nb_entries];
+    entry->tag = *tag;
+    memset (&entry->stats, 0, sizeof (modbus_tag_stats_t));
+    entry->deadline = modbus_time_us ();
+    heap_push (tag->priority, nb_entries);
+
+    return nb_entries++;
+}
+
+int c_modbus_scheduler::nb_tags () {
+    return nb_entries;
+}
+
+void c_modbus_scheduler::set_select_time (int select_time) {
+    this->select_time = select_time;
+}
+
+int c_modbus_scheduler::set_image (int slave, modbus_mapping_t *image) {
+    if (slave < 0 || slave >= MODBUS_SCHED_SLAVES)
+        return -1;
+
+    images[slave] = image;
+
+    return 0;
+}
+
+void c_modbus_scheduler::store (const modbus_tag_t *tag, const void *values) {
+    modbus_mapping_t *image = images[tag->slave];
+    uint8_t bits[MAX_STATUS / 8 + 1];
+    uint8_t *tab;
+    modbus_seqlock_t *locks;
+
+    switch (tag->function) {
+    case FC_READ_COIL_STATUS:
+    case FC_READ_INPUT_STATUS:
+        if (tag->function == FC_READ_COIL_STATUS) {
+            tab = image->tab_coil_status;
+            locks = image->seq_coil_status;
+        } else {
+            tab = image->tab_input_status;
+            locks = image->seq_input_status;
+        }
+        if (image->bit_packed) {
+            modbus_bits_pack ( (const uint8_t *) values, tag->nb, bits);
+            modbus_mapping_write_bits (tab, locks, tag->address, tag->nb, bits);
+        } else {
+            modbus_mapping_write (tab, locks, tag->address, tag->nb,
+                                  (const uint8_t *) values);
+        }
+        break;
+    case FC_READ_HOLDING_REGISTERS:
+        modbus_mapping_write (image->tab_holding_registers, image->seq_holding_registers,
+                              tag->address, tag->nb, (const uint16_t *) values);
+        break;
+    default:
+        modbus_mapping_write (image->tab_input_registers, image->seq_input_registers,
+                              tag->address, tag->nb, (const uint16_t *) values);
+        break;
+    }
+}
+
+int c_modbus_scheduler::scan (modbus_sched_entry_t *entry) {
+    modbus_tag_t *tag = &entry->tag;
+    uint16_t values[MAX_STATUS / 2 + 1];
+    void *dest = tag->dest;
+    int status;
+
+    /* The values are stored in the image once the response is whole */
+    if (dest == NULL)
+        dest = values;
+
+    ctx->modbus_set_slave (tag->slave);
+
+    if (tag->request != NULL) {
+        status = ctx->modbus_execute (tag->request, dest, select_time);
+    } else {
+        switch (tag->function) {
+        case FC_READ_COIL_STATUS:
+            status = ctx->read_coil_status (tag->address, tag->nb,
+                                            (uint8_t *) dest, select_time);
+            break;
+        case FC_READ_INPUT_STATUS:
+            status = ctx->read_input_status (tag->address, tag->nb,
+                                             (uint8_t *) dest, select_time);
+            break;
+        default:
+            status = ctx->read_registers_typed (tag->function, tag->address, tag->nb,
+                                                dest, UINT16, WORD_ORDER_BIG, select_time);
+            break;
+        }
+    }
+
+    if (tag->dest == NULL && status > 0)
+        store (tag, dest);
+
+    if (samples != NULL && status > 0)
+        publish (tag, dest, status);
+
+    return status;
+}
+
+void c_modbus_scheduler::set_queues (c_modbus_queue *samples, c_modbus_queue *commands) {
+    this->samples = samples;
+    this->commands = commands;
+}
+
+void c_modbus_scheduler::publish (const modbus_tag_t *tag, const void *values, int nb) {
+    modbus_sample_t sample;
+    int bits = (tag->function == FC_READ_COIL_STATUS || tag->function == FC_READ_INPUT_STATUS);
+    int i;
+
+    memset (&sample, 0, sizeof (sample));
+    sample.timestamp_us = modbus_time_us ();
+    sample.slave = tag->slave;
+    sample.function = tag->function;
+    sample.data_type = bits ? UINT8 : UINT16;
+
+    /* A full queue drops or waits according to its policy */
+    for (i = 0; i < nb; i++) {
+        sample.address = tag->address + i;
+        if (bits)
+            sample.value.integer = ( (const uint8_t *) values) [i];
+        else
+            sample.value.integer = ( (const uint16_t *) values) [i];
+        samples->push (&sample);
+    }
+}
+
+int c_modbus_scheduler::execute (const modbus_command_t *command) {
+    uint8_t bits[MODBUS_COMMAND_MAX_VALUES];
+    int status;
+    int i;
+
+    if (command->nb < 1 || command->nb > MODBUS_COMMAND_MAX_VALUES) {
+        fprintf (stderr, "ERROR Invalid number of values of a command (%d)\n", command->nb);
+        return INVALID_DATA;
+    }
+
+    ctx->modbus_set_slave (command->slave);
+
+    switch (command->function) {
+    case FC_FORCE_SINGLE_COIL:
+        status = ctx->force_single_coil (command->address, command->values[0], select_time);
+        break;
+    case FC_PRESET_SINGLE_REGISTER:
+        status = ctx->preset_single_register (command->address, command->values[0], select_time);
+        break;
+    case FC_FORCE_MULTIPLE_COILS:
+        for (i = 0; i < command->nb; i++)
+            bits[i] = command->values[i] ? TRUE : FALSE;
+        status = ctx->force_multiple_coils (command->address, command->nb, bits, select_time);
+        break;
+    case FC_PRESET_MULTIPLE_REGISTERS:
+        status = ctx->preset_multiple_registers (command->address, command->nb,
+                                                 command->values, select_time);
+        break;
+    default:
+        fprintf (stderr, "ERROR Invalid function of a command (0x%X)\n", command->function);
+        status = INVALID_DATA;
+        break;
+    }
+
+    return status;
+}
+
+int c_modbus_scheduler::execute_command (int max_wait) {
+    modbus_command_t command;
+    int status;
+
+    if (commands->pop (&command, 1, max_wait) != 1)
+        return 0;
+
+    status = execute (&command);
+    if (command.cb != NULL)
+        command.cb (status, command.arg);
+
+    return 1;
+}
+
+int c_modbus_scheduler::run_once (int max_wait) {
+    modbus_sched_entry_t *entry;
+    long long now;
+    long long next;
+    long long lateness;
+    long long period;
+    long long missed;
+    int priority;
+    int index = -1;
+    int status;
+
+    /* A write of the application goes before the scans, one per call */
+    if (commands != NULL && execute_command (0) > 0)
+        return 1;
+
+    now = modbus_time_us ();
+    next = now + (long long) max_wait * 1000;
+
+    /* Most urgent class first */
+    for (priority = 0; priority < MODBUS_SCHED_CLASSES; priority++) {
+        if (heap_sizes[priority] == 0)
+            continue;
+        entry = &entries[heaps[priority][0]];
+        if (entry->deadline <= now) {
+            index = heap_pop (priority);
+            break;
+        }
+        if (entry->deadline < next)
+            next = entry->deadline;
+    }
+
+    if (index == -1) {
+        /* Nothing due, the bus waits for the next deadline (or for a
+           command) */
+        if (next > now && commands != NULL)
+            return execute_command ( (next - now + 999) / 1000);
+        if (next > now)
+            ctx->modbus_sleep ( (next - now) / 1000000, (next - now) % 1000000);
+        return 0;
+    }
+
+    entry = &entries[index];
+    lateness = now - entry->deadline;
+    period = (long long) entry->tag.period_ms * 1000;
+
+    status = scan (entry);
+
+    entry->stats.nb_scans++;
+    entry->stats.last_status = status;
+    if (status < 0)
+        entry->stats.nb_errors++;
+    entry->stats.total_lateness_us += lateness;
+    if (lateness > entry->stats.max_lateness_us)
+        entry->stats.max_lateness_us = lateness;
+
+    entry->deadline += period;
+    if (lateness >= period) {
+        /* The scan started after the next period, skips the periods
+           missed to keep the phase */
+        missed = lateness / period;
+        entry->stats.nb_overruns += missed;
+        entry->deadline += missed * period;
+    }
+    heap_push (entry->tag.priority, index);
+
+    if (entry->tag.cb != NULL)
+        entry->tag.cb (index, status, entry->tag.arg);
+
+    return 1;
+}
+
+void c_modbus_scheduler::run () {
+    running = TRUE;
+    while (running) {
+        run_once (select_time);
+    }
+}
+
+void c_modbus_scheduler::stop () {
+    running = FALSE;
+}
+
+int c_modbus_scheduler::get_stats (int tag_id, modbus_tag_stats_t *stats) {
+    if (tag_id < 0 || tag_id >= nb_entries)
+        return -1;
+
+    *stats = entries[tag_id].stats;
+
+    return 0;
+}
+
+void c_modbus_scheduler::reset_stats () {
+    int i;
+
+    for (i = 0; i < nb_entries; i++)
+        memset (&entries[i].stats, 0, sizeof (modbus_tag_stats_t));
+}
+
+void c_modbus_scheduler::dump_stats (FILE *fp) {
+    modbus_sched_entry_t *entry;
+    int i;
+
+    fprintf (fp, "tag  slave  fc  address   nb  period  scans  errors  overruns  lateness(avg/max us)\n");
+    for (i = 0; i < nb_entries; i++) {
+        entry = &entries[i];
+        if (entry->stats.nb_errors == 0 && entry->stats.nb_overruns == 0)
+            continue;
+        fprintf (fp, "%3d  %5d  %2d  %7d  %3d  %6d  %5lu  %6lu  %8lu  %lld/%lld\n",
+                 i, entry->tag.slave, entry->tag.function, entry->tag.address,
+                 entry->tag.nb, entry->tag.period_ms, entry->stats.nb_scans,
+                 entry->stats.nb_errors, entry->stats.nb_overruns,
+                 entry->stats.nb_scans ? entry->stats.total_lateness_us / (long long) entry->stats.nb_scans : 0LL,
+                 entry->stats.max_lateness_us);
+    }
+}
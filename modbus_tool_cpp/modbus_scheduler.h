@@ -0,0 +1,175 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_SCHEDULER_H_
+#define _MODBUS_SCHEDULER_H_
+
+#include <stdio.h>
+
+#include "modbus.h"
+#include "modbus_mapping.h"
+#include "modbus_queue.h"
+
+/* Scan classes, 0 is the most urgent (alarms) */
+#define MODBUS_SCHED_CLASSES          4
+#define MODBUS_SCHED_DEFAULT_TAGS  1024
+#define MODBUS_SCHED_SLAVES         256
+
+/* Called after each scan of a tag. status is the number of values read
+   or less than 0 for exceptions errors, like the functions of c_modbus. */
+typedef void (*modbus_sched_cb_t) (int tag_id, int status, void *arg);
+
+/* A block of values polled at a fixed rate */
+typedef struct
+{
+    int slave;
+    /* FC_READ_COIL_STATUS, FC_READ_INPUT_STATUS,
+       FC_READ_HOLDING_REGISTERS or FC_READ_INPUT_REGISTERS */
+    int function;
+    int address;
+    int nb;
+    /* uint8_t[nb] for the bits, uint16_t[nb] for the registers, or NULL
+       to store the values in the image of the slave (see set_image) at
+       the same address */
+    void *dest;
+    int period_ms;
+    /* Scan class, 0 to MODBUS_SCHED_CLASSES - 1 */
+    int priority;
+    modbus_sched_cb_t cb;
+    void *arg;
+    /* Query prepared beforehand (see modbus_prepare, the blocks of a
+       c_modbus_profile), sent as is at each scan. NULL to build the
+       query at each scan. */
+    modbus_prepared_t *request;
+} modbus_tag_t;
+
+typedef struct
+{
+    unsigned long nb_scans;
+    unsigned long nb_errors;
+    /* Scans which couldn't start before the next period */
+    unsigned long nb_overruns;
+    /* Delay between the deadline and the start of the scan */
+    long long max_lateness_us;
+    long long total_lateness_us;
+    int last_status;
+} modbus_tag_stats_t;
+
+typedef struct
+{
+    modbus_tag_t tag;
+    modbus_tag_stats_t stats;
+    /* Monotonic time in us of the next scan */
+    long long deadline;
+} modbus_sched_entry_t;
+
+/* Polls a list of tags over one c_modbus connection.
+
+   The tags of each scan class are kept in a heap ordered by deadline.
+   Before each transaction the scheduler takes the most urgent class
+   having a tag due and scans its earliest deadline, so a fast class
+   preempts the slow ones at the next transaction. The bus only waits
+   when no tag is due.
+
+   A tag keeps its phase (the next deadline is the previous one plus the
+   period). When a scan starts after the next period, an overrun is
+   counted and the missed periods are skipped. */
+class c_modbus_scheduler
+{
+public:
+
+    c_modbus_scheduler (c_modbus *ctx, int max_tags);
+    ~c_modbus_scheduler ();
+
+    /* Adds a tag, its first scan is due immediately.
+       Returns the tag id or -1 on failure. */
+    int add_tag (const modbus_tag_t *tag);
+
+    /* The tags of the slave without dest store their values in the
+       tables of image (a c_modbus_shm for example) with its sequence
+       locks, the readers of the image see each scan whole. Must be set
+       before adding the tags, NULL to remove it.
+       Returns 0 or -1 if the slave is invalid. */
+    int set_image (int slave, modbus_mapping_t *image);
+
+    /* Number of tags */
+    int nb_tags ();
+
+    /* Each value read by a scan is pushed to samples (modbus_sample_t,
+       UINT8 for the bits, UINT16 for the registers), and the writes
+       popped from commands (modbus_command_t) are sent before the next
+       scan, so the application threads never touch the bus. The queues
+       belong to the caller, NULL for none. */
+    void set_queues (c_modbus_queue *samples, c_modbus_queue *commands);
+
+    /* Response time out in ms for each transaction (default 500) */
+    void set_select_time (int select_time);
+
+    /* Waits at most max_wait ms for a tag to be due and scans it, or
+       sends a command (see set_queues).
+       Returns the number of scans or commands (0 or 1). */
+    int run_once (int max_wait);
+
+    /* Scans the tags until stop () is called */
+    void run ();
+
+    void stop ();
+
+    /* Returns 0 or -1 if the tag id is invalid */
+    int get_stats (int tag_id, modbus_tag_stats_t *stats);
+
+    void reset_stats ();
+
+    /* Prints the statistics of the tags having overruns or errors */
+    void dump_stats (FILE *fp);
+
+private:
+
+    c_modbus *ctx;
+    modbus_sched_entry_t *entries;
+    int max_tags;
+    int nb_entries;
+    /* Heaps of entry indexes, one per class */
+    int *heaps[MODBUS_SCHED_CLASSES];
+    int heap_sizes[MODBUS_SCHED_CLASSES];
+    int select_time;
+    volatile int running;
+    modbus_mapping_t *images[MODBUS_SCHED_SLAVES];
+
+    /* See set_queues */
+    c_modbus_queue *samples;
+    c_modbus_queue *commands;
+
+    void heap_push (int priority, int index);
+    int heap_pop (int priority);
+    void heap_sift_down (int priority, int pos);
+
+    /* Performs the transaction of a tag */
+    int scan (modbus_sched_entry_t *entry);
+
+    /* Copies the values of a scan to the image of the slave */
+    void store (const modbus_tag_t *tag, const void *values);
+
+    /* Pushes the values of a scan to the samples queue */
+    void publish (const modbus_tag_t *tag, const void *values, int nb);
+
+    /* Sends a command queued, waiting at most max_wait ms for one.
+       Returns 1 if a command was sent or 0 */
+    int execute_command (int max_wait);
+
+    int execute (const modbus_command_t *command);
+};
+
+#endif  /* _MODBUS_SCHEDULER_H_ */
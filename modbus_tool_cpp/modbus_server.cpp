@@ -0,0 +1,467 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Event driven Modbus TCP slave (Linux epoll).
+
+   A single thread accepts the masters and receives their queries without
+   blocking: the reception of each connection progresses with the data
+   available and resumes at the next event.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "modbus_server.h"
+#include "modbus_capture.h"
+
+#define MAX_EVENTS 64
+
+c_modbus_server::c_modbus_server (c_modbus *ctx, modbus_mapping_t *mb_mapping,
+                                  int max_connections) {
+    int i;
+
+    this->ctx = ctx;
+    this->mb_mapping = mb_mapping;
+    if (max_connections <= 0)
+        max_connections = MODBUS_SERVER_DEFAULT_CONNECTIONS;
+    this->max_connections = max_connections;
+    nb_connections = 0;
+    listen_fd = -1;
+    own_listen_fd = FALSE;
+    epoll_fd = -1;
+    running = FALSE;
+    handler = NULL;
+    handler_arg = NULL;
+
+    conns = (modbus_server_conn_t *) malloc (max_connections * sizeof (modbus_server_conn_t));
+    if (conns == NULL) {
+        this->max_connections = 0;
+    }
+    /* The buffers are allocated with the first connection of a slot */
+    for (i = 0; i < this->max_connections; i++) {
+        conns[i].fd = -1;
+        conns[i].rx = NULL;
+        conns[i].tx = NULL;
+        conns[i].writing = FALSE;
+    }
+
+    /* A failure on a connection only closes that connection */
+    ctx->modbus_set_error_handling (NOP_ON_ERROR);
+}
+
+c_modbus_server::~c_modbus_server () {
+    int i;
+
+    modbus_server_close ();
+    for (i = 0; i < max_connections; i++) {
+        delete conns[i].rx;
+        delete conns[i].tx;
+    }
+    free (conns);
+}
+
+int c_modbus_server::modbus_server_listen (int nb_connection) {
+    if (ctx->mb_param->type_com != TCP) {
+        fprintf (stderr, "ERROR The server is only available in TCP\n");
+        return -1;
+    }
+
+    listen_fd = ctx->modbus_slave_listen_tcp (nb_connection);
+    if (listen_fd < 0)
+        return -1;
+    own_listen_fd = TRUE;
+    fcntl (listen_fd, F_SETFL, fcntl (listen_fd, F_GETFL) | O_NONBLOCK);
+
+    return server_watch_listen_fd ();
+}
+
+int c_modbus_server::modbus_server_listen_fd (int fd) {
+    if (ctx->mb_param->type_com != TCP) {
+        fprintf (stderr, "ERROR The server is only available in TCP\n");
+        return -1;
+    }
+
+    listen_fd = fd;
+    own_listen_fd = FALSE;
+
+    return server_watch_listen_fd ();
+}
+
+int c_modbus_server::modbus_server_get_listen_fd () {
+    return listen_fd;
+}
+
+int c_modbus_server::server_watch_listen_fd () {
+    struct epoll_event ev;
+
+    epoll_fd = epoll_create (max_connections + 1);
+    if (epoll_fd < 0) {
+        perror ("epoll_create");
+        if (own_listen_fd)
+            close (listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror ("epoll_ctl");
+        modbus_server_close ();
+        return -1;
+    }
+
+    return 0;
+}
+
+void c_modbus_server::server_accept () {
+    int i;
+    int fd;
+    int option;
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    struct epoll_event ev;
+    modbus_server_conn_t *conn;
+
+    for (;;) {
+        addrlen = sizeof (struct sockaddr_in);
+        fd = accept (listen_fd, (struct sockaddr *) &addr, &addrlen);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != ECONNABORTED && errno != EINTR)
+                perror ("accept");
+            return;
+        }
+
+        conn = NULL;
+        for (i = 0; i < max_connections; i++) {
+            if (conns[i].fd == -1) {
+                conn = &conns[i];
+                break;
+            }
+        }
+        if (conn == NULL) {
+            fprintf (stderr, "ERROR Too many connections, %s refused\n",
+                     inet_ntoa (addr.sin_addr));
+            close (fd);
+            continue;
+        }
+
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+        option = 1;
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &option, sizeof (int));
+
+        memset (&ev, 0, sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror ("epoll_ctl");
+            close (fd);
+            continue;
+        }
+
+        if (conn->rx == NULL) {
+            conn->rx = new c_modbus_rx_ring (MODBUS_IO_DEFAULT_SIZE);
+            conn->tx = new c_modbus_tx_queue (MODBUS_IO_DEFAULT_SIZE, MODBUS_IO_DEFAULT_IOV);
+        }
+        conn->rx->reset ();
+        conn->fd = fd;
+        conn->writing = FALSE;
+        nb_connections++;
+
+        if (ctx->mb_param->debug) {
+            printf ("The client %s is connected\n", inet_ntoa (addr.sin_addr));
+        }
+    }
+}
+
+int c_modbus_server::server_receive (modbus_server_conn_t *conn) {
+    int ret;
+
+    /* All the queries in the socket buffer at once (the epoll is level
+       triggered, what doesn't fit is read at the next event) */
+    ret = conn->rx->fill (conn->fd);
+    if (ret < 0)
+        return -1;
+
+    return server_process (conn);
+}
+
+int c_modbus_server::server_process (modbus_server_conn_t *conn) {
+    uint8_t *query;
+    int ret = 0;
+    int i;
+    int nb_queries = 0;
+    int old_fd;
+
+    for (;;) {
+        /* A master which doesn't read its responses isn't answered
+           anymore: its queries wait in rx until the socket takes the
+           responses queued (EPOLLOUT) */
+        if (conn->writing)
+            break;
+        if (conn->tx->room () < MAX_ADU_LENGTH_TCP) {
+            if (server_flush (conn) < 0)
+                return -1;
+            if (conn->writing)
+                break;
+        }
+
+        ret = conn->rx->next_frame (&query);
+        if (ret <= 0)
+            break;
+
+        if (ctx->mb_param->debug) {
+            for (i = 0; i < ret; i++)
+                printf ("<%.2X>", query[i]);
+            printf ("\n");
+        }
+        if (ctx->capture != NULL)
+            ctx->capture_frame (MODBUS_CAPTURE_RX, query, ret);
+
+        if (handler != NULL) {
+            handler (conn->fd, query, ret, handler_arg);
+        } else {
+            /* The response is queued for the socket of the connection */
+            old_fd = ctx->mb_param->fd;
+            ctx->mb_param->fd = conn->fd;
+            ctx->modbus_set_tx_queue (conn->tx);
+            ctx->modbus_slave_manage (query, ret, mb_mapping);
+            ctx->modbus_set_tx_queue (NULL);
+            ctx->mb_param->fd = old_fd;
+        }
+        nb_queries++;
+    }
+    /* The stream is out of sync, the connection is dropped */
+    if (ret < 0)
+        return -1;
+
+    if (server_flush (conn) < 0)
+        return -1;
+
+    return nb_queries;
+}
+
+int c_modbus_server::server_flush (modbus_server_conn_t *conn) {
+    struct epoll_event ev;
+    int pending;
+
+    if (conn->tx->pending () == 0 && !conn->writing)
+        return 0;
+
+    pending = conn->tx->flush (conn->fd);
+    if (pending < 0)
+        return -1;
+
+    /* The socket buffer is full, the rest is sent once it's writable.
+       Meanwhile nothing more is read from the master */
+    if ( (pending > 0) != conn->writing) {
+        conn->writing = (pending > 0);
+        memset (&ev, 0, sizeof (ev));
+        ev.events = conn->writing ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl (epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+
+    return 0;
+}
+
+modbus_server_conn_t *c_modbus_server::server_find_conn (int fd) {
+    int i;
+
+    if (fd < 0)
+        return NULL;
+
+    for (i = 0; i < max_connections; i++) {
+        if (conns[i].fd == fd)
+            return &conns[i];
+    }
+
+    return NULL;
+}
+
+int c_modbus_server::modbus_server_send (int fd, const uint8_t *response,
+                                         int response_length) {
+    modbus_server_conn_t *conn = server_find_conn (fd);
+
+    if (conn == NULL)
+        return -1;
+
+    if (conn->tx->push_copy (response, response_length) == 0)
+        return 0;
+
+    /* Full, what the socket takes now frees room (a failure closes the
+       connection at its next flush, not from a handler) */
+    if (server_flush (conn) < 0)
+        return -1;
+
+    return conn->tx->push_copy (response, response_length);
+}
+
+void c_modbus_server::modbus_server_flush () {
+    int i;
+
+    for (i = 0; i < max_connections; i++) {
+        if (conns[i].fd != -1 && server_flush (&conns[i]) < 0)
+            server_close_conn (&conns[i]);
+    }
+}
+
+void c_modbus_server::server_close_conn (modbus_server_conn_t *conn) {
+    /* The handler mustn't answer on a descriptor which may be reused */
+    if (handler != NULL)
+        handler (conn->fd, NULL, 0, handler_arg);
+
+    epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    ctx->modbus_slave_close_tcp (conn->fd);
+    conn->fd = -1;
+    conn->tx->clear ();
+    nb_connections--;
+}
+
+int c_modbus_server::modbus_server_run_once (int select_time) {
+    int i;
+    int nfds;
+    int ret;
+    int nb_queries = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    nfds = epoll_wait (epoll_fd, events, MAX_EVENTS, select_time);
+    if (nfds < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror ("epoll_wait");
+        return -1;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        modbus_server_conn_t *conn = (modbus_server_conn_t *) events[i].data.ptr;
+
+        if (conn == NULL) {
+            server_accept ();
+            continue;
+        }
+
+        if (conn->fd == -1)
+            continue;
+
+        if (events[i].events & EPOLLIN) {
+            ret = server_receive (conn);
+            if (ret < 0) {
+                server_close_conn (conn);
+                continue;
+            }
+            nb_queries += ret;
+        }
+
+        if (events[i].events & EPOLLOUT) {
+            if (server_flush (conn) < 0) {
+                server_close_conn (conn);
+                continue;
+            }
+            /* Drained, the queries left in rx are answered */
+            if (!conn->writing) {
+                ret = server_process (conn);
+                if (ret < 0) {
+                    server_close_conn (conn);
+                    continue;
+                }
+                nb_queries += ret;
+            }
+        }
+
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+            server_close_conn (conn);
+        }
+    }
+
+    return nb_queries;
+}
+
+int c_modbus_server::modbus_server_run () {
+    running = TRUE;
+    while (running) {
+        if (modbus_server_run_once (TIME_OUT_END_OF_TRAME / 1000) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void c_modbus_server::modbus_server_stop () {
+    running = FALSE;
+}
+
+int c_modbus_server::modbus_server_nb_connections () {
+    return nb_connections;
+}
+
+void c_modbus_server::modbus_server_set_handler (modbus_server_handler_t handler, void *arg) {
+    this->handler = handler;
+    handler_arg = arg;
+}
+
+void c_modbus_server::modbus_server_close () {
+    int i;
+
+    for (i = 0; i < max_connections; i++) {
+        if (conns[i].fd != -1)
+            server_close_conn (&conns[i]);
+    }
+
+    if (epoll_fd != -1) {
+        close (epoll_fd);
+        epoll_fd = -1;
+    }
+
+    if (listen_fd != -1) {
+        if (own_listen_fd)
+            close (listen_fd);
+        listen_fd = -1;
+    }
+
+}
+
+void c_modbus_server::modbus_server_get_io_counters (modbus_io_counters_t *rx, modbus_io_counters_t *tx) {
+    modbus_io_counters_t counters;
+    int i;
+
+    memset (rx, 0, sizeof (*rx));
+    memset (tx, 0, sizeof (*tx));
+    for (i = 0; i < max_connections; i++) {
+        if (conns[i].rx == NULL)
+            continue;
+        conns[i].rx->get_counters (&counters);
+        rx->nb_calls += counters.nb_calls;
+        rx->nb_frames += counters.nb_frames;
+        rx->nb_bytes += counters.nb_bytes;
+        conns[i].tx->get_counters (&counters);
+        tx->nb_calls += counters.nb_calls;
+        tx->nb_frames += counters.nb_frames;
+        tx->nb_bytes += counters.nb_bytes;
+    }
+}
@@ -0,0 +1,147 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_SERVER_H_
+#define _MODBUS_SERVER_H_
+
+#include "modbus.h"
+#include "modbus_io.h"
+
+#define MODBUS_SERVER_DEFAULT_CONNECTIONS  256
+
+/* Called for each complete query instead of modbus_slave_manage, the
+   handler sends the response of fd with modbus_server_send, at once or
+   later. It's
+   called with query set to NULL when the connection of fd is closed. */
+typedef void (*modbus_server_handler_t) (int fd, const uint8_t *query,
+                                         int query_length, void *arg);
+
+/* State of a connection with a modbus master */
+typedef struct
+{
+    /* Socket, -1 if the slot is free */
+    int fd;
+    /* Queries received, parsed in place */
+    c_modbus_rx_ring *rx;
+    /* Responses of the queries of an event, sent together */
+    c_modbus_tx_queue *tx;
+    /* Waiting for the socket to take the rest of the responses */
+    int writing;
+} modbus_server_conn_t;
+
+/* Event driven Modbus TCP slave serving many masters from one thread.
+
+   The sockets are watched with epoll. On each event, all the data of the
+   socket is read with one recv () in the buffer of the connection and
+   every complete query is answered by modbus_slave_manage of the
+   c_modbus context given to the constructor; the responses are queued
+   and sent with one system call (see c_modbus_tx_queue), so a master
+   pipelining its queries costs much less than one system call per
+   transaction. That context must be initialized with modbus_init_tcp,
+   its error handling is set to NOP_ON_ERROR because a failure on one
+   connection must not reconnect the context.
+
+   To use several cores, run one server per thread, each with its own
+   c_modbus context, on the listening socket of the first one (see
+   modbus_server_listen_fd) and a mapping created by
+   modbus_mapping_new_concurrent. */
+class c_modbus_server
+{
+public:
+
+    c_modbus_server (c_modbus *ctx, modbus_mapping_t *mb_mapping,
+                     int max_connections);
+    ~c_modbus_server ();
+
+    /* Listens on the port of the context.
+       Returns 0 on success or -1 on failure. */
+    int modbus_server_listen (int nb_connection);
+
+    /* Accepts the connections of a socket already listening (returned by
+       modbus_server_get_listen_fd of another server). The socket isn't
+       closed by this server.
+       Returns 0 on success or -1 on failure. */
+    int modbus_server_listen_fd (int fd);
+
+    int modbus_server_get_listen_fd ();
+
+    /* Waits at most select_time ms for events and handles them.
+       Returns the number of queries answered or -1 on failure. */
+    int modbus_server_run_once (int select_time);
+
+    /* Handles events until modbus_server_stop () is called.
+       Returns 0 or -1 on failure. */
+    int modbus_server_run ();
+
+    void modbus_server_stop ();
+
+    /* Number of connected masters */
+    int modbus_server_nb_connections ();
+
+    /* Gives the queries to handler instead of answering them from the
+       mapping (NULL to restore) */
+    void modbus_server_set_handler (modbus_server_handler_t handler, void *arg);
+
+    /* Queues a response of the handler for the connection fd, sent by
+       modbus_server_flush () or at the end of the next event.
+       Returns 0 or -1 if the connection is closed or its queue full */
+    int modbus_server_send (int fd, const uint8_t *response, int response_length);
+
+    /* Sends the responses queued on all the connections */
+    void modbus_server_flush ();
+
+    /* Closes all the connections and the listening socket */
+    void modbus_server_close ();
+
+    /* System calls, frames and bytes received and sent since the start */
+    void modbus_server_get_io_counters (modbus_io_counters_t *rx, modbus_io_counters_t *tx);
+
+private:
+
+    c_modbus *ctx;
+    modbus_mapping_t *mb_mapping;
+    modbus_server_conn_t *conns;
+    int max_connections;
+    int nb_connections;
+    int listen_fd;
+    int own_listen_fd;
+    int epoll_fd;
+    volatile int running;
+    modbus_server_handler_t handler;
+    void *handler_arg;
+
+    int server_watch_listen_fd ();
+
+    void server_accept ();
+
+    /* Returns the number of queries answered or -1 if the connection
+       must be closed */
+    int server_receive (modbus_server_conn_t *conn);
+
+    /* Answers the queries of rx while the responses can be sent.
+       Returns like server_receive */
+    int server_process (modbus_server_conn_t *conn);
+
+    /* Sends the responses queued.
+       Returns 0 or -1 if the connection must be closed */
+    int server_flush (modbus_server_conn_t *conn);
+
+    void server_close_conn (modbus_server_conn_t *conn);
+
+    /* Returns the connection of fd or NULL */
+    modbus_server_conn_t *server_find_conn (int fd);
+};
+
+#endif  /* _MODBUS_SERVER_H_ */
@@ -0,0 +1,299 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modbus_shm.h"
+
+static size_t shm_align (size_t size) {
+    return (size + MODBUS_CACHE_LINE - 1) & ~ (size_t) (MODBUS_CACHE_LINE - 1);
+}
+
+/* Computes the offsets of the tables and locks of a layout in header.
+   Returns the size of the region. */
+static uint64_t shm_layout (modbus_shm_header_t *header) {
+    uint64_t offset = shm_align (sizeof (modbus_shm_header_t));
+    int64_t nb;
+    int i;
+
+    for (i = 0; i < MODBUS_SHM_TABLES; i++) {
+        nb = header->nb_values[i];
+        header->table_offsets[i] = offset;
+        if (i == MODBUS_SHM_COIL_STATUS || i == MODBUS_SHM_INPUT_STATUS)
+            offset += shm_align (header->bit_packed ? (nb + 7) / 8 : nb);
+        else
+            offset += shm_align (nb * sizeof (uint16_t));
+    }
+
+    for (i = 0; i < MODBUS_SHM_TABLES; i++) {
+        header->lock_offsets[i] = offset;
+        offset += shm_align ( (header->nb_values[i] / MODBUS_MAPPING_BLOCK + 1) *
+                              sizeof (modbus_seqlock_t));
+    }
+
+    return offset;
+}
+
+c_modbus_shm::c_modbus_shm () {
+    fd = -1;
+    map = NULL;
+    map_size = 0;
+    header = NULL;
+    generation = 0;
+    memset (&mapping, 0, sizeof (mapping));
+}
+
+c_modbus_shm::~c_modbus_shm () {
+    close ();
+}
+
+/* A name without other '/' than the first one is a shared memory
+   object */
+static int is_shm_name (const char *name) {
+    return name[0] == '/' && strchr (name + 1, '/') == NULL;
+}
+
+int c_modbus_shm::open_object (const char *name, int flags) {
+    if (is_shm_name (name))
+        return shm_open (name, flags, 0644);
+
+    return ::open (name, flags, 0644);
+}
+
+int c_modbus_shm::unlink (const char *name) {
+    if (is_shm_name (name))
+        return shm_unlink (name);
+
+    return ::unlink (name);
+}
+
+void c_modbus_shm::set_mapping () {
+    mapping.nb_coil_status = header->nb_values[MODBUS_SHM_COIL_STATUS];
+    mapping.nb_input_status = header->nb_values[MODBUS_SHM_INPUT_STATUS];
+    mapping.nb_holding_registers = header->nb_values[MODBUS_SHM_HOLDING_REGISTERS];
+    mapping.nb_input_registers = header->nb_values[MODBUS_SHM_INPUT_REGISTERS];
+    mapping.bit_packed = header->bit_packed;
+
+    mapping.tab_coil_status = map + header->table_offsets[MODBUS_SHM_COIL_STATUS];
+    mapping.tab_input_status = map + header->table_offsets[MODBUS_SHM_INPUT_STATUS];
+    mapping.tab_holding_registers =
+        (uint16_t *) (map + header->table_offsets[MODBUS_SHM_HOLDING_REGISTERS]);
+    mapping.tab_input_registers =
+        (uint16_t *) (map + header->table_offsets[MODBUS_SHM_INPUT_REGISTERS]);
+
+    mapping.seq_coil_status =
+        (modbus_seqlock_t *) (map + header->lock_offsets[MODBUS_SHM_COIL_STATUS]);
+    mapping.seq_input_status =
+        (modbus_seqlock_t *) (map + header->lock_offsets[MODBUS_SHM_INPUT_STATUS]);
+    mapping.seq_holding_registers =
+        (modbus_seqlock_t *) (map + header->lock_offsets[MODBUS_SHM_HOLDING_REGISTERS]);
+    mapping.seq_input_registers =
+        (modbus_seqlock_t *) (map + header->lock_offsets[MODBUS_SHM_INPUT_REGISTERS]);
+}
+
+int c_modbus_shm::create (const char *name, int nb_coil_status, int nb_input_status,
+                          int nb_holding_registers, int nb_input_registers, int packed) {
+    modbus_shm_header_t layout;
+    modbus_seqlock_t *locks;
+    struct stat st;
+    int kept = FALSE;
+    int i;
+    int j;
+
+    close ();
+
+    if (nb_coil_status < 0 || nb_input_status < 0 ||
+            nb_holding_registers < 0 || nb_input_registers < 0) {
+        fprintf (stderr, "ERROR Invalid size of the image %s\n", name);
+        return -1;
+    }
+
+    memset (&layout, 0, sizeof (layout));
+    layout.magic = MODBUS_SHM_MAGIC;
+    layout.version = MODBUS_SHM_VERSION;
+    layout.header_size = sizeof (modbus_shm_header_t);
+    layout.nb_values[MODBUS_SHM_COIL_STATUS] = nb_coil_status;
+    layout.nb_values[MODBUS_SHM_INPUT_STATUS] = nb_input_status;
+    layout.nb_values[MODBUS_SHM_HOLDING_REGISTERS] = nb_holding_registers;
+    layout.nb_values[MODBUS_SHM_INPUT_REGISTERS] = nb_input_registers;
+    layout.bit_packed = packed ? TRUE : FALSE;
+    layout.size = shm_layout (&layout);
+
+    fd = open_object (name, O_RDWR | O_CREAT);
+    if (fd == -1) {
+        fprintf (stderr, "ERROR Can't create the image %s (%s)\n", name, strerror (errno));
+        return -1;
+    }
+
+    if (fstat (fd, &st) == -1) {
+        fprintf (stderr, "ERROR Can't stat the image %s (%s)\n", name, strerror (errno));
+        close ();
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        map_size = st.st_size;
+        map = (uint8_t *) mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf (stderr, "ERROR Can't map the image %s (%s)\n", name, strerror (errno));
+            map = NULL;
+            close ();
+            return -1;
+        }
+        header = (modbus_shm_header_t *) map;
+
+        if ( (uint64_t) st.st_size >= sizeof (modbus_shm_header_t) &&
+                header->magic == MODBUS_SHM_MAGIC && header->version == MODBUS_SHM_VERSION) {
+            /* The generation goes on, even for a new layout, so the
+               consumers still attached see the change */
+            layout.generation = header->generation;
+
+            if ( (uint64_t) st.st_size == layout.size && header->size == layout.size &&
+                    header->bit_packed == layout.bit_packed &&
+                    memcmp (header->nb_values, layout.nb_values, sizeof (layout.nb_values)) == 0)
+                kept = TRUE;
+            else
+                header->generation++;
+        }
+
+        if (!kept) {
+            /* The consumers keep their mapping of the old image, a fresh
+               one is created instead of resizing it under them */
+            close ();
+            if (unlink (name) == -1 && errno != ENOENT) {
+                fprintf (stderr, "ERROR Can't remove the image %s (%s)\n", name, strerror (errno));
+                return -1;
+            }
+
+            fd = open_object (name, O_RDWR | O_CREAT | O_EXCL);
+            if (fd == -1) {
+                fprintf (stderr, "ERROR Can't create the image %s (%s)\n", name, strerror (errno));
+                return -1;
+            }
+        }
+    }
+
+    if (kept) {
+        /* Same layout, the values of the last writer are kept.
+
+           A writer stopped during an update leaves an odd sequence, the
+           readers would wait for it forever */
+        for (i = 0; i < MODBUS_SHM_TABLES; i++) {
+            locks = (modbus_seqlock_t *) (map + layout.lock_offsets[i]);
+            for (j = 0; j <= layout.nb_values[i] / MODBUS_MAPPING_BLOCK; j++)
+                if (locks[j].sequence & 1)
+                    locks[j].sequence++;
+        }
+    } else {
+        /* A new object is filled with zeros by ftruncate */
+        if (ftruncate (fd, layout.size) == -1) {
+            fprintf (stderr, "ERROR Can't size the image %s (%s)\n", name, strerror (errno));
+            close ();
+            return -1;
+        }
+
+        map_size = layout.size;
+        map = (uint8_t *) mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf (stderr, "ERROR Can't map the image %s (%s)\n", name, strerror (errno));
+            map = NULL;
+            close ();
+            return -1;
+        }
+        header = (modbus_shm_header_t *) map;
+    }
+
+    layout.generation++;
+    layout.writer_pid = getpid ();
+    memcpy (header, &layout, sizeof (layout));
+    generation = header->generation;
+
+    set_mapping ();
+
+    return 0;
+}
+
+int c_modbus_shm::attach (const char *name) {
+    struct stat st;
+
+    close ();
+
+    fd = open_object (name, O_RDONLY);
+    if (fd == -1) {
+        fprintf (stderr, "ERROR Can't open the image %s (%s)\n", name, strerror (errno));
+        return -1;
+    }
+
+    if (fstat (fd, &st) == -1 || st.st_size < (off_t) sizeof (modbus_shm_header_t)) {
+        fprintf (stderr, "ERROR %s isn't a register image\n", name);
+        close ();
+        return -1;
+    }
+
+    map_size = st.st_size;
+    map = (uint8_t *) mmap (NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf (stderr, "ERROR Can't map the image %s (%s)\n", name, strerror (errno));
+        map = NULL;
+        close ();
+        return -1;
+    }
+    header = (modbus_shm_header_t *) map;
+
+    if (header->magic != MODBUS_SHM_MAGIC || header->version != MODBUS_SHM_VERSION ||
+            header->size > map_size) {
+        fprintf (stderr, "ERROR %s isn't a register image (version %d)\n",
+                 name, MODBUS_SHM_VERSION);
+        close ();
+        return -1;
+    }
+    generation = header->generation;
+
+    set_mapping ();
+
+    return 0;
+}
+
+void c_modbus_shm::close () {
+    if (map != NULL)
+        munmap (map, map_size);
+    if (fd != -1)
+        ::close (fd);
+
+    fd = -1;
+    map = NULL;
+    map_size = 0;
+    header = NULL;
+    memset (&mapping, 0, sizeof (mapping));
+}
+
+modbus_mapping_t *c_modbus_shm::get_mapping () {
+    return (header != NULL) ? &mapping : NULL;
+}
+
+const modbus_shm_header_t *c_modbus_shm::get_header () {
+    return header;
+}
+
+int c_modbus_shm::writer_restarted () {
+    return header != NULL && header->generation != generation;
+}
@@ -0,0 +1,113 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_SHM_H_
+#define _MODBUS_SHM_H_
+
+#include "modbus.h"
+#include "modbus_mapping.h"
+
+/* "MBIM" */
+#define MODBUS_SHM_MAGIC    0x4D49424D
+#define MODBUS_SHM_VERSION  1
+
+/* Tables of the image, in the order of the region */
+#define MODBUS_SHM_COIL_STATUS        0
+#define MODBUS_SHM_INPUT_STATUS       1
+#define MODBUS_SHM_HOLDING_REGISTERS  2
+#define MODBUS_SHM_INPUT_REGISTERS    3
+#define MODBUS_SHM_TABLES             4
+
+/* Start of the region, the offsets are relative to it */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t size;
+    int32_t nb_values[MODBUS_SHM_TABLES];
+    int32_t bit_packed;
+    /* Incremented each time a writer creates the image, a consumer
+       seeing it change knows the writer restarted */
+    volatile uint32_t generation;
+    uint64_t table_offsets[MODBUS_SHM_TABLES];
+    uint64_t lock_offsets[MODBUS_SHM_TABLES];
+    /* Process of the last writer */
+    int32_t writer_pid;
+    uint32_t reserved;
+} modbus_shm_header_t;
+
+/* Register image in a POSIX shared memory object or a mapped file.
+
+   The writer (a slave answering with modbus_slave_manage, or a
+   c_modbus_scheduler storing its scans with set_image) creates the
+   image, the other processes of the host attach it and read the values
+   in place through the mapping: modbus_mapping_read (or _read_bits for
+   a packed image) on the tables with their sequence locks, no socket and
+   no copy through the kernel.
+
+   The layout is described by a versioned header. When a writer creates
+   an image which already exists with the same layout, the values are
+   kept: a restarted process goes on with the last image at once. */
+class c_modbus_shm
+{
+public:
+
+    c_modbus_shm ();
+    ~c_modbus_shm ();
+
+    /* Creates or opens the image for writing. name is a shared memory
+       object ("/name") or the path of a file. packed stores the coils
+       and input status as bits (see modbus_mapping_new_packed).
+       Returns 0 or -1 on failure. */
+    int create (const char *name, int nb_coil_status, int nb_input_status,
+                int nb_holding_registers, int nb_input_registers, int packed);
+
+    /* Maps an image created by a writer, read only.
+       Returns 0 or -1 on failure. */
+    int attach (const char *name);
+
+    void close ();
+
+    /* Removes the image (the processes having it mapped keep it) */
+    static int unlink (const char *name);
+
+    /* Tables and sequence locks of the image, NULL if not opened. A
+       mapping of attach () is read only. */
+    modbus_mapping_t *get_mapping ();
+
+    const modbus_shm_header_t *get_header ();
+
+    /* Returns TRUE if the writer created the image again since the
+       attach () (the consumer should read everything again, and attach
+       again to follow a new layout) */
+    int writer_restarted ();
+
+private:
+
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    modbus_shm_header_t *header;
+    modbus_mapping_t mapping;
+    uint32_t generation;
+
+    int open_object (const char *name, int flags);
+
+    /* Points the mapping to the tables of the region */
+    void set_mapping ();
+};
+
+#endif  /* _MODBUS_SHM_H_ */
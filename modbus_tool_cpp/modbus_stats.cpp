@@ -0,0 +1,289 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "modbus_stats.h"
+
+static const int TAB_FUNCTIONS[MODBUS_STATS_FUNCTIONS - 1] = {
+    FC_READ_COIL_STATUS,
+    FC_READ_INPUT_STATUS,
+    FC_READ_HOLDING_REGISTERS,
+    FC_READ_INPUT_REGISTERS,
+    FC_FORCE_SINGLE_COIL,
+    FC_PRESET_SINGLE_REGISTER,
+    FC_FORCE_MULTIPLE_COILS,
+    FC_PRESET_MULTIPLE_REGISTERS,
+    FC_REPORT_SLAVE_ID
+};
+
+static int bucket_index (long long value) {
+    int msb;
+    int shift;
+
+    if (value < MODBUS_STATS_SUB_BUCKETS)
+        return value < 0 ? 0 : (int) value;
+    if (value >= (1LL << MODBUS_STATS_MAX_BIT))
+        return MODBUS_STATS_BUCKETS - 1;
+
+    msb = 31 - __builtin_clz ( (unsigned int) value);
+    shift = msb - MODBUS_STATS_SUB_BITS;
+
+    return (shift + 1) * MODBUS_STATS_SUB_BUCKETS +
+           (int) ( (value >> shift) & (MODBUS_STATS_SUB_BUCKETS - 1));
+}
+
+/* Highest value of a bucket */
+static long long bucket_value (int index) {
+    int shift;
+
+    if (index < MODBUS_STATS_SUB_BUCKETS)
+        return index;
+
+    shift = index / MODBUS_STATS_SUB_BUCKETS - 1;
+
+    return ( ( (long long) (MODBUS_STATS_SUB_BUCKETS + index % MODBUS_STATS_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+static void entry_init (modbus_stats_entry_t *entry) {
+    memset (entry, 0, sizeof (modbus_stats_entry_t));
+    entry->min_us = -1;
+}
+
+c_modbus_stats::c_modbus_stats () {
+    memset (slaves, 0, sizeof (slaves));
+    dump_fp = NULL;
+    dump_period_us = 0;
+    next_dump_us = 0;
+}
+
+c_modbus_stats::~c_modbus_stats () {
+    int i;
+
+    for (i = 0; i < MODBUS_STATS_SLAVES; i++)
+        free (slaves[i]);
+}
+
+int c_modbus_stats::function_index (int function) {
+    int i;
+
+    for (i = 0; i < MODBUS_STATS_FUNCTIONS - 1; i++) {
+        if (TAB_FUNCTIONS[i] == function)
+            return i;
+    }
+
+    return MODBUS_STATS_FUNCTIONS - 1;
+}
+
+modbus_stats_slave_t *c_modbus_stats::slave_block (int slave) {
+    modbus_stats_slave_t *block;
+    int i;
+
+    slave &= MODBUS_STATS_SLAVES - 1;
+    block = slaves[slave];
+    if (block == NULL) {
+        block = (modbus_stats_slave_t *) malloc (sizeof (modbus_stats_slave_t));
+        if (block == NULL)
+            return NULL;
+        block->lock.sequence = 0;
+        for (i = 0; i < MODBUS_STATS_FUNCTIONS; i++)
+            entry_init (&block->entries[i]);
+        /* Visible to the readers once initialized */
+        __sync_synchronize ();
+        slaves[slave] = block;
+    }
+
+    return block;
+}
+
+void c_modbus_stats::periodic_dump () {
+    long long now;
+
+    if (dump_fp != NULL) {
+        now = modbus_time_us ();
+        if (now >= next_dump_us) {
+            next_dump_us = now + dump_period_us;
+            dump (dump_fp);
+        }
+    }
+}
+
+void c_modbus_stats::record (int slave, int function, int status, long long latency_us,
+                             int bytes_sent, int bytes_received) {
+    modbus_stats_slave_t *block;
+    modbus_stats_entry_t *entry;
+
+    block = slave_block (slave);
+    if (block == NULL)
+        return;
+    entry = &block->entries[function_index (function)];
+
+    modbus_seqlock_write_begin (&block->lock);
+
+    entry->nb_requests++;
+    entry->bytes_sent += bytes_sent;
+    entry->bytes_received += bytes_received;
+
+    if (status == SELECT_TIMEOUT) {
+        entry->nb_timeouts++;
+    } else if (status == INVALID_CRC) {
+        entry->nb_crc_errors++;
+    } else if (status < 0 && status != MB_EXCEPTION &&
+               (status > ILLEGAL_FUNCTION || status < GATEWAY_PROBLEM_TARGET)) {
+        entry->nb_errors++;
+    } else {
+        /* A response came back (normal or exception) */
+        if (status < 0)
+            entry->nb_exceptions++;
+        entry->nb_responses++;
+        entry->total_us += latency_us;
+        if (entry->min_us < 0 || latency_us < entry->min_us)
+            entry->min_us = latency_us;
+        if (latency_us > entry->max_us)
+            entry->max_us = latency_us;
+        entry->histogram[bucket_index (latency_us)]++;
+    }
+
+    modbus_seqlock_write_end (&block->lock);
+
+    periodic_dump ();
+}
+
+void c_modbus_stats::record_broadcast (int slave, int function, int bytes_sent) {
+    modbus_stats_slave_t *block;
+    modbus_stats_entry_t *entry;
+
+    block = slave_block (slave);
+    if (block == NULL)
+        return;
+    entry = &block->entries[function_index (function)];
+
+    modbus_seqlock_write_begin (&block->lock);
+    entry->nb_requests++;
+    entry->nb_broadcasts++;
+    entry->bytes_sent += bytes_sent;
+    modbus_seqlock_write_end (&block->lock);
+
+    periodic_dump ();
+}
+
+int c_modbus_stats::snapshot (int slave, int function, modbus_stats_entry_t *entry) {
+    modbus_stats_slave_t *block;
+    uint32_t sequence;
+
+    block = slaves[slave & (MODBUS_STATS_SLAVES - 1)];
+    if (block == NULL)
+        return -1;
+
+    do {
+        sequence = modbus_seqlock_read_begin (&block->lock);
+        memcpy (entry, &block->entries[function_index (function)],
+                sizeof (modbus_stats_entry_t));
+    } while (modbus_seqlock_read_retry (&block->lock, sequence));
+
+    return 0;
+}
+
+void c_modbus_stats::reset () {
+    modbus_stats_slave_t *block;
+    int i;
+    int j;
+
+    for (i = 0; i < MODBUS_STATS_SLAVES; i++) {
+        block = slaves[i];
+        if (block == NULL)
+            continue;
+        modbus_seqlock_write_begin (&block->lock);
+        for (j = 0; j < MODBUS_STATS_FUNCTIONS; j++)
+            entry_init (&block->entries[j]);
+        modbus_seqlock_write_end (&block->lock);
+    }
+}
+
+long long c_modbus_stats::percentile (const modbus_stats_entry_t *entry, double percent) {
+    unsigned long long count = 0;
+    unsigned long long rank;
+    int i;
+
+    if (entry->nb_responses == 0)
+        return 0;
+
+    rank = (unsigned long long) (entry->nb_responses * percent / 100.0);
+    if (rank >= entry->nb_responses)
+        rank = entry->nb_responses - 1;
+
+    for (i = 0; i < MODBUS_STATS_BUCKETS; i++) {
+        count += entry->histogram[i];
+        if (count > rank)
+            break;
+    }
+
+    if (i == MODBUS_STATS_BUCKETS)
+        i--;
+
+    /* Never more than the maximum seen */
+    return bucket_value (i) < entry->max_us ? bucket_value (i) : entry->max_us;
+}
+
+void c_modbus_stats::dump (FILE *fp) {
+    modbus_stats_entry_t entry;
+    int slave;
+    int i;
+
+    fprintf (fp, "slave  fc  requests  broadcasts  timeouts  crc  exceptions  errors  sent  received"
+             "  latency min/avg/p50/p99/max (us)\n");
+    for (slave = 0; slave < MODBUS_STATS_SLAVES; slave++) {
+        if (slaves[slave] == NULL)
+            continue;
+
+        for (i = 0; i < MODBUS_STATS_FUNCTIONS; i++) {
+            int function = i < MODBUS_STATS_FUNCTIONS - 1 ? TAB_FUNCTIONS[i] : 0;
+            char name[4];
+
+            snapshot (slave, function, &entry);
+            if (entry.nb_requests == 0)
+                continue;
+
+            /* The other function codes are shown as -- */
+            if (function)
+                sprintf (name, "%02X", function);
+            else
+                strcpy (name, "--");
+
+            fprintf (fp, "%5d  %s  %8u  %10u  %8u  %3u  %10u  %6u  %4llu  %8llu"
+                     "  %lld/%lld/%lld/%lld/%lld\n",
+                     slave, name, entry.nb_requests, entry.nb_broadcasts,
+                     entry.nb_timeouts, entry.nb_crc_errors, entry.nb_exceptions,
+                     entry.nb_errors, entry.bytes_sent, entry.bytes_received,
+                     entry.min_us < 0 ? 0 : entry.min_us,
+                     entry.nb_responses ? entry.total_us / entry.nb_responses : 0,
+                     percentile (&entry, 50), percentile (&entry, 99), entry.max_us);
+        }
+    }
+    fflush (fp);
+}
+
+void c_modbus_stats::set_periodic_dump (FILE *fp, int period_s) {
+    if (period_s <= 0) {
+        dump_fp = NULL;
+        return;
+    }
+
+    dump_period_us = (long long) period_s * 1000000;
+    next_dump_us = modbus_time_us () + dump_period_us;
+    dump_fp = fp;
+}
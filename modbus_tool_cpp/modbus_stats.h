@@ -0,0 +1,123 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_STATS_H_
+#define _MODBUS_STATS_H_
+
+#include <stdio.h>
+
+#include "modbus.h"
+#include "modbus_mapping.h"
+
+/* Latency histogram: the values below MODBUS_STATS_SUB_BUCKETS us have a
+   bucket each, then every power of two is split in MODBUS_STATS_SUB_BUCKETS
+   buckets (12.5% of precision) up to 2^24 us (16 s). */
+#define MODBUS_STATS_SUB_BITS       3
+#define MODBUS_STATS_SUB_BUCKETS    (1 << MODBUS_STATS_SUB_BITS)
+#define MODBUS_STATS_MAX_BIT       24
+#define MODBUS_STATS_BUCKETS       ((MODBUS_STATS_MAX_BIT - MODBUS_STATS_SUB_BITS + 1) * MODBUS_STATS_SUB_BUCKETS)
+
+#define MODBUS_STATS_SLAVES       256
+
+/* Statistics are kept for FC 0x01 to 0x06, 0x0F, 0x10, 0x11, the other
+   function codes share the last entry */
+#define MODBUS_STATS_FUNCTIONS     10
+
+typedef struct
+{
+    uint32_t nb_requests;
+    /* Broadcasts sent, no response expected */
+    uint32_t nb_broadcasts;
+    /* Responses (normal or exception) received */
+    uint32_t nb_responses;
+    uint32_t nb_timeouts;
+    uint32_t nb_crc_errors;
+    uint32_t nb_exceptions;
+    /* Socket failures, invalid data, ... */
+    uint32_t nb_errors;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    /* Round trip of the responses, from the send to the last byte */
+    long long min_us;
+    long long max_us;
+    long long total_us;
+    uint32_t histogram[MODBUS_STATS_BUCKETS];
+} modbus_stats_entry_t;
+
+typedef struct
+{
+    modbus_seqlock_t lock;
+    modbus_stats_entry_t entries[MODBUS_STATS_FUNCTIONS];
+} modbus_stats_slave_t;
+
+/* Transaction statistics per slave and function code.
+
+   Given to a c_modbus context with modbus_set_stats, the context reads
+   the monotonic clock before sending a query and after its response
+   (or the error) and records the transaction. Without stats, nothing
+   is measured.
+
+   The blocks of the slaves are allocated at their first transaction.
+   The recording is done by the thread of the context, snapshots can be
+   taken from any thread: they are consistent (sequence lock). */
+class c_modbus_stats
+{
+public:
+
+    c_modbus_stats ();
+    ~c_modbus_stats ();
+
+    /* status is the value returned by the transaction */
+    void record (int slave, int function, int status, long long latency_us,
+                 int bytes_sent, int bytes_received);
+
+    /* A broadcast counts as a request without a response */
+    void record_broadcast (int slave, int function, int bytes_sent);
+
+    /* Copies the statistics of a slave and function code.
+       Returns 0 or -1 if no transaction was recorded for the slave. */
+    int snapshot (int slave, int function, modbus_stats_entry_t *entry);
+
+    void reset ();
+
+    /* Prints the slaves and function codes used, with the latency
+       percentiles */
+    void dump (FILE *fp);
+
+    /* Dumps every period_s seconds from record (), 0 to disable */
+    void set_periodic_dump (FILE *fp, int period_s);
+
+    /* Latency in us below which are percent % of the responses (upper
+       bound of the bucket), 0 if no response */
+    static long long percentile (const modbus_stats_entry_t *entry, double percent);
+
+    /* Index of a function code in the entries of a slave */
+    static int function_index (int function);
+
+private:
+
+    modbus_stats_slave_t *slaves[MODBUS_STATS_SLAVES];
+    FILE *dump_fp;
+    long long dump_period_us;
+    long long next_dump_us;
+
+    /* Block of a slave, allocated at its first transaction (NULL if the
+       allocation failed) */
+    modbus_stats_slave_t *slave_block (int slave);
+
+    void periodic_dump ();
+};
+
+#endif  /* _MODBUS_STATS_H_ */
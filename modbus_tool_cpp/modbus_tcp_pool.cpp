@@ -0,0 +1,337 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "modbus_tcp_pool.h"
+
+/* Absolute time in ms from now for pthread_cond_timedwait */
+static void pool_deadline (struct timespec *ts, int ms) {
+    clock_gettime (CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+c_modbus_tcp_pool::c_modbus_tcp_pool (const char *ip_address, int port, int slave,
+                                      int nb_connections) {
+    modbus_tcp_connection_t *connection;
+    int i;
+
+    if (nb_connections <= 0)
+        nb_connections = 1;
+    if (nb_connections > MODBUS_TCP_POOL_MAX_CONNECTIONS) {
+        fprintf (stderr, "ERROR Too many connections in the pool (%d > %d)\n",
+                 nb_connections, MODBUS_TCP_POOL_MAX_CONNECTIONS);
+        nb_connections = MODBUS_TCP_POOL_MAX_CONNECTIONS;
+    }
+
+    nb = nb_connections;
+    next = 0;
+    backoff_min_ms = MODBUS_TCP_POOL_BACKOFF_MIN;
+    backoff_max_ms = MODBUS_TCP_POOL_BACKOFF_MAX;
+    seed = (unsigned int) modbus_time_us () ^ (unsigned int) getpid ();
+    running = FALSE;
+    memset (&counters, 0, sizeof (counters));
+    pthread_mutex_init (&mutex, NULL);
+    pthread_cond_init (&cond, NULL);
+
+    for (i = 0; i < nb; i++) {
+        connection = &connections[i];
+        connection->ctx = new c_modbus ("", 9600, "none", 8, 1, slave);
+        connection->ctx->modbus_init_tcp (ip_address, port, slave);
+        /* The failed connections are given back to the pool */
+        connection->ctx->modbus_set_error_handling (CLOSE_ON_ERROR);
+        connection->ctx->mb_param->fd = -1;
+        connection->state = TCP_POOL_DOWN;
+        connection->backoff_ms = backoff_min_ms;
+        connection->next_attempt_us = 0;
+    }
+}
+
+c_modbus_tcp_pool::~c_modbus_tcp_pool () {
+    int i;
+
+    stop ();
+    for (i = 0; i < nb; i++)
+        delete connections[i].ctx;
+    pthread_cond_destroy (&cond);
+    pthread_mutex_destroy (&mutex);
+}
+
+void c_modbus_tcp_pool::set_connect_timeout (int timeout_ms) {
+    int i;
+
+    for (i = 0; i < nb; i++)
+        connections[i].ctx->modbus_set_connect_timeout (timeout_ms);
+}
+
+void c_modbus_tcp_pool::set_keepalive (int idle_s, int interval_s, int nb_probes) {
+    int i;
+
+    for (i = 0; i < nb; i++)
+        connections[i].ctx->modbus_set_keepalive (idle_s, interval_s, nb_probes);
+}
+
+void c_modbus_tcp_pool::set_backoff (int min_ms, int max_ms) {
+    int i;
+
+    backoff_min_ms = (min_ms > 0) ? min_ms : MODBUS_TCP_POOL_BACKOFF_MIN;
+    backoff_max_ms = (max_ms > 0) ? max_ms : MODBUS_TCP_POOL_BACKOFF_MAX;
+    if (backoff_max_ms < backoff_min_ms)
+        backoff_max_ms = backoff_min_ms;
+
+    pthread_mutex_lock (&mutex);
+    for (i = 0; i < nb; i++)
+        connections[i].backoff_ms = backoff_min_ms;
+    pthread_mutex_unlock (&mutex);
+}
+
+int c_modbus_tcp_pool::start () {
+    if (running)
+        return 0;
+
+    running = TRUE;
+    if (pthread_create (&thread, NULL, connect_thread, this) != 0) {
+        fprintf (stderr, "ERROR Can't start the thread of the TCP pool\n");
+        running = FALSE;
+        return -1;
+    }
+
+    return 0;
+}
+
+void c_modbus_tcp_pool::stop () {
+    modbus_tcp_connection_t *connection;
+    int i;
+
+    if (!running)
+        return;
+
+    pthread_mutex_lock (&mutex);
+    running = FALSE;
+    pthread_cond_broadcast (&cond);
+    pthread_mutex_unlock (&mutex);
+    pthread_join (thread, NULL);
+
+    for (i = 0; i < nb; i++) {
+        connection = &connections[i];
+        if (connection->ctx->mb_param->fd >= 0) {
+            connection->ctx->modbus_close ();
+            connection->ctx->mb_param->fd = -1;
+        }
+        connection->state = TCP_POOL_DOWN;
+        connection->backoff_ms = backoff_min_ms;
+        connection->next_attempt_us = 0;
+    }
+}
+
+void c_modbus_tcp_pool::schedule (modbus_tcp_connection_t *connection) {
+    int delay_ms;
+
+    connection->state = TCP_POOL_DOWN;
+
+    /* Between half and all of the backoff: after a connection which
+       worked, the minimum backoff (it was reset by the connect) */
+    delay_ms = connection->backoff_ms / 2 + rand_r (&seed) % (connection->backoff_ms / 2 + 1);
+    connection->next_attempt_us = modbus_time_us () + delay_ms * 1000LL;
+
+    connection->backoff_ms *= 2;
+    if (connection->backoff_ms > backoff_max_ms)
+        connection->backoff_ms = backoff_max_ms;
+}
+
+void c_modbus_tcp_pool::check_idle () {
+    modbus_tcp_connection_t *connection;
+    char c;
+    int ret;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        connection = &connections[i];
+        if (connection->state != TCP_POOL_IDLE)
+            continue;
+
+        ret = recv (connection->ctx->mb_param->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (ret > 0) {
+            /* Late response of a query which timed out */
+            connection->ctx->modbus_flush ();
+        } else if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            connection->ctx->modbus_close ();
+            connection->ctx->mb_param->fd = -1;
+            counters.nb_disconnects++;
+            schedule (connection);
+        }
+    }
+}
+
+int c_modbus_tcp_pool::connect_due () {
+    modbus_tcp_connection_t *connection;
+    long long now;
+    long long wait_us = MODBUS_TCP_POOL_CHECK_PERIOD * 1000LL;
+    int ret;
+    int i;
+
+    for (i = 0; i < nb && running; i++) {
+        connection = &connections[i];
+        if (connection->state != TCP_POOL_DOWN)
+            continue;
+
+        now = modbus_time_us ();
+        if (connection->next_attempt_us > now) {
+            if (connection->next_attempt_us - now < wait_us)
+                wait_us = connection->next_attempt_us - now;
+            continue;
+        }
+
+        /* Without the mutex, the connect waits up to its time out */
+        connection->state = TCP_POOL_CONNECTING;
+        pthread_mutex_unlock (&mutex);
+        ret = connection->ctx->modbus_connect ();
+        pthread_mutex_lock (&mutex);
+
+        if (ret < 0) {
+            counters.nb_connect_failures++;
+            schedule (connection);
+            now = modbus_time_us ();
+            if (connection->next_attempt_us - now < wait_us)
+                wait_us = connection->next_attempt_us - now;
+        } else {
+            counters.nb_connects++;
+            connection->state = TCP_POOL_IDLE;
+            connection->backoff_ms = backoff_min_ms;
+            pthread_cond_broadcast (&cond);
+        }
+    }
+
+    return (wait_us + 999) / 1000;
+}
+
+void *c_modbus_tcp_pool::connect_thread (void *arg) {
+    c_modbus_tcp_pool *pool = (c_modbus_tcp_pool *) arg;
+    long long last_check = 0;
+    struct timespec ts;
+    int wait_ms;
+
+    pthread_mutex_lock (&pool->mutex);
+    while (pool->running) {
+        wait_ms = pool->connect_due ();
+
+        if (modbus_time_us () - last_check >= MODBUS_TCP_POOL_CHECK_PERIOD * 1000LL) {
+            pool->check_idle ();
+            last_check = modbus_time_us ();
+            /* A connection may be down now */
+            continue;
+        }
+
+        if (pool->running && wait_ms > 0) {
+            pool_deadline (&ts, wait_ms);
+            pthread_cond_timedwait (&pool->cond, &pool->mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock (&pool->mutex);
+
+    return NULL;
+}
+
+c_modbus *c_modbus_tcp_pool::acquire (int timeout_ms) {
+    modbus_tcp_connection_t *connection;
+    c_modbus *ctx = NULL;
+    struct timespec ts;
+    int i;
+
+    if (timeout_ms > 0)
+        pool_deadline (&ts, timeout_ms);
+
+    pthread_mutex_lock (&mutex);
+    for (;;) {
+        for (i = 0; i < nb; i++) {
+            connection = &connections[ (next + i) % nb];
+            if (connection->state == TCP_POOL_IDLE) {
+                connection->state = TCP_POOL_BUSY;
+                ctx = connection->ctx;
+                /* The next acquire starts from the following one */
+                next = (next + i + 1) % nb;
+                break;
+            }
+        }
+        if (ctx != NULL || timeout_ms == 0)
+            break;
+
+        if (timeout_ms < 0) {
+            pthread_cond_wait (&cond, &mutex);
+        } else if (pthread_cond_timedwait (&cond, &mutex, &ts) == ETIMEDOUT) {
+            timeout_ms = 0;
+        }
+    }
+    if (ctx == NULL)
+        counters.nb_acquire_timeouts++;
+    pthread_mutex_unlock (&mutex);
+
+    return ctx;
+}
+
+void c_modbus_tcp_pool::release (c_modbus *ctx) {
+    modbus_tcp_connection_t *connection;
+    int i;
+
+    pthread_mutex_lock (&mutex);
+    for (i = 0; i < nb; i++) {
+        connection = &connections[i];
+        if (connection->ctx != ctx || connection->state != TCP_POOL_BUSY)
+            continue;
+
+        if (ctx->mb_param->fd < 0) {
+            /* Closed by error_treat */
+            counters.nb_disconnects++;
+            schedule (connection);
+        } else {
+            connection->state = TCP_POOL_IDLE;
+        }
+        /* Wakes up the connect thread or a thread waiting in acquire () */
+        pthread_cond_broadcast (&cond);
+        break;
+    }
+    pthread_mutex_unlock (&mutex);
+}
+
+int c_modbus_tcp_pool::nb_connected () {
+    int nb_connected = 0;
+    int i;
+
+    pthread_mutex_lock (&mutex);
+    for (i = 0; i < nb; i++) {
+        if (connections[i].state == TCP_POOL_IDLE || connections[i].state == TCP_POOL_BUSY)
+            nb_connected++;
+    }
+    pthread_mutex_unlock (&mutex);
+
+    return nb_connected;
+}
+
+void c_modbus_tcp_pool::get_counters (modbus_tcp_pool_counters_t *counters) {
+    pthread_mutex_lock (&mutex);
+    *counters = this->counters;
+    pthread_mutex_unlock (&mutex);
+}
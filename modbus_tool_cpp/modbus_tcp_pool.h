@@ -0,0 +1,144 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_TCP_POOL_H_
+#define _MODBUS_TCP_POOL_H_
+
+#include <pthread.h>
+
+#include "modbus.h"
+
+#define MODBUS_TCP_POOL_MAX_CONNECTIONS  32
+
+/* Bounds of the delay between two connection attempts in ms */
+#define MODBUS_TCP_POOL_BACKOFF_MIN      100
+#define MODBUS_TCP_POOL_BACKOFF_MAX    30000
+
+/* Period of the check of the idle connections in ms */
+#define MODBUS_TCP_POOL_CHECK_PERIOD    1000
+
+typedef enum {
+    TCP_POOL_DOWN = 0,
+    TCP_POOL_CONNECTING,
+    TCP_POOL_IDLE,
+    TCP_POOL_BUSY
+} tcp_pool_state_t;
+
+typedef struct
+{
+    c_modbus *ctx;
+    tcp_pool_state_t state;
+    /* Delay before the next attempt, doubled on each failure */
+    int backoff_ms;
+    /* Monotonic time in us of the next attempt */
+    long long next_attempt_us;
+} modbus_tcp_connection_t;
+
+typedef struct
+{
+    unsigned long nb_connects;
+    unsigned long nb_connect_failures;
+    /* Connections closed by an error of a query or by the check */
+    unsigned long nb_disconnects;
+    /* acquire () without a connection in time */
+    unsigned long nb_acquire_timeouts;
+} modbus_tcp_pool_counters_t;
+
+/* Pool of TCP connections to a slave (or a gateway).
+
+   The connections are opened by a thread of the pool, never by the
+   threads sending the queries: a connection which fails is closed
+   (CLOSE_ON_ERROR) and opened again in the background after a delay
+   growing from the minimum to the maximum backoff, with a random part so
+   the connections to a device which restarts don't come back all at
+   once. The connections are bounded by the connect time out and can
+   send TCP keepalive probes; the idle ones are checked every
+   MODBUS_TCP_POOL_CHECK_PERIOD ms for a close by the peer.
+
+   A thread takes a connected context with acquire (), sends its queries
+   and gives it back with release (). With several connections, the
+   queries of several threads go on in parallel and a connection which
+   is down doesn't stop the others. */
+class c_modbus_tcp_pool
+{
+public:
+
+    c_modbus_tcp_pool (const char *ip_address, int port, int slave, int nb_connections);
+    ~c_modbus_tcp_pool ();
+
+    /* Applied to the next connections, see modbus_set_connect_timeout */
+    void set_connect_timeout (int timeout_ms);
+
+    /* See modbus_set_keepalive */
+    void set_keepalive (int idle_s, int interval_s, int nb_probes);
+
+    /* Bounds of the delay between two attempts in ms, 0 or less for the
+       defaults */
+    void set_backoff (int min_ms, int max_ms);
+
+    /* Starts the thread which opens the connections.
+       Returns 0 or -1 on failure. */
+    int start ();
+
+    /* Stops the thread and closes the connections, they must all be
+       released */
+    void stop ();
+
+    /* Takes a connected context, waiting at most timeout_ms ms (0 to
+       return at once, -1 forever).
+       Returns the context or NULL if none is connected in time. */
+    c_modbus *acquire (int timeout_ms);
+
+    /* Gives back a context of acquire (), it is opened again if a query
+       closed it */
+    void release (c_modbus *ctx);
+
+    /* Number of connections open */
+    int nb_connected ();
+
+    void get_counters (modbus_tcp_pool_counters_t *counters);
+
+private:
+
+    modbus_tcp_connection_t connections[MODBUS_TCP_POOL_MAX_CONNECTIONS];
+    int nb;
+    /* Next connection tried by acquire () */
+    int next;
+    int backoff_min_ms;
+    int backoff_max_ms;
+    unsigned int seed;
+
+    pthread_t thread;
+    /* The state of the connections */
+    pthread_mutex_t mutex;
+    /* Signaled when a connection is opened or must be */
+    pthread_cond_t cond;
+    volatile int running;
+    modbus_tcp_pool_counters_t counters;
+
+    static void *connect_thread (void *arg);
+
+    /* Opens the connections due and checks the idle ones.
+       Returns the time in ms to wait for the next attempt. */
+    int connect_due ();
+
+    /* Checks the idle connections, with the mutex */
+    void check_idle ();
+
+    /* The connection is down, the next attempt is in its backoff */
+    void schedule (modbus_tcp_connection_t *connection);
+};
+
+#endif  /* _MODBUS_TCP_POOL_H_ */
@@ -0,0 +1,228 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_TRANSPORT_H_
+#define _MODBUS_TRANSPORT_H_
+
+#include "modbus.h"
+#include "modbus_crc.h"
+
+/* Transport policies: the layout of the ADU of each transport as
+   constants known at compile time */
+struct modbus_rtu_transport
+{
+    static const int type_com = RTU;
+    static const int header_length = HEADER_LENGTH_RTU;
+    static const int checksum_length = CHECKSUM_LENGTH_RTU;
+    static const int max_adu_length = MAX_ADU_LENGTH_RTU;
+    static const int preset_query_length = PRESET_QUERY_LENGTH_RTU;
+    static const int preset_response_length = PRESET_RESPONSE_LENGTH_RTU;
+};
+
+struct modbus_tcp_transport
+{
+    static const int type_com = TCP;
+    static const int header_length = HEADER_LENGTH_TCP;
+    static const int checksum_length = CHECKSUM_LENGTH_TCP;
+    static const int max_adu_length = MAX_ADU_LENGTH_TCP;
+    static const int preset_query_length = PRESET_QUERY_LENGTH_TCP;
+    static const int preset_response_length = PRESET_RESPONSE_LENGTH_TCP;
+};
+
+/* Frame codec of a transport: headers, finalization (CRC or MBAP
+   length), CRC check, prepared queries and expected response lengths.
+
+   The tests on TRANSPORT::type_com are constant so each instance only
+   keeps the code of its transport and every function can be inlined.
+   Only this codec is specialized: c_modbus dispatches to it once on
+   mb_param->type_com, and its receive path, slave handlers and response
+   checks (as well as the server, the gateway and the other classes
+   built on c_modbus) still use the header length of the context at run
+   time. */
+template <typename TRANSPORT>
+struct modbus_frame
+{
+    static int slave (const uint8_t *msg) {
+        return msg[TRANSPORT::header_length - 1];
+    }
+
+    static int function (const uint8_t *msg) {
+        return msg[TRANSPORT::header_length];
+    }
+
+    /* Builds the header of a query, t_id is only used in TCP.
+       Returns the length of the header. */
+    static int build_query_basis (int slave, int function, int start_addr, int nb,
+                                  uint16_t t_id, uint8_t *query) {
+        uint8_t *pdu = query + TRANSPORT::header_length;
+
+        if (TRANSPORT::type_com == TCP) {
+            query[0] = t_id >> 8;
+            query[1] = t_id & 0x00ff;
+            /* Protocol Modbus */
+            query[2] = 0;
+            query[3] = 0;
+            /* The length is set by finalize () at offsets 4 and 5 */
+        }
+        pdu[-1] = slave;
+        pdu[0] = function;
+        pdu[1] = start_addr >> 8;
+        pdu[2] = start_addr & 0x00ff;
+        pdu[3] = nb >> 8;
+        pdu[4] = nb & 0x00ff;
+
+        return TRANSPORT::preset_query_length;
+    }
+
+    /* Builds the header of a response, t_id is the one of the query */
+    static int build_response_basis (int slave, int function, int t_id, uint8_t *response) {
+        if (TRANSPORT::type_com == TCP) {
+            response[0] = t_id >> 8;
+            response[1] = t_id & 0x00ff;
+            response[2] = 0;
+            response[3] = 0;
+        }
+        response[TRANSPORT::header_length - 1] = slave;
+        response[TRANSPORT::header_length] = function;
+
+        return TRANSPORT::preset_response_length;
+    }
+
+    /* Appends the CRC in RTU or sets the length of the MBAP header in
+       TCP. Returns the length of the ADU to send. */
+    static int finalize (uint8_t *msg, int msg_length) {
+        if (TRANSPORT::type_com == RTU) {
+            uint16_t crc = modbus_crc16 (msg, msg_length);
+
+            msg[msg_length++] = crc >> 8;
+            msg[msg_length++] = crc & 0x00FF;
+        } else {
+            /* Substract the header length to the message length */
+            msg[4] = (msg_length - 6) >> 8;
+            msg[5] = (msg_length - 6) & 0x00FF;
+        }
+
+        return msg_length;
+    }
+
+    /* Returns msg_length if the CRC of a RTU frame is correct (always in
+       TCP) else INVALID_CRC */
+    static int check_crc (const uint8_t *msg, int msg_length) {
+        if (TRANSPORT::type_com == RTU) {
+            if (msg_length < 2)
+                return INVALID_CRC;
+
+            if (modbus_crc16 (msg, msg_length - 2) !=
+                ( (msg[msg_length - 2] << 8) | msg[msg_length - 1]))
+                return INVALID_CRC;
+        }
+
+        return msg_length;
+    }
+
+    /* Builds a query for modbus_execute (see c_modbus::modbus_prepare).
+       Returns 0 or INVALID_DATA */
+    static int prepare (int slave, int function, int start_addr, int nb,
+                        modbus_prepared_t *request) {
+        int max_nb;
+        int length;
+
+        switch (function) {
+        case FC_READ_COIL_STATUS:
+        case FC_READ_INPUT_STATUS:
+            max_nb = MAX_STATUS;
+            break;
+        case FC_READ_HOLDING_REGISTERS:
+        case FC_READ_INPUT_REGISTERS:
+            max_nb = MAX_REGISTERS;
+            break;
+        case FC_FORCE_SINGLE_COIL:
+            nb = nb ? 0xFF00 : 0;
+            max_nb = 0xFFFF;
+            break;
+        case FC_PRESET_SINGLE_REGISTER:
+            max_nb = 0xFFFF;
+            break;
+        default:
+            return INVALID_DATA;
+        }
+
+        if (start_addr < 0 || start_addr > 0xFFFF || nb < 0 || nb > max_nb ||
+                (nb == 0 && max_nb != 0xFFFF))
+            return INVALID_DATA;
+
+        length = build_query_basis (slave, function, start_addr, nb, 0, request->query);
+        request->query_length = finalize (request->query, length);
+        request->response_length = response_length (request->query, UINT16);
+
+        return 0;
+    }
+
+    /* Length of an exception response */
+    static int exception_length () {
+        return TRANSPORT::header_length + 2 + TRANSPORT::checksum_length;
+    }
+
+    /* Length of the response expected for a query or
+       MSG_LENGTH_UNDEFINED (report slave ID). The registers are counted
+       as values of data_type (see read_registers). */
+    static int response_length (const uint8_t *query, uint8_t data_type) {
+        const uint8_t *pdu = query + TRANSPORT::header_length;
+        int nb = (pdu[3] << 8) | pdu[4];
+        int length;
+
+        switch (pdu[0]) {
+        case FC_READ_COIL_STATUS:
+        case FC_READ_INPUT_STATUS:
+            /* Header + nb values (code from force_multiple_coils) */
+            length = 2 + (nb / 8) + ( (nb % 8) ? 1 : 0);
+            break;
+        case FC_READ_HOLDING_REGISTERS:
+        case FC_READ_INPUT_REGISTERS:
+            switch (data_type) {
+            case INT8:
+            case UINT8:
+                length = 2 + nb;
+                break;
+            case INT32:
+            case UINT32:
+                length = 2 + 4 * nb;
+                break;
+            default:
+                /* The 64 bits and floating point types are counted
+                   in registers */
+                length = 2 + 2 * nb;
+                break;
+            }
+            break;
+        case FC_READ_EXCEPTION_STATUS:
+            length = 3;
+            break;
+        case FC_REPORT_SLAVE_ID:
+            /* The response is device specific (the header provides the
+               length) */
+            return MSG_LENGTH_UNDEFINED;
+        default:
+            length = 5;
+        }
+
+        return length + TRANSPORT::header_length + TRANSPORT::checksum_length;
+    }
+};
+
+typedef modbus_frame<modbus_rtu_transport> modbus_rtu_frame;
+typedef modbus_frame<modbus_tcp_transport> modbus_tcp_frame;
+
+#endif  /* _MODBUS_TRANSPORT_H_ */
@@ -0,0 +1,449 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include "modbus_uring.h"
+
+/* The probe of the operations appeared with the read operations (5.6) */
+#if defined (__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#if defined (IO_URING_OP_SUPPORTED)
+#define MODBUS_HAVE_IO_URING
+#endif
+#endif
+
+/* user_data of the poll and timeout entries of a read */
+#define URING_INTERNAL  (1ULL << 63)
+/* user_data of read_timeout (), its poll and timeout entries are
+   URING_INTERNAL | URING_SYNC */
+#define URING_SYNC      ( (1ULL << 63) - 1)
+
+c_modbus_uring::c_modbus_uring (int entries) {
+    ring_fd = -1;
+    nb_entries = 0;
+    sq_ring = NULL;
+    sq_ring_size = 0;
+    cq_ring = NULL;
+    cq_ring_size = 0;
+    sqes = NULL;
+    timeouts = NULL;
+    stashed = NULL;
+    nb_stashed = 0;
+    max_stashed = 0;
+    sq_local_tail = 0;
+    nb_prepared = 0;
+    fixed_base = NULL;
+    fixed_length = 0;
+    memset (&counters, 0, sizeof (counters));
+
+    if (entries <= 0)
+        entries = MODBUS_URING_DEFAULT_ENTRIES;
+
+#ifdef MODBUS_HAVE_IO_URING
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    static const int ops[] = { IORING_OP_POLL_ADD, IORING_OP_LINK_TIMEOUT,
+                               IORING_OP_READ, IORING_OP_READ_FIXED,
+                               IORING_OP_WRITE
+                             };
+    size_t probe_size = sizeof (*probe) + 256 * sizeof (struct io_uring_probe_op);
+    unsigned i;
+    int supported = TRUE;
+
+    memset (&p, 0, sizeof (p));
+    ring_fd = syscall (__NR_io_uring_setup, entries, &p);
+    if (ring_fd < 0) {
+        /* Old kernel or forbidden (seccomp) */
+        ring_fd = -1;
+        return;
+    }
+
+    /* All the operations of a read must be known */
+    probe = (struct io_uring_probe *) calloc (1, probe_size);
+    if (probe == NULL ||
+            syscall (__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        supported = FALSE;
+    } else {
+        for (i = 0; i < sizeof (ops) / sizeof (ops[0]); i++) {
+            if (ops[i] > probe->last_op || ! (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                supported = FALSE;
+        }
+    }
+    free (probe);
+    if (!supported) {
+        release ();
+        return;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size)
+            sq_ring_size = cq_ring_size;
+        cq_ring_size = 0;
+    }
+
+    sq_ring = mmap (NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = NULL;
+        release ();
+        return;
+    }
+    if (cq_ring_size == 0) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap (NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = NULL;
+            release ();
+            return;
+        }
+    }
+    sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        sqes = NULL;
+        release ();
+        return;
+    }
+
+    timeouts = calloc (p.sq_entries, sizeof (struct __kernel_timespec));
+    stashed = (modbus_uring_completion_t *) calloc (p.cq_entries, sizeof (modbus_uring_completion_t));
+    if (timeouts == NULL || stashed == NULL) {
+        release ();
+        return;
+    }
+    max_stashed = p.cq_entries;
+
+    sq_head = (unsigned *) ( (uint8_t *) sq_ring + p.sq_off.head);
+    sq_tail = (unsigned *) ( (uint8_t *) sq_ring + p.sq_off.tail);
+    sq_mask = (unsigned *) ( (uint8_t *) sq_ring + p.sq_off.ring_mask);
+    sq_array = (unsigned *) ( (uint8_t *) sq_ring + p.sq_off.array);
+    cq_head = (unsigned *) ( (uint8_t *) cq_ring + p.cq_off.head);
+    cq_tail = (unsigned *) ( (uint8_t *) cq_ring + p.cq_off.tail);
+    cq_mask = (unsigned *) ( (uint8_t *) cq_ring + p.cq_off.ring_mask);
+    cqes = (uint8_t *) cq_ring + p.cq_off.cqes;
+
+    nb_entries = p.sq_entries;
+    sq_local_tail = *sq_tail;
+#endif
+}
+
+c_modbus_uring::~c_modbus_uring () {
+    release ();
+}
+
+void c_modbus_uring::release () {
+#ifdef MODBUS_HAVE_IO_URING
+    if (sqes != NULL)
+        munmap (sqes, nb_entries * sizeof (struct io_uring_sqe));
+    if (cq_ring != NULL && cq_ring != sq_ring)
+        munmap (cq_ring, cq_ring_size);
+    if (sq_ring != NULL)
+        munmap (sq_ring, sq_ring_size);
+#endif
+    free (timeouts);
+    free (stashed);
+    if (ring_fd != -1)
+        close (ring_fd);
+
+    ring_fd = -1;
+    nb_entries = 0;
+    sq_ring = NULL;
+    cq_ring = NULL;
+    sqes = NULL;
+    timeouts = NULL;
+    stashed = NULL;
+    nb_stashed = 0;
+    max_stashed = 0;
+}
+
+int c_modbus_uring::is_available () {
+    return nb_entries > 0;
+}
+
+int c_modbus_uring::register_pool (c_modbus_pool *pool) {
+#ifdef MODBUS_HAVE_IO_URING
+    struct iovec iov;
+
+    if (!is_available () || fixed_base != NULL || pool->nb_buffers () == 0)
+        return -1;
+
+    /* The whole pool is one registered buffer */
+    iov.iov_base = pool->get_memory ();
+    iov.iov_len = pool->get_memory_size ();
+    if (syscall (__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        /* Usually RLIMIT_MEMLOCK, the plain reads are used */
+        fprintf (stderr, "ERROR Can't register the buffers of the pool: %s\n",
+                 strerror (errno));
+        return -1;
+    }
+    fixed_base = (uint8_t *) iov.iov_base;
+    fixed_length = iov.iov_len;
+
+    return 0;
+#else
+    (void) pool;
+    return -1;
+#endif
+}
+
+void *c_modbus_uring::get_sqe () {
+#ifdef MODBUS_HAVE_IO_URING
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (sq_local_tail - *sq_head >= nb_entries)
+        return NULL;
+
+    index = sq_local_tail & *sq_mask;
+    sqe = (struct io_uring_sqe *) sqes + index;
+    memset (sqe, 0, sizeof (*sqe));
+    sq_array[index] = index;
+    sq_local_tail++;
+    nb_prepared++;
+
+    return sqe;
+#else
+    return NULL;
+#endif
+}
+
+int c_modbus_uring::queue_read (int fd, uint8_t *buffer, int length, long timeout_us,
+                                uint64_t user_data) {
+#ifdef MODBUS_HAVE_IO_URING
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec *ts;
+    uint64_t internal = (user_data == URING_SYNC) ? URING_INTERNAL | URING_SYNC : URING_INTERNAL;
+
+    if (!is_available () ||
+            nb_entries - (sq_local_tail - *sq_head) < MODBUS_URING_READ_ENTRIES)
+        return -1;
+
+    /* Waits for the data */
+    sqe = (struct io_uring_sqe *) get_sqe ();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = POLLIN;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = internal;
+
+    /* Cancels the poll after the time out, the read is then canceled */
+    if (timeout_us > 0) {
+        sqe = (struct io_uring_sqe *) get_sqe ();
+        ts = (struct __kernel_timespec *) timeouts + ( (sq_local_tail - 1) & *sq_mask);
+        ts->tv_sec = timeout_us / 1000000;
+        ts->tv_nsec = (timeout_us % 1000000) * 1000;
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long) ts;
+        sqe->len = 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = internal;
+    }
+
+    sqe = (struct io_uring_sqe *) get_sqe ();
+    if (buffer >= fixed_base && buffer + length <= fixed_base + fixed_length) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = length;
+    sqe->user_data = user_data;
+
+    return 0;
+#else
+    (void) fd;
+    (void) buffer;
+    (void) length;
+    (void) timeout_us;
+    (void) user_data;
+    return -1;
+#endif
+}
+
+int c_modbus_uring::queue_write (int fd, const uint8_t *buffer, int length, uint64_t user_data) {
+#ifdef MODBUS_HAVE_IO_URING
+    struct io_uring_sqe *sqe;
+
+    if (!is_available ())
+        return -1;
+
+    sqe = (struct io_uring_sqe *) get_sqe ();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = length;
+    sqe->user_data = user_data;
+
+    return 0;
+#else
+    (void) fd;
+    (void) buffer;
+    (void) length;
+    (void) user_data;
+    return -1;
+#endif
+}
+
+int c_modbus_uring::submit (int wait_nr) {
+#ifdef MODBUS_HAVE_IO_URING
+    int ret;
+    unsigned to_submit = nb_prepared;
+    int submitted = 0;
+
+    if (!is_available ())
+        return SOCKET_FAILURE;
+
+    /* The entries must be visible before the tail */
+    __sync_synchronize ();
+    *sq_tail = sq_local_tail;
+    __sync_synchronize ();
+    nb_prepared = 0;
+
+    /* Interrupted before submitting anything, it's done again */
+    do {
+        ret = syscall (__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+                       wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        counters.nb_enter++;
+        if (ret > 0) {
+            to_submit -= ret;
+            submitted += ret;
+        }
+    } while ( (ret == -1 && errno == EINTR) || (ret > 0 && to_submit > 0));
+
+    if (ret == -1)
+        return SOCKET_FAILURE;
+    counters.nb_submitted += submitted;
+
+    return submitted;
+#else
+    (void) wait_nr;
+    return SOCKET_FAILURE;
+#endif
+}
+
+int c_modbus_uring::reap_one (modbus_uring_completion_t *completion) {
+#ifdef MODBUS_HAVE_IO_URING
+    struct io_uring_cqe *cqe;
+    unsigned head = *cq_head;
+    int user;
+
+    __sync_synchronize ();
+    if (head == *cq_tail)
+        return -1;
+
+    cqe = (struct io_uring_cqe *) cqes + (head & *cq_mask);
+    user = ! (cqe->user_data & URING_INTERNAL);
+    completion->user_data = cqe->user_data;
+    if (user) {
+        if (cqe->res >= 0)
+            completion->res = cqe->res;
+        else if (cqe->res == -ECANCELED)
+            /* The poll was canceled by its timeout */
+            completion->res = SELECT_TIMEOUT;
+        else
+            completion->res = SOCKET_FAILURE;
+    }
+
+    /* The entry is read before the kernel may reuse it */
+    __sync_synchronize ();
+    *cq_head = head + 1;
+    counters.nb_completed++;
+
+    return user;
+#else
+    (void) completion;
+    return -1;
+#endif
+}
+
+int c_modbus_uring::reap (modbus_uring_completion_t *completions, int max) {
+    int nb = 0;
+    int ret;
+
+    if (!is_available ())
+        return 0;
+
+    /* Completed during a read_timeout () first */
+    while (nb < max && nb_stashed > 0) {
+        completions[nb++] = stashed[0];
+        nb_stashed--;
+        memmove (stashed, stashed + 1, nb_stashed * sizeof (modbus_uring_completion_t));
+    }
+
+    while (nb < max && (ret = reap_one (&completions[nb])) >= 0)
+        nb += ret;
+
+    return nb;
+}
+
+int c_modbus_uring::read_timeout (int fd, uint8_t *buffer, int length, long timeout_us) {
+    modbus_uring_completion_t completion;
+    modbus_uring_completion_t entry;
+    int nb_entries = (timeout_us > 0) ? MODBUS_URING_READ_ENTRIES : MODBUS_URING_READ_ENTRIES - 1;
+    int ret;
+
+    if (queue_read (fd, buffer, length, timeout_us, URING_SYNC) < 0)
+        return SOCKET_FAILURE;
+
+    if (submit (nb_entries) < 0)
+        return SOCKET_FAILURE;
+
+    /* All the entries of the read are completed before returning, usually
+       without waiting again. The results of queue_read () and
+       queue_write () completed meanwhile are kept for reap (). */
+    completion.res = SOCKET_FAILURE;
+    while (nb_entries > 0) {
+        ret = reap_one (&entry);
+        if (ret < 0) {
+            if (submit (nb_entries) < 0)
+                return SOCKET_FAILURE;
+        } else if (entry.user_data == URING_SYNC) {
+            completion = entry;
+            nb_entries--;
+        } else if (entry.user_data == (URING_INTERNAL | URING_SYNC)) {
+            nb_entries--;
+        } else if (ret > 0) {
+            if (nb_stashed < max_stashed)
+                stashed[nb_stashed++] = entry;
+            else
+                fprintf (stderr, "ERROR Completion %llu lost, too many results not reaped\n",
+                         (unsigned long long) entry.user_data);
+        }
+    }
+
+    return completion.res;
+}
+
+void c_modbus_uring::get_counters (modbus_uring_counters_t *counters) {
+    *counters = this->counters;
+}
@@ -0,0 +1,150 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MODBUS_URING_H_
+#define _MODBUS_URING_H_
+
+#include "modbus.h"
+#include "modbus_pool.h"
+
+#define MODBUS_URING_DEFAULT_ENTRIES  64
+
+/* A read uses 3 entries (poll, timeout and read) */
+#define MODBUS_URING_READ_ENTRIES      3
+
+typedef struct
+{
+    /* Given to queue_read () or queue_write () */
+    uint64_t user_data;
+    /* Number of bytes, 0 if the connection is closed, SELECT_TIMEOUT or
+       SOCKET_FAILURE */
+    int32_t res;
+} modbus_uring_completion_t;
+
+typedef struct
+{
+    /* io_uring_enter () calls */
+    unsigned long nb_enter;
+    unsigned long nb_submitted;
+    unsigned long nb_completed;
+} modbus_uring_counters_t;
+
+/* io_uring backend of the transports.
+
+   A read waits for the data with a poll linked to a timeout and to the
+   read itself, so a single io_uring_enter () replaces the select () and
+   the read () of receive_msg; the serial port and the sockets are opened
+   non blocking, polling first keeps the read from failing with EAGAIN.
+   The memory of a c_modbus_pool may be registered, the reads in its
+   buffers then use the fixed buffer operations.
+
+   queue_read () and queue_write () only prepare the entries, submit ()
+   sends all of them at once and reap () gets the results, so one thread
+   can keep the I/Os of many ports or connections in flight. The ring
+   given to a c_modbus (modbus_set_io_uring) is used synchronously by
+   read_timeout (): the results of the other I/Os completed meanwhile are
+   kept for the next reap (), as many as the completion queue holds.
+
+   The raw system calls are used (no liburing). When the kernel or its
+   headers don't support them is_available () is FALSE and c_modbus keeps
+   the select () path. */
+class c_modbus_uring
+{
+public:
+
+    c_modbus_uring (int entries);
+    ~c_modbus_uring ();
+
+    int is_available ();
+
+    /* Registers the buffers of the pool (one pool per ring).
+       Returns 0 or -1 on failure */
+    int register_pool (c_modbus_pool *pool);
+
+    /* Prepares a read of at most length bytes, after the data is
+       available or timeout_us us (0 to wait forever).
+       user_data must be below 2^63 - 1.
+       Returns 0 or -1 if the ring is full */
+    int queue_read (int fd, uint8_t *buffer, int length, long timeout_us,
+                    uint64_t user_data);
+
+    int queue_write (int fd, const uint8_t *buffer, int length, uint64_t user_data);
+
+    /* Submits the entries prepared and waits for wait_nr completions
+       (of entries, a read counts for MODBUS_URING_READ_ENTRIES).
+       Returns the number of entries submitted or SOCKET_FAILURE */
+    int submit (int wait_nr);
+
+    /* Gets at most max results of reads and writes completed.
+       Returns the number of results */
+    int reap (modbus_uring_completion_t *completions, int max);
+
+    /* Reads like read () after waiting at most timeout_us us.
+       Returns the number of bytes, 0 if the connection is closed,
+       SELECT_TIMEOUT or SOCKET_FAILURE */
+    int read_timeout (int fd, uint8_t *buffer, int length, long timeout_us);
+
+    void get_counters (modbus_uring_counters_t *counters);
+
+private:
+
+    int ring_fd;
+    unsigned nb_entries;
+
+    /* Submission queue */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    void *sqes;
+    /* Entries prepared not submitted */
+    unsigned sq_local_tail;
+    unsigned nb_prepared;
+
+    /* Completion queue */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+
+    /* Timeouts of the reads, read by the kernel when submitted */
+    void *timeouts;
+
+    /* Results reaped by read_timeout () for reap () */
+    modbus_uring_completion_t *stashed;
+    int nb_stashed;
+    int max_stashed;
+
+    /* Registered buffers */
+    uint8_t *fixed_base;
+    size_t fixed_length;
+
+    modbus_uring_counters_t counters;
+
+    void *get_sqe ();
+
+    /* Consumes a completion (user_data is set for all of them).
+       Returns 1 for a read or a write, 0 for an entry of a read or -1
+       if there is none */
+    int reap_one (modbus_uring_completion_t *completion);
+
+    void release ();
+};
+
+#endif  /* _MODBUS_URING_H_ */